@@ -0,0 +1,173 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A tiny HTTP/1.0 admin interface on its own port.
+ */
+#include "admin.h"
+#include "csapp.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ADMIN_MAX_HANDLERS 32
+#define ADMIN_PATHLEN 64
+
+typedef struct {
+    char path[ADMIN_PATHLEN];
+    admin_handler_t handler;
+} admin_route_t;
+
+static pthread_mutex_t g_admin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static admin_route_t g_routes[ADMIN_MAX_HANDLERS];
+static size_t g_nroutes;
+
+int admin_register(const char *path, admin_handler_t handler) {
+    int res = -1;
+    pthread_mutex_lock(&g_admin_mutex);
+    if (g_nroutes < ADMIN_MAX_HANDLERS) {
+        strncpy(g_routes[g_nroutes].path, path, ADMIN_PATHLEN - 1);
+        g_routes[g_nroutes].handler = handler;
+        g_nroutes++;
+        res = 0;
+    }
+    pthread_mutex_unlock(&g_admin_mutex);
+    return res;
+}
+
+void admin_respond(int fd, const char *status, const char *content_type,
+                   const char *body, size_t len) {
+    char header[MAXLINE];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: %s\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n",
+                        status, content_type, len);
+    if (rio_writen(fd, header, hlen) < 0)
+        return;
+    if (len > 0)
+        rio_writen(fd, body, len);
+}
+
+const char *admin_query_param(const char *query, const char *key, char *buf,
+                              size_t len) {
+    const size_t keylen = strlen(key);
+    const char *p = query;
+    while (p && *p) {
+        if (strncmp(p, key, keylen) == 0 && p[keylen] == '=') {
+            const char *value = p + keylen + 1;
+            size_t n = strcspn(value, "&");
+            if (n >= len)
+                n = len - 1;
+            memcpy(buf, value, n);
+            buf[n] = '\0';
+            return buf;
+        }
+        p = strchr(p, '&');
+        if (p)
+            p++;
+    }
+    return NULL;
+}
+
+/**
+ * Built-in `/stats` handler.
+ */
+static void handle_stats(int fd, const char *query) {
+    // Metrics register and counters gain digits between sizing the dump and
+    // writing it, so grow the buffer until a dump fits.
+    size_t cap = stats_dump(NULL, 0) + 1, len;
+    char *body = NULL;
+    while (1) {
+        char *grown = realloc(body, cap);
+        if (grown == NULL) {
+            free(body);
+            admin_respond(fd, "500 Internal Server Error", "text/plain", "",
+                          0);
+            return;
+        }
+        body = grown;
+        if ((len = stats_dump(body, cap)) < cap)
+            break;
+        cap = len + len / 8 + 1;
+    }
+    admin_respond(fd, "200 OK", "text/plain", body, len);
+    free(body);
+}
+
+/**
+ * @brief Read one request from the admin client and dispatch it.
+ */
+static void admin_serve(int fd) {
+    char line[MAXLINE], method[16], target[MAXLINE];
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+
+    if (rio_readlineb(&rio, line, sizeof(line)) <= 0)
+        return;
+    if (sscanf(line, "%15s %8191s", method, target) != 2) {
+        admin_respond(fd, "400 Bad Request", "text/plain", "", 0);
+        return;
+    }
+    // Drain the request headers.
+    ssize_t n;
+    while ((n = rio_readlineb(&rio, line, sizeof(line))) > 0)
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+            break;
+
+    const char *query = "";
+    char *q = strchr(target, '?');
+    if (q) {
+        *q = '\0';
+        query = q + 1;
+    }
+
+    admin_handler_t handler = NULL;
+    pthread_mutex_lock(&g_admin_mutex);
+    for (size_t i = 0; i < g_nroutes; ++i)
+        if (strcmp(g_routes[i].path, target) == 0)
+            handler = g_routes[i].handler;
+    pthread_mutex_unlock(&g_admin_mutex);
+
+    if (handler)
+        handler(fd, query);
+    else
+        admin_respond(fd, "404 Not Found", "text/plain", "", 0);
+}
+
+/**
+ * @brief Admin thread. Requests are served one at a time; admin traffic is
+ * rare and must never compete with the proxy's own workers.
+ */
+static void *thread_admin(void *vargp) {
+    int listenfd = (int)(size_t)vargp;
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        admin_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int admin_start(const char *port) {
+    int listenfd = open_listenfd(port);
+    if (listenfd < 0)
+        return -1;
+
+    admin_register("/stats", handle_stats);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_admin, (void *)(size_t)listenfd)) {
+        close(listenfd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A tiny HTTP/1.0 admin interface on its own port. Subsystems register a
+ * handler per path; the admin thread serves one request per connection.
+ *
+ * Built-in paths:
+ * - `/stats` dumps every counter and histogram (cf. stats.h).
+ */
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stddef.h>
+
+/**
+ * Handler for an admin path.
+ *
+ * @param  fd     Client socket. The handler must write a full response,
+ *                typically through admin_respond. The socket is closed for it.
+ * @param  query  Query string without the leading '?', or "" if none.
+ */
+typedef void (*admin_handler_t)(int fd, const char *query);
+
+/**
+ * Register a handler for an exact path such as "/stats".
+ *
+ * @return 0 on success, -1 if the handler table is full.
+ */
+int admin_register(const char *path, admin_handler_t handler);
+
+/**
+ * Start serving admin requests on `port` from a background thread.
+ *
+ * @return 0 on success, -1 if the port could not be opened.
+ */
+int admin_start(const char *port);
+
+/**
+ * Write a complete HTTP/1.0 response.
+ */
+void admin_respond(int fd, const char *status, const char *content_type,
+                   const char *body, size_t len);
+
+/**
+ * Look up `key` in a query string of the form "a=1&b=2". Copies the value
+ * into buf and returns buf, or returns NULL if the key is absent.
+ */
+const char *admin_query_param(const char *query, const char *key, char *buf,
+                              size_t len);
+
+#endif
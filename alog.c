@@ -0,0 +1,353 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Asynchronous access log: per-thread single-producer rings drained by one
+ * writer thread.
+ */
+#include "alog.h"
+#include "stats.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALOG_MAX_RINGS 1024
+#define ALOG_BATCH_SIZE (256 * 1024)
+#define ALOG_LINE_MAX 256
+#define ALOG_FLUSH_US (100 * 1000)
+#define ALOG_IDLE_US (10 * 1000)
+#define ALOG_PATH_LEN 4096
+#define CACHE_LINE 64
+
+/**************** STRUCTS ****************/
+typedef enum {
+    RING_FREE,    /* Not owned by any thread. */
+    RING_ACTIVE,  /* Owned by a live thread. */
+    RING_RETIRED  /* Owner exited; free again once drained. */
+} ring_state_t;
+
+/**
+ * A single-producer, single-consumer ring of records. The owning thread only
+ * advances `tail`, the writer thread only advances `head`; each lives on its
+ * own cache line.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic size_t head;
+    _Alignas(CACHE_LINE) _Atomic size_t tail;
+    _Alignas(CACHE_LINE) atomic_int state;
+    size_t mask;
+    alog_record_t *records;
+} alog_ring_t;
+
+/**
+ * @param  key        Thread-specific ring of the calling thread.
+ * @param  rings      Rings ever handed out; recycled, never freed early.
+ * @param  nrings     Number of rings allocated so far.
+ * @param  batch      Bytes formatted but not yet written.
+ * @param  file_size  Bytes in the current log file.
+ */
+struct ALog {
+    alog_cfg_t cfg;
+    char *path;
+    int fd;
+    size_t ring_records;
+
+    pthread_key_t key;
+    alog_ring_t *rings[ALOG_MAX_RINGS];
+    atomic_size_t nrings;
+    pthread_mutex_t rings_mutex;
+
+    char *batch;
+    size_t batch_len;
+    size_t file_size;
+
+    pthread_t tid;
+    atomic_bool stopping;
+
+    stat_counter_t *stat_records;
+    stat_counter_t *stat_dropped;
+    stat_counter_t *stat_bytes;
+    stat_counter_t *stat_rotations;
+};
+
+/**************** HELPERS ****************/
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Key destructor: the owner of a ring has exited.
+ */
+static void ring_retire(void *arg) {
+    alog_ring_t *ring = arg;
+    atomic_store_explicit(&ring->state, RING_RETIRED, memory_order_release);
+}
+
+/**
+ * @brief Claim a ring for the calling thread: a free one if there is any,
+ * otherwise a new one. Only taken once per thread, so the mutex is off the
+ * hot path.
+ */
+static alog_ring_t *ring_claim(alog_t *log) {
+    alog_ring_t *ring = NULL;
+    pthread_mutex_lock(&log->rings_mutex);
+    const size_t nrings = atomic_load(&log->nrings);
+    for (size_t i = 0; i < nrings && ring == NULL; ++i) {
+        int expected = RING_FREE;
+        if (atomic_compare_exchange_strong(&log->rings[i]->state, &expected,
+                                           RING_ACTIVE))
+            ring = log->rings[i];
+    }
+    if (ring == NULL && nrings < ALOG_MAX_RINGS) {
+        ring = aligned_alloc(CACHE_LINE, sizeof(alog_ring_t));
+        alog_record_t *records =
+            ring ? malloc(log->ring_records * sizeof(alog_record_t)) : NULL;
+        if (records) {
+            atomic_init(&ring->head, 0);
+            atomic_init(&ring->tail, 0);
+            atomic_init(&ring->state, RING_ACTIVE);
+            ring->mask = log->ring_records - 1;
+            ring->records = records;
+            log->rings[nrings] = ring;
+            atomic_store(&log->nrings, nrings + 1);
+        } else {
+            free(ring);
+            ring = NULL;
+        }
+    }
+    pthread_mutex_unlock(&log->rings_mutex);
+
+    if (ring)
+        pthread_setspecific(log->key, ring);
+    return ring;
+}
+
+/**
+ * @brief Start a binary log file with its header.
+ */
+static void file_header(alog_t *log) {
+    alog_file_header_t header = {.record_size = sizeof(alog_record_t)};
+    memcpy(header.magic, ALOG_MAGIC, sizeof(header.magic));
+    if (write(log->fd, &header, sizeof(header)) == sizeof(header))
+        log->file_size += sizeof(header);
+}
+
+/**
+ * @brief Write out the batch buffer, rotating the file first if it is due.
+ */
+static void batch_flush(alog_t *log) {
+    if (log->batch_len == 0)
+        return;
+
+    if (log->cfg.rotate_bytes > 0 &&
+        log->file_size + log->batch_len > log->cfg.rotate_bytes &&
+        log->file_size > 0) {
+        char from[ALOG_PATH_LEN], to[ALOG_PATH_LEN];
+        for (int i = log->cfg.keep; i > 1; --i) {
+            snprintf(from, sizeof(from), "%s.%d", log->path, i - 1);
+            snprintf(to, sizeof(to), "%s.%d", log->path, i);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", log->path);
+        if (log->cfg.keep > 0)
+            rename(log->path, to);
+        else
+            unlink(log->path);
+
+        int fd = open(log->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+                                     O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            close(log->fd);
+            log->fd = fd;
+            log->file_size = 0;
+            stats_add(log->stat_rotations, 1);
+            if (log->cfg.format == ALOG_BINARY)
+                file_header(log);
+        }
+    }
+
+    const char *p = log->batch;
+    size_t left = log->batch_len;
+    while (left > 0) {
+        ssize_t n = write(log->fd, p, left);
+        if (n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+    log->file_size += log->batch_len - left;
+    stats_add(log->stat_bytes, log->batch_len - left);
+    log->batch_len = 0;
+}
+
+/**
+ * @brief Move every queued record of every ring into the batch buffer.
+ *
+ * @return Number of records moved.
+ */
+static size_t drain(alog_t *log) {
+    const size_t rec_len = (log->cfg.format == ALOG_BINARY)
+                               ? sizeof(alog_record_t)
+                               : ALOG_LINE_MAX;
+    const size_t nrings = atomic_load(&log->nrings);
+    size_t moved = 0;
+
+    for (size_t i = 0; i < nrings; ++i) {
+        alog_ring_t *ring = log->rings[i];
+        const int state =
+            atomic_load_explicit(&ring->state, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        const size_t tail =
+            atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (; head != tail; ++head) {
+            if (log->batch_len + rec_len > ALOG_BATCH_SIZE)
+                batch_flush(log);
+            const alog_record_t *rec = &ring->records[head & ring->mask];
+            if (log->cfg.format == ALOG_BINARY) {
+                memcpy(log->batch + log->batch_len, rec, rec_len);
+                log->batch_len += rec_len;
+            } else {
+                size_t n = alog_format(rec, log->batch + log->batch_len,
+                                       rec_len);
+                log->batch_len += (n < rec_len) ? n : rec_len - 1;
+            }
+            moved++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        // The owner is gone and everything it queued has been moved.
+        if (state == RING_RETIRED)
+            atomic_store(&ring->state, RING_FREE);
+    }
+    stats_add(log->stat_records, moved);
+    return moved;
+}
+
+static void *thread_alog(void *vargp) {
+    alog_t *log = vargp;
+    uint64_t last_flush = now_us();
+
+    while (!atomic_load(&log->stopping)) {
+        size_t moved = drain(log);
+        const uint64_t now = now_us();
+        if (now - last_flush >= ALOG_FLUSH_US) {
+            batch_flush(log);
+            last_flush = now;
+        }
+        if (moved == 0)
+            usleep(ALOG_IDLE_US);
+    }
+    drain(log);
+    batch_flush(log);
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+alog_t *alog_open(const alog_cfg_t *cfg) {
+    alog_t *log = calloc(1, sizeof(alog_t));
+    if (log == NULL)
+        return NULL;
+    log->cfg = *cfg;
+    log->path = strdup(cfg->path);
+    log->batch = malloc(ALOG_BATCH_SIZE);
+    log->ring_records = 1;
+    while (log->ring_records < cfg->ring_records)
+        log->ring_records <<= 1;
+
+    log->fd = open(cfg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->path == NULL || log->batch == NULL || log->fd < 0 ||
+        strlen(cfg->path) + 16 > ALOG_PATH_LEN) {
+        if (log->fd >= 0)
+            close(log->fd);
+        free(log->batch);
+        free(log->path);
+        free(log);
+        return NULL;
+    }
+    log->file_size = lseek(log->fd, 0, SEEK_END);
+    if (cfg->format == ALOG_BINARY && log->file_size == 0)
+        file_header(log);
+
+    pthread_key_create(&log->key, ring_retire);
+    pthread_mutex_init(&log->rings_mutex, NULL);
+    atomic_init(&log->nrings, 0);
+    atomic_init(&log->stopping, false);
+
+    log->stat_records = stats_counter("alog.records");
+    log->stat_dropped = stats_counter("alog.dropped");
+    log->stat_bytes = stats_counter("alog.bytes");
+    log->stat_rotations = stats_counter("alog.rotations");
+
+    if (pthread_create(&log->tid, NULL, thread_alog, log) != 0) {
+        pthread_key_delete(log->key);
+        close(log->fd);
+        free(log->batch);
+        free(log->path);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+void alog_close(alog_t *log) {
+    atomic_store(&log->stopping, true);
+    pthread_join(log->tid, NULL);
+    pthread_key_delete(log->key);
+
+    for (size_t i = 0; i < atomic_load(&log->nrings); ++i) {
+        free(log->rings[i]->records);
+        free(log->rings[i]);
+    }
+    pthread_mutex_destroy(&log->rings_mutex);
+    close(log->fd);
+    free(log->batch);
+    free(log->path);
+    free(log);
+}
+
+int alog_write(alog_t *log, const alog_record_t *rec) {
+    alog_ring_t *ring = pthread_getspecific(log->key);
+    if (ring == NULL && (ring = ring_claim(log)) == NULL) {
+        stats_add(log->stat_dropped, 1);
+        return -1;
+    }
+
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head > ring->mask) {
+        stats_add(log->stat_dropped, 1);
+        return -1;
+    }
+    ring->records[tail & ring->mask] = *rec;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+size_t alog_format(const alog_record_t *rec, char *buf, size_t len) {
+    static const char *outcomes[] = {
+        [ALOG_HIT] = "HIT", [ALOG_MISS] = "MISS", [ALOG_ERROR] = "ERROR"};
+    char when[32], addr[INET_ADDRSTRLEN];
+    struct tm tm;
+    time_t secs = rec->time_us / 1000000;
+    gmtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    struct in_addr in = {.s_addr = rec->client};
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+    return snprintf(buf, len, "%s.%06uZ %s %.*s %u %" PRIu64 " %s %u %uus\n",
+                    when, (unsigned)(rec->time_us % 1000000), addr,
+                    ALOG_URI_LEN, rec->uri, rec->status, rec->bytes,
+                    rec->outcome <= ALOG_ERROR ? outcomes[rec->outcome] : "-",
+                    rec->lane, rec->latency_us);
+}
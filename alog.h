@@ -0,0 +1,114 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Asynchronous access log. Relays never touch the log file: each thread fills
+ * in fixed-size binary records and pushes them onto a ring of its own, which
+ * takes no lock and makes no system call. A background thread drains every
+ * ring into a large batch buffer, formats it if the log is text, and writes it
+ * out in one go, rotating the file when it grows too large.
+ *
+ * When a ring is full because the writer has fallen behind, new records are
+ * dropped and counted (`alog.dropped`) rather than making the relay wait.
+ */
+#ifndef ALOG_H
+#define ALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ALOG_URI_LEN 100
+
+typedef enum {
+    ALOG_TEXT,  /* One line per request. */
+    ALOG_BINARY /* A file header, then raw alog_record_t's. */
+} alog_format_t;
+
+/**
+ * How a request was answered.
+ */
+typedef enum {
+    ALOG_HIT,  /* From the cache. */
+    ALOG_MISS, /* From the origin. */
+    ALOG_ERROR /* Not answered in full. */
+} alog_outcome_t;
+
+/**
+ * A single access log record, 128 bytes. Binary logs are a sequence of these
+ * after the file header.
+ *
+ * @param  time_us     Wall clock time the request arrived, in microseconds
+ *                     since the epoch.
+ * @param  latency_us  Time until the response was sent in full.
+ * @param  bytes       Bytes sent to the client.
+ * @param  client      IPv4 address of the client, in network byte order.
+ * @param  status      HTTP status of the response, 0 if unknown.
+ * @param  uri         Requested URI, truncated and NUL-terminated.
+ */
+typedef struct {
+    uint64_t time_us;
+    uint64_t bytes;
+    uint32_t latency_us;
+    uint32_t client;
+    uint16_t status;
+    uint8_t outcome;
+    uint8_t lane;
+    char uri[ALOG_URI_LEN];
+} alog_record_t;
+
+/**
+ * Header at the start of every binary log file.
+ */
+#define ALOG_MAGIC "ALOG0001"
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+} alog_file_header_t;
+
+/**
+ * @param  path          Log file. Rotated files are `path`.1 (the most
+ *                       recent) up to `path`.<keep>.
+ * @param  format        Text or binary.
+ * @param  rotate_bytes  Rotate once the file reaches this size (0 = never).
+ * @param  keep          Rotated files to keep.
+ * @param  ring_records  Records each thread can have queued, rounded up to a
+ *                       power of two.
+ */
+typedef struct {
+    const char *path;
+    alog_format_t format;
+    size_t rotate_bytes;
+    int keep;
+    size_t ring_records;
+} alog_cfg_t;
+
+typedef struct ALog alog_t;
+
+/**
+ * Open the log file and start the writer thread.
+ *
+ * @return NULL if the file could not be opened.
+ */
+alog_t *alog_open(const alog_cfg_t *cfg);
+
+/**
+ * Write out every queued record, stop the writer thread and close the file.
+ */
+void alog_close(alog_t *log);
+
+/**
+ * Queue a record. Thread-safe, lock-free and wait-free: the record is dropped
+ * if the calling thread's ring is full.
+ *
+ * @return 0 if queued, -1 if dropped.
+ */
+int alog_write(alog_t *log, const alog_record_t *rec);
+
+/**
+ * Format a record as a text log line, with its trailing newline.
+ *
+ * @return Length of the line, like snprintf.
+ */
+size_t alog_format(const alog_record_t *rec, char *buf, size_t len);
+
+#endif
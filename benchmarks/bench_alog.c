@@ -0,0 +1,170 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cost of access logging as seen by the relays. Several threads log records
+ * as fast as they can, through the asynchronous log in text and binary format,
+ * and through stdio the way a synchronous logger would: fprintf to a shared
+ * FILE, flushed per record. Reports the time each call takes the logging
+ * thread, and how many records the asynchronous log had to drop.
+ */
+#include "alog.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_RECORDS (200 * 1000)
+#define DEFAULT_RATE_US 0
+
+typedef enum { MODE_ALOG, MODE_STDIO } log_mode_t;
+
+static int g_records = DEFAULT_RECORDS;
+static unsigned g_gap_us = DEFAULT_RATE_US;
+static log_mode_t g_mode;
+static alog_t *g_log;
+static FILE *g_file;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill(alog_record_t *rec, int i) {
+    rec->time_us = 1700000000ULL * 1000000 + i;
+    rec->latency_us = 100 + i % 1000;
+    rec->bytes = 1000 + i;
+    rec->client = 0x0100007f;
+    rec->status = 200;
+    rec->outcome = i % 3 ? ALOG_HIT : ALOG_MISS;
+    rec->lane = i % 3 ? 0 : 1;
+    snprintf(rec->uri, sizeof(rec->uri), "http://localhost:8080/objects/%d",
+             i % 5000);
+}
+
+/**
+ * @brief Log records back to back (or `g_gap_us` apart), timing only the
+ * logging calls.
+ */
+static void *thread_logger(void *vargp) {
+    uint64_t *elapsed_ns = vargp;
+    alog_record_t rec;
+    char line[256];
+    *elapsed_ns = 0;
+
+    for (int i = 0; i < g_records; ++i) {
+        fill(&rec, i);
+        uint64_t start = now_ns();
+        if (g_mode == MODE_ALOG) {
+            alog_write(g_log, &rec);
+        } else {
+            alog_format(&rec, line, sizeof(line));
+            fputs(line, g_file);
+            fflush(g_file);
+        }
+        *elapsed_ns += now_ns() - start;
+        if (g_gap_us)
+            usleep(g_gap_us);
+    }
+    return NULL;
+}
+
+static void run(const char *name, int nthreads) {
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    uint64_t *elapsed = calloc(nthreads, sizeof(uint64_t));
+    stat_counter_t *dropped = stats_counter("alog.dropped");
+    const uint64_t dropped_before = stats_get(dropped);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; ++i)
+        pthread_create(&tids[i], NULL, thread_logger, &elapsed[i]);
+    uint64_t total = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(tids[i], NULL);
+        total += elapsed[i];
+    }
+    uint64_t wall = now_ns() - start;
+
+    const uint64_t n = (uint64_t)nthreads * g_records;
+    printf("%-8s %8.1f ns/record in caller %8.2f M records/s %10lu dropped\n",
+           name, (double)total / n, n / (wall / 1e3),
+           (unsigned long)(stats_get(dropped) - dropped_before));
+    free(tids);
+    free(elapsed);
+}
+
+int main(int argc, char **argv) {
+    int nthreads = DEFAULT_THREADS;
+    size_t rotate_mb = 0;
+    const char *dir = "/tmp";
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:g:R:d:")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            g_records = atoi(optarg);
+            break;
+        case 'g':
+            g_gap_us = atoi(optarg);
+            break;
+        case 'R':
+            rotate_mb = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-t threads] [-n records per thread] "
+                    "[-g gap us] [-R rotate MB] [-d dir]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char path[256];
+    printf("%d threads, %d records each\n", nthreads, g_records);
+
+    static const struct {
+        const char *name;
+        alog_format_t format;
+    } formats[] = {{"text", ALOG_TEXT}, {"binary", ALOG_BINARY}};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        snprintf(path, sizeof(path), "%s/bench_alog.%s", dir, formats[i].name);
+        unlink(path);
+        alog_cfg_t cfg = {
+            .path = path,
+            .format = formats[i].format,
+            .rotate_bytes = rotate_mb * 1024 * 1024,
+            .keep = 2,
+            .ring_records = 4096,
+        };
+        g_mode = MODE_ALOG;
+        if ((g_log = alog_open(&cfg)) == NULL) {
+            perror("alog_open");
+            exit(EXIT_FAILURE);
+        }
+        run(formats[i].name, nthreads);
+        alog_close(g_log);
+    }
+
+    snprintf(path, sizeof(path), "%s/bench_alog.stdio", dir);
+    g_mode = MODE_STDIO;
+    if ((g_file = fopen(path, "w")) == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    run("stdio", nthreads);
+    fclose(g_file);
+
+    printf("rotations: %lu\n",
+           (unsigned long)stats_get(stats_counter("alog.rotations")));
+    return 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Convergence of the pool size controller under step changes in load. Tasks
+ * block like misses waiting on an origin; the arrival rate steps through a
+ * few phases, and the pool size the controller settles on is traced over time
+ * along with the queueing delay it measured.
+ */
+#include "sched.h"
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_TASK_US (20 * 1000)
+#define DEFAULT_PHASE_MS 3000
+#define DEFAULT_MAX_WORKERS 64
+#define TRACE_INTERVAL_US (250 * 1000)
+
+/*
+ * Arrival rates of the phases, in tasks per second. With 20 ms tasks these
+ * need about 2, 20, 4, 40 and 2 workers.
+ */
+static const unsigned g_phases[] = {100, 1000, 200, 2000, 100};
+#define NUM_PHASES (sizeof(g_phases) / sizeof(g_phases[0]))
+
+static atomic_bool g_done;
+static atomic_uint g_phase;
+static uint64_t g_task_us = DEFAULT_TASK_US;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void task_body(void *arg) {
+    usleep(g_task_us);
+}
+
+/**
+ * @brief Print what the controller sees and decides, a few times a second.
+ */
+static void *thread_trace(void *vargp) {
+    sched_t *sched = vargp;
+    stat_counter_t *wait = stats_counter("sched.tune.wait_us");
+    stat_counter_t *util = stats_counter("sched.tune.util_pct");
+    stat_counter_t *blocked = stats_counter("sched.tune.blocked_pct");
+    stat_counter_t *depth = stats_counter("sched.queue_depth");
+    const uint64_t start = now_us();
+
+    printf("%8s %6s %8s %10s %6s %8s %6s\n", "time", "rate", "workers",
+           "wait us", "util", "blocked", "queue");
+    while (!atomic_load(&g_done)) {
+        usleep(TRACE_INTERVAL_US);
+        printf("%7.2fs %6u %8d %10" PRIu64 " %5" PRIu64 "%% %7" PRIu64
+               "%% %6" PRIu64 "\n",
+               (now_us() - start) / 1e6, g_phases[atomic_load(&g_phase)],
+               sched_workers(sched), stats_get(wait), stats_get(util),
+               stats_get(blocked), stats_get(depth));
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int min_workers = 1, max_workers = DEFAULT_MAX_WORKERS;
+    uint64_t phase_ms = DEFAULT_PHASE_MS;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:M:p:t:")) != -1) {
+        switch (opt) {
+        case 'm':
+            min_workers = atoi(optarg);
+            break;
+        case 'M':
+            max_workers = atoi(optarg);
+            break;
+        case 'p':
+            phase_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            g_task_us = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-m min workers] [-M max workers] "
+                    "[-p phase ms] [-t task us]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sched_t *sched = sched_init(min_workers, SCHED_STEAL);
+    sched_tune_t tune = {
+        .min_workers = min_workers,
+        .max_workers = max_workers,
+        .interval_us = 100 * 1000,
+        .target_wait_us = 1000,
+        .grow_step = 2,
+    };
+    if (sched == NULL || sched_autosize(sched, &tune) < 0) {
+        fprintf(stderr, "invalid pool configuration\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t trace;
+    pthread_create(&trace, NULL, thread_trace, sched);
+
+    for (unsigned p = 0; p < NUM_PHASES; ++p) {
+        atomic_store(&g_phase, p);
+        const uint64_t gap = 1000000 / g_phases[p];
+        const uint64_t end = now_us() + phase_ms * 1000;
+        uint64_t next = now_us();
+        while (next < end) {
+            sched_submit(sched, task_body, NULL);
+            next += gap;
+            uint64_t now = now_us();
+            if (next > now)
+                usleep(next - now);
+        }
+    }
+
+    atomic_store(&g_done, true);
+    pthread_join(trace, NULL);
+    sched_free(sched);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Hot local reads through the cache view (cf. cacheview.h) against requests
+ * to a running proxy, over TCP and over its UNIX socket. Start the proxy with
+ * `-V <segment>` (and `-U <path>` for the UNIX socket row).
+ *
+ * Reads through the view are timed twice: a lookup alone, the response used
+ * in place, and cacheview_get, which copies it out. With `-e`, threads fetch
+ * a stream of distinct objects through the proxy meanwhile, so that entries
+ * are inserted and evicted under the readers; the bench then also counts the
+ * reads that found the response evicted or overwritten.
+ *
+ * The bench serves every object itself from a small origin:
+ * `/obj/<id>-<size>` answers with `size` bytes.
+ */
+#define _GNU_SOURCE
+#include "cacheview.h"
+#include "unixsock.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LOOKUPS 1000000
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_OBJECT_KB 16
+#define ORIGIN_THREADS 8
+#define BUFSIZE (64 * 1024)
+#define WARM_TRIES 100
+
+static int g_origin_port;
+static size_t g_object_size = DEFAULT_OBJECT_KB * 1024;
+static atomic_bool g_stop;
+static atomic_uint g_next_object = 1;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_row(const char *label, uint64_t *samples, size_t n) {
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+    if (n > 0)
+        printf("  %-24s p50 %9.0f ns  p99 %9.0f ns  (%zu)\n", label,
+               (double)samples[n / 2], (double)samples[n * 99 / 100], n);
+}
+
+/**
+ * @brief Origin: answers `/obj/<id>-<size>` with `size` bytes of filler.
+ */
+static void *thread_origin(void *vargp) {
+    int listenfd = (int)(size_t)vargp;
+    char *buf = malloc(BUFSIZE);
+    memset(buf, 'x', BUFSIZE);
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        char req[1024], head[256];
+        unsigned id;
+        size_t size = 0;
+        ssize_t n = read(fd, req, sizeof(req) - 1);
+        if (n > 0) {
+            req[n] = '\0';
+            const char *path = strstr(req, "/obj/");
+            if (path && sscanf(path, "/obj/%u-%zu", &id, &size) != 2)
+                size = 0;
+        }
+        int len = snprintf(head, sizeof(head),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Content-Length: %zu\r\n\r\n",
+                           size);
+        if (write(fd, head, len) == len)
+            for (size_t left = size; left > 0;) {
+                size_t chunk = left < BUFSIZE ? left : BUFSIZE;
+                if (write(fd, buf, chunk) <= 0)
+                    break;
+                left -= chunk;
+            }
+        close(fd);
+    }
+    return NULL;
+}
+
+static int start_origin(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 1024) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("origin");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ORIGIN_THREADS; ++i) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, thread_origin, (void *)(size_t)fd);
+        pthread_detach(tid);
+    }
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Fetch `uri` through the proxy on the loopback `port`, or on the UNIX
+ * socket `path` if it is not NULL.
+ *
+ * @return Bytes of the response, or -1.
+ */
+static ssize_t fetch(int port, const char *path, const char *uri, char *buf,
+                     size_t cap) {
+    int fd;
+    if (path) {
+        fd = unixsock_connect(path);
+    } else {
+        struct sockaddr_in addr = {.sin_family = AF_INET,
+                                   .sin_port = htons(port)};
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 &&
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0)
+        return -1;
+    char req[512];
+    int len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", uri);
+    ssize_t total = -1, n;
+    if (write(fd, req, len) == len)
+        for (total = 0; (size_t)total < cap &&
+                        (n = read(fd, buf + total, cap - total)) > 0;)
+            total += n;
+    close(fd);
+    return total;
+}
+
+static void object_uri(char *uri, size_t len, unsigned id) {
+    snprintf(uri, len, "http://127.0.0.1:%d/obj/%u-%zu", g_origin_port, id,
+             g_object_size);
+}
+
+/**
+ * @brief Fetch a distinct object through the proxy, over and over.
+ */
+static void *thread_evict(void *vargp) {
+    const int port = (int)(size_t)vargp;
+    char uri[256];
+    char *buf = malloc(BUFSIZE * 2);
+    while (!atomic_load(&g_stop)) {
+        object_uri(uri, sizeof(uri), atomic_fetch_add(&g_next_object, 1));
+        fetch(port, NULL, uri, buf, BUFSIZE * 2);
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *segment = NULL;
+    int proxy_port = 0;
+    const char *proxy_path = NULL;
+    size_t lookups = DEFAULT_LOOKUPS;
+    size_t requests = DEFAULT_REQUESTS;
+    int evict_threads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "V:P:U:n:r:k:e:")) != -1) {
+        switch (opt) {
+        case 'V':
+            segment = optarg;
+            break;
+        case 'P':
+            proxy_port = atoi(optarg);
+            break;
+        case 'U':
+            proxy_path = optarg;
+            break;
+        case 'n':
+            lookups = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            requests = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            g_object_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'e':
+            evict_threads = atoi(optarg);
+            break;
+        default:
+            segment = NULL;
+        }
+    }
+    if (segment == NULL || proxy_port == 0 || lookups == 0 ||
+        g_object_size == 0 || g_object_size > BUFSIZE) {
+        fprintf(stderr,
+                "Usage: %s -V segment -P proxy_port [-U proxy socket] "
+                "[-n lookups] [-r requests] [-k object KB] "
+                "[-e evicting threads]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char tcp_addr[64];
+    snprintf(tcp_addr, sizeof(tcp_addr), "127.0.0.1:%d", proxy_port);
+    cacheview_t *view = cacheview_open(segment, tcp_addr);
+    if (view == NULL) {
+        fprintf(stderr, "%s is not a cache view\n", segment);
+        exit(EXIT_FAILURE);
+    }
+    g_origin_port = start_origin();
+
+    // The first request caches the object; the view has it once the proxy
+    // is done inserting.
+    char uri[256];
+    char *buf = malloc(BUFSIZE * 2);
+    cacheview_ref_t ref;
+    object_uri(uri, sizeof(uri), 0);
+    cacheview_get(view, uri, buf, BUFSIZE * 2);
+    int tries = 0;
+    while (cacheview_lookup(view, uri, &ref) < 0 && ++tries < WARM_TRIES)
+        usleep(1000);
+    if (tries == WARM_TRIES) {
+        fprintf(stderr, "%s never showed up in the view\n", uri);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t *tids = malloc((evict_threads + 1) * sizeof(pthread_t));
+    for (int i = 0; i < evict_threads; ++i)
+        pthread_create(&tids[i], NULL, thread_evict,
+                       (void *)(size_t)proxy_port);
+
+    const size_t max = lookups > requests ? lookups : requests;
+    uint64_t *samples = malloc(max * sizeof(uint64_t));
+    size_t n = 0, misses = 0, torn = 0;
+    uint64_t checksum = 0;
+    for (size_t i = 0; i < lookups; ++i) {
+        const uint64_t start = now_ns();
+        if (cacheview_lookup(view, uri, &ref) < 0) {
+            ++misses;
+            continue;
+        }
+        checksum += (unsigned char)ref.body[ref.body_len / 2];
+        if (!cacheview_valid(view, &ref)) {
+            ++torn;
+            continue;
+        }
+        samples[n++] = now_ns() - start;
+    }
+    printf("%zu KB object, %d evicting threads:\n", g_object_size / 1024,
+           evict_threads);
+    print_row("view lookup, in place", samples, n);
+
+    n = 0;
+    for (size_t i = 0; i < lookups; ++i) {
+        const uint64_t start = now_ns();
+        if (cacheview_get(view, uri, buf, BUFSIZE * 2) > 0)
+            samples[n++] = now_ns() - start;
+    }
+    print_row("view get, copied out", samples, n);
+
+    const char *paths[] = {NULL, proxy_path};
+    const char *labels[] = {"proxy over TCP", "proxy over UNIX socket"};
+    for (int p = 0; p < (proxy_path ? 2 : 1); ++p) {
+        n = 0;
+        for (size_t i = 0; i < requests; ++i) {
+            const uint64_t start = now_ns();
+            if (fetch(proxy_port, paths[p], uri, buf, BUFSIZE * 2) > 0)
+                samples[n++] = now_ns() - start;
+        }
+        print_row(labels[p], samples, n);
+    }
+
+    atomic_store(&g_stop, true);
+    for (int i = 0; i < evict_threads; ++i)
+        pthread_join(tids[i], NULL);
+    printf("view misses %zu, reads overwritten under the reader %zu "
+           "(checksum %lu)\n",
+           misses, torn, (unsigned long)checksum);
+    cacheview_close(view);
+    free(samples);
+    free(tids);
+    free(buf);
+    return 0;
+}
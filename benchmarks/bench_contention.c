@@ -0,0 +1,292 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Lock contention in a running proxy under the hit-while-evict pattern of
+ * `failed_tests/D17-stress.cmd`: a few threads keep fetching a small hot set
+ * of objects, which the proxy answers from its cache, while others fetch a
+ * stream of distinct 20-100 KB objects that keep evicting from the 1 MB
+ * cache. Reports the latency of the hits, then the proxy's lock metrics and
+ * long-hold call sites from its admin port (start it with `-a`).
+ *
+ * The bench serves every object itself from a small origin: `/obj/<id>-<size>`
+ * answers with `size` bytes.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HIT_THREADS 8
+#define DEFAULT_EVICT_THREADS 4
+#define DEFAULT_SECONDS 5
+#define ORIGIN_THREADS 8
+#define MAX_SAMPLES (1 << 20)
+#define BUFSIZE (64 * 1024)
+
+/*
+ * The hot set and the sizes of the evicting stream, both from D17.
+ */
+static const size_t g_hot_sizes[] = {33, 50, 66, 50, 50};
+static const size_t g_stream_sizes[] = {50, 66, 100, 100, 100, 100, 66, 50,
+                                        33, 20};
+#define NHOT (sizeof(g_hot_sizes) / sizeof(g_hot_sizes[0]))
+#define NSTREAM (sizeof(g_stream_sizes) / sizeof(g_stream_sizes[0]))
+
+static int g_proxy_port;
+static int g_origin_port;
+static atomic_bool g_stop;
+static atomic_uint g_next_object = NHOT;
+static atomic_ulong g_errors;
+
+static uint64_t *g_samples;
+static atomic_size_t g_nsamples;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Origin: answers `/obj/<id>-<size>` with `size` bytes of filler.
+ */
+static void *thread_origin(void *vargp) {
+    int listenfd = (int)(size_t)vargp;
+    char *buf = malloc(BUFSIZE);
+    memset(buf, 'x', BUFSIZE);
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        char req[1024], head[256];
+        unsigned id;
+        size_t size = 0;
+        ssize_t n = read(fd, req, sizeof(req) - 1);
+        if (n > 0) {
+            req[n] = '\0';
+            const char *path = strstr(req, "/obj/");
+            if (path && sscanf(path, "/obj/%u-%zu", &id, &size) != 2)
+                size = 0;
+        }
+        int len = snprintf(head, sizeof(head),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Content-Length: %zu\r\n\r\n",
+                           size);
+        if (write(fd, head, len) == len)
+            for (size_t left = size; left > 0;) {
+                size_t chunk = left < BUFSIZE ? left : BUFSIZE;
+                if (write(fd, buf, chunk) <= 0)
+                    break;
+                left -= chunk;
+            }
+        close(fd);
+    }
+    return NULL;
+}
+
+static int start_origin(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 1024) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("origin");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ORIGIN_THREADS; ++i) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, thread_origin, (void *)(size_t)fd);
+    }
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Fetch an object through the proxy.
+ *
+ * @return 0 if the whole body arrived, -1 otherwise.
+ */
+static int fetch(unsigned id, size_t kb) {
+    char req[256], buf[BUFSIZE];
+    int fd = connect_local(g_proxy_port);
+    if (fd < 0) {
+        perror("connect to proxy");
+        exit(EXIT_FAILURE);
+    }
+    int len = snprintf(req, sizeof(req),
+                       "GET http://127.0.0.1:%d/obj/%u-%zu HTTP/1.0\r\n"
+                       "Host: 127.0.0.1:%d\r\n\r\n",
+                       g_origin_port, id, kb * 1024, g_origin_port);
+    size_t total = 0, head_len = 0;
+    if (write(fd, req, len) == len) {
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            if (head_len == 0 && total == 0) {
+                char *end = memmem(buf, n, "\r\n\r\n", 4);
+                head_len = end ? (size_t)(end - buf) + 4 : 0;
+            }
+            total += n;
+        }
+    }
+    close(fd);
+    if (head_len == 0 || total - head_len != kb * 1024) {
+        atomic_fetch_add(&g_errors, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static void *thread_hits(void *vargp) {
+    unsigned i = (unsigned)(size_t)vargp;
+    while (!atomic_load(&g_stop)) {
+        i = (i + 1) % NHOT;
+        uint64_t start = now_ns();
+        if (fetch(i, g_hot_sizes[i]) < 0)
+            continue;
+        size_t k = atomic_fetch_add(&g_nsamples, 1);
+        if (k < MAX_SAMPLES)
+            g_samples[k] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static void *thread_evict(void *vargp) {
+    while (!atomic_load(&g_stop)) {
+        unsigned id = atomic_fetch_add(&g_next_object, 1);
+        fetch(id, g_stream_sizes[id % NSTREAM]);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print the lines of an admin page that start with `prefix`.
+ */
+static void print_admin(int port, const char *path, const char *prefix) {
+    char req[128], buf[BUFSIZE];
+    int fd = connect_local(port);
+    if (fd < 0) {
+        perror("connect to admin port");
+        return;
+    }
+    int len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", path);
+    size_t total = 0;
+    ssize_t n;
+    if (write(fd, req, len) == len)
+        while (total < sizeof(buf) - 1 &&
+               (n = read(fd, buf + total, sizeof(buf) - 1 - total)) > 0)
+            total += n;
+    close(fd);
+    buf[total] = '\0';
+
+    char *body = strstr(buf, "\r\n\r\n");
+    for (char *line = body ? strtok(body + 4, "\n") : NULL; line;
+         line = strtok(NULL, "\n"))
+        if (strncmp(line, prefix, strlen(prefix)) == 0)
+            printf("  %s\n", line);
+}
+
+int main(int argc, char **argv) {
+    int hit_threads = DEFAULT_HIT_THREADS;
+    int evict_threads = DEFAULT_EVICT_THREADS;
+    int seconds = DEFAULT_SECONDS;
+    int admin_port = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "P:A:r:e:d:")) != -1) {
+        switch (opt) {
+        case 'P':
+            g_proxy_port = atoi(optarg);
+            break;
+        case 'A':
+            admin_port = atoi(optarg);
+            break;
+        case 'r':
+            hit_threads = atoi(optarg);
+            break;
+        case 'e':
+            evict_threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            g_proxy_port = 0;
+        }
+    }
+    if (g_proxy_port == 0) {
+        fprintf(stderr,
+                "Usage: %s -P proxy_port [-A admin_port] [-r hit threads] "
+                "[-e evicting threads] [-d seconds]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    g_origin_port = start_origin();
+    g_samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+
+    // Warm the hot set.
+    for (unsigned i = 0; i < NHOT; ++i)
+        fetch(i, g_hot_sizes[i]);
+
+    pthread_t *tids = malloc((hit_threads + evict_threads) * sizeof(pthread_t));
+    for (int i = 0; i < hit_threads; ++i)
+        pthread_create(&tids[i], NULL, thread_hits, (void *)(size_t)i);
+    for (int i = 0; i < evict_threads; ++i)
+        pthread_create(&tids[hit_threads + i], NULL, thread_evict, NULL);
+    sleep(seconds);
+    atomic_store(&g_stop, true);
+    for (int i = 0; i < hit_threads + evict_threads; ++i)
+        pthread_join(tids[i], NULL);
+
+    size_t n = atomic_load(&g_nsamples);
+    if (n > MAX_SAMPLES)
+        n = MAX_SAMPLES;
+    qsort(g_samples, n, sizeof(uint64_t), cmp_u64);
+    const unsigned fetched = atomic_load(&g_next_object) - NHOT;
+    printf("%d hit threads, %d evicting threads, %d s\n", hit_threads,
+           evict_threads, seconds);
+    printf("hot fetches %zu (%.0f/s), evicting fetches %u, errors %lu\n", n,
+           (double)n / seconds, fetched, atomic_load(&g_errors));
+    if (n > 0)
+        printf("hot latency us: p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               g_samples[n / 2] / 1e3, g_samples[n * 99 / 100] / 1e3,
+               g_samples[n * 999 / 1000] / 1e3, g_samples[n - 1] / 1e3);
+
+    if (admin_port) {
+        printf("lock metrics:\n");
+        print_admin(admin_port, "/stats", "lock.");
+        printf("long holds:\n");
+        print_admin(admin_port, "/locks", "");
+    }
+    free(tids);
+    free(g_samples);
+    return 0;
+}
@@ -0,0 +1,252 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Compares coroutines against threads on the two costs that matter for the
+ * proxy: how long it takes to switch between two connections, and how much
+ * memory each parked connection holds.
+ *
+ * Each parked connection touches `footprint` bytes of its stack before it
+ * blocks, which stands in for the relay path's stack buffers.
+ */
+#define _GNU_SOURCE
+#include "coro.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SWITCHES (1000 * 1000)
+#define DEFAULT_CONNS 2000
+#define DEFAULT_FOOTPRINT (32 * 1024)
+
+static size_t g_switches = DEFAULT_SWITCHES;
+static size_t g_footprint = DEFAULT_FOOTPRINT;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Resident and virtual memory of this process, in bytes.
+ */
+static void read_mem(size_t *rss, size_t *vsz) {
+    size_t pages_vsz = 0, pages_rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%zu %zu", &pages_vsz, &pages_rss) != 2)
+            pages_vsz = pages_rss = 0;
+        fclose(f);
+    }
+    *rss = pages_rss * sysconf(_SC_PAGESIZE);
+    *vsz = pages_vsz * sysconf(_SC_PAGESIZE);
+}
+
+/**************** CONTEXT SWITCH COST ****************/
+static void coro_pingpong(void *arg) {
+    for (size_t i = 0; i < g_switches / 2; ++i)
+        coro_yield();
+}
+
+static double bench_coro_switch(void) {
+    coro_loop_t *loop = coro_loop_init(CORO_STACK_SIZE);
+    coro_spawn(loop, coro_pingpong, NULL);
+    coro_spawn(loop, coro_pingpong, NULL);
+    coro_loop_stop(loop);
+
+    double start = now_sec();
+    coro_loop_run(loop);
+    double elapsed = now_sec() - start;
+
+    coro_loop_free(loop);
+    return elapsed * 1e9 / g_switches;
+}
+
+typedef struct {
+    int in, out;
+} pipe_pair_t;
+
+static void *thread_pingpong(void *vargp) {
+    pipe_pair_t *p = vargp;
+    char c = 0;
+    for (size_t i = 0; i < g_switches / 2; ++i) {
+        if (read(p->in, &c, 1) != 1 || write(p->out, &c, 1) != 1)
+            break;
+    }
+    return NULL;
+}
+
+/**
+ * Two threads handing a token back and forth through pipes. Every hand-off is
+ * a blocking read, which is exactly what a thread-per-connection proxy does.
+ */
+static double bench_thread_switch(void) {
+    int ab[2], ba[2];
+    if (pipe(ab) < 0 || pipe(ba) < 0)
+        return -1;
+
+    pthread_t tid;
+    pipe_pair_t peer = {.in = ab[0], .out = ba[1]};
+    pthread_create(&tid, NULL, thread_pingpong, &peer);
+
+    char c = 0;
+    double start = now_sec();
+    for (size_t i = 0; i < g_switches / 2; ++i) {
+        if (write(ab[1], &c, 1) != 1 || read(ba[0], &c, 1) != 1)
+            break;
+    }
+    double elapsed = now_sec() - start;
+    pthread_join(tid, NULL);
+
+    close(ab[0]);
+    close(ab[1]);
+    close(ba[0]);
+    close(ba[1]);
+    return elapsed * 1e9 / g_switches;
+}
+
+/**************** MEMORY PER CONNECTION ****************/
+/**
+ * Touch `footprint` bytes of stack, then block on the pipe until released.
+ */
+static void park_on_fd(int fd) {
+    char *frame = alloca(g_footprint);
+    memset(frame, 1, g_footprint);
+    __asm__ volatile("" : : "r"(frame) : "memory");
+
+    char c;
+    while (read(fd, &c, 1) < 0)
+        coro_wait_fd(fd, EPOLLIN);
+}
+
+static void coro_parked(void *arg) {
+    park_on_fd((int)(size_t)arg);
+}
+
+static void *thread_parked(void *vargp) {
+    park_on_fd((int)(size_t)vargp);
+    return NULL;
+}
+
+static void *thread_loop(void *vargp) {
+    coro_loop_run(vargp);
+    return NULL;
+}
+
+/**
+ * One pipe per connection, so that every parked connection has its own
+ * descriptor to wait on. Closing the write ends releases everyone.
+ */
+static int (*open_pipes(size_t nconns))[2] {
+    int (*pipes)[2] = malloc(nconns * sizeof(*pipes));
+    for (size_t i = 0; i < nconns; ++i) {
+        if (pipe2(pipes[i], O_NONBLOCK) < 0) {
+            perror("pipe2");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pipes;
+}
+
+static void close_pipes(int (*pipes)[2], size_t nconns) {
+    for (size_t i = 0; i < nconns; ++i)
+        close(pipes[i][1]);
+}
+
+static void bench_coro_memory(size_t nconns) {
+    size_t rss0, vsz0, rss1, vsz1;
+    int (*pipes)[2] = open_pipes(nconns);
+    coro_loop_t *loop = coro_loop_init(CORO_STACK_SIZE);
+    pthread_t tid;
+    pthread_create(&tid, NULL, thread_loop, loop);
+
+    read_mem(&rss0, &vsz0);
+    for (size_t i = 0; i < nconns; ++i)
+        coro_spawn(loop, coro_parked, (void *)(size_t)pipes[i][0]);
+    while (coro_loop_count(loop) < nconns)
+        usleep(1000);
+    usleep(100 * 1000);
+    read_mem(&rss1, &vsz1);
+
+    printf("coroutines: %8.1f KB rss/conn  %8.1f KB vsz/conn\n",
+           (double)(rss1 - rss0) / nconns / 1024,
+           (double)(vsz1 - vsz0) / nconns / 1024);
+
+    close_pipes(pipes, nconns);
+    coro_loop_stop(loop);
+    pthread_join(tid, NULL);
+    coro_loop_free(loop);
+    for (size_t i = 0; i < nconns; ++i)
+        close(pipes[i][0]);
+    free(pipes);
+}
+
+static void bench_thread_memory(size_t nconns) {
+    size_t rss0, vsz0, rss1, vsz1;
+    int (*pipes)[2] = open_pipes(nconns);
+    pthread_t *tids = malloc(nconns * sizeof(pthread_t));
+
+    read_mem(&rss0, &vsz0);
+    size_t started = 0;
+    for (; started < nconns; ++started)
+        if (pthread_create(&tids[started], NULL, thread_parked,
+                           (void *)(size_t)pipes[started][0]))
+            break;
+    usleep(200 * 1000);
+    read_mem(&rss1, &vsz1);
+
+    if (started < nconns)
+        printf("threads:    only %zu of %zu threads could be created\n",
+               started, nconns);
+    if (started > 0)
+        printf("threads:    %8.1f KB rss/conn  %8.1f KB vsz/conn\n",
+               (double)(rss1 - rss0) / started / 1024,
+               (double)(vsz1 - vsz0) / started / 1024);
+
+    close_pipes(pipes, nconns);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    for (size_t i = 0; i < nconns; ++i)
+        close(pipes[i][0]);
+    free(pipes);
+    free(tids);
+}
+
+int main(int argc, char **argv) {
+    size_t nconns = DEFAULT_CONNS;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:f:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nconns = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            g_switches = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            g_footprint = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n conns] [-s switches] [-f footprint]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("context switch (%zu switches)\n", g_switches);
+    printf("coroutines: %8.1f ns/switch\n", bench_coro_switch());
+    printf("threads:    %8.1f ns/switch\n", bench_thread_switch());
+
+    printf("\nmemory per parked connection (%zu conns, %zu KB touched)\n",
+           nconns, g_footprint / 1024);
+    bench_coro_memory(nconns);
+    bench_thread_memory(nconns);
+    return 0;
+}
@@ -0,0 +1,202 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Memory held by the proxy for idle keep-alive connections. Opens many client
+ * connections to a running proxy (started with `-k`), sends one request on
+ * each and reads the full response, then leaves them all idle and reports the
+ * proxy's resident memory per connection.
+ *
+ * The bench serves the requested object itself from a tiny origin thread, so
+ * only the first request is a miss.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DEFAULT_CONNS 10000
+#define ORIGIN_BODY "hello, idle world\n"
+
+/**
+ * @brief Resident set size of a process in KB, from /proc.
+ */
+static long rss_kb(int pid) {
+    char path[64], line[256];
+    long kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+/**
+ * @brief Origin: answers every connection with the same small response.
+ */
+static void *thread_origin(void *vargp) {
+    int listenfd = (int)(size_t)vargp;
+    char buf[4096], resp[256];
+    int len = snprintf(resp, sizeof(resp),
+                       "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\n\r\n%s",
+                       strlen(ORIGIN_BODY), ORIGIN_BODY);
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        if (read(fd, buf, sizeof(buf)) > 0 && write(fd, resp, len) < 0)
+            perror("origin write");
+        close(fd);
+    }
+    return NULL;
+}
+
+static int start_origin(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 128) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("origin");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, thread_origin, (void *)(size_t)fd);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Connect to the proxy on the loopback interface.
+ */
+static int connect_proxy(int proxy_port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(proxy_port);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Send one keep-alive request and read the whole response.
+ *
+ * @return 0 if the proxy kept the connection open.
+ */
+static int request(int fd, const char *req, size_t reqlen) {
+    char buf[4096];
+    size_t got = 0;
+    if (write(fd, req, reqlen) != (ssize_t)reqlen)
+        return -1;
+    while (got < sizeof(buf) - 1) {
+        ssize_t n = read(fd, buf + got, sizeof(buf) - 1 - got);
+        if (n <= 0)
+            return -1;
+        got += n;
+        buf[got] = '\0';
+        char *body = strstr(buf, "\r\n\r\n");
+        if (body && strlen(body + 4) >= strlen(ORIGIN_BODY))
+            return strstr(buf, "Connection: keep-alive") ? 0 : -1;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int nconns = DEFAULT_CONNS, proxy_port = 0, proxy_pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:P:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nconns = atoi(optarg);
+            break;
+        case 'P':
+            proxy_port = atoi(optarg);
+            break;
+        case 'p':
+            proxy_pid = atoi(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+    if (proxy_port <= 0 || proxy_pid <= 0) {
+        fprintf(stderr, "Usage: %s -P proxy port -p proxy pid [-n conns]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((rlim_t)nconns + 16 > rl.rlim_cur) {
+        nconns = rl.rlim_cur - 16;
+        printf("open file limit: using %d connections\n", nconns);
+    }
+
+    char req[256];
+    const int origin_port = start_origin();
+    int reqlen = snprintf(req, sizeof(req),
+                          "GET http://127.0.0.1:%d/idle HTTP/1.1\r\n"
+                          "Host: 127.0.0.1:%d\r\n\r\n",
+                          origin_port, origin_port);
+
+    // Warm the cache, so that every measured connection is a hit.
+    int fd = connect_proxy(proxy_port);
+    if (fd < 0 || request(fd, req, reqlen) < 0) {
+        fprintf(stderr, "proxy did not keep the connection open; -k set?\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    sleep(1);
+    const long rss_before = rss_kb(proxy_pid);
+
+    // Connections the proxy drops (e.g. when it fails to resolve the client)
+    // are counted and skipped.
+    int *fds = malloc(nconns * sizeof(int));
+    int open_conns = 0, dropped = 0;
+    for (int i = 0; i < nconns; ++i) {
+        int fd = connect_proxy(proxy_port);
+        if (fd < 0) {
+            fprintf(stderr, "connect %d: %s\n", i, strerror(errno));
+            break;
+        }
+        if (request(fd, req, reqlen) < 0) {
+            close(fd);
+            dropped++;
+            continue;
+        }
+        fds[open_conns++] = fd;
+    }
+    sleep(1);
+    const long rss_after = rss_kb(proxy_pid);
+
+    printf("%d idle keep-alive connections (%d dropped)\n", open_conns,
+           dropped);
+    printf("proxy RSS %ld KB -> %ld KB, %.0f bytes per connection\n",
+           rss_before, rss_after,
+           open_conns ? (rss_after - rss_before) * 1024.0 / open_conns : 0.0);
+
+    for (int i = 0; i < open_conns; ++i)
+        close(fds[i]);
+    free(fds);
+    return 0;
+}
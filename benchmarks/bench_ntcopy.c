@@ -0,0 +1,231 @@
+/**
+ * @author Jonathan Helland
+ *
+ * What large cache fills cost the hits that run beside them. Threads serve a
+ * hot set of small objects from a cache (cf. cache.h) under one lock, as the
+ * proxy does, while other threads keep inserting large objects that evict
+ * each other. The hit latency is measured without fills, with fills copied
+ * by memcpy, and with fills copied by ntcopy (cf. ntcopy.h), whose
+ * non-temporal stores leave the CPU caches to the hot set.
+ *
+ * `-r` and `-f` set the number of hit and fill threads, `-g` the gap between
+ * the fills of a thread in microseconds, `-d` the duration of each run in
+ * seconds, `-H` and `-s` the number of hot objects and their size in bytes,
+ * `-l` the size of the large objects in KB and `-c` the cache size in MB.
+ */
+#include "cache.h"
+#include "ntcopy.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HIT_THREADS 1
+#define DEFAULT_FILL_THREADS 1
+#define DEFAULT_SECONDS 3
+#define DEFAULT_GAP_US 50
+#define DEFAULT_HOT 512
+#define DEFAULT_HOT_SIZE 3072
+#define DEFAULT_LARGE_KB 96
+#define DEFAULT_CACHE_MB 16
+#define MAX_SAMPLES (1 << 22)
+#define SOURCES 8
+#define KEY_LEN 32
+
+static cache_t *g_cache;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_hot = DEFAULT_HOT;
+static size_t g_hot_size = DEFAULT_HOT_SIZE;
+static size_t g_large_size = DEFAULT_LARGE_KB * 1024;
+static unsigned g_gap_us = DEFAULT_GAP_US;
+static char *g_sources[SOURCES];
+static atomic_bool g_stop;
+static atomic_uint g_next_large;
+static atomic_ulong g_fill_bytes;
+static atomic_ulong g_checksum;
+
+static uint64_t *g_samples;
+static atomic_size_t g_nsamples;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Look up hot objects at random and read each one through.
+ */
+static void *thread_hit(void *vargp) {
+    unsigned seed = (unsigned)(size_t)vargp;
+    char key[KEY_LEN];
+    while (!atomic_load(&g_stop)) {
+        snprintf(key, sizeof(key), "hot-%u", rand_r(&seed) % (unsigned)g_hot);
+        const uint64_t start = now_ns();
+        pthread_mutex_lock(&g_lock);
+        block_t *block = cache_find(g_cache, key, strlen(key) + 1);
+        pthread_mutex_unlock(&g_lock);
+        if (block == NULL)
+            continue;
+        uint64_t sum = 0;
+        for (size_t i = 0; i + sizeof(uint64_t) <= block->size;
+             i += sizeof(uint64_t))
+            sum += *(const uint64_t *)((const char *)block->value + i);
+        pthread_mutex_lock(&g_lock);
+        cache_release(g_cache, block);
+        pthread_mutex_unlock(&g_lock);
+        const uint64_t elapsed = now_ns() - start;
+
+        atomic_fetch_add_explicit(&g_checksum, sum, memory_order_relaxed);
+        const size_t i = atomic_fetch_add(&g_nsamples, 1);
+        if (i < MAX_SAMPLES)
+            g_samples[i] = elapsed;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Insert distinct large objects, which evict the previous ones, one
+ * every g_gap_us at most. The copy happens under the lock, as in the proxy,
+ * so without a gap the hits would mostly measure waiting for it.
+ */
+static void *thread_fill(void *vargp) {
+    char key[KEY_LEN];
+    while (!atomic_load(&g_stop)) {
+        const unsigned id = atomic_fetch_add(&g_next_large, 1);
+        snprintf(key, sizeof(key), "large-%u", id);
+        pthread_mutex_lock(&g_lock);
+        cache_insert(g_cache, key, strlen(key) + 1, g_sources[id % SOURCES],
+                     g_large_size);
+        pthread_mutex_unlock(&g_lock);
+        atomic_fetch_add(&g_fill_bytes, g_large_size);
+        if (g_gap_us)
+            usleep(g_gap_us);
+    }
+    return NULL;
+}
+
+/**
+ * @brief One run of `seconds` with `fillers` fill threads.
+ */
+static void run(const char *label, int hitters, int fillers, int seconds) {
+    atomic_store(&g_stop, false);
+    atomic_store(&g_nsamples, 0);
+    atomic_store(&g_fill_bytes, 0);
+    pthread_t *tids = malloc((hitters + fillers) * sizeof(pthread_t));
+    for (int i = 0; i < hitters; ++i)
+        pthread_create(&tids[i], NULL, thread_hit, (void *)(size_t)(i + 1));
+    for (int i = 0; i < fillers; ++i)
+        pthread_create(&tids[hitters + i], NULL, thread_fill, NULL);
+    sleep(seconds);
+    atomic_store(&g_stop, true);
+    for (int i = 0; i < hitters + fillers; ++i)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    size_t n = atomic_load(&g_nsamples);
+    if (n > MAX_SAMPLES)
+        n = MAX_SAMPLES;
+    qsort(g_samples, n, sizeof(uint64_t), cmp_u64);
+    if (n == 0)
+        return;
+    printf("  %-18s hits %8.0f/s  p50 %6lu ns  p90 %6lu ns  p99 %6lu ns",
+           label, (double)atomic_load(&g_nsamples) / seconds,
+           (unsigned long)g_samples[n / 2],
+           (unsigned long)g_samples[n * 9 / 10],
+           (unsigned long)g_samples[n * 99 / 100]);
+    if (fillers > 0)
+        printf("  fills %6.0f MB/s",
+               (double)atomic_load(&g_fill_bytes) / (1 << 20) / seconds);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    int hitters = DEFAULT_HIT_THREADS, fillers = DEFAULT_FILL_THREADS;
+    int seconds = DEFAULT_SECONDS;
+    size_t cache_mb = DEFAULT_CACHE_MB;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:g:d:H:s:l:c:")) != -1) {
+        switch (opt) {
+        case 'r':
+            hitters = atoi(optarg);
+            break;
+        case 'f':
+            fillers = atoi(optarg);
+            break;
+        case 'g':
+            g_gap_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'H':
+            g_hot = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            g_hot_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            g_large_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'c':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            hitters = 0;
+        }
+    }
+    if (hitters <= 0 || fillers < 0 || seconds <= 0 || g_hot == 0 ||
+        g_hot_size == 0 || g_large_size == 0 ||
+        g_hot * g_hot_size + 2 * g_large_size > cache_mb << 20) {
+        fprintf(stderr,
+                "Usage: %s [-r hit threads] [-f fill threads] [-g gap us] "
+                "[-d seconds] [-H hot objects] [-s hot object bytes] "
+                "[-l large KB] [-c cache MB]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    g_cache = cache_init(cache_mb << 20);
+    char key[KEY_LEN];
+    char *value = malloc(g_hot_size);
+    memset(value, 1, g_hot_size);
+    for (size_t i = 0; i < g_hot; ++i) {
+        snprintf(key, sizeof(key), "hot-%zu", i);
+        cache_insert(g_cache, key, strlen(key) + 1, value, g_hot_size);
+    }
+    free(value);
+    for (int i = 0; i < SOURCES; ++i) {
+        g_sources[i] = malloc(g_large_size);
+        memset(g_sources[i], i, g_large_size);
+    }
+    g_samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+
+    printf("%zu hot objects of %zu B, %zu KB fills every %u us, %zu MB cache, "
+           "%d hit and %d fill threads, ntcopy kernel %s:\n",
+           g_hot, g_hot_size, g_large_size / 1024, g_gap_us, cache_mb,
+           hitters, fillers, ntcopy_kernel());
+    run("no fills", hitters, 0, seconds);
+    ntcopy_set_threshold(0);
+    run("fills, memcpy", hitters, fillers, seconds);
+    ntcopy_set_threshold(NTCOPY_DEFAULT_THRESHOLD);
+    run("fills, ntcopy", hitters, fillers, seconds);
+    printf("checksum %lu\n", (unsigned long)atomic_load(&g_checksum));
+
+    cache_free(g_cache);
+    for (int i = 0; i < SOURCES; ++i)
+        free(g_sources[i]);
+    free(g_samples);
+    return 0;
+}
@@ -0,0 +1,217 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Throughput of the buffered RIO reader (cf. csapp.h) on HTTP responses of
+ * 100 KB to 10 MB: a thread writes responses back to back into a socket, and
+ * the reader takes each one apart as the proxy would, the header line by line
+ * with rio_readlineb and the body with one rio_readnb into a buffer of its
+ * size. With `-p`, the body is also read in place with rio_peekb and
+ * rio_consumeb, without being copied out.
+ *
+ * `-m` sets the megabytes read per body size, `-s` adds a body size in KB to
+ * the default ones, `-u` uses a UNIX socket pair instead of loopback TCP and
+ * `-b` sets the size of the reader's buffer in KB.
+ */
+#define _GNU_SOURCE
+#include "csapp.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MB 2048
+#define MAX_SIZES 8
+
+/**
+ * What the writer sends: `count` responses with a body of `size` bytes.
+ */
+typedef struct {
+    int fd;
+    size_t size;
+    size_t count;
+} writer_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *thread_writer(void *vargp) {
+    writer_t *w = vargp;
+    char head[256];
+    const int head_len = snprintf(head, sizeof(head),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Server: bench_rio\r\n"
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Content-Length: %zu\r\n"
+                                  "Connection: close\r\n\r\n",
+                                  w->size);
+    char *body = malloc(w->size);
+    memset(body, 'x', w->size);
+    for (size_t i = 0; i < w->count; ++i)
+        if (rio_writen(w->fd, head, head_len) < 0 ||
+            rio_writen(w->fd, body, w->size) < 0)
+            break;
+    free(body);
+    close(w->fd);
+    return NULL;
+}
+
+/**
+ * @brief A connected pair of sockets: loopback TCP, or a UNIX socket pair.
+ */
+static int connect_pair(bool unix_pair, int fds[2]) {
+    if (unix_pair)
+        return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0 ||
+        bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0)
+        return -1;
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+    fds[1] = accept(listenfd, NULL, NULL);
+    close(listenfd);
+    return fds[1] < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Read one response off `rio`, the body copied into `body` or, if it
+ * is NULL, read in place.
+ *
+ * @return 0 on success, -1 if the response was cut short.
+ */
+static int read_response(rio_t *rio, char *body, size_t size,
+                         uint64_t *checksum) {
+    char line[MAXLINE];
+    ssize_t n;
+    while ((n = rio_readlineb(rio, line, sizeof(line))) > 0)
+        if (strcmp(line, "\r\n") == 0)
+            break;
+    if (n <= 0)
+        return -1;
+
+    if (body) {
+        if (rio_readnb(rio, body, size) != (ssize_t)size)
+            return -1;
+        *checksum += (unsigned char)body[size - 1];
+        return 0;
+    }
+    for (size_t left = size; left > 0;) {
+        const void *view;
+        if ((n = rio_peekb(rio, &view)) <= 0)
+            return -1;
+        const size_t cnt = (size_t)n < left ? (size_t)n : left;
+        if (cnt == left)
+            *checksum += ((const unsigned char *)view)[cnt - 1];
+        rio_consumeb(rio, cnt);
+        left -= cnt;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stream `count` responses of `size` bytes through a fresh socket.
+ *
+ * @return The throughput in MB/s, or -1 on error.
+ */
+static double run(bool unix_pair, size_t size, size_t count, bool copy,
+                  size_t bufsize) {
+    int fds[2];
+    if (connect_pair(unix_pair, fds) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    writer_t w = {.fd = fds[0], .size = size, .count = count};
+    pthread_t tid;
+    pthread_create(&tid, NULL, thread_writer, &w);
+
+    rio_t rio;
+    char *rbuf = bufsize ? malloc(bufsize) : NULL;
+    if (rbuf)
+        rio_readinitb_buf(&rio, fds[1], rbuf, bufsize);
+    else
+        rio_readinitb(&rio, fds[1]);
+    char *body = copy ? malloc(size) : NULL;
+    uint64_t checksum = 0;
+    size_t done = 0;
+    const uint64_t start = now_ns();
+    while (done < count && read_response(&rio, body, size, &checksum) == 0)
+        ++done;
+    const uint64_t elapsed = now_ns() - start;
+
+    close(fds[1]);
+    pthread_join(tid, NULL);
+    free(body);
+    free(rbuf);
+    if (done < count || checksum != done * 'x')
+        return -1;
+    return (double)size * count / (1 << 20) / (elapsed / 1e9);
+}
+
+int main(int argc, char **argv) {
+    size_t sizes[MAX_SIZES] = {100 << 10, 1 << 20, 10 << 20};
+    size_t nsizes = 3;
+    size_t mb = DEFAULT_MB, bufsize = 0;
+    bool unix_pair = false, peek = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:b:up")) != -1) {
+        switch (opt) {
+        case 'm':
+            mb = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if (nsizes < MAX_SIZES)
+                sizes[nsizes++] = strtoul(optarg, NULL, 10) << 10;
+            break;
+        case 'b':
+            bufsize = strtoul(optarg, NULL, 10) << 10;
+            break;
+        case 'u':
+            unix_pair = true;
+            break;
+        case 'p':
+            peek = true;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-m MB per size] [-s body KB] [-b buffer KB] "
+                    "[-u] [-p]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%s, %zu KB reader buffer, %zu MB per size:\n",
+           unix_pair ? "UNIX socket pair" : "loopback TCP",
+           (bufsize ? bufsize : RIO_BUFSIZE) >> 10, mb);
+    for (size_t i = 0; i < nsizes; ++i) {
+        if (sizes[i] == 0)
+            continue;
+        size_t count = (mb << 20) / sizes[i];
+        if (count == 0)
+            count = 1;
+        printf("  %6zu KB bodies  rio_readnb %8.0f MB/s", sizes[i] >> 10,
+               run(unix_pair, sizes[i], count, true, bufsize));
+        if (peek)
+            printf("  rio_peekb %8.0f MB/s",
+                   run(unix_pair, sizes[i], count, false, bufsize));
+        printf("\n");
+    }
+    return 0;
+}
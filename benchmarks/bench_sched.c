@@ -0,0 +1,166 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Tail latency of the worker pool under skewed load: most tasks are quick
+ * (cache hits) but a few block for a long time (misses on slow origins). Each
+ * scheduling mode runs the same arrival sequence, and the time from submission
+ * to completion of every task is reported.
+ *
+ * The last run classifies tasks into a fast and a slow priority lane, with some
+ * workers reserved for the fast one. Raise the share of slow tasks (`-s`) until
+ * they saturate the pool to see the difference.
+ */
+#include "sched.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_WORKERS 8
+#define DEFAULT_TASKS 2000
+#define DEFAULT_FAST_US 200
+#define DEFAULT_SLOW_US (200 * 1000)
+#define DEFAULT_SLOW_PERMILLE 10
+#define DEFAULT_GAP_US 500
+
+typedef struct {
+    uint64_t submitted_us;
+    uint64_t work_us;
+    uint64_t latency_us;
+    atomic_int *done;
+} bench_task_t;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Blocks like a relay waiting on a socket, rather than burning CPU.
+ */
+static void task_body(void *arg) {
+    bench_task_t *t = arg;
+    usleep(t->work_us);
+    t->latency_us = now_us() - t->submitted_us;
+    atomic_fetch_add(t->done, 1);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void run_mode(const char *name, sched_mode_t mode, int workers,
+                     const sched_lane_t *lanes, size_t ntasks,
+                     const uint64_t *work, uint64_t gap_us) {
+    bench_task_t *tasks = calloc(ntasks, sizeof(bench_task_t));
+    uint64_t *fast = malloc(ntasks * sizeof(uint64_t));
+    atomic_int done = 0;
+    sched_t *sched = lanes ? sched_init_lanes(workers, mode, lanes, 2)
+                           : sched_init(workers, mode);
+    if (sched == NULL) {
+        fprintf(stderr, "%s: invalid pool configuration\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = now_us();
+    for (size_t i = 0; i < ntasks; ++i) {
+        tasks[i].work_us = work[i];
+        tasks[i].done = &done;
+        tasks[i].submitted_us = now_us();
+        if (lanes)
+            sched_submit_lane(sched, work[i] < DEFAULT_SLOW_US ? 0 : 1,
+                              task_body, &tasks[i]);
+        else
+            sched_submit(sched, task_body, &tasks[i]);
+        usleep(gap_us);
+    }
+    while ((size_t)atomic_load(&done) < ntasks)
+        usleep(1000);
+    uint64_t elapsed = now_us() - start;
+    sched_free(sched);
+
+    // Only the quick tasks' latency is interesting: the slow ones are slow no
+    // matter what, the question is who they hold up.
+    size_t nfast = 0;
+    for (size_t i = 0; i < ntasks; ++i)
+        if (work[i] < DEFAULT_SLOW_US)
+            fast[nfast++] = tasks[i].latency_us;
+    qsort(fast, nfast, sizeof(uint64_t), cmp_u64);
+
+    printf("%-8s p50 %8.2f ms  p99 %8.2f ms  p99.9 %8.2f ms  max %8.2f ms  "
+           "(%.2f s)\n",
+           name, fast[nfast / 2] / 1e3, fast[nfast * 99 / 100] / 1e3,
+           fast[nfast * 999 / 1000] / 1e3, fast[nfast - 1] / 1e3,
+           elapsed / 1e6);
+
+    free(fast);
+    free(tasks);
+}
+
+int main(int argc, char **argv) {
+    int workers = DEFAULT_WORKERS;
+    size_t ntasks = DEFAULT_TASKS;
+    unsigned slow_permille = DEFAULT_SLOW_PERMILLE;
+    uint64_t gap_us = DEFAULT_GAP_US;
+    int reserved = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:n:s:g:r:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'n':
+            ntasks = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            slow_permille = atoi(optarg);
+            break;
+        case 'g':
+            gap_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            reserved = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-w workers] [-n tasks] [-s slow permille] "
+                    "[-g gap us] [-r reserved fast workers]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Same arrival sequence for every mode.
+    uint64_t *work = malloc(ntasks * sizeof(uint64_t));
+    srand(42);
+    for (size_t i = 0; i < ntasks; ++i)
+        work[i] = ((unsigned)rand() % 1000 < slow_permille) ? DEFAULT_SLOW_US
+                                                            : DEFAULT_FAST_US;
+
+    printf("%d workers, %zu tasks, %u/1000 slow (%d ms), one every %" PRIu64
+           " us\n",
+           workers, ntasks, slow_permille, DEFAULT_SLOW_US / 1000, gap_us);
+    if (reserved < 0)
+        reserved = (workers + 3) / 4;
+    sched_lane_t lanes[2] = {
+        {.name = "fast", .reserved = reserved, .budget_us = 1000},
+        {.name = "slow", .reserved = 0, .budget_us = 1000 * 1000},
+    };
+
+    printf("latency of the quick tasks, submission to completion:\n");
+    run_mode("static", SCHED_STATIC, workers, NULL, ntasks, work, gap_us);
+    run_mode("shared", SCHED_SHARED, workers, NULL, ntasks, work, gap_us);
+    run_mode("steal", SCHED_STEAL, workers, NULL, ntasks, work, gap_us);
+    run_mode("lanes", SCHED_STEAL, workers, lanes, ntasks, work, gap_us);
+
+    free(work);
+    return 0;
+}
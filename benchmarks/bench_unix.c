@@ -0,0 +1,477 @@
+/**
+ * @author Jonathan Helland
+ *
+ * UNIX sockets against loopback TCP, for co-located deployments. First the
+ * bare transports: the round-trip latency of small messages bounced back and
+ * forth, and the throughput of a bulk stream. Then, given a running proxy
+ * listening on both (`<port> -U <path>`), the same comparison for requests
+ * through it: cache hits over either listener, and misses fetched from the
+ * origin over TCP or over a UNIX socket.
+ *
+ * The bench serves every object itself, from an origin listening on the TCP
+ * port `-o` and the UNIX socket `-O`: `/obj/<id>-<size>` answers with `size`
+ * bytes. Requests name the origin `127.0.0.1:<port>` to reach it over TCP and
+ * `localhost:<port>` to reach it over the UNIX socket, so start the proxy
+ * with `-O localhost:<port>=<path>`.
+ */
+#define _GNU_SOURCE
+#include "unixsock.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ROUND_TRIPS 100000
+#define DEFAULT_MSG_SIZE 64
+#define DEFAULT_BULK_MB 1024
+#define DEFAULT_THREADS 4
+#define DEFAULT_REQUESTS 5000
+#define DEFAULT_OBJECT_KB 16
+#define ORIGIN_THREADS 8
+#define BUFSIZE (64 * 1024)
+
+/**
+ * Where to connect: a TCP port on the loopback interface or a UNIX socket.
+ */
+typedef struct {
+    const char *name;
+    int port;
+    const char *path;
+} endpoint_t;
+
+/**
+ * One row of proxy results: `threads` clients each fetching `requests`
+ * objects through `proxy` from the origin `host`, each a distinct object
+ * unless `hit`.
+ */
+typedef struct {
+    const char *label;
+    const endpoint_t *proxy;
+    const char *host;
+    bool hit;
+} proxy_case_t;
+
+static int g_threads = DEFAULT_THREADS;
+static int g_requests = DEFAULT_REQUESTS;
+static size_t g_object_size = DEFAULT_OBJECT_KB * 1024;
+static int g_origin_port;
+static atomic_uint g_next_object = 1;
+static atomic_ulong g_errors;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int connect_to(const endpoint_t *ep) {
+    if (ep->path)
+        return unixsock_connect(ep->path);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(ep->port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * @brief Listen on `port` of the loopback interface, or on an ephemeral port
+ * if it is 0, which is then stored back into `port`.
+ */
+static int listen_tcp(int *port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(*port)};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 1024) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int read_full(int fd, void *buf, size_t n) {
+    for (size_t done = 0; done < n;) {
+        ssize_t r = read(fd, (char *)buf + done, n - done);
+        if (r <= 0)
+            return -1;
+        done += r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n) {
+    for (size_t done = 0; done < n;) {
+        ssize_t w = write(fd, (const char *)buf + done, n - done);
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+/**************** TRANSPORTS ****************/
+/**
+ * @brief Peer of the transport tests. Each connection starts with a message
+ * size: a nonzero one asks for every message of that size to be echoed back,
+ * zero for a stream to be drained to its end and acknowledged with one byte.
+ */
+static void *thread_peer(void *vargp) {
+    int listenfd = (int)(size_t)vargp;
+    char *buf = malloc(BUFSIZE);
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        uint64_t size;
+        if (read_full(fd, &size, sizeof(size)) == 0) {
+            if (size > 0 && size <= BUFSIZE) {
+                while (read_full(fd, buf, size) == 0 &&
+                       write_full(fd, buf, size) == 0)
+                    ;
+            } else if (size == 0) {
+                while (read(fd, buf, BUFSIZE) > 0)
+                    ;
+                write_full(fd, "", 1);
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Bounce `n` messages of `size` bytes off the peer and print the
+ * round-trip latencies.
+ */
+static void bench_round_trips(const endpoint_t *ep, int n, size_t size) {
+    uint64_t *samples = malloc(n * sizeof(uint64_t));
+    char *msg = calloc(1, size);
+    uint64_t header = size;
+    int fd = connect_to(ep);
+    if (fd < 0 || write_full(fd, &header, sizeof(header)) < 0) {
+        perror("connect to peer");
+        exit(EXIT_FAILURE);
+    }
+    int done = 0;
+    const uint64_t begin = now_ns();
+    for (; done < n; ++done) {
+        const uint64_t start = now_ns();
+        if (write_full(fd, msg, size) < 0 || read_full(fd, msg, size) < 0)
+            break;
+        samples[done] = now_ns() - start;
+    }
+    const double s = (now_ns() - begin) / 1e9;
+    close(fd);
+
+    qsort(samples, done, sizeof(uint64_t), cmp_u64);
+    if (done > 0)
+        printf("  %-22s p50 %7.1f us  p99 %7.1f us  %9.0f round trips/s\n",
+               ep->name, samples[done / 2] / 1e3,
+               samples[(size_t)done * 99 / 100] / 1e3,
+               done / s);
+    free(msg);
+    free(samples);
+}
+
+/**
+ * @brief Stream `mb` megabytes to the peer and print the throughput, up to
+ * the peer acknowledging that it read everything.
+ */
+static void bench_bulk(const endpoint_t *ep, size_t mb) {
+    char *buf = calloc(1, BUFSIZE);
+    uint64_t header = 0;
+    int fd = connect_to(ep);
+    if (fd < 0 || write_full(fd, &header, sizeof(header)) < 0) {
+        perror("connect to peer");
+        exit(EXIT_FAILURE);
+    }
+    const size_t total = mb * 1024 * 1024;
+    const uint64_t start = now_ns();
+    size_t sent = 0;
+    while (sent < total && write_full(fd, buf, BUFSIZE) == 0)
+        sent += BUFSIZE;
+    shutdown(fd, SHUT_WR);
+    char ack;
+    const bool ok = read_full(fd, &ack, 1) == 0;
+    const double s = (now_ns() - start) / 1e9;
+    close(fd);
+
+    if (ok)
+        printf("  %-22s %9.0f MB/s\n", ep->name, sent / s / (1024 * 1024));
+    free(buf);
+}
+
+/**************** PROXY ****************/
+/**
+ * @brief Origin: answers `/obj/<id>-<size>` with `size` bytes of filler.
+ */
+static void *thread_origin(void *vargp) {
+    int listenfd = (int)(size_t)vargp;
+    char *buf = malloc(BUFSIZE);
+    memset(buf, 'x', BUFSIZE);
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        char req[1024], head[256];
+        unsigned id;
+        size_t size = 0;
+        ssize_t n = read(fd, req, sizeof(req) - 1);
+        if (n > 0) {
+            req[n] = '\0';
+            const char *path = strstr(req, "/obj/");
+            if (path && sscanf(path, "/obj/%u-%zu", &id, &size) != 2)
+                size = 0;
+        }
+        int len = snprintf(head, sizeof(head),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Content-Length: %zu\r\n\r\n",
+                           size);
+        if (write_full(fd, head, len) == 0)
+            for (size_t left = size; left > 0;) {
+                size_t chunk = left < BUFSIZE ? left : BUFSIZE;
+                if (write_full(fd, buf, chunk) < 0)
+                    break;
+                left -= chunk;
+            }
+        close(fd);
+    }
+    return NULL;
+}
+
+static void start_threads(void *(*fn)(void *), int listenfd, int n) {
+    for (int i = 0; i < n; ++i) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, fn, (void *)(size_t)listenfd);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * @brief Fetch object `id` from the origin `host` through the proxy.
+ *
+ * @return 0 if the whole body arrived, -1 otherwise.
+ */
+static int fetch(const endpoint_t *proxy, const char *host, unsigned id) {
+    char req[256], buf[BUFSIZE];
+    int fd = connect_to(proxy);
+    if (fd < 0) {
+        atomic_fetch_add(&g_errors, 1);
+        return -1;
+    }
+    int len = snprintf(req, sizeof(req),
+                       "GET http://%s:%d/obj/%u-%zu HTTP/1.0\r\n"
+                       "Host: %s:%d\r\n\r\n",
+                       host, g_origin_port, id, g_object_size, host,
+                       g_origin_port);
+    size_t total = 0, head_len = 0;
+    if (write_full(fd, req, len) == 0) {
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            if (head_len == 0 && total == 0) {
+                char *end = memmem(buf, n, "\r\n\r\n", 4);
+                head_len = end ? (size_t)(end - buf) + 4 : 0;
+            }
+            total += n;
+        }
+    }
+    close(fd);
+    if (head_len == 0 || total - head_len != g_object_size) {
+        atomic_fetch_add(&g_errors, 1);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const proxy_case_t *c;
+    uint64_t *samples;
+    int n;
+} client_t;
+
+static void *thread_client(void *vargp) {
+    client_t *client = vargp;
+    const proxy_case_t *c = client->c;
+    for (int i = 0; i < g_requests; ++i) {
+        const unsigned id = c->hit ? 0 : atomic_fetch_add(&g_next_object, 1);
+        const uint64_t start = now_ns();
+        if (fetch(c->proxy, c->host, id) == 0)
+            client->samples[client->n++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static void bench_proxy(const proxy_case_t *c) {
+    if (c->hit)
+        fetch(c->proxy, c->host, 0);
+
+    client_t *clients = calloc(g_threads, sizeof(client_t));
+    pthread_t *tids = malloc(g_threads * sizeof(pthread_t));
+    const uint64_t start = now_ns();
+    for (int i = 0; i < g_threads; ++i) {
+        clients[i].c = c;
+        clients[i].samples = malloc(g_requests * sizeof(uint64_t));
+        pthread_create(&tids[i], NULL, thread_client, &clients[i]);
+    }
+    for (int i = 0; i < g_threads; ++i)
+        pthread_join(tids[i], NULL);
+    const double s = (now_ns() - start) / 1e9;
+
+    size_t n = 0;
+    uint64_t *samples = malloc((size_t)g_threads * g_requests *
+                               sizeof(uint64_t));
+    for (int i = 0; i < g_threads; ++i) {
+        memcpy(samples + n, clients[i].samples,
+               clients[i].n * sizeof(uint64_t));
+        n += clients[i].n;
+        free(clients[i].samples);
+    }
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+    if (n > 0)
+        printf("  %-22s p50 %7.1f us  p99 %7.1f us  %9.0f requests/s  "
+               "%7.0f MB/s\n",
+               c->label, samples[n / 2] / 1e3, samples[n * 99 / 100] / 1e3,
+               n / s, n * (double)g_object_size / s / (1024 * 1024));
+    free(samples);
+    free(tids);
+    free(clients);
+}
+
+int main(int argc, char **argv) {
+    int round_trips = DEFAULT_ROUND_TRIPS;
+    size_t msg_size = DEFAULT_MSG_SIZE;
+    size_t bulk_mb = DEFAULT_BULK_MB;
+    int proxy_port = 0;
+    const char *proxy_path = NULL;
+    const char *origin_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:P:U:o:O:c:r:k:")) != -1) {
+        switch (opt) {
+        case 'n':
+            round_trips = atoi(optarg);
+            break;
+        case 's':
+            msg_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            bulk_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            proxy_port = atoi(optarg);
+            break;
+        case 'U':
+            proxy_path = optarg;
+            break;
+        case 'o':
+            g_origin_port = atoi(optarg);
+            break;
+        case 'O':
+            origin_path = optarg;
+            break;
+        case 'c':
+            g_threads = atoi(optarg);
+            break;
+        case 'r':
+            g_requests = atoi(optarg);
+            break;
+        case 'k':
+            g_object_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        default:
+            round_trips = 0;
+        }
+    }
+    const bool proxy = proxy_port || proxy_path || origin_path;
+    if (round_trips <= 0 || msg_size == 0 || msg_size > BUFSIZE ||
+        g_threads <= 0 || g_requests <= 0 ||
+        (proxy && (!proxy_port || !proxy_path || !origin_path ||
+                   !g_origin_port))) {
+        fprintf(stderr,
+                "Usage: %s [-n round trips] [-s message bytes] [-b bulk MB] "
+                "[-P proxy port -U proxy socket -o origin port "
+                "-O origin socket [-c threads] [-r requests] [-k object KB]]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char peer_path[64];
+    snprintf(peer_path, sizeof(peer_path), "@bench_unix.%d", (int)getpid());
+    endpoint_t tcp = {.name = "loopback TCP"};
+    endpoint_t uds = {.name = "UNIX socket", .path = peer_path};
+    int tcpfd = listen_tcp(&tcp.port);
+    int unixfd = unixsock_listen(peer_path, 1024);
+    if (tcpfd < 0 || unixfd < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    start_threads(thread_peer, tcpfd, 2);
+    start_threads(thread_peer, unixfd, 2);
+
+    printf("round trips of %zu bytes (%d):\n", msg_size, round_trips);
+    bench_round_trips(&tcp, round_trips, msg_size);
+    bench_round_trips(&uds, round_trips, msg_size);
+    printf("bulk stream (%zu MB):\n", bulk_mb);
+    bench_bulk(&tcp, bulk_mb);
+    bench_bulk(&uds, bulk_mb);
+    if (!proxy)
+        return 0;
+
+    int origin_tcp = listen_tcp(&g_origin_port);
+    int origin_unix = unixsock_listen(origin_path, 1024);
+    if (origin_tcp < 0 || origin_unix < 0) {
+        perror("origin");
+        exit(EXIT_FAILURE);
+    }
+    start_threads(thread_origin, origin_tcp, ORIGIN_THREADS);
+    start_threads(thread_origin, origin_unix, ORIGIN_THREADS);
+
+    const endpoint_t proxy_tcp = {.name = "TCP", .port = proxy_port};
+    const endpoint_t proxy_unix = {.name = "UNIX", .path = proxy_path};
+    const proxy_case_t cases[] = {
+        {"hit, TCP listener", &proxy_tcp, "127.0.0.1", true},
+        {"hit, UNIX listener", &proxy_unix, "127.0.0.1", true},
+        {"miss, TCP upstream", &proxy_tcp, "127.0.0.1", false},
+        {"miss, UNIX upstream", &proxy_tcp, "localhost", false},
+        {"miss, UNIX both ends", &proxy_unix, "localhost", false},
+    };
+    printf("proxy, %zu KB objects (%d threads x %d requests):\n",
+           g_object_size / 1024, g_threads, g_requests);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+        bench_proxy(&cases[i]);
+    printf("errors %lu\n", atomic_load(&g_errors));
+    return 0;
+}
@@ -0,0 +1,110 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Fixed-size buffer pools with a bounded free list.
+ */
+#include "bufpool.h"
+#include "mem.h"
+#include "plock.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**************** STRUCTS ****************/
+/**
+ * Free buffers are linked through their first bytes.
+ */
+typedef struct FreeBuf {
+    struct FreeBuf *next;
+} free_buf_t;
+
+/**
+ * @param  nfree     Length of the free list.
+ * @param  max_free  Bound on nfree; further returns are freed.
+ */
+struct BufPool {
+    size_t bufsize;
+    size_t max_free;
+
+    plock_t mutex;
+    free_buf_t *free_list;
+    size_t nfree;
+
+    stat_counter_t *stat_in_use;
+    stat_counter_t *stat_free;
+};
+
+/**************** PUBLIC INTERFACE ****************/
+bufpool_t *bufpool_init(const char *name, size_t bufsize, size_t max_free) {
+    char stat_name[STATS_NAME_LEN];
+    bufpool_t *pool = calloc(1, sizeof(bufpool_t));
+    if (pool == NULL)
+        return NULL;
+
+    pool->bufsize =
+        (bufsize < sizeof(free_buf_t)) ? sizeof(free_buf_t) : bufsize;
+    pool->max_free = max_free;
+    snprintf(stat_name, sizeof(stat_name), "bufpool.%s", name);
+    plock_init(&pool->mutex, stat_name);
+
+    snprintf(stat_name, sizeof(stat_name), "bufpool.%s.in_use", name);
+    pool->stat_in_use = stats_counter(stat_name);
+    snprintf(stat_name, sizeof(stat_name), "bufpool.%s.free", name);
+    pool->stat_free = stats_counter(stat_name);
+    return pool;
+}
+
+void bufpool_free(bufpool_t *pool) {
+    free_buf_t *buf = pool->free_list;
+    while (buf) {
+        free_buf_t *next = buf->next;
+        mem_free(MEM_BUFFERS, buf);
+        buf = next;
+    }
+    stats_set(pool->stat_free, 0);
+    plock_destroy(&pool->mutex);
+    free(pool);
+}
+
+void *bufpool_get(bufpool_t *pool) {
+    plock_lock(&pool->mutex);
+    free_buf_t *buf = pool->free_list;
+    if (buf) {
+        pool->free_list = buf->next;
+        pool->nfree--;
+    }
+    plock_unlock(&pool->mutex);
+
+    if (buf)
+        stats_sub(pool->stat_free, 1);
+    else if ((buf = mem_malloc(MEM_BUFFERS, pool->bufsize)) == NULL)
+        return NULL;
+    stats_add(pool->stat_in_use, 1);
+    return buf;
+}
+
+void bufpool_put(bufpool_t *pool, void *ptr) {
+    if (ptr == NULL)
+        return;
+    free_buf_t *buf = ptr;
+    stats_sub(pool->stat_in_use, 1);
+
+    plock_lock(&pool->mutex);
+    if (pool->nfree < pool->max_free) {
+        buf->next = pool->free_list;
+        pool->free_list = buf;
+        pool->nfree++;
+        buf = NULL;
+    }
+    plock_unlock(&pool->mutex);
+
+    if (buf)
+        mem_free(MEM_BUFFERS, buf);
+    else
+        stats_add(pool->stat_free, 1);
+}
+
+size_t bufpool_bufsize(const bufpool_t *pool) {
+    return pool->bufsize;
+}
@@ -0,0 +1,49 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Shared pools of fixed-size buffers. A connection borrows its I/O buffers
+ * only while a request is actually being relayed and gives them back as soon
+ * as it goes idle, so an idle connection costs no buffer memory at all.
+ *
+ * Returned buffers are kept on a free list for reuse, up to a bound; beyond
+ * that they go back to the allocator, so a burst does not pin its peak
+ * memory forever.
+ */
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+typedef struct BufPool bufpool_t;
+
+/**
+ * Create a pool of `bufsize`-byte buffers that keeps at most `max_free`
+ * returned buffers around. `name` labels its stats, e.g.
+ * "bufpool.<name>.in_use". Must be freed later by bufpool_free.
+ */
+bufpool_t *bufpool_init(const char *name, size_t bufsize, size_t max_free);
+
+/**
+ * Free the pool and every buffer on its free list. Buffers still borrowed
+ * must not be returned afterwards.
+ */
+void bufpool_free(bufpool_t *pool);
+
+/**
+ * Borrow a buffer. Thread-safe. Contents are undefined.
+ *
+ * @return NULL on allocation failure.
+ */
+void *bufpool_get(bufpool_t *pool);
+
+/**
+ * Return a buffer obtained from bufpool_get. Thread-safe. NULL is ignored.
+ */
+void bufpool_put(bufpool_t *pool, void *buf);
+
+/**
+ * Size of the pool's buffers.
+ */
+size_t bufpool_bufsize(const bufpool_t *pool);
+
+#endif
@@ -6,6 +6,8 @@
  */
 #include "cache.h"
 #include "csapp.h"
+#include "mem.h"
+#include "ntcopy.h"
 
 #include <assert.h>
 #include <stdbool.h>
@@ -23,12 +25,29 @@
  * @return Pointer to the initialized cache.
  */
 cache_t *cache_init(size_t size) {
+    return cache_init_budget(size, CACHE_BUDGET_VALUES);
+}
+
+/**
+ * @brief Initialize a cache whose size limit applies either to the values
+ * alone or to everything the cache allocates.
+ *
+ * @param  size    The largest number of bytes allowed in the cache at any
+ *                 given time.
+ * @param  budget  What `size` applies to.
+ *
+ * @return Pointer to the initialized cache.
+ */
+cache_t *cache_init_budget(size_t size, cache_budget_t budget) {
     cache_t *cache = malloc(sizeof(cache_t));
     if (cache == NULL)
         return NULL;
 
     cache->max_size = size;
     cache->size = 0;
+    cache->footprint = 0;
+    cache->budget = budget;
+    cache->nlisteners = 0;
 
     cache->map = hashmap_init(1);
     cache->lru_list = list_init();
@@ -40,9 +59,27 @@ cache_t *cache_init(size_t size) {
  * Free the memory associated with a block, including the key and value.
  */
 static void free_block(block_t *block) {
-    free(block->key);
-    free(block->value);
-    free(block);
+    mem_free(MEM_CACHE_KEYS, block->key);
+    mem_free(MEM_CACHE_VALUES, block->value);
+    mem_free(MEM_CACHE_BLOCKS, block);
+}
+
+/**
+ * Tell every listener about a block entering or leaving the cache.
+ */
+static void notify(cache_t *cache, block_t *block, cache_event_t event) {
+    for (size_t i = 0; i < cache->nlisteners; ++i)
+        cache->listeners[i].fn(cache, block, event, cache->listeners[i].arg);
+}
+
+/**
+ * @brief The bytes counted against the cache's size limit: the values, or the
+ * whole footprint including the hash table bins.
+ */
+size_t cache_used(const cache_t *cache) {
+    if (cache->budget == CACHE_BUDGET_VALUES)
+        return cache->size;
+    return cache->footprint + cache->map->size * sizeof(bin_t);
 }
 
 /**
@@ -64,6 +101,25 @@ void cache_free(cache_t *cache) {
     free(cache);
 }
 
+/**
+ * Unlink a block, already out of the hash table, from the LRU list and free
+ * it unless a reader still holds it.
+ */
+static void remove_block(cache_t *cache, block_t *block, node_t *node) {
+    notify(cache, block, CACHE_EVICTED);
+
+    cache->size -= block->size;
+    cache->footprint -= block->footprint;
+    list_delete(cache->lru_list, node);
+    mem_free(MEM_LIST_NODES, node);
+
+    // Readers still holding the block free it when they are done.
+    if (block->refcount == 0)
+        free_block(block);
+    else
+        block->evicted = true;
+}
+
 /**
  * Remove an entry from the cache. This will free the memory of the key and
  * value as well.
@@ -75,12 +131,7 @@ int cache_delete(cache_t *cache, block_t *block) {
     void *value = hashmap_delete(cache->map, block->key, block->keylen);
     if (value == NULL)
         return -1;
-
-    cache->size -= block->size;
-    node_t *node = list_find(cache->lru_list, block);
-    list_delete(cache->lru_list, node);
-    free(node);
-    free_block(block);
+    remove_block(cache, block, list_find(cache->lru_list, block));
     return 0;
 }
 
@@ -88,7 +139,8 @@ int cache_delete(cache_t *cache, block_t *block) {
  * Create a new block given the data to be stored. This must be freed later by
  * free_block.
  *
- * The key and value are copied.
+ * The key and value are copied, a large value without going through the CPU
+ * caches (cf. ntcopy.h), so that it does not evict the working set of hits.
  *
  * @param  key     Bytestring hashed by the hashtable.
  * @param  keylen  Number of bytes to hash.
@@ -99,15 +151,19 @@ int cache_delete(cache_t *cache, block_t *block) {
  */
 static block_t *get_block(const void *key, size_t keylen, const void *value,
                           size_t size) {
-    block_t *block = malloc(sizeof(block_t));
+    block_t *block = mem_malloc(MEM_CACHE_BLOCKS, sizeof(block_t));
 
-    block->key = malloc(keylen);
+    block->key = mem_malloc(MEM_CACHE_KEYS, keylen);
     block->key = memcpy(block->key, key, keylen);
     block->keylen = keylen;
 
-    block->value = malloc(size);
-    memcpy(block->value, value, size);
+    block->value = mem_malloc(MEM_CACHE_VALUES, size);
+    ntcopy(block->value, value, size);
     block->size = size;
+    block->footprint =
+        mem_size(block) + mem_size(block->key) + mem_size(block->value);
+    block->refcount = 0;
+    block->evicted = false;
 
     return block;
 }
@@ -142,26 +198,60 @@ int cache_insert(cache_t *cache, const void *key, size_t keylen,
 
     // Create a new block to store the data.
     block_t *block = get_block(key, keylen, value, size);
+    if (cache->budget == CACHE_BUDGET_FOOTPRINT &&
+        block->footprint > cache->max_size) {
+        free_block(block);
+        return -1;
+    }
 
-    // Update the current cache size.
-    // Evict blocks until the new block fits.
+    // Add the new block and update the current cache size.
+    hashmap_insert(cache->map, block->key, block->keylen, block);
+    node_t *node = list_insert(cache->lru_list, block);
+    block->footprint += mem_size(node);
     cache->size += block->size;
+    cache->footprint += block->footprint;
+    notify(cache, block, CACHE_INSERTED);
 
-    node_t *head = cache->lru_list->head;
-    node_t *n = head;
-    while (n != NULL && cache->size > cache->max_size) {
-        n = n->prev;
-        block_t *b = (block_t *)n->value;
+    // Evict blocks until the new block fits. The least recently used block
+    // sits just before the head, which is the new block. cache_delete frees
+    // its node, so look the tail up again after every eviction.
+    while (cache->lru_list->head->prev != node &&
+           cache_used(cache) > cache->max_size) {
+        block_t *b = (block_t *)cache->lru_list->head->prev->value;
         cache_delete(cache, b);
     }
 
-    // Add the new block.
-    hashmap_insert(cache->map, block->key, block->keylen, block);
-    list_insert(cache->lru_list, block);
-
     return 0;
 }
 
+/**
+ * @brief Change the size limit of the cache. Entries beyond it are evicted by
+ * the next insertion, or by cache_trim.
+ */
+void cache_set_max_size(cache_t *cache, size_t max_size) {
+    cache->max_size = max_size;
+}
+
+/**
+ * @brief Evict least recently used entries while the cache is over its size
+ * limit.
+ *
+ * @param  cache          Pointer to the cache to trim.
+ * @param  max_evictions  Evict no more than this many entries.
+ *
+ * @return 1 if the cache is still over its limit, 0 otherwise.
+ */
+int cache_trim(cache_t *cache, size_t max_evictions) {
+    for (size_t i = 0; i < max_evictions; ++i) {
+        if (cache->lru_list->head == NULL ||
+            cache_used(cache) <= cache->max_size)
+            return 0;
+        cache_delete(cache, (block_t *)cache->lru_list->head->prev->value);
+    }
+    return cache->lru_list->head != NULL &&
+           cache_used(cache) > cache->max_size;
+}
+
 /**
  * Lookup an entry in the cache and return a pointer to the block if found.
  *
@@ -183,5 +273,107 @@ block_t *cache_find(cache_t *cache, const void *key, size_t keylen) {
 
     node_t *node = list_find(cache->lru_list, block);
     list_move_to_head(cache->lru_list, node);
+    block->refcount++;
     return block;
 }
+
+/**
+ * Take another reference on a block without looking it up.
+ *
+ * @param  cache  Pointer to the cache the block is in, or was evicted from.
+ * @param  block  Block in the cache, or already referenced by the caller.
+ */
+void cache_retain(cache_t *cache, block_t *block) {
+    block->refcount++;
+}
+
+/**
+ * @brief Add a function told about every insertion and eviction.
+ *
+ * @return 0 on success, -1 if there is no room for another listener.
+ */
+int cache_add_listener(cache_t *cache, cache_listener_fn fn, void *arg) {
+    if (cache->nlisteners == CACHE_MAX_LISTENERS)
+        return -1;
+    cache->listeners[cache->nlisteners].fn = fn;
+    cache->listeners[cache->nlisteners].arg = arg;
+    cache->nlisteners++;
+    return 0;
+}
+
+/**
+ * @brief Remove a listener added by cache_add_listener, keeping the others in
+ * order.
+ */
+void cache_remove_listener(cache_t *cache, cache_listener_fn fn, void *arg) {
+    for (size_t i = 0; i < cache->nlisteners; ++i) {
+        if (cache->listeners[i].fn == fn && cache->listeners[i].arg == arg) {
+            memmove(&cache->listeners[i], &cache->listeners[i + 1],
+                    (cache->nlisteners - i - 1) * sizeof(cache->listeners[0]));
+            cache->nlisteners--;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Reference every block in the cache, least recently used first.
+ *
+ * @param  cache  Pointer to the cache.
+ * @param  n      Set to the number of blocks.
+ *
+ * @return Array of the blocks, to be freed by the caller after releasing
+ *         them, or NULL if there are none or allocation failed.
+ */
+block_t **cache_snapshot(cache_t *cache, size_t *n) {
+    *n = 0;
+    if (cache->lru_list->head == NULL)
+        return NULL;
+    block_t **blocks = malloc(cache->lru_list->length * sizeof(block_t *));
+    if (blocks == NULL)
+        return NULL;
+
+    node_t *node = cache->lru_list->head->prev;
+    for (size_t i = 0; i < cache->lru_list->length; ++i) {
+        blocks[i] = node->value;
+        blocks[i]->refcount++;
+        node = node->prev;
+    }
+    *n = cache->lru_list->length;
+    return blocks;
+}
+
+/**
+ * @brief Remove every block `match` returns true for, in a single pass over
+ * the LRU list.
+ *
+ * @return The number of blocks removed.
+ */
+size_t cache_purge(cache_t *cache, cache_match_fn match, void *arg) {
+    size_t purged = 0;
+    const size_t length = cache->lru_list->length;
+    node_t *node = cache->lru_list->head;
+    for (size_t i = 0; i < length; ++i) {
+        node_t *next = node->next;
+        block_t *block = node->value;
+        if (match(block, arg)) {
+            hashmap_delete(cache->map, block->key, block->keylen);
+            remove_block(cache, block, node);
+            purged++;
+        }
+        node = next;
+    }
+    return purged;
+}
+
+/**
+ * Drop a reference taken by cache_find, freeing the block if it was evicted
+ * while in use.
+ *
+ * @param  cache  Pointer to the cache the block was found in.
+ * @param  block  Block returned by cache_find, or retained.
+ */
+void cache_release(cache_t *cache, block_t *block) {
+    if (--block->refcount == 0 && block->evicted)
+        free_block(block);
+}
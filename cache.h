@@ -3,6 +3,10 @@
  *
  * An LRU cache implementation, using a hash table and doubly linked circular
  * list as the underlying data structures.
+ *
+ * The cache does no locking of its own: callers serialize every call under one
+ * lock. A block returned by cache_find stays valid outside that lock, even if
+ * it is evicted meanwhile, until it is handed back with cache_release.
  */
 #ifndef CACHE_H
 #define CACHE_H
@@ -11,6 +15,7 @@
 #include "list.h"
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 /**
@@ -20,14 +25,59 @@
  * @param  value     The value associated with the key in the hash table.
  * @param  size      The number of bytes consumed by the value.
  * @param  keylen    The number of bytes for the key.
+ * @param  footprint The bytes the allocator reserved for the block: value,
+ *                   key, the block itself and its LRU list node.
+ * @param  refcount  The number of readers still using the block, taken by
+ *                   cache_find and dropped by cache_release.
+ * @param  evicted   Whether the block has left the cache. An evicted block is
+ *                   freed by whoever drops the last reference.
  */
 typedef struct Block {
     void *key;
     void *value;
     size_t size;
     size_t keylen;
+    size_t footprint;
+    size_t refcount;
+    bool evicted;
 } block_t;
 
+/**
+ * What the size limit of a cache applies to.
+ */
+typedef enum {
+    CACHE_BUDGET_VALUES,   /* The cached values only. */
+    CACHE_BUDGET_FOOTPRINT /* Everything the cache allocates: values, keys,
+                              blocks, list nodes and hash table bins. */
+} cache_budget_t;
+
+/**
+ * What happened to a block, for a cache listener.
+ */
+typedef enum {
+    CACHE_INSERTED, /* The block was just added. */
+    CACHE_EVICTED   /* The block is leaving the cache, evicted or deleted. */
+} cache_event_t;
+
+struct Cache;
+
+/*
+ * Listeners a cache can have at once.
+ */
+#define CACHE_MAX_LISTENERS 4
+
+/**
+ * Called under the caller's cache lock whenever a block enters or leaves the
+ * cache. The block may be retained (cf. cache_retain) to use it later.
+ */
+typedef void (*cache_listener_fn)(struct Cache *cache, block_t *block,
+                                  cache_event_t event, void *arg);
+
+/**
+ * Predicate over cached blocks, for cache_purge.
+ */
+typedef bool (*cache_match_fn)(const block_t *block, void *arg);
+
 /**
  * The wrapper for the cache, primarily composed of a hash table to store values
  * and handle fast retrieval, and doubly linked circular list to enforce the LRU
@@ -39,13 +89,25 @@ typedef struct Block {
  * @param  size      The number of bytes currently used by the values stored.
  *                   This does not include overhead, including keys, the hash
  *                   table itself, and the LRU list itself.
- * @param  max_size  The largest number of bytes storable in the cache. The size
- *                   will never exceed this.
+ * @param  footprint The bytes reserved for the blocks, all overhead included
+ *                   except the hash table, whose size is read off the table.
+ * @param  max_size  The largest number of bytes storable in the cache. The
+ *                   budgeted size (cf. cache_used) will never exceed this.
+ * @param  budget    What max_size applies to.
+ * @param  listeners Told about every insertion and eviction, in the order
+ *                   they were added.
  */
 typedef struct Cache {
     hashmap_t *map;
     list_t *lru_list;
     size_t size, max_size;
+    size_t footprint;
+    cache_budget_t budget;
+    struct {
+        cache_listener_fn fn;
+        void *arg;
+    } listeners[CACHE_MAX_LISTENERS];
+    size_t nlisteners;
 } cache_t;
 
 /**
@@ -54,6 +116,30 @@ typedef struct Cache {
  */
 cache_t *cache_init(size_t size);
 
+/**
+ * Initialize a cache whose size limit applies to `budget`.
+ */
+cache_t *cache_init_budget(size_t size, cache_budget_t budget);
+
+/**
+ * The bytes counted against the cache's size limit.
+ */
+size_t cache_used(const cache_t *cache);
+
+/**
+ * Change the size limit. Nothing is evicted here; see cache_trim.
+ */
+void cache_set_max_size(cache_t *cache, size_t max_size);
+
+/**
+ * Evict least recently used entries while the cache is over its size limit,
+ * at most `max_evictions` of them, so that callers can shrink a large cache a
+ * batch at a time without holding its lock throughout.
+ *
+ * @return 1 if the cache is still over its limit, 0 otherwise.
+ */
+int cache_trim(cache_t *cache, size_t max_evictions);
+
 /**
  * Free the memory consumed by the cache. This includes memory used by the keys
  * and values themselves.
@@ -79,4 +165,46 @@ int cache_insert(cache_t *cache, const void *key, size_t keylen,
  */
 block_t *cache_find(cache_t *cache, const void *key, size_t keylen);
 
+/**
+ * Take another reference on a block that is in the cache or already held.
+ * Like cache_find, minus the lookup and the LRU update.
+ */
+void cache_retain(cache_t *cache, block_t *block);
+
+/**
+ * Tell `fn` about insertions and evictions from now on.
+ *
+ * @return 0 on success, -1 if the cache has CACHE_MAX_LISTENERS already.
+ */
+int cache_add_listener(cache_t *cache, cache_listener_fn fn, void *arg);
+
+/**
+ * Stop telling `fn` (with `arg`) about insertions and evictions.
+ */
+void cache_remove_listener(cache_t *cache, cache_listener_fn fn, void *arg);
+
+/**
+ * Take a reference on every block in the cache, least recently used first,
+ * so that they can be used outside the lock.
+ *
+ * @param[out]  n  Number of blocks.
+ *
+ * @return An array to free after releasing every block in it, or NULL if
+ *         the cache is empty or it could not be allocated.
+ */
+block_t **cache_snapshot(cache_t *cache, size_t *n);
+
+/**
+ * Remove every block `match` returns true for, as cache_delete would.
+ *
+ * @return The number of blocks removed.
+ */
+size_t cache_purge(cache_t *cache, cache_match_fn match, void *arg);
+
+/**
+ * Drop a reference taken by cache_find, cache_retain or cache_snapshot. The
+ * block must not be used afterwards.
+ */
+void cache_release(cache_t *cache, block_t *block);
+
 #endif
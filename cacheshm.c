@@ -0,0 +1,343 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache view publisher.
+ */
+#include "cacheshm.h"
+#include "ntcopy.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHESHM_MAX_ORDERS 48
+#define CACHESHM_NONE UINT32_MAX
+
+/**************** GLOBALS ****************/
+/*
+ * The segment being published. Only the thread holding the cache lock
+ * touches it, in the cache listener.
+ *
+ * The buddy allocator's bookkeeping stays out of the segment: a free list per
+ * order, linked through the unit (min_block) indexes of the free blocks, and
+ * the order of the free block starting at each unit, or -1.
+ */
+static struct {
+    cacheshm_header_t *shm;
+    cacheshm_slot_t *slots;
+    _Atomic uint64_t *gens;
+    char *data;
+    uint64_t mask;
+    unsigned max_order;
+    uint32_t free_head[CACHESHM_MAX_ORDERS];
+    uint32_t *next;
+    uint32_t *prev;
+    int8_t *free_order;
+
+    stat_counter_t *stat_entries;
+    stat_counter_t *stat_bytes;
+    stat_counter_t *stat_published;
+    stat_counter_t *stat_full;
+} g_cacheshm;
+
+/**************** BUDDY ALLOCATOR ****************/
+static void push_free(uint32_t unit, unsigned order) {
+    const uint32_t head = g_cacheshm.free_head[order];
+    g_cacheshm.next[unit] = head;
+    g_cacheshm.prev[unit] = CACHESHM_NONE;
+    if (head != CACHESHM_NONE)
+        g_cacheshm.prev[head] = unit;
+    g_cacheshm.free_head[order] = unit;
+    g_cacheshm.free_order[unit] = order;
+}
+
+static void unlink_free(uint32_t unit, unsigned order) {
+    const uint32_t next = g_cacheshm.next[unit], prev = g_cacheshm.prev[unit];
+    if (prev != CACHESHM_NONE)
+        g_cacheshm.next[prev] = next;
+    else
+        g_cacheshm.free_head[order] = next;
+    if (next != CACHESHM_NONE)
+        g_cacheshm.prev[next] = prev;
+    g_cacheshm.free_order[unit] = -1;
+}
+
+static unsigned order_of(size_t bytes) {
+    unsigned order = 0;
+    while (((size_t)g_cacheshm.shm->min_block << order) < bytes)
+        ++order;
+    return order;
+}
+
+/**
+ * @return The first unit of a free block of `1 << order` units, or
+ *         CACHESHM_NONE if there is none left.
+ */
+static uint32_t alloc_units(unsigned order) {
+    unsigned have = order;
+    while (have <= g_cacheshm.max_order &&
+           g_cacheshm.free_head[have] == CACHESHM_NONE)
+        ++have;
+    if (have > g_cacheshm.max_order)
+        return CACHESHM_NONE;
+
+    const uint32_t unit = g_cacheshm.free_head[have];
+    unlink_free(unit, have);
+    // Split, handing the upper halves back.
+    while (have > order) {
+        --have;
+        push_free(unit + ((uint32_t)1 << have), have);
+    }
+    return unit;
+}
+
+/**
+ * @brief Free a block, first bumping its generation so that readers still
+ * holding it see that it is gone before anything overwrites it.
+ */
+static void free_units(uint32_t unit, unsigned order) {
+    atomic_fetch_add_explicit(&g_cacheshm.gens[unit], 1,
+                              memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    while (order < g_cacheshm.max_order) {
+        const uint32_t buddy = unit ^ ((uint32_t)1 << order);
+        if (g_cacheshm.free_order[buddy] != (int8_t)order)
+            break;
+        unlink_free(buddy, order);
+        if (buddy < unit)
+            unit = buddy;
+        ++order;
+    }
+    push_free(unit, order);
+}
+
+/**************** SLOTS ****************/
+static inline cacheshm_block_t *block_at(uint64_t off) {
+    return (cacheshm_block_t *)(g_cacheshm.data + off);
+}
+
+/**
+ * @return The slot holding `key`, or NULL.
+ */
+static cacheshm_slot_t *find_slot(const void *key, size_t keylen,
+                                  uint64_t hash) {
+    for (unsigned probe = 0; probe < CACHESHM_MAX_PROBE; ++probe) {
+        cacheshm_slot_t *slot = &g_cacheshm.slots[(hash + probe) &
+                                                  g_cacheshm.mask];
+        if (slot->state == CACHESHM_EMPTY)
+            return NULL;
+        if (slot->state == CACHESHM_LIVE && slot->hash == hash &&
+            slot->keylen == keylen &&
+            memcmp(block_at(slot->off) + 1, key, keylen) == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Rewrite a slot under its sequence lock.
+ */
+static void write_slot(cacheshm_slot_t *slot, const cacheshm_slot_t *value) {
+    const uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->hash = value->hash;
+    slot->off = value->off;
+    slot->gen = value->gen;
+    slot->keylen = value->keylen;
+    slot->size = value->size;
+    slot->state = value->state;
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+static void unpublish(cacheshm_slot_t *slot) {
+    const size_t bytes = sizeof(cacheshm_block_t) + slot->keylen + slot->size;
+    const uint64_t off = slot->off;
+    const cacheshm_slot_t deleted = {.hash = slot->hash,
+                                     .state = CACHESHM_DELETED};
+    write_slot(slot, &deleted);
+    free_units(off / g_cacheshm.shm->min_block, order_of(bytes));
+
+    atomic_fetch_sub_explicit(&g_cacheshm.shm->entries, 1,
+                              memory_order_relaxed);
+    stats_sub(g_cacheshm.stat_entries, 1);
+    stats_sub(g_cacheshm.stat_bytes,
+              (size_t)g_cacheshm.shm->min_block << order_of(bytes));
+}
+
+/**
+ * @brief Copy a cached response into the segment and index it. An entry that
+ * finds no room is left out; lookups of it fall back to the proxy.
+ */
+static void publish(const block_t *block) {
+    const uint64_t hash = cacheshm_hash(block->key, block->keylen);
+    cacheshm_slot_t *slot = find_slot(block->key, block->keylen, hash);
+    if (slot)
+        unpublish(slot);
+
+    // A free slot within reach of the hash.
+    slot = NULL;
+    for (unsigned probe = 0; probe < CACHESHM_MAX_PROBE; ++probe) {
+        cacheshm_slot_t *s = &g_cacheshm.slots[(hash + probe) &
+                                               g_cacheshm.mask];
+        if (s->state != CACHESHM_LIVE) {
+            slot = s;
+            break;
+        }
+    }
+    const size_t bytes =
+        sizeof(cacheshm_block_t) + block->keylen + block->size;
+    const unsigned order = order_of(bytes);
+    const uint32_t unit =
+        (slot && order <= g_cacheshm.max_order) ? alloc_units(order)
+                                                : CACHESHM_NONE;
+    if (unit == CACHESHM_NONE) {
+        stats_add(g_cacheshm.stat_full, 1);
+        return;
+    }
+
+    const uint64_t off = (uint64_t)unit * g_cacheshm.shm->min_block;
+    cacheshm_block_t *b = block_at(off);
+    b->keylen = block->keylen;
+    b->size = block->size;
+    memcpy(b + 1, block->key, block->keylen);
+    ntcopy((char *)(b + 1) + block->keylen, block->value, block->size);
+
+    // The slot's release store publishes the block along with it.
+    const cacheshm_slot_t live = {
+        .hash = hash,
+        .off = off,
+        .gen = atomic_load_explicit(&g_cacheshm.gens[unit],
+                                    memory_order_relaxed),
+        .state = CACHESHM_LIVE,
+        .keylen = block->keylen,
+        .size = block->size,
+    };
+    write_slot(slot, &live);
+
+    atomic_fetch_add_explicit(&g_cacheshm.shm->entries, 1,
+                              memory_order_relaxed);
+    stats_add(g_cacheshm.stat_entries, 1);
+    stats_add(g_cacheshm.stat_bytes,
+              (size_t)g_cacheshm.shm->min_block << order);
+    stats_add(g_cacheshm.stat_published, 1);
+}
+
+static void on_cache_event(cache_t *cache, block_t *block,
+                           cache_event_t event, void *arg) {
+    if (event == CACHE_INSERTED) {
+        publish(block);
+        return;
+    }
+    cacheshm_slot_t *slot =
+        find_slot(block->key, block->keylen,
+                  cacheshm_hash(block->key, block->keylen));
+    if (slot)
+        unpublish(slot);
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int cacheshm_start(const char *path, size_t size, cache_t *cache,
+                   plock_t *lock) {
+    uint64_t data_size = CACHESHM_MIN_BLOCK;
+    while (data_size < size)
+        data_size <<= 1;
+    const uint64_t units = data_size / CACHESHM_MIN_BLOCK;
+    // One slot per unit: there can never be more entries than that.
+    const uint64_t nslots = units;
+    const uint64_t slots_off = 64;
+    const uint64_t gens_off = slots_off + nslots * sizeof(cacheshm_slot_t);
+    const uint64_t data_off =
+        (gens_off + units * sizeof(uint64_t) + 4095) & ~(uint64_t)4095;
+    const size_t len = data_off + data_size;
+
+    // Written aside and renamed into place, so that readers of a previous
+    // segment keep a consistent mapping.
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, len) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        unlink(tmp);
+        return -1;
+    }
+
+    unsigned max_order = 0;
+    while (((uint64_t)1 << max_order) < units)
+        ++max_order;
+    g_cacheshm.next = calloc(units, sizeof(uint32_t));
+    g_cacheshm.prev = calloc(units, sizeof(uint32_t));
+    g_cacheshm.free_order = malloc(units);
+    if (max_order >= CACHESHM_MAX_ORDERS || g_cacheshm.next == NULL ||
+        g_cacheshm.prev == NULL || g_cacheshm.free_order == NULL) {
+        free(g_cacheshm.next);
+        free(g_cacheshm.prev);
+        free(g_cacheshm.free_order);
+        munmap(base, len);
+        unlink(tmp);
+        return -1;
+    }
+    memset(g_cacheshm.free_order, -1, units);
+    for (unsigned order = 0; order < CACHESHM_MAX_ORDERS; ++order)
+        g_cacheshm.free_head[order] = CACHESHM_NONE;
+    g_cacheshm.max_order = max_order;
+    push_free(0, max_order);
+
+    cacheshm_header_t *shm = (cacheshm_header_t *)base;
+    shm->version = CACHESHM_VERSION;
+    shm->header_size = sizeof(cacheshm_header_t);
+    shm->pid = getpid();
+    shm->min_block = CACHESHM_MIN_BLOCK;
+    shm->nslots = nslots;
+    shm->slots_off = slots_off;
+    shm->gens_off = gens_off;
+    shm->data_off = data_off;
+    shm->data_size = data_size;
+    atomic_init(&shm->entries, 0);
+
+    g_cacheshm.shm = shm;
+    g_cacheshm.slots = (cacheshm_slot_t *)(base + slots_off);
+    g_cacheshm.gens = (_Atomic uint64_t *)(base + gens_off);
+    g_cacheshm.data = base + data_off;
+    g_cacheshm.mask = nslots - 1;
+    g_cacheshm.stat_entries = stats_counter("cacheshm.entries");
+    g_cacheshm.stat_bytes = stats_counter("cacheshm.bytes");
+    g_cacheshm.stat_published = stats_counter("cacheshm.published");
+    g_cacheshm.stat_full = stats_counter("cacheshm.full");
+
+    // Whatever is cached already goes in first, oldest first.
+    plock_lock(lock);
+    size_t n = 0;
+    block_t **blocks = cache_snapshot(cache, &n);
+    for (size_t i = 0; i < n; ++i) {
+        publish(blocks[i]);
+        cache_release(cache, blocks[i]);
+    }
+    free(blocks);
+    int added = cache_add_listener(cache, on_cache_event, NULL);
+    plock_unlock(lock);
+
+    // Readers trust the layout once they see the magic.
+    atomic_thread_fence(memory_order_release);
+    memcpy(shm->magic, CACHESHM_MAGIC, sizeof(CACHESHM_MAGIC));
+    if (added < 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
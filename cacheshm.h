@@ -0,0 +1,118 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache view: a read-only mirror of the cache in a shared memory segment, so
+ * that processes on the same host look responses up and read them in place,
+ * with no request to the proxy at all. The proxy copies every response into
+ * the segment as it is cached and drops it from there when it is evicted;
+ * readers map the segment read-only and never write to it.
+ *
+ * Layout, version 1, in native byte order:
+ *
+ *     offset 0        cacheshm_header_t
+ *     slots_off       nslots x cacheshm_slot_t
+ *     gens_off        data_size / min_block generation counters
+ *     data_off        data_size bytes of blocks
+ *
+ * The slots are an open-addressing hash table of the cached URIs, probed
+ * linearly from the FNV-1a hash of the key for at most CACHESHM_MAX_PROBE
+ * slots; a lookup stops at the first empty slot. Each slot is guarded by a
+ * sequence lock of its own, odd while the proxy rewrites it.
+ *
+ * Each response lives in a block of the data area, a cacheshm_block_t
+ * followed by the key and the response, allocated with a buddy allocator
+ * whose smallest block is `min_block` bytes. The generation of the block
+ * starting at offset `off` is `gens[off / min_block]`; the proxy bumps it
+ * whenever it frees the block, before anything else may be written there.
+ * A reader takes the generation from the slot, reads the block, and only
+ * then checks that the generation is unchanged: if it is, nothing it read
+ * was overwritten. cacheview.h implements that protocol for readers.
+ *
+ * The proxy replaces the segment with a new file when it restarts; readers
+ * of the old one keep seeing its last contents, and should map the path
+ * again when the pid in the header is no longer the proxy's.
+ */
+#ifndef CACHESHM_H
+#define CACHESHM_H
+
+#include "cache.h"
+#include "plock.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHESHM_MAGIC "PXVIEW1"
+#define CACHESHM_VERSION 1
+#define CACHESHM_MIN_BLOCK 256
+#define CACHESHM_MAX_PROBE 64
+
+/**
+ * @param  nslots     Slots of the hash table, a power of two.
+ * @param  data_size  Bytes of the data area, a power of two.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t pid;
+    uint32_t min_block;
+    uint64_t nslots;
+    uint64_t slots_off;
+    uint64_t gens_off;
+    uint64_t data_off;
+    uint64_t data_size;
+    _Atomic uint64_t entries;
+} cacheshm_header_t;
+
+#define CACHESHM_EMPTY 0
+#define CACHESHM_LIVE 1
+#define CACHESHM_DELETED 2
+
+/**
+ * @param  seq    Sequence lock of the slot, odd while it is rewritten.
+ * @param  state  CACHESHM_EMPTY, CACHESHM_LIVE or CACHESHM_DELETED.
+ * @param  off    Offset of the block in the data area.
+ * @param  gen    Generation of the block when it was filled.
+ */
+typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t hash;
+    uint64_t off;
+    uint64_t gen;
+    uint32_t state;
+    uint32_t keylen;
+    uint64_t size;
+} cacheshm_slot_t;
+
+/**
+ * Header of a block, followed by `keylen` bytes of key and `size` bytes of
+ * response.
+ */
+typedef struct {
+    uint64_t keylen;
+    uint64_t size;
+} cacheshm_block_t;
+
+/**
+ * Hash of a key, which picks the first slot probed.
+ */
+static inline uint64_t cacheshm_hash(const void *key, size_t keylen) {
+    const unsigned char *p = key;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < keylen; ++i)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+/**
+ * Create the segment at `path`, with a data area of at least `size` bytes,
+ * and mirror `cache` into it from now on. `lock` is the lock that callers of
+ * `cache` hold. Progress is exported as `cacheshm.*` stats.
+ *
+ * @return 0 on success, -1 if the file could not be created.
+ */
+int cacheshm_start(const char *path, size_t size, cache_t *cache,
+                   plock_t *lock);
+
+#endif
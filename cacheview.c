@@ -0,0 +1,241 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache view reader.
+ */
+#define _GNU_SOURCE
+#include "cacheview.h"
+#include "unixsock.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHEVIEW_REQUEST_LEN 4096
+
+/**************** HELPERS ****************/
+/**
+ * @brief Take a consistent copy of a slot, retrying while the proxy rewrites
+ * it.
+ *
+ * @return 0 on success, -1 if the slot kept changing.
+ */
+static int read_slot(const cacheshm_slot_t *slot, cacheshm_slot_t *copy) {
+    for (int attempt = 0; attempt < CACHEVIEW_TRIES; ++attempt) {
+        const uint64_t seq =
+            atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+        copy->hash = slot->hash;
+        copy->off = slot->off;
+        copy->gen = slot->gen;
+        copy->state = slot->state;
+        copy->keylen = slot->keylen;
+        copy->size = slot->size;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief One pass over the slots `uri` may sit in.
+ *
+ * @return 0 on a hit, 1 on a miss, -1 if the pass read something that
+ *         changed under it and should be retried.
+ */
+static int lookup_once(const cacheview_t *view, const char *uri,
+                       size_t keylen, uint64_t hash, cacheview_ref_t *ref) {
+    const cacheshm_header_t *shm = view->shm;
+    for (unsigned probe = 0; probe < CACHESHM_MAX_PROBE; ++probe) {
+        cacheshm_slot_t slot;
+        if (read_slot(&view->slots[(hash + probe) & (shm->nslots - 1)],
+                      &slot) < 0)
+            return -1;
+        if (slot.state == CACHESHM_EMPTY)
+            return 1;
+        if (slot.state != CACHESHM_LIVE || slot.hash != hash ||
+            slot.keylen != keylen)
+            continue;
+        if (slot.off % shm->min_block != 0 ||
+            slot.off + sizeof(cacheshm_block_t) + keylen + slot.size >
+                shm->data_size)
+            return -1;
+
+        const cacheshm_block_t *block =
+            (const cacheshm_block_t *)(view->data + slot.off);
+        ref->off = slot.off;
+        ref->gen = slot.gen;
+        if (memcmp(block + 1, uri, keylen) != 0) {
+            // Another key with the same hash, unless the block is gone.
+            if (!cacheview_valid(view, ref))
+                return -1;
+            continue;
+        }
+        ref->response = (const char *)(block + 1) + keylen;
+        ref->size = slot.size;
+        const char *end = memmem(ref->response, ref->size, "\r\n\r\n", 4);
+        ref->body = end ? end + 4 : ref->response + ref->size;
+        ref->body_len = ref->response + ref->size - ref->body;
+        return cacheview_valid(view, ref) ? 0 : -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Connect to the proxy at `host:port` or the UNIX socket `addr`.
+ */
+static int connect_proxy(const char *addr) {
+    if (unixsock_is_path(addr))
+        return unixsock_connect(addr);
+
+    char host[256];
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL || (size_t)(colon - addr) >= sizeof(host))
+        return -1;
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM,
+                             .ai_flags = AI_NUMERICSERV};
+    struct addrinfo *list;
+    if (getaddrinfo(host, colon + 1, &hints, &list) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *p = list; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC,
+                    p->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/**
+ * @brief Ask the proxy for `uri`, which then caches it for the next lookup.
+ */
+static ssize_t get_from_proxy(const char *proxy, const char *uri, char *buf,
+                              size_t cap) {
+    char request[CACHEVIEW_REQUEST_LEN];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.0\r\nConnection: close\r\n\r\n", uri);
+    if (len < 0 || (size_t)len >= sizeof(request))
+        return -1;
+    int fd = connect_proxy(proxy);
+    if (fd < 0)
+        return -1;
+
+    ssize_t total = -1;
+    if (send(fd, request, len, MSG_NOSIGNAL) == len) {
+        // Read one byte past `cap` to tell a full buffer from a larger
+        // response.
+        char extra;
+        ssize_t n;
+        total = 0;
+        while ((n = read(fd, (size_t)total < cap ? buf + total : &extra,
+                         (size_t)total < cap ? cap - total : 1)) > 0)
+            total += n;
+        if (n < 0 || (size_t)total > cap)
+            total = -1;
+    }
+    close(fd);
+    return total;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+cacheview_t *cacheview_open(const char *path, const char *proxy) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(cacheshm_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    const size_t len = st.st_size;
+    char *base = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    // The layout can be trusted once the magic is there.
+    const cacheshm_header_t *shm = (const cacheshm_header_t *)base;
+    const bool ready =
+        memcmp(shm->magic, CACHESHM_MAGIC, sizeof(CACHESHM_MAGIC)) == 0;
+    atomic_thread_fence(memory_order_acquire);
+    const uint64_t units = shm->min_block ? shm->data_size / shm->min_block
+                                          : 0;
+    cacheview_t *view = NULL;
+    if (ready && shm->version == CACHESHM_VERSION &&
+        shm->header_size == sizeof(cacheshm_header_t) && units > 0 &&
+        (shm->nslots & (shm->nslots - 1)) == 0 && shm->nslots > 0 &&
+        shm->slots_off + shm->nslots * sizeof(cacheshm_slot_t) <= len &&
+        shm->gens_off + units * sizeof(uint64_t) <= len &&
+        shm->data_off + shm->data_size <= len)
+        view = malloc(sizeof(cacheview_t));
+    if (view == NULL) {
+        munmap(base, len);
+        return NULL;
+    }
+
+    view->shm = shm;
+    view->len = len;
+    view->slots = (const cacheshm_slot_t *)(base + shm->slots_off);
+    view->gens = (const _Atomic uint64_t *)(base + shm->gens_off);
+    view->data = base + shm->data_off;
+    view->proxy = proxy;
+    return view;
+}
+
+void cacheview_close(cacheview_t *view) {
+    if (view == NULL)
+        return;
+    munmap((void *)view->shm, view->len);
+    free(view);
+}
+
+int cacheview_lookup(const cacheview_t *view, const char *uri,
+                     cacheview_ref_t *ref) {
+    const size_t keylen = strlen(uri) + 1;
+    const uint64_t hash = cacheshm_hash(uri, keylen);
+    for (int attempt = 0; attempt < CACHEVIEW_TRIES; ++attempt) {
+        const int res = lookup_once(view, uri, keylen, hash, ref);
+        if (res >= 0)
+            return res == 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+bool cacheview_valid(const cacheview_t *view, const cacheview_ref_t *ref) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&view->gens[ref->off / view->shm->min_block],
+                                memory_order_relaxed) == ref->gen;
+}
+
+ssize_t cacheview_get(const cacheview_t *view, const char *uri, char *buf,
+                      size_t cap) {
+    for (int attempt = 0; attempt < CACHEVIEW_TRIES; ++attempt) {
+        cacheview_ref_t ref;
+        if (cacheview_lookup(view, uri, &ref) < 0)
+            break;
+        if (ref.size > cap)
+            return -1;
+        memcpy(buf, ref.response, ref.size);
+        if (cacheview_valid(view, &ref))
+            return ref.size;
+    }
+    return view->proxy ? get_from_proxy(view->proxy, uri, buf, cap) : -1;
+}
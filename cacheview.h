@@ -0,0 +1,105 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Client library of the cache view (cf. cacheshm.h), for processes on the
+ * same host as the proxy: look a URI up in the proxy's cache and read its
+ * response straight out of shared memory, falling back to a request to the
+ * proxy when it is not there.
+ *
+ *     cacheview_t *view = cacheview_open("/dev/shm/proxy-cache", "/run/px");
+ *     cacheview_ref_t ref;
+ *     if (cacheview_lookup(view, uri, &ref) == 0) {
+ *         consume(ref.body, ref.body_len);
+ *         if (!cacheview_valid(view, &ref))
+ *             ...  // Evicted meanwhile: what consume saw may be torn.
+ *     }
+ *
+ * Lookups take no lock and make no system call, and a view may be used by
+ * any number of threads at once. Only cacheview_get copies the response.
+ * A process links cacheview.c and unixsock.c alone.
+ */
+#ifndef CACHEVIEW_H
+#define CACHEVIEW_H
+
+#include "cacheshm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Times a lookup retries a slot that the proxy is rewriting, or a response
+ * that was overwritten while it was read, before it gives up.
+ */
+#define CACHEVIEW_TRIES 16
+
+/**
+ * A mapped view.
+ *
+ * @param  proxy  Where cacheview_get sends requests the view cannot answer:
+ *                `host:port` or a UNIX socket (cf. unixsock.h), or NULL.
+ */
+typedef struct {
+    const cacheshm_header_t *shm;
+    size_t len;
+    const cacheshm_slot_t *slots;
+    const _Atomic uint64_t *gens;
+    const char *data;
+    const char *proxy;
+} cacheview_t;
+
+/**
+ * A response found in the view, to be trusted only as long as
+ * cacheview_valid says so.
+ *
+ * @param  response  The whole response, status line and headers included.
+ * @param  body      The body within it.
+ */
+typedef struct {
+    const char *response;
+    size_t size;
+    const char *body;
+    size_t body_len;
+    uint64_t off;
+    uint64_t gen;
+} cacheview_ref_t;
+
+/**
+ * Map the cache view at `path` read-only.
+ *
+ * @param  proxy  Address of the proxy, for cacheview_get; may be NULL. It is
+ *                kept, not copied.
+ *
+ * @return The view, or NULL if `path` is not a cache view this code
+ *         understands.
+ */
+cacheview_t *cacheview_open(const char *path, const char *proxy);
+
+void cacheview_close(cacheview_t *view);
+
+/**
+ * Look `uri` up, as the proxy keys it: the absolute URI of the request.
+ *
+ * @return 0 if `ref` now refers to its response, -1 if it is not cached.
+ */
+int cacheview_lookup(const cacheview_t *view, const char *uri,
+                     cacheview_ref_t *ref);
+
+/**
+ * Whether the response `ref` refers to is still intact, i.e. whether what
+ * was read from it so far can be trusted.
+ */
+bool cacheview_valid(const cacheview_t *view, const cacheview_ref_t *ref);
+
+/**
+ * Copy the response to a GET of `uri` into `buf`: from the view if it is
+ * there, from the proxy otherwise.
+ *
+ * @return Bytes of the response, or -1 if it could not be had or is larger
+ *         than `cap`.
+ */
+ssize_t cacheview_get(const cacheview_t *view, const char *uri, char *buf,
+                      size_t cap);
+
+#endif
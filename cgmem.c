@@ -0,0 +1,228 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache budget controller driven by cgroup memory usage and PSI.
+ */
+#include "cgmem.h"
+#include "stats.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CGMEM_LINE 512
+
+/**************** GLOBALS ****************/
+/*
+ * The controller's files, bounds and state, plus its stats. psi_bp is the
+ * PSI figure in hundredths of a percent.
+ */
+static struct {
+    cgmem_tune_t tune;
+    char current_path[PATH_MAX];
+    char max_path[PATH_MAX];
+    char pressure_path[PATH_MAX];
+    cgmem_apply_fn apply;
+    void *arg;
+    size_t budget;
+    int calm;
+
+    stat_counter_t *stat_current;
+    stat_counter_t *stat_limit;
+    stat_counter_t *stat_psi_bp;
+    stat_counter_t *stat_budget;
+    stat_counter_t *stat_shrinks;
+    stat_counter_t *stat_grows;
+} g_cgmem;
+
+/**************** HELPERS ****************/
+/**
+ * @brief Read the first line of a small file, NUL-terminated.
+ *
+ * @return 0 on success, -1 if it could not be read.
+ */
+static int read_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char *res = fgets(buf, len, f);
+    fclose(f);
+    return res ? 0 : -1;
+}
+
+/**
+ * @brief Read a byte count such as memory.current. "max" reads as 0.
+ */
+static int read_bytes(const char *path, size_t *bytes) {
+    char line[CGMEM_LINE];
+    if (read_line(path, line, sizeof(line)) < 0)
+        return -1;
+    *bytes = (strncmp(line, "max", 3) == 0) ? 0 : strtoull(line, NULL, 10);
+    return 0;
+}
+
+/**
+ * @brief Read the `some avg10` figure of a PSI file, in percent.
+ */
+static int read_psi(const char *path, double *avg10) {
+    char line[CGMEM_LINE];
+    if (read_line(path, line, sizeof(line)) < 0 ||
+        sscanf(line, "some avg10=%lf", avg10) != 1)
+        return -1;
+    return 0;
+}
+
+static bool is_readable(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%.*s/%s", PATH_MAX - 32, dir, name);
+    return access(path, R_OK) == 0;
+}
+
+/**
+ * @brief Locate the proxy's own cgroup v2 directory, under the unified
+ * hierarchy whether it is mounted at CGMEM_ROOT or, on hybrid systems, at
+ * CGMEM_ROOT/unified.
+ *
+ * @return 0 on success, -1 if no directory with memory.current was found.
+ */
+static int find_cgroup(char *dir, size_t len) {
+    char line[CGMEM_LINE];
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL)
+        return -1;
+    int res = -1;
+    while (res < 0 && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) != 0)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        const char *roots[] = {CGMEM_ROOT, CGMEM_ROOT "/unified"};
+        for (size_t i = 0; i < 2 && res < 0; ++i) {
+            snprintf(dir, len, "%s%s", roots[i], line + 3);
+            if (is_readable(dir, "memory.current"))
+                res = 0;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+/**
+ * @brief One period of the controller: read the group's state and move the
+ * budget.
+ */
+static void step(void) {
+    const cgmem_tune_t *tune = &g_cgmem.tune;
+    size_t current = 0, limit = 0;
+    double psi = 0;
+    bool have_usage = read_bytes(g_cgmem.current_path, &current) == 0 &&
+                      read_bytes(g_cgmem.max_path, &limit) == 0 && limit > 0;
+    bool have_psi = read_psi(g_cgmem.pressure_path, &psi) == 0;
+
+    stats_set(g_cgmem.stat_current, current);
+    stats_set(g_cgmem.stat_limit, limit);
+    stats_set(g_cgmem.stat_psi_bp, (uint64_t)(psi * 100));
+
+    const double usage_pct = have_usage ? 100.0 * current / limit : 0;
+    const bool pressure = (have_usage && usage_pct >= tune->high_pct) ||
+                          (have_psi && psi >= tune->psi_high);
+    const bool calm = (!have_usage || usage_pct <= tune->low_pct) &&
+                      (!have_psi || psi <= tune->psi_low);
+
+    size_t budget = g_cgmem.budget;
+    if (pressure) {
+        g_cgmem.calm = 0;
+        budget -= budget / 8;
+        if (budget < tune->min_bytes)
+            budget = tune->min_bytes;
+    } else if (calm && ++g_cgmem.calm >= tune->calm_periods) {
+        // Each step up waits for a fresh run of calm periods.
+        g_cgmem.calm = 0;
+        budget += tune->max_bytes / 16;
+        if (budget > tune->max_bytes)
+            budget = tune->max_bytes;
+    } else if (!calm) {
+        g_cgmem.calm = 0;
+    }
+
+    if (budget != g_cgmem.budget) {
+        stats_add(budget < g_cgmem.budget ? g_cgmem.stat_shrinks
+                                          : g_cgmem.stat_grows,
+                  1);
+        g_cgmem.budget = budget;
+        stats_set(g_cgmem.stat_budget, budget);
+        g_cgmem.apply(budget, g_cgmem.arg);
+    }
+}
+
+static void *thread_cgmem(void *vargp) {
+    const struct timespec interval = {
+        .tv_sec = g_cgmem.tune.interval_us / 1000000,
+        .tv_nsec = (long)(g_cgmem.tune.interval_us % 1000000) * 1000,
+    };
+    while (1) {
+        nanosleep(&interval, NULL);
+        step();
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+void cgmem_tune_defaults(cgmem_tune_t *tune, size_t min_bytes,
+                         size_t max_bytes) {
+    *tune = (cgmem_tune_t){
+        .dir = NULL,
+        .min_bytes = min_bytes,
+        .max_bytes = max_bytes,
+        .interval_us = 1000 * 1000,
+        .high_pct = 90,
+        .low_pct = 75,
+        .psi_high = 10,
+        .psi_low = 1,
+        .calm_periods = 5,
+    };
+}
+
+int cgmem_start(const cgmem_tune_t *tune, cgmem_apply_fn apply, void *arg) {
+    char dir[PATH_MAX];
+    if (tune->min_bytes == 0 || tune->min_bytes > tune->max_bytes ||
+        tune->interval_us == 0 || tune->low_pct > tune->high_pct ||
+        tune->psi_low > tune->psi_high)
+        return -1;
+    if (tune->dir)
+        snprintf(dir, sizeof(dir), "%s", tune->dir);
+    else if (find_cgroup(dir, sizeof(dir)) < 0)
+        return -1;
+
+    g_cgmem.tune = *tune;
+    g_cgmem.apply = apply;
+    g_cgmem.arg = arg;
+    g_cgmem.budget = tune->max_bytes;
+    snprintf(g_cgmem.current_path, PATH_MAX, "%.*s/memory.current",
+             PATH_MAX - 32, dir);
+    snprintf(g_cgmem.max_path, PATH_MAX, "%.*s/memory.max", PATH_MAX - 32,
+             dir);
+    if (is_readable(dir, "memory.pressure"))
+        snprintf(g_cgmem.pressure_path, PATH_MAX, "%.*s/memory.pressure",
+                 PATH_MAX - 32, dir);
+    else
+        snprintf(g_cgmem.pressure_path, PATH_MAX, "/proc/pressure/memory");
+
+    g_cgmem.stat_current = stats_counter("cgmem.current_bytes");
+    g_cgmem.stat_limit = stats_counter("cgmem.limit_bytes");
+    g_cgmem.stat_psi_bp = stats_counter("cgmem.psi_some_avg10_bp");
+    g_cgmem.stat_budget = stats_counter("cgmem.budget_bytes");
+    g_cgmem.stat_shrinks = stats_counter("cgmem.shrinks");
+    g_cgmem.stat_grows = stats_counter("cgmem.grows");
+    stats_set(g_cgmem.stat_budget, g_cgmem.budget);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_cgmem, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache budget controller for containers. A fixed cache size either wastes a
+ * shared memory limit or gets the proxy OOM-killed once neighbours grow, so
+ * this watches the cgroup v2 memory controller and sizes the cache budget to
+ * what the group can spare:
+ *
+ * - `memory.current` against `memory.max`: usage of the group's limit.
+ * - `memory.pressure` (PSI), the `some avg10` figure: the share of the last
+ *   10 seconds in which some task stalled on memory. Falls back to the
+ *   system-wide /proc/pressure/memory when the group has no such file.
+ *
+ * Under pressure (usage above `high_pct` of the limit, or stalls above
+ * `psi_high`) the budget shrinks by an eighth per period. It grows back by a
+ * sixteenth of `max_bytes` after every `calm_periods` periods in a row below
+ * `low_pct` and `psi_low`; in between, it holds. The gap between
+ * the two sets of thresholds keeps the budget from oscillating.
+ *
+ * The cgroup directory can be any directory holding files of the same names,
+ * so pressure can be simulated by writing them by hand.
+ */
+#ifndef CGMEM_H
+#define CGMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CGMEM_ROOT "/sys/fs/cgroup"
+
+/**
+ * Bounds, thresholds and period of the controller.
+ *
+ * @param  dir           Directory holding memory.current, memory.max and
+ *                       memory.pressure. NULL for the proxy's own cgroup.
+ * @param  min_bytes     Never shrink the budget below this.
+ * @param  max_bytes     Never grow it beyond this; also the initial budget.
+ * @param  interval_us   Controller period.
+ * @param  high_pct      Usage of the limit, in percent, that counts as
+ *                       pressure.
+ * @param  low_pct       Usage below which the budget may grow.
+ * @param  psi_high      PSI `some avg10`, in percent, that counts as pressure.
+ * @param  psi_low       PSI below which the budget may grow.
+ * @param  calm_periods  Calm periods in a row before growing.
+ */
+typedef struct {
+    const char *dir;
+    size_t min_bytes;
+    size_t max_bytes;
+    uint64_t interval_us;
+    double high_pct;
+    double low_pct;
+    double psi_high;
+    double psi_low;
+    int calm_periods;
+} cgmem_tune_t;
+
+/**
+ * Called from the controller thread with every new budget.
+ */
+typedef void (*cgmem_apply_fn)(size_t budget, void *arg);
+
+/**
+ * Fill in the default thresholds and period, for the budget bounds given.
+ */
+void cgmem_tune_defaults(cgmem_tune_t *tune, size_t min_bytes,
+                         size_t max_bytes);
+
+/**
+ * Start the controller thread. Its readings and decisions are exported as
+ * `cgmem.*` stats.
+ *
+ * @return 0 on success, -1 on invalid bounds or if the cgroup's memory files
+ *         cannot be found.
+ */
+int cgmem_start(const cgmem_tune_t *tune, cgmem_apply_fn apply, void *arg);
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Queue of cache changes for background writers.
+ */
+#include "changeq.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+void changeq_init(changeq_t *q, cache_t *cache, plock_t *lock,
+                  size_t max_pending) {
+    *q = (changeq_t){
+        .cache = cache,
+        .lock = lock,
+        .max_pending = max_pending,
+    };
+    q->tail = &q->head;
+}
+
+int changeq_push(changeq_t *q, block_t *block, cache_event_t event,
+                 uint32_t type) {
+    change_t *c;
+    if (event == CACHE_INSERTED) {
+        if (q->pending_bytes + block->size > q->max_pending)
+            return 0;
+        if ((c = malloc(sizeof(change_t))) == NULL)
+            return -1;
+        c->block = block;
+        c->keylen = 0;
+        cache_retain(q->cache, block);
+        q->pending_bytes += block->size;
+    } else {
+        if ((c = malloc(sizeof(change_t) + block->keylen)) == NULL)
+            return -1;
+        c->block = NULL;
+        c->keylen = block->keylen;
+        memcpy(c->key, block->key, block->keylen);
+    }
+    c->type = type;
+    c->next = NULL;
+    *q->tail = c;
+    q->tail = &c->next;
+    return 1;
+}
+
+int changeq_prepend(change_t **list, uint32_t type) {
+    change_t *c = malloc(sizeof(change_t));
+    if (c == NULL)
+        return -1;
+    *c = (change_t){.next = *list, .type = type};
+    *list = c;
+    return 0;
+}
+
+change_t *changeq_take(changeq_t *q) {
+    change_t *list = q->head;
+    q->head = NULL;
+    q->tail = &q->head;
+    q->pending_bytes = 0;
+    return list;
+}
+
+int changeq_from_snapshot(changeq_t *q, block_t **blocks, size_t n,
+                          uint32_t type, change_t **list) {
+    change_t **tail = list;
+    *list = NULL;
+    size_t listed = 0;
+    for (; listed < n; ++listed) {
+        change_t *c = malloc(sizeof(change_t));
+        if (c == NULL)
+            break;
+        *c = (change_t){.type = type, .block = blocks[listed]};
+        *tail = c;
+        tail = &c->next;
+    }
+    if (listed == n)
+        return 0;
+
+    plock_lock(q->lock);
+    for (size_t i = listed; i < n; ++i)
+        cache_release(q->cache, blocks[i]);
+    plock_unlock(q->lock);
+    changeq_release(q, *list);
+    *list = NULL;
+    return -1;
+}
+
+void changeq_release(changeq_t *q, change_t *list) {
+    plock_lock(q->lock);
+    for (change_t *c = list; c; c = c->next)
+        if (c->block)
+            cache_release(q->cache, c->block);
+    plock_unlock(q->lock);
+    while (list) {
+        change_t *next = list->next;
+        free(list);
+        list = next;
+    }
+}
+
+int changeq_write(const change_t *list, changeq_header_fn header,
+                  changeq_writev_fn writev, void *arg) {
+    _Alignas(8) unsigned char headers[CHANGEQ_BATCH][CHANGEQ_MAX_HEADER];
+    struct iovec iov[3 * CHANGEQ_BATCH];
+    while (list) {
+        int nrec = 0, niov = 0;
+        size_t bytes = 0;
+        for (; list && nrec < CHANGEQ_BATCH; list = list->next, ++nrec) {
+            const block_t *b = list->block;
+            const void *key = b ? b->key : list->key;
+            const size_t keylen = b ? b->keylen : list->keylen;
+            const void *body = b ? b->value : NULL;
+            const size_t size = b ? b->size : 0;
+            const size_t len =
+                header(headers[nrec], list, key, keylen, body, size);
+            assert(len <= CHANGEQ_MAX_HEADER);
+            iov[niov++] = (struct iovec){headers[nrec], len};
+            if (keylen)
+                iov[niov++] = (struct iovec){(void *)key, keylen};
+            if (size)
+                iov[niov++] = (struct iovec){(void *)body, size};
+            bytes += len + keylen + size;
+        }
+        if (writev(iov, niov, nrec, bytes, arg) < 0)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Queue of cache changes waiting for a background thread to write them out,
+ * shared by the journal (cf. journal.h) and replication (cf. repl.h). Their
+ * cache listeners queue every insertion and eviction; a writer thread takes
+ * the whole queue at once, writes it with changeq_write and releases it.
+ *
+ * An insertion holds a reference on its cache block instead of a copy of the
+ * response; an eviction carries a copy of the key, since the block may be
+ * gone by the time it is written. Insertions are skipped while more than
+ * `max_pending` bytes of responses are queued, so a stalled writer bounds
+ * the memory it pins. Evictions are never skipped: whatever reads the
+ * records would keep entries the cache dropped.
+ *
+ * The queue has no lock of its own. Its owner serializes pushes and takes
+ * with one mutex of its own, which usually guards more state besides.
+ */
+#ifndef CHANGEQ_H
+#define CHANGEQ_H
+
+#include "cache.h"
+#include "plock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Records per changeq_writev_fn call; each takes up to three iovecs.
+ */
+#define CHANGEQ_BATCH 256
+
+/*
+ * Largest record header changeq_write can lay out.
+ */
+#define CHANGEQ_MAX_HEADER 32
+
+/**
+ * A record waiting to be written.
+ *
+ * @param  type    The owner's record type.
+ * @param  block   The inserted block, referenced, or NULL.
+ * @param  keylen  Length of `key`, for records without a block.
+ */
+typedef struct Change {
+    struct Change *next;
+    uint32_t type;
+    block_t *block;
+    size_t keylen;
+    char key[];
+} change_t;
+
+/**
+ * @param  cache          The cache whose blocks are referenced.
+ * @param  lock           The lock callers of `cache` hold.
+ * @param  max_pending    Bound on pending_bytes, past which insertions are
+ *                        skipped.
+ * @param  pending_bytes  Bytes of responses referenced by the queue.
+ */
+typedef struct {
+    cache_t *cache;
+    plock_t *lock;
+    size_t max_pending;
+    change_t *head;
+    change_t **tail;
+    size_t pending_bytes;
+} changeq_t;
+
+/**
+ * Fill in the header of the record for `c` at `header`, whose key and body
+ * follow it.
+ *
+ * @return The size of the header, at most CHANGEQ_MAX_HEADER.
+ */
+typedef size_t (*changeq_header_fn)(void *header, const change_t *c,
+                                    const void *key, size_t keylen,
+                                    const void *body, size_t size);
+
+/**
+ * Write a batch of `nrec` records, `bytes` bytes in `niov` iovecs, which may
+ * be modified.
+ *
+ * @return 0 on success, -1 on error.
+ */
+typedef int (*changeq_writev_fn)(struct iovec *iov, int niov, int nrec,
+                                 size_t bytes, void *arg);
+
+void changeq_init(changeq_t *q, cache_t *cache, plock_t *lock,
+                  size_t max_pending);
+
+/**
+ * Queue a record of `type` for `event` on `block`. Called from a cache
+ * listener, under the cache lock and the owner's mutex.
+ *
+ * @return 1 if queued, 0 if the insertion was skipped, -1 if allocation
+ *         failed.
+ */
+int changeq_push(changeq_t *q, block_t *block, cache_event_t event,
+                 uint32_t type);
+
+/**
+ * Add a record of `type` with neither key nor body, e.g. a marker, at the
+ * front of `*list`.
+ *
+ * @return 0 on success, -1 if allocation failed.
+ */
+int changeq_prepend(change_t **list, uint32_t type);
+
+/**
+ * Take every queued record. Called under the owner's mutex.
+ */
+change_t *changeq_take(changeq_t *q);
+
+/**
+ * Turn the `n` blocks of a cache_snapshot into a list of insertions of
+ * `type`, which hold the snapshot's references. `blocks` itself is left to
+ * the caller.
+ *
+ * @return 0 on success, -1 if allocation failed, in which case every
+ *         reference of the snapshot has been dropped.
+ */
+int changeq_from_snapshot(changeq_t *q, block_t **blocks, size_t n,
+                          uint32_t type, change_t **list);
+
+/**
+ * Drop the references held by a list of records, and free it. Takes the
+ * cache lock.
+ */
+void changeq_release(changeq_t *q, change_t *list);
+
+/**
+ * Write a list of records CHANGEQ_BATCH at a time, each as the header from
+ * `header`, then the key and the body, if any.
+ *
+ * @return 0 on success, -1 as soon as `writev` fails.
+ */
+int changeq_write(const change_t *list, changeq_header_fn header,
+                  changeq_writev_fn writev, void *arg);
+
+/**
+ * Skip the first `w` bytes of `*n` iovecs after a short write, moving `*iov`
+ * past the ones written in full.
+ */
+static inline void changeq_iov_advance(struct iovec **iov, int *n, size_t w) {
+    while (*n > 0 && w >= (*iov)->iov_len) {
+        w -= (*iov)->iov_len;
+        (*iov)++;
+        (*n)--;
+    }
+    if (*n > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + w;
+        (*iov)->iov_len -= w;
+    }
+}
+
+#endif
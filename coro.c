@@ -0,0 +1,738 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A small stackful coroutine runtime backed by epoll.
+ *
+ * On x86-64 the context switch is a hand-rolled swap of the callee-saved
+ * registers and the stack pointer, which avoids the sigprocmask system call
+ * that swapcontext(3) makes on every switch. Other architectures fall back to
+ * ucontext.
+ */
+#include "coro.h"
+#include "unixsock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#define CORO_MAX_EVENTS 256
+#define CORO_CACHE_MAX 64
+
+/**************** CONTEXT SWITCHING ****************/
+#if defined(__x86_64__)
+/**
+ * Saved execution context. Everything else lives on the coroutine's own stack.
+ */
+typedef struct {
+    void *sp;
+} coro_ctx_t;
+
+/**
+ * Save the callee-saved registers of the running context onto its stack, store
+ * its stack pointer in `from`, then restore the context saved in `to`.
+ */
+void coro_switch(coro_ctx_t *from, coro_ctx_t *to);
+__asm__(".text\n"
+        ".globl coro_switch\n"
+        ".hidden coro_switch\n"
+        ".type coro_switch, @function\n"
+        "coro_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq (%rsi), %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coro_switch, .-coro_switch\n");
+
+/**
+ * Lay out a fresh stack so that the first switch into it "returns" into entry
+ * with the stack aligned as if entry had been called.
+ */
+static void ctx_make(coro_ctx_t *ctx, void *stack, size_t size,
+                     void (*entry)(void)) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    void **sp = (void **)top;
+    *--sp = NULL;           // Fake return address of entry.
+    *--sp = (void *)entry;  // Popped by the ret in coro_switch.
+    for (int i = 0; i < 6; ++i)
+        *--sp = NULL;       // rbp, rbx, r12-r15.
+    ctx->sp = sp;
+}
+#else
+typedef struct {
+    ucontext_t uc;
+} coro_ctx_t;
+
+static inline void coro_switch(coro_ctx_t *from, coro_ctx_t *to) {
+    swapcontext(&from->uc, &to->uc);
+}
+
+static void ctx_make(coro_ctx_t *ctx, void *stack, size_t size,
+                     void (*entry)(void)) {
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    ctx->uc.uc_link = NULL;
+    makecontext(&ctx->uc, entry, 0);
+}
+#endif
+
+/**************** STRUCTS ****************/
+/**
+ * A single coroutine.
+ *
+ * @param  ctx        Saved context while the coroutine is switched out.
+ * @param  fn         Body of the coroutine.
+ * @param  arg        Argument passed to fn.
+ * @param  map        Base of the stack mapping, including the guard page.
+ * @param  map_size   Length of the stack mapping.
+ * @param  next       Link for the run queue and the free list.
+ * @param  dead       Set once fn has returned.
+ * @param  waiting    Parked on epoll. Cleared by the first event that wakes
+ *                    it, so that a coroutine waiting on several descriptors
+ *                    is queued to run only once.
+ */
+struct Coro {
+    coro_ctx_t ctx;
+    coro_fn_t fn;
+    void *arg;
+    void *map;
+    size_t map_size;
+    struct Coro *next;
+    bool dead;
+    bool waiting;
+};
+
+/**
+ * Pending coroutine handed to a loop from another thread.
+ */
+typedef struct SpawnReq {
+    coro_fn_t fn;
+    void *arg;
+    struct SpawnReq *next;
+} spawn_req_t;
+
+/**
+ * @param  ctx         Scheduler context of the thread running the loop.
+ * @param  epfd        epoll instance for parked coroutines.
+ * @param  evfd        eventfd used to wake the loop when the inbox fills.
+ * @param  stack_size  Usable stack size of each coroutine.
+ * @param  current     Coroutine currently switched in, if any.
+ * @param  ready_head  Run queue (FIFO).
+ * @param  free_list   Finished coroutines kept around to recycle their stacks.
+ * @param  count       Number of live coroutines.
+ * @param  inbox       Spawn requests from other threads.
+ */
+struct CoroLoop {
+    coro_ctx_t ctx;
+    int epfd, evfd;
+    size_t stack_size;
+    coro_t *current;
+    coro_t *ready_head, *ready_tail;
+    coro_t *free_list;
+    size_t nfree;
+    atomic_size_t count;
+    atomic_bool stopping;
+    pthread_mutex_t inbox_mutex;
+    spawn_req_t *inbox;
+};
+
+/**
+ * The loop running on this thread, if any.
+ */
+static __thread coro_loop_t *t_loop;
+
+/**************** RUN QUEUE ****************/
+static void ready_push(coro_loop_t *loop, coro_t *co) {
+    co->next = NULL;
+    if (loop->ready_tail)
+        loop->ready_tail->next = co;
+    else
+        loop->ready_head = co;
+    loop->ready_tail = co;
+}
+
+/**************** COROUTINE LIFETIME ****************/
+/**
+ * First frame of every coroutine. Never returns: once the body finishes, the
+ * coroutine is marked dead and control goes back to the scheduler for good.
+ */
+static void coro_entry(void) {
+    coro_loop_t *loop = t_loop;
+    coro_t *co = loop->current;
+    co->fn(co->arg);
+
+    // Coroutines never migrate between loops, so this is still our loop.
+    co->dead = true;
+    coro_switch(&co->ctx, &loop->ctx);
+    abort();
+}
+
+/**
+ * Allocate a coroutine and its stack. The lowest page of the mapping is a
+ * guard page.
+ */
+static coro_t *coro_alloc(coro_loop_t *loop) {
+    coro_t *co = malloc(sizeof(coro_t));
+    if (co == NULL)
+        return NULL;
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    co->map_size = loop->stack_size + page;
+    co->map = mmap(NULL, co->map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                   0);
+    if (co->map == MAP_FAILED) {
+        free(co);
+        return NULL;
+    }
+    if (mprotect(co->map, page, PROT_NONE) < 0) {
+        munmap(co->map, co->map_size);
+        free(co);
+        return NULL;
+    }
+    return co;
+}
+
+static void coro_destroy(coro_t *co) {
+    munmap(co->map, co->map_size);
+    free(co);
+}
+
+/**
+ * Start a coroutine on the calling thread's loop.
+ */
+static int coro_start(coro_loop_t *loop, coro_fn_t fn, void *arg) {
+    coro_t *co = loop->free_list;
+    if (co != NULL) {
+        loop->free_list = co->next;
+        loop->nfree--;
+    } else if ((co = coro_alloc(loop)) == NULL) {
+        return -1;
+    }
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    co->fn = fn;
+    co->arg = arg;
+    co->dead = false;
+    co->waiting = false;
+    ctx_make(&co->ctx, (char *)co->map + page, co->map_size - page,
+             coro_entry);
+
+    atomic_fetch_add(&loop->count, 1);
+    ready_push(loop, co);
+    return 0;
+}
+
+/**
+ * Recycle the stack of a finished coroutine, or unmap it if the cache is full.
+ */
+static void coro_release(coro_loop_t *loop, coro_t *co) {
+    atomic_fetch_sub(&loop->count, 1);
+    if (loop->nfree >= CORO_CACHE_MAX) {
+        coro_destroy(co);
+        return;
+    }
+    co->next = loop->free_list;
+    loop->free_list = co;
+    loop->nfree++;
+}
+
+/**
+ * Switch into a coroutine and run it until it yields, parks, or finishes.
+ */
+static void loop_resume(coro_loop_t *loop, coro_t *co) {
+    loop->current = co;
+    coro_switch(&loop->ctx, &co->ctx);
+    loop->current = NULL;
+    if (co->dead)
+        coro_release(loop, co);
+}
+
+/**
+ * Start every coroutine queued by other threads.
+ */
+static void loop_drain_inbox(coro_loop_t *loop) {
+    uint64_t ticks;
+    if (read(loop->evfd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+        perror("coro eventfd");
+
+    pthread_mutex_lock(&loop->inbox_mutex);
+    spawn_req_t *req = loop->inbox;
+    loop->inbox = NULL;
+    pthread_mutex_unlock(&loop->inbox_mutex);
+
+    // The inbox is LIFO; reverse it so that connections start in arrival
+    // order.
+    spawn_req_t *fifo = NULL;
+    while (req) {
+        spawn_req_t *next = req->next;
+        req->next = fifo;
+        fifo = req;
+        req = next;
+    }
+    while (fifo) {
+        spawn_req_t *next = fifo->next;
+        if (coro_start(loop, fifo->fn, fifo->arg) < 0)
+            perror("coro_start");
+        free(fifo);
+        fifo = next;
+    }
+}
+
+/**************** PUBLIC INTERFACE ****************/
+coro_loop_t *coro_loop_init(size_t stack_size) {
+    coro_loop_t *loop = calloc(1, sizeof(coro_loop_t));
+    if (loop == NULL)
+        return NULL;
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    loop->stack_size = (stack_size + page - 1) & ~(page - 1);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epfd < 0 || loop->evfd < 0) {
+        coro_loop_free(loop);
+        return NULL;
+    }
+
+    // The eventfd is the only registration whose data pointer is NULL.
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) < 0) {
+        coro_loop_free(loop);
+        return NULL;
+    }
+
+    pthread_mutex_init(&loop->inbox_mutex, NULL);
+    atomic_init(&loop->count, 0);
+    atomic_init(&loop->stopping, false);
+    return loop;
+}
+
+void coro_loop_run(coro_loop_t *loop) {
+    struct epoll_event events[CORO_MAX_EVENTS];
+    t_loop = loop;
+
+    while (1) {
+        // Run everything that is currently runnable. Coroutines that yield
+        // during this pass are picked up on the next one, after polling, so
+        // that a busy coroutine cannot starve I/O.
+        coro_t *batch = loop->ready_head;
+        loop->ready_head = loop->ready_tail = NULL;
+        while (batch) {
+            coro_t *next = batch->next;
+            loop_resume(loop, batch);
+            batch = next;
+        }
+
+        if (atomic_load(&loop->stopping) && atomic_load(&loop->count) == 0) {
+            pthread_mutex_lock(&loop->inbox_mutex);
+            bool idle = (loop->inbox == NULL);
+            pthread_mutex_unlock(&loop->inbox_mutex);
+            if (idle)
+                break;
+        }
+
+        int timeout = (loop->ready_head != NULL) ? 0 : -1;
+        int n = epoll_wait(loop->epfd, events, CORO_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            coro_t *co = events[i].data.ptr;
+            if (co == NULL) {
+                loop_drain_inbox(loop);
+            } else if (co->waiting) {
+                co->waiting = false;
+                ready_push(loop, co);
+            }
+        }
+    }
+
+    t_loop = NULL;
+}
+
+void coro_loop_stop(coro_loop_t *loop) {
+    const uint64_t one = 1;
+    atomic_store(&loop->stopping, true);
+    if (write(loop->evfd, &one, sizeof(one)) < 0)
+        perror("coro eventfd");
+}
+
+void coro_loop_free(coro_loop_t *loop) {
+    while (loop->free_list) {
+        coro_t *next = loop->free_list->next;
+        coro_destroy(loop->free_list);
+        loop->free_list = next;
+    }
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    if (loop->evfd >= 0)
+        close(loop->evfd);
+    free(loop);
+}
+
+int coro_spawn(coro_loop_t *loop, coro_fn_t fn, void *arg) {
+    if (t_loop == loop)
+        return coro_start(loop, fn, arg);
+
+    spawn_req_t *req = malloc(sizeof(spawn_req_t));
+    if (req == NULL)
+        return -1;
+    req->fn = fn;
+    req->arg = arg;
+
+    pthread_mutex_lock(&loop->inbox_mutex);
+    req->next = loop->inbox;
+    loop->inbox = req;
+    pthread_mutex_unlock(&loop->inbox_mutex);
+
+    // Once queued, the request is the loop's: a failed wakeup must not tell
+    // the caller to clean up after a coroutine that will still run. EAGAIN
+    // means the counter is full, so the loop is due to wake anyway.
+    const uint64_t one = 1;
+    if (write(loop->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("coro eventfd");
+    return 0;
+}
+
+coro_t *coro_self(void) {
+    return t_loop ? t_loop->current : NULL;
+}
+
+size_t coro_loop_count(coro_loop_t *loop) {
+    return atomic_load(&loop->count);
+}
+
+void coro_yield(void) {
+    coro_t *co = coro_self();
+    if (co == NULL)
+        return;
+    ready_push(t_loop, co);
+    coro_switch(&co->ctx, &t_loop->ctx);
+}
+
+/**
+ * @brief Register a one-shot wakeup of `co` for events on fd.
+ */
+static int arm_fd(coro_loop_t *loop, coro_t *co, int fd, uint32_t events) {
+    struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = co};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT ||
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Drop the registrations of the first `nfds` descriptors. They are
+ * deleted rather than modified to no events, since EPOLL_CTL_MOD always adds
+ * EPOLLERR and EPOLLHUP back: an error on the descriptor would then wake the
+ * loop on every wait, pointing at a coroutine that may be gone. arm_fd adds
+ * them again when they are next waited on.
+ */
+static void disarm_fds(coro_loop_t *loop, const struct pollfd *fds,
+                       nfds_t nfds) {
+    for (nfds_t i = 0; i < nfds; ++i)
+        if (fds[i].fd >= 0)
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+}
+
+void coro_forget_fd(int fd) {
+    if (t_loop)
+        epoll_ctl(t_loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * @brief Park the current coroutine until fd becomes ready.
+ *
+ * Registrations are one-shot and stay in the epoll set (disarmed) after they
+ * fire, so the next wait on the same descriptor is a single EPOLL_CTL_MOD.
+ * Closing the descriptor removes it from the set.
+ *
+ * @return 0 once the descriptor is ready.
+ * @return -1 if the descriptor could not be waited on.
+ */
+int coro_wait_fd(int fd, uint32_t events) {
+    coro_t *co = coro_self();
+    if (co == NULL) {
+        struct pollfd pfd = {.fd = fd, .events = 0};
+        if (events & EPOLLIN)
+            pfd.events |= POLLIN;
+        if (events & EPOLLOUT)
+            pfd.events |= POLLOUT;
+        while (poll(&pfd, 1, -1) < 0)
+            if (errno != EINTR)
+                return -1;
+        return 0;
+    }
+
+    if (arm_fd(t_loop, co, fd, events) < 0)
+        return -1;
+    co->waiting = true;
+    coro_switch(&co->ctx, &t_loop->ctx);
+    return 0;
+}
+
+/**
+ * @brief Park the current coroutine until any of the descriptors is ready,
+ * then fill in revents with a non-blocking poll(2).
+ *
+ * Registrations that did not fire are disarmed before returning, so none of
+ * them can wake the coroutine later while it waits on something else.
+ */
+int coro_poll(struct pollfd *fds, nfds_t nfds) {
+    coro_t *co = coro_self();
+    if (co == NULL) {
+        while (poll(fds, nfds, -1) < 0)
+            if (errno != EINTR)
+                return -1;
+        return 0;
+    }
+
+    for (nfds_t i = 0; i < nfds; ++i) {
+        uint32_t events = 0;
+        if (fds[i].events & POLLIN)
+            events |= EPOLLIN | EPOLLRDHUP;
+        if (fds[i].events & POLLOUT)
+            events |= EPOLLOUT;
+        if (fds[i].fd >= 0 && arm_fd(t_loop, co, fds[i].fd, events) < 0) {
+            disarm_fds(t_loop, fds, i);
+            return -1;
+        }
+    }
+    co->waiting = true;
+    coro_switch(&co->ctx, &t_loop->ctx);
+    disarm_fds(t_loop, fds, nfds);
+
+    while (poll(fds, nfds, 0) < 0)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+/**************** COROUTINE-AWARE RIO ****************/
+/**
+ * read(2) that parks the coroutine instead of failing with EAGAIN.
+ */
+static ssize_t co_read(int fd, void *buf, size_t n) {
+    ssize_t rc;
+    while ((rc = read(fd, buf, n)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (coro_wait_fd(fd, EPOLLIN) < 0)
+            return -1;
+    }
+    return rc;
+}
+
+ssize_t co_rio_writen(int fd, const void *usrbuf, size_t n) {
+    size_t nleft = n;
+    const char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        ssize_t nwritten = write(fd, bufp, nleft);
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if (coro_wait_fd(fd, EPOLLOUT) < 0)
+                return -1;
+            continue;
+        }
+        nleft -= nwritten;
+        bufp += nwritten;
+    }
+    return n;
+}
+
+/**
+ * readv(2) that parks the coroutine instead of failing with EAGAIN.
+ */
+static ssize_t co_readv(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t rc;
+    while ((rc = readv(fd, iov, iovcnt)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (coro_wait_fd(fd, EPOLLIN) < 0)
+            return -1;
+    }
+    return rc;
+}
+
+ssize_t co_rio_peekb(rio_t *rp, const void **bufp) {
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = co_read(rp->rio_fd, rp->rio_base, rp->rio_size);
+        if (rp->rio_cnt <= 0)
+            return rp->rio_cnt;
+        rp->rio_bufptr = rp->rio_base;
+    }
+    *bufp = rp->rio_bufptr;
+    return rp->rio_cnt;
+}
+
+ssize_t co_rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
+    size_t nleft = n;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if (rp->rio_cnt > 0) {
+            const size_t cnt =
+                (size_t)rp->rio_cnt < nleft ? (size_t)rp->rio_cnt : nleft;
+            memcpy(bufp, rp->rio_bufptr, cnt);
+            rio_consumeb(rp, cnt);
+            nleft -= cnt;
+            bufp += cnt;
+            continue;
+        }
+
+        // Straight into the caller's memory, the surplus into the buffer.
+        struct iovec iov[2] = {{.iov_base = bufp, .iov_len = nleft},
+                               {.iov_base = rp->rio_base,
+                                .iov_len = rp->rio_size}};
+        ssize_t nread = co_readv(rp->rio_fd, iov, 2);
+        if (nread < 0)
+            return -1;
+        if (nread == 0)
+            break;
+        if ((size_t)nread > nleft) {
+            rp->rio_bufptr = rp->rio_base;
+            rp->rio_cnt = nread - nleft;
+            nread = nleft;
+        }
+        nleft -= nread;
+        bufp += nread;
+    }
+    return n - nleft;
+}
+
+ssize_t co_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    char *bufp = usrbuf;
+    size_t n = 0;
+
+    while (n + 1 < maxlen) {
+        const void *src;
+        const ssize_t avail = co_rio_peekb(rp, &src);
+        if (avail < 0)
+            return -1;
+        if (avail == 0)
+            break;
+        size_t cnt = maxlen - 1 - n;
+        if ((size_t)avail < cnt)
+            cnt = avail;
+        const char *nl = memchr(src, '\n', cnt);
+        if (nl)
+            cnt = nl - (const char *)src + 1;
+        memcpy(bufp + n, src, cnt);
+        rio_consumeb(rp, cnt);
+        n += cnt;
+        if (nl)
+            break;
+    }
+    bufp[n] = '\0';
+    return n;
+}
+
+/**
+ * @brief Connect to the UNIX socket `path`. There is no handshake to wait
+ * for: the connection is queued on the listener right away, or fails if its
+ * backlog is full.
+ */
+static int co_open_unixfd(const char *path) {
+    if (coro_self() == NULL)
+        return unixsock_connect(path);
+
+    struct sockaddr_un sun;
+    socklen_t len;
+    if (unixsock_addr(path, &sun, &len) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, len) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Connect to hostname:port without blocking the loop on the TCP
+ * handshake. Name resolution still blocks, as getaddrinfo(3) has no
+ * non-blocking interface. Origins routed to a UNIX socket are connected to
+ * there instead (cf. unixsock_route).
+ *
+ * Outside of a coroutine this is plain open_clientfd.
+ *
+ * @return A connected, non-blocking socket.
+ * @return -2 if name resolution failed, -1 for any other error.
+ */
+int co_open_clientfd(const char *hostname, const char *port) {
+    const char *path = unixsock_route(hostname, port);
+    if (path)
+        return co_open_unixfd(path);
+    if (coro_self() == NULL)
+        return open_clientfd(hostname, port);
+
+    struct addrinfo hints, *listp, *p;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(hostname, port, &hints, &listp) != 0)
+        return -2;
+
+    int clientfd = -1;
+    for (p = listp; p; p = p->ai_next) {
+        clientfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                          p->ai_protocol);
+        if (clientfd < 0)
+            continue;
+
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        if (errno == EINPROGRESS && coro_wait_fd(clientfd, EPOLLOUT) == 0) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+                err == 0)
+                break;
+        }
+        close(clientfd);
+        clientfd = -1;
+    }
+
+    freeaddrinfo(listp);
+    return clientfd;
+}
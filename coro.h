@@ -0,0 +1,112 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A small stackful coroutine runtime. Each event loop owns one thread, an epoll
+ * instance and a run queue of coroutines. Coroutines run straight-line blocking
+ * style code; whenever a socket would block, the coroutine parks itself on the
+ * loop's epoll instance and the loop switches to the next runnable coroutine.
+ *
+ * Stacks are mmap'd with a PROT_NONE guard page below them, so an overflow
+ * faults instead of silently trampling a neighbouring stack. Only the pages a
+ * coroutine actually touches are backed by memory.
+ *
+ * The co_* I/O functions mirror the RIO package from csapp.h. Inside a
+ * coroutine they are yield points; outside of one they behave exactly like
+ * their RIO counterparts, which lets the relay code run unchanged in either
+ * mode.
+ */
+#ifndef CORO_H
+#define CORO_H
+
+#include "csapp.h"
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Default usable stack size for a coroutine. This has to accommodate the
+ * proxy's relay path, which keeps a full object buffer on the stack.
+ */
+#define CORO_STACK_SIZE (256 * 1024)
+
+typedef struct Coro coro_t;
+typedef struct CoroLoop coro_loop_t;
+typedef void (*coro_fn_t)(void *arg);
+
+/**
+ * Create an event loop. The loop is not bound to a thread until coro_loop_run
+ * is called from it.
+ */
+coro_loop_t *coro_loop_init(size_t stack_size);
+
+/**
+ * Run the event loop on the calling thread. Returns once coro_loop_stop has
+ * been called and all coroutines have finished.
+ */
+void coro_loop_run(coro_loop_t *loop);
+
+/**
+ * Ask the loop to exit once it is out of coroutines. Thread-safe.
+ */
+void coro_loop_stop(coro_loop_t *loop);
+
+/**
+ * Free the loop. Must only be called after coro_loop_run has returned.
+ */
+void coro_loop_free(coro_loop_t *loop);
+
+/**
+ * Start a coroutine on the loop. Thread-safe: when called from another thread
+ * the coroutine is handed to the loop through its inbox.
+ *
+ * @return 0 once the coroutine is started or queued, -1 if it could not be,
+ *         in which case it never runs and `arg` is still the caller's.
+ */
+int coro_spawn(coro_loop_t *loop, coro_fn_t fn, void *arg);
+
+/**
+ * Return the coroutine running on this thread, or NULL if the caller is not a
+ * coroutine.
+ */
+coro_t *coro_self(void);
+
+/**
+ * Put the current coroutine at the back of the run queue.
+ */
+void coro_yield(void);
+
+/**
+ * Block the current coroutine until fd is ready for the given epoll events.
+ * Outside of a coroutine this falls back to poll(2).
+ */
+int coro_wait_fd(int fd, uint32_t events);
+
+/**
+ * Block the current coroutine until any of the descriptors is ready, like
+ * poll(2) without a timeout; revents is filled in on return. Outside of a
+ * coroutine this is poll(2).
+ */
+int coro_poll(struct pollfd *fds, nfds_t nfds);
+
+/**
+ * Remove fd from the current loop's epoll set before it is handed to another
+ * thread or loop, which may wait on it elsewhere. Outside of a loop, this
+ * does nothing.
+ */
+void coro_forget_fd(int fd);
+
+/**
+ * Number of coroutines currently alive on the loop.
+ */
+size_t coro_loop_count(coro_loop_t *loop);
+
+/* Coroutine-aware counterparts of the RIO package. */
+ssize_t co_rio_writen(int fd, const void *usrbuf, size_t n);
+ssize_t co_rio_peekb(rio_t *rp, const void **bufp);
+ssize_t co_rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t co_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+int co_open_clientfd(const char *hostname, const char *port);
+
+#endif
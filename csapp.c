@@ -0,0 +1,459 @@
+/**
+ * @author Jonathan Helland
+ *
+ * In-tree implementation of the CS:APP3e library declared in csapp.h: the
+ * RIO package, the SIO printf family, the allocation and signal wrappers, and
+ * open_clientfd/open_listenfd. It behaves as the course's version does, so
+ * that the proxy builds and runs outside of the course environment.
+ */
+#include "csapp.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**************** SIGNAL WRAPPERS ****************/
+handler_t *Signal(int signum, handler_t *handler) {
+    struct sigaction action, old_action;
+
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask); // Block sigs of type being handled.
+    action.sa_flags = SA_RESTART; // Restart syscalls if possible.
+
+    if (sigaction(signum, &action, &old_action) < 0) {
+        perror("Signal error");
+        exit(EXIT_FAILURE);
+    }
+    return old_action.sa_handler;
+}
+
+/**************** SIO (SIGNAL-SAFE I/O) ****************/
+/**
+ * Output buffer of the SIO formatter, flushed with write(2) when full.
+ */
+typedef struct {
+    int fd;
+    size_t len;
+    ssize_t total;
+    char buf[256];
+} sio_out_t;
+
+static void sio_flush(sio_out_t *out) {
+    if (out->len > 0 && out->total >= 0 &&
+        rio_writen(out->fd, out->buf, out->len) < 0)
+        out->total = -1;
+    else if (out->total >= 0)
+        out->total += out->len;
+    out->len = 0;
+}
+
+static void sio_putc(sio_out_t *out, char c) {
+    if (out->len == sizeof(out->buf))
+        sio_flush(out);
+    out->buf[out->len++] = c;
+}
+
+static void sio_puts(sio_out_t *out, const char *s) {
+    while (*s)
+        sio_putc(out, *s++);
+}
+
+static void sio_putu(sio_out_t *out, uintmax_t v, unsigned base) {
+    char digits[sizeof(uintmax_t) * 8];
+    size_t n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v > 0);
+    while (n > 0)
+        sio_putc(out, digits[--n]);
+}
+
+/**
+ * @brief printf without locks or allocation, hence safe in signal handlers.
+ *
+ * Supports the conversions %c, %s, %d, %i, %u, %x, %p and %%, with the length
+ * modifiers l, ll and z; flags, widths and precisions are not supported.
+ */
+ssize_t sio_vdprintf(int fileno, const char *fmt, va_list argp) {
+    sio_out_t out = {.fd = fileno};
+    for (const char *p = fmt; *p; ++p) {
+        if (*p != '%') {
+            sio_putc(&out, *p);
+            continue;
+        }
+        int longs = 0;
+        bool size = false;
+        for (++p; *p == 'l' || *p == 'z'; ++p) {
+            if (*p == 'l')
+                ++longs;
+            else
+                size = true;
+        }
+        switch (*p) {
+        case 'c':
+            sio_putc(&out, (char)va_arg(argp, int));
+            break;
+        case 's': {
+            const char *s = va_arg(argp, const char *);
+            sio_puts(&out, s ? s : "(null)");
+            break;
+        }
+        case 'd':
+        case 'i': {
+            intmax_t v = size        ? va_arg(argp, ssize_t)
+                         : longs > 1 ? va_arg(argp, long long)
+                         : longs     ? va_arg(argp, long)
+                                     : va_arg(argp, int);
+            if (v < 0)
+                sio_putc(&out, '-');
+            sio_putu(&out, v < 0 ? -(uintmax_t)v : (uintmax_t)v, 10);
+            break;
+        }
+        case 'u':
+        case 'x': {
+            uintmax_t v = size        ? va_arg(argp, size_t)
+                          : longs > 1 ? va_arg(argp, unsigned long long)
+                          : longs     ? va_arg(argp, unsigned long)
+                                      : va_arg(argp, unsigned);
+            sio_putu(&out, v, *p == 'x' ? 16 : 10);
+            break;
+        }
+        case 'p':
+            sio_puts(&out, "0x");
+            sio_putu(&out, (uintptr_t)va_arg(argp, void *), 16);
+            break;
+        case '%':
+            sio_putc(&out, '%');
+            break;
+        default:
+            // Unsupported conversion: print it as it was given.
+            sio_putc(&out, '%');
+            if (*p == '\0')
+                --p;
+            else
+                sio_putc(&out, *p);
+        }
+    }
+    sio_flush(&out);
+    return out.total;
+}
+
+ssize_t sio_dprintf(int fileno, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_vdprintf(fileno, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+ssize_t sio_printf(const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_vdprintf(STDOUT_FILENO, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+ssize_t sio_eprintf(const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    ssize_t ret = sio_vdprintf(STDERR_FILENO, fmt, argp);
+    va_end(argp);
+    return ret;
+}
+
+void __sio_assert_fail(const char *assertion, const char *file,
+                       unsigned int line, const char *function) {
+    sio_eprintf("%s: %s:%u: %s: Assertion `%s' failed.\n", __progname, file,
+                line, function, assertion);
+    abort();
+}
+
+/**************** DYNAMIC STORAGE ALLOCATION WRAPPERS ****************/
+void *Malloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL && size != 0) {
+        perror("Malloc error");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void *Realloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p == NULL && size != 0) {
+        perror("Realloc error");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void *Calloc(size_t nmemb, size_t size) {
+    void *p = calloc(nmemb, size);
+    if (p == NULL && nmemb != 0 && size != 0) {
+        perror("Calloc error");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void Free(void *ptr) {
+    free(ptr);
+}
+
+/**************** RIO (ROBUST I/O) ****************/
+/**
+ * @brief Read up to `n` bytes, unbuffered, retrying after signals.
+ *
+ * @return The number of bytes read, short only at EOF, or -1 on error.
+ */
+ssize_t rio_readn(int fd, void *usrbuf, size_t n) {
+    size_t nleft = n;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        ssize_t nread = read(fd, bufp, nleft);
+        if (nread < 0) {
+            if (errno != EINTR)
+                return -1;
+            nread = 0;
+        } else if (nread == 0) {
+            break; // EOF
+        }
+        nleft -= nread;
+        bufp += nread;
+    }
+    return n - nleft;
+}
+
+/**
+ * @brief Write all `n` bytes, unbuffered, retrying after signals.
+ *
+ * @return `n`, or -1 on error.
+ */
+ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
+    size_t nleft = n;
+    const char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        ssize_t nwritten = write(fd, bufp, nleft);
+        if (nwritten <= 0) {
+            if (nwritten < 0 && errno == EINTR)
+                nwritten = 0;
+            else
+                return -1;
+        }
+        nleft -= nwritten;
+        bufp += nwritten;
+    }
+    return n;
+}
+
+/**
+ * @brief Refill the internal buffer of `rp` with one read if it is empty.
+ *
+ * @return The number of unread bytes in the buffer, 0 at EOF or -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp) {
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_base, rp->rio_size);
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR)
+                return -1;
+        } else if (rp->rio_cnt == 0) {
+            return 0; // EOF
+        } else {
+            rp->rio_bufptr = rp->rio_base;
+        }
+    }
+    return rp->rio_cnt;
+}
+
+void rio_readinitb(rio_t *rp, int fd) {
+    rio_readinitb_buf(rp, fd, rp->rio_buf, sizeof(rp->rio_buf));
+}
+
+void rio_readinitb_buf(rio_t *rp, int fd, void *buf, size_t size) {
+    rp->rio_fd = fd;
+    rp->rio_cnt = 0;
+    rp->rio_base = rp->rio_bufptr = buf;
+    rp->rio_size = size;
+}
+
+ssize_t rio_peekb(rio_t *rp, const void **bufp) {
+    const ssize_t n = rio_fill(rp);
+    if (n > 0)
+        *bufp = rp->rio_bufptr;
+    return n;
+}
+
+void rio_consumeb(rio_t *rp, size_t n) {
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
+/**
+ * @brief Read up to `n` bytes through the buffer of `rp`. Once the buffer is
+ * drained, the rest is read straight into `usrbuf`, and what follows it into
+ * the buffer, with a single readv(2) per round.
+ *
+ * @return The number of bytes read, short only at EOF, or -1 on error.
+ */
+ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
+    size_t nleft = n;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if (rp->rio_cnt > 0) {
+            const size_t cnt =
+                (size_t)rp->rio_cnt < nleft ? (size_t)rp->rio_cnt : nleft;
+            memcpy(bufp, rp->rio_bufptr, cnt);
+            rio_consumeb(rp, cnt);
+            nleft -= cnt;
+            bufp += cnt;
+            continue;
+        }
+
+        struct iovec iov[2] = {{.iov_base = bufp, .iov_len = nleft},
+                               {.iov_base = rp->rio_base,
+                                .iov_len = rp->rio_size}};
+        ssize_t nread = readv(rp->rio_fd, iov, 2);
+        if (nread < 0) {
+            if (errno != EINTR)
+                return -1;
+            continue;
+        }
+        if (nread == 0)
+            break; // EOF
+        if ((size_t)nread > nleft) {
+            rp->rio_bufptr = rp->rio_base;
+            rp->rio_cnt = nread - nleft;
+            nread = nleft;
+        }
+        nleft -= nread;
+        bufp += nread;
+    }
+    return n - nleft;
+}
+
+/**
+ * @brief Read a line of at most `maxlen - 1` bytes, newline included, through
+ * the buffer of `rp`, and NUL-terminate it. Lines are found with memchr in
+ * the buffer and copied out whole.
+ *
+ * @return The number of bytes read, 0 at EOF or -1 on error.
+ */
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    char *bufp = usrbuf;
+    size_t n = 0;
+
+    while (n + 1 < maxlen) {
+        const void *src;
+        const ssize_t avail = rio_peekb(rp, &src);
+        if (avail < 0)
+            return -1;
+        if (avail == 0)
+            break; // EOF
+        size_t cnt = maxlen - 1 - n;
+        if ((size_t)avail < cnt)
+            cnt = avail;
+        const char *nl = memchr(src, '\n', cnt);
+        if (nl)
+            cnt = nl - (const char *)src + 1;
+        memcpy(bufp + n, src, cnt);
+        rio_consumeb(rp, cnt);
+        n += cnt;
+        if (nl)
+            break;
+    }
+    bufp[n] = '\0';
+    return n;
+}
+
+/**************** CLIENT/SERVER HELPERS ****************/
+/**
+ * @brief Open a connection to `hostname:port`, trying every address it
+ * resolves to in turn.
+ *
+ * @return The connected descriptor, -2 if the name did not resolve or -1 if
+ *         no address accepted the connection.
+ */
+int open_clientfd(const char *hostname, const char *port) {
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM,
+                             .ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG};
+    struct addrinfo *listp;
+    if (getaddrinfo(hostname, port, &hints, &listp) != 0)
+        return -2;
+
+    int clientfd = -1;
+    for (struct addrinfo *p = listp; p; p = p->ai_next) {
+        clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (clientfd < 0)
+            continue;
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(clientfd);
+        clientfd = -1;
+    }
+    freeaddrinfo(listp);
+    return clientfd;
+}
+
+/**
+ * @brief Open a socket listening on `port` of every local address.
+ *
+ * @return The listening descriptor, -2 if the port did not resolve or -1 on
+ *         any other error.
+ */
+/**
+ * @brief Listen on the first of the addresses of `host` that binds, with
+ * `flags` for getaddrinfo.
+ */
+static int listen_on(const char *host, const char *port, int flags) {
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM,
+                             .ai_flags = flags | AI_NUMERICSERV};
+    struct addrinfo *listp;
+    if (getaddrinfo(host, port, &hints, &listp) != 0)
+        return -2;
+
+    int listenfd = -1;
+    const int optval = 1;
+    for (struct addrinfo *p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listenfd < 0)
+            continue;
+        // Rebind at once after a restart rather than wait out TIME_WAIT.
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                   sizeof(optval));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    if (listenfd < 0)
+        return -1;
+
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+int open_listenfd(const char *port) {
+    return listen_on(NULL, port, AI_PASSIVE | AI_ADDRCONFIG);
+}
+
+int open_listenfd_at(const char *host, const char *port) {
+    return listen_on(host, port, AI_PASSIVE);
+}
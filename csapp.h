@@ -52,7 +52,9 @@ typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     ssize_t rio_cnt;           /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_base;            /* Internal buf: rio_buf or the caller's */
+    size_t rio_size;           /* Size of the internal buf */
+    char rio_buf[RIO_BUFSIZE]; /* Default internal buffer */
 } rio_t;
 
 /* External variables */
@@ -97,8 +99,27 @@ void rio_readinitb(rio_t *rp, int fd);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
+/*
+ * Zero-copy additions to the Rio package. rio_readinitb_buf reads through the
+ * caller's buffer of `size` bytes instead of rio_buf. rio_peekb points *bufp
+ * at the unread bytes of the internal buffer, refilling it if it is empty, and
+ * returns how many there are (0 at EOF, -1 on error); rio_consumeb marks `n`
+ * of them as read. Whenever the internal buffer is empty, rio_readnb reads
+ * straight into the caller's memory, with one readv(2) that also refills the
+ * internal buffer with whatever follows.
+ */
+void rio_readinitb_buf(rio_t *rp, int fd, void *buf, size_t size);
+ssize_t rio_peekb(rio_t *rp, const void **bufp);
+void rio_consumeb(rio_t *rp, size_t n);
+
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(const char *hostname, const char *port);
 int open_listenfd(const char *port);
 
+/*
+ * open_listenfd on the addresses of `host` alone, e.g. "127.0.0.1" to accept
+ * connections from the local host only.
+ */
+int open_listenfd_at(const char *host, const char *port);
+
 #endif /* CSAPP_H */
@@ -4,6 +4,11 @@
 #include "test_list.c"
 #include "test_hashmap.c"
 #include "test_cache.c"
+#include "test_wsdeque.c"
+#include "test_spill.c"
+#include "test_rio.c"
+#include "test_ntcopy.c"
+#include "test_repl.c"
 
 #include <assert.h>
 #include <stdio.h>
@@ -17,6 +22,21 @@ int main(void) {
 
     assert( run_test_list() == EXIT_SUCCESS );
     printf("\n");
+
+    assert( run_test_wsdeque() == EXIT_SUCCESS );
+    printf("\n");
+
+    assert( run_test_spill() == EXIT_SUCCESS );
+    printf("\n");
+
+    assert( run_test_rio() == EXIT_SUCCESS );
+    printf("\n");
+
+    assert( run_test_ntcopy() == EXIT_SUCCESS );
+    printf("\n");
+
+    assert( run_test_repl() == EXIT_SUCCESS );
+    printf("\n");
 }
 
 #endif
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,10 @@
 #define CACHE_SIZE (64)
 #define BLOCK_SIZE (32)
 
+static bool match_key(const block_t *block, void *arg) {
+    return strcmp(block->key, arg) == 0;
+}
+
 int run_test_cache(void) {
     printf("Testing cache...\n");
 
@@ -19,30 +24,48 @@ int run_test_cache(void) {
     cache_free(cache);
     printf("\tinit OK\n");
 
-    pthread_cond_t cond;
-    pthread_mutex_t mut;
-
     cache = cache_init(16);
     char *mem = malloc(16);
-    int res = cache_insert(cache, "abc", 4, mem, 17, &cond, &mut);
+    int res = cache_insert(cache, "abc", 4, mem, 17);
     assert(res == -1);
-    cache_insert(cache, "abc", 4, mem, 16, &cond, &mut);
+    cache_insert(cache, "abc", 4, mem, 16);
     assert(cache->size == 16);
-    cache_insert(cache, "cba", 4, mem, 16, &cond, &mut);
+    cache_insert(cache, "cba", 4, mem, 16);
     assert(cache->size == 16);
-    assert(cache_find(cache, "abc", 4, &mut) == NULL);
+    assert(cache_find(cache, "abc", 4) == NULL);
     printf("\tinsert OK\n");
 
-    block_t *block = cache_find(cache, "cba", 4, &mut);
+    block_t *block = cache_find(cache, "cba", 4);
     assert(memcmp(block->value, mem, 16) == 0);
     assert(block->refcount == 1);
-    cache_release(cache, "cba", 4, &cond);
+    cache_release(cache, block);
     assert(block->refcount == 0);
     cache_delete(cache, block);
     assert(cache->size == 0);
     printf("\tdelete OK\n");
 
     cache_free(cache);
+
+    // Removing the most recently used entry moves the LRU head along.
+    cache = cache_init(64);
+    cache_insert(cache, "a", 2, mem, 16);
+    cache_insert(cache, "b", 2, mem, 16);
+    assert(cache_purge(cache, match_key, "b") == 1);
+    cache_insert(cache, "c", 2, mem, 16);
+    assert(cache->lru_list->length == 2);
+    block = cache_find(cache, "c", 2);
+    assert(block != NULL && cache->lru_list->head->value == block);
+    cache_release(cache, block);
+    assert(cache_delete(cache, block) == 0);
+    cache_insert(cache, "d", 2, mem, 16);
+    assert((block = cache_find(cache, "a", 2)) != NULL);
+    cache_release(cache, block);
+    assert((block = cache_find(cache, "d", 2)) != NULL);
+    cache_release(cache, block);
+    assert(cache->lru_list->length == 2 && cache->size == 32);
+    cache_free(cache);
+    printf("\tdelete head OK\n");
+
     free(mem);
 
     cache = cache_init(CACHE_SIZE);
@@ -57,10 +80,10 @@ int run_test_cache(void) {
         keys[i] = key;
 
         mem2[i] = malloc(10);
-        strncpy(mem2[i], "aaa", sizeof("aaa"));
+        strncpy(mem2[i], "aaa", 10);
 
         cache_insert(cache, keys[i], strlen(keys[i]) + 1, mem2[i],
-                     10, &cond, &mut);
+                     10);
         printf("cache->size %zu\n", cache->size);
         free(key);
         free(mem2[i]);
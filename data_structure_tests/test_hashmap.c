@@ -19,7 +19,8 @@ int run_test_hashmap(void) {
     printf("\tinit OK\n");
 
     map = hashmap_init(1);
-    void *a, *b, *c, *d;
+    int va, vb, vc, vd;
+    void *a = &va, *b = &vb, *c = &vc, *d = &vd;
     const char *k1 = "aa", *k2 = "ab", *k3 = "ac", *k4 = "ad";
 
     hashmap_insert(map, k1, strlen(k1), a);
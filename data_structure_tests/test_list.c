@@ -20,10 +20,12 @@ int run_test_list(void) {
    n3 = list_insert(list, &c);
    n4 = list_insert(list, &d);
    assert(list->length == 4);
+   assert(list->head == n4);
    printf("\tinsertion OK\n");
 
    node_t *n = list_find(list, &a);
    assert( n == n1 );
+   assert( list_find(list, &b) == n2 );
    printf("\tfind OK\n");
 
    list_delete(list, n3);
@@ -0,0 +1,51 @@
+#ifndef TEST_NTCOPY_C
+#define TEST_NTCOPY_C
+
+#include "ntcopy.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NTCOPY_TEST_LEN (64 * 1024)
+
+int run_test_ntcopy(void) {
+    printf("Testing ntcopy (%s)...\n", ntcopy_kernel());
+
+    char *src = malloc(NTCOPY_TEST_LEN + 64);
+    char *dst = malloc(NTCOPY_TEST_LEN + 64);
+    for (size_t i = 0; i < NTCOPY_TEST_LEN + 64; ++i)
+        src[i] = (char)(i * 31 + 7);
+
+    // Every alignment of either side, and lengths around the kernels' steps,
+    // with the bytes around the copy left alone.
+    ntcopy_set_threshold(NTCOPY_MIN);
+    const size_t lens[] = {0, 1, 255, 256, 257, 300, 4095, 4096, 4097,
+                           NTCOPY_TEST_LEN - 1};
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l)
+        for (size_t so = 0; so < 32; so += 3)
+            for (size_t d = 0; d < 32; d += 5) {
+                memset(dst, 0, NTCOPY_TEST_LEN + 64);
+                assert( ntcopy(dst + d, src + so, lens[l]) == dst + d );
+                assert( memcmp(dst + d, src + so, lens[l]) == 0 );
+                for (size_t i = 0; i < d; ++i)
+                    assert( dst[i] == 0 );
+                assert( dst[d + lens[l]] == 0 );
+            }
+    printf("\talignments and lengths OK\n");
+
+    // Off, every copy is a memcpy.
+    ntcopy_set_threshold(0);
+    assert( ntcopy(dst, src, NTCOPY_TEST_LEN) == dst );
+    assert( memcmp(dst, src, NTCOPY_TEST_LEN) == 0 );
+    ntcopy_set_threshold(NTCOPY_DEFAULT_THRESHOLD);
+    printf("\tthreshold OK\n");
+
+    free(src);
+    free(dst);
+    printf("test_ntcopy OK\n");
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef TEST_REPL_C
+#define TEST_REPL_C
+
+#include "repl.h"
+#include "cache.h"
+#include "plock.h"
+#include "csapp.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPL_TEST_WAIT_MS (5000)
+
+/**
+ * Write one record for `key` (NUL included) to a standby, with `size` bytes
+ * of `value` for insertions.
+ */
+static void repl_test_record(int fd, uint32_t type, const char *key,
+                             const char *value, size_t size) {
+    repl_record_t rec = {
+        .type = type,
+        .keylen = strlen(key) + 1,
+        .size = size,
+    };
+    assert( rio_writen(fd, &rec, sizeof(rec)) == sizeof(rec) );
+    assert( rio_writen(fd, key, rec.keylen) == (ssize_t)rec.keylen );
+    if (size)
+        assert( rio_writen(fd, value, size) == (ssize_t)size );
+}
+
+/**
+ * Wait until the standby has applied the insertion of `key`.
+ */
+static void repl_test_wait(cache_t *cache, plock_t *lock, const char *key) {
+    const struct timespec tick = {.tv_nsec = 1000000};
+    for (int i = 0; i < REPL_TEST_WAIT_MS; ++i) {
+        plock_lock(lock);
+        block_t *block = cache_find(cache, key, strlen(key) + 1);
+        if (block)
+            cache_release(cache, block);
+        plock_unlock(lock);
+        if (block)
+            return;
+        nanosleep(&tick, NULL);
+    }
+    assert( !"standby never applied the stream" );
+}
+
+int run_test_repl(void) {
+    printf("Testing repl...\n");
+
+    cache_t *cache = cache_init(1024);
+    plock_t lock;
+    plock_init(&lock, "test_repl");
+    char addr[64];
+    snprintf(addr, sizeof(addr), "@test_repl-%d", (int)getpid());
+    assert( repl_start_standby(addr, cache, &lock) == 0 );
+    printf("\tstandby OK\n");
+
+    // Evicting the standby's most recently used key, then inserting.
+    const char value[16] = "0123456789abcde";
+    int fd = repl_open(addr);
+    assert( fd >= 0 );
+    repl_test_record(fd, REPL_INSERT, "a", value, sizeof(value));
+    repl_test_record(fd, REPL_INSERT, "b", value, sizeof(value));
+    repl_test_record(fd, REPL_EVICT, "b", NULL, 0);
+    repl_test_record(fd, REPL_INSERT, "c", value, sizeof(value));
+    repl_test_wait(cache, &lock, "c");
+
+    plock_lock(&lock);
+    block_t *block = cache_find(cache, "b", 2);
+    assert( block == NULL );
+    assert( cache->lru_list->length == 2 && cache->size == 32 );
+    plock_unlock(&lock);
+    printf("\tevict most recent OK\n");
+
+    // A clear drops everything, head included, and inserts still work.
+    repl_test_record(fd, REPL_CLEAR, "", NULL, 0);
+    repl_test_record(fd, REPL_INSERT, "d", value, sizeof(value));
+    repl_test_wait(cache, &lock, "d");
+    plock_lock(&lock);
+    assert( cache->lru_list->length == 1 && cache->size == 16 );
+    plock_unlock(&lock);
+    close(fd);
+    printf("\tclear OK\n");
+
+    printf("test_repl OK\n");
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef TEST_RIO_C
+#define TEST_RIO_C
+
+#include "csapp.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RIO_TEST_BUFSIZE (64)
+#define RIO_TEST_LEN (4096)
+
+/**
+ * A socket whose peer already sent `len` bytes of `data` and hung up.
+ */
+static int rio_test_socket(const char *data, size_t len) {
+    int fds[2];
+    assert( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0 );
+    assert( rio_writen(fds[0], data, len) == (ssize_t)len );
+    close(fds[0]);
+    return fds[1];
+}
+
+int run_test_rio(void) {
+    printf("Testing rio...\n");
+
+    char in[RIO_TEST_LEN], out[RIO_TEST_LEN + 1];
+    for (size_t i = 0; i < sizeof(in); ++i)
+        in[i] = 'a' + i % 26;
+    memcpy(in, "GET / HTTP/1.0\r\nHost: x\r\n\r\n", 27);
+
+    // Lines come out whole, then the body reads straight through.
+    rio_t rio;
+    int fd = rio_test_socket(in, sizeof(in));
+    rio_readinitb(&rio, fd);
+    assert( rio_readlineb(&rio, out, sizeof(out)) == 16 );
+    assert( strcmp(out, "GET / HTTP/1.0\r\n") == 0 );
+    assert( rio_readlineb(&rio, out, 5) == 4 );
+    assert( strcmp(out, "Host") == 0 );
+    assert( rio_readlineb(&rio, out, sizeof(out)) == 5 );
+    assert( rio_readlineb(&rio, out, sizeof(out)) == 2 );
+    assert( rio_readnb(&rio, out, sizeof(in)) == sizeof(in) - 27 );
+    assert( memcmp(out, in + 27, sizeof(in) - 27) == 0 );
+    assert( rio_readnb(&rio, out, 1) == 0 );
+    close(fd);
+    printf("\treadlineb and readnb OK\n");
+
+    // With a small buffer, reads past it land partly in the caller's memory
+    // and partly in the buffer, and still come out in order.
+    char buf[RIO_TEST_BUFSIZE];
+    fd = rio_test_socket(in, sizeof(in));
+    rio_readinitb_buf(&rio, fd, buf, sizeof(buf));
+    size_t total = 0;
+    for (size_t step = 1; total < sizeof(in); step = step * 3 + 1) {
+        size_t n = step < sizeof(in) - total ? step : sizeof(in) - total;
+        assert( rio_readnb(&rio, out + total, n) == (ssize_t)n );
+        total += n;
+    }
+    assert( memcmp(out, in, sizeof(in)) == 0 );
+    assert( rio_readnb(&rio, out, 1) == 0 );
+    close(fd);
+    printf("\tcaller's buffer OK\n");
+
+    // Peeking hands out the buffered bytes in place, at most a buffer each.
+    const void *view;
+    ssize_t n;
+    fd = rio_test_socket(in, sizeof(in));
+    rio_readinitb_buf(&rio, fd, buf, sizeof(buf));
+    total = 0;
+    while ((n = rio_peekb(&rio, &view)) > 0) {
+        assert( n <= RIO_TEST_BUFSIZE );
+        assert( view >= (const void *)buf &&
+                (const char *)view + n <= buf + sizeof(buf) );
+        const size_t cnt = n > 7 ? 7 : n;
+        memcpy(out + total, view, cnt);
+        rio_consumeb(&rio, cnt);
+        total += cnt;
+    }
+    assert( n == 0 && total == sizeof(in) );
+    assert( memcmp(out, in, sizeof(in)) == 0 );
+    close(fd);
+    printf("\tpeek and consume OK\n");
+
+    printf("test_rio OK\n");
+    return EXIT_SUCCESS;
+}
+
+#endif
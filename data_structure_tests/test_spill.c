@@ -0,0 +1,119 @@
+#ifndef TEST_SPILL_C
+#define TEST_SPILL_C
+
+#include "spill.h"
+#include "bufpool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPILL_TEST_BUFSIZE (128)
+#define SPILL_TEST_CAP (1000)
+
+/**
+ * Drain the queue into `out`, a few bytes at a time.
+ */
+static size_t spill_drain(spill_t *spill, char *out, size_t step) {
+    size_t total = 0, n;
+    const char *src;
+    while ((src = spill_peek(spill, &n)) != NULL && n > 0) {
+        if (n > step)
+            n = step;
+        memcpy(out + total, src, n);
+        spill_consume(spill, n);
+        total += n;
+    }
+    return total;
+}
+
+/**
+ * Queue as much of `in` as fits, through spill_reserve and spill_commit.
+ */
+static size_t spill_fill(spill_t *spill, const char *in, size_t len) {
+    size_t total = 0, n;
+    char *dst;
+    while (total < len && (dst = spill_reserve(spill, &n)) != NULL) {
+        if (n > len - total)
+            n = len - total;
+        memcpy(dst, in + total, n);
+        spill_commit(spill, n);
+        total += n;
+    }
+    return total;
+}
+
+int run_test_spill(void) {
+    printf("Testing spill...\n");
+
+    bufpool_t *pool = bufpool_init("test_spill", SPILL_TEST_BUFSIZE, 4);
+    const size_t chunk = spill_chunk_size(pool);
+    spill_t spill;
+    spill_init(&spill, pool, SPILL_TEST_CAP);
+    size_t n;
+    assert( spill_len(&spill) == 0 );
+    assert( spill_peek(&spill, &n) == NULL && n == 0 );
+    printf("\tinit OK\n");
+
+    char in[2 * SPILL_TEST_CAP], out[2 * SPILL_TEST_CAP];
+    for (size_t i = 0; i < sizeof(in); ++i)
+        in[i] = (char)(i * 7);
+
+    // Spans several chunks; bytes come out in order.
+    assert( spill_fill(&spill, in, 3 * chunk + 5) == 3 * chunk + 5 );
+    assert( spill_len(&spill) == 3 * chunk + 5 );
+    assert( spill_drain(&spill, out, 17) == 3 * chunk + 5 );
+    assert( memcmp(in, out, 3 * chunk + 5) == 0 );
+    assert( spill_len(&spill) == 0 );
+    printf("\tfill and drain OK\n");
+
+    // The cap is never exceeded, and space frees up as the queue drains.
+    assert( spill_fill(&spill, in, sizeof(in)) == SPILL_TEST_CAP );
+    assert( spill_full(&spill) );
+    assert( spill_reserve(&spill, &n) == NULL && n == 0 );
+    spill_peek(&spill, &n);
+    spill_consume(&spill, n);
+    assert( !spill_full(&spill) );
+    assert( spill_fill(&spill, in + SPILL_TEST_CAP, sizeof(in)) == n );
+    assert( spill_drain(&spill, out, sizeof(out)) == SPILL_TEST_CAP );
+    assert( memcmp(in + n, out, SPILL_TEST_CAP - n) == 0 );
+    assert( memcmp(in + SPILL_TEST_CAP, out + SPILL_TEST_CAP - n, n) == 0 );
+    printf("\tcap OK\n");
+
+    // Reserve and commit interleaved with consumption.
+    size_t written = 0, read = 0;
+    for (size_t i = 0; read < sizeof(in); ++i) {
+        char *dst = spill_reserve(&spill, &n);
+        if (dst && written < sizeof(in)) {
+            if (n > 33)
+                n = 33;
+            if (n > sizeof(in) - written)
+                n = sizeof(in) - written;
+            memcpy(dst, in + written, n);
+            spill_commit(&spill, n);
+            written += n;
+        }
+        if (i % 3 == 0 || written == sizeof(in)) {
+            const char *src = spill_peek(&spill, &n);
+            if (n > 0) {
+                memcpy(out + read, src, n);
+                spill_consume(&spill, n);
+                read += n;
+            }
+        }
+    }
+    assert( memcmp(in, out, sizeof(in)) == 0 );
+    printf("\treserve and commit OK\n");
+
+    spill_fill(&spill, in, SPILL_TEST_CAP);
+    spill_clear(&spill);
+    assert( spill_len(&spill) == 0 );
+    assert( spill_peek(&spill, &n) == NULL );
+    bufpool_free(pool);
+    printf("\tclear OK\n");
+
+    return EXIT_SUCCESS;
+}
+
+#endif
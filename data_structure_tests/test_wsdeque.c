@@ -0,0 +1,99 @@
+#ifndef TEST_WSDEQUE_C
+#define TEST_WSDEQUE_C
+
+#include "wsdeque.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WSDEQUE_NUM_ITEMS (100000)
+#define WSDEQUE_NUM_THIEVES (3)
+
+static atomic_uint_fast8_t g_taken[WSDEQUE_NUM_ITEMS + 1];
+static atomic_bool g_owner_done;
+
+static void *thread_thief(void *vargp) {
+    wsdeque_t *deque = vargp;
+    while (1) {
+        void *item = wsdeque_steal(deque);
+        if (item == WSDEQUE_ABORT)
+            continue;
+        if (item == NULL) {
+            if (atomic_load(&g_owner_done))
+                break;
+            continue;
+        }
+        atomic_fetch_add(&g_taken[(uintptr_t)item], 1);
+    }
+    return NULL;
+}
+
+int run_test_wsdeque(void) {
+    printf("Testing wsdeque...\n");
+
+    wsdeque_t *deque = wsdeque_init(4);
+    wsdeque_free(deque);
+    printf("\tinit OK\n");
+
+    deque = wsdeque_init(4);
+    assert( wsdeque_pop(deque) == NULL );
+    assert( wsdeque_steal(deque) == NULL );
+    for (uintptr_t i = 1; i <= 3; ++i)
+        wsdeque_push(deque, (void *)i);
+    assert( wsdeque_size(deque) == 3 );
+    assert( wsdeque_pop(deque) == (void *)3 );
+    assert( wsdeque_steal(deque) == (void *)1 );
+    assert( wsdeque_pop(deque) == (void *)2 );
+    assert( wsdeque_pop(deque) == NULL );
+    printf("\tpush, pop and steal OK\n");
+
+    // Force the ring to grow several times.
+    for (uintptr_t i = 1; i <= 100; ++i)
+        wsdeque_push(deque, (void *)i);
+    assert( wsdeque_size(deque) == 100 );
+    for (uintptr_t i = 1; i <= 50; ++i)
+        assert( wsdeque_steal(deque) == (void *)i );
+    for (uintptr_t i = 100; i > 50; --i)
+        assert( wsdeque_pop(deque) == (void *)i );
+    assert( wsdeque_size(deque) == 0 );
+    wsdeque_free(deque);
+    printf("\tgrowth OK\n");
+
+    // Owner pushes and pops while thieves steal; every item must be taken
+    // exactly once.
+    deque = wsdeque_init(16);
+    atomic_store(&g_owner_done, false);
+    pthread_t thieves[WSDEQUE_NUM_THIEVES];
+    for (size_t i = 0; i < WSDEQUE_NUM_THIEVES; ++i)
+        pthread_create(&thieves[i], NULL, thread_thief, deque);
+
+    for (uintptr_t i = 1; i <= WSDEQUE_NUM_ITEMS; ++i) {
+        wsdeque_push(deque, (void *)i);
+        if (i % 3 == 0) {
+            void *item = wsdeque_pop(deque);
+            if (item)
+                atomic_fetch_add(&g_taken[(uintptr_t)item], 1);
+        }
+    }
+    void *item;
+    while ((item = wsdeque_pop(deque)) != NULL)
+        atomic_fetch_add(&g_taken[(uintptr_t)item], 1);
+    atomic_store(&g_owner_done, true);
+    for (size_t i = 0; i < WSDEQUE_NUM_THIEVES; ++i)
+        pthread_join(thieves[i], NULL);
+
+    for (size_t i = 1; i <= WSDEQUE_NUM_ITEMS; ++i)
+        assert( atomic_load(&g_taken[i]) == 1 );
+    wsdeque_free(deque);
+    printf("\tconcurrent steal OK\n");
+
+    printf("test_wsdeque OK\n");
+    return EXIT_SUCCESS;
+}
+
+#endif
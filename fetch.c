@@ -0,0 +1,90 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Background fetches from origins.
+ */
+#include "fetch.h"
+#include "csapp.h"
+#include "unixsock.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define FETCH_REQUEST_LEN 2048
+
+/**************** PUBLIC INTERFACE ****************/
+int fetch_parse_url(const char *uri, char *host, char *port, size_t *path) {
+    if (strncasecmp(uri, "http://", 7) != 0)
+        return -1;
+    const char *start = uri + 7;
+    const size_t host_len = strcspn(start, ":/");
+    if (host_len == 0 || host_len >= FETCH_HOST_LEN)
+        return -1;
+    memcpy(host, start, host_len);
+    host[host_len] = '\0';
+
+    const char *rest = start + host_len;
+    if (*rest == ':') {
+        const size_t port_len = strspn(rest + 1, "0123456789");
+        if (port_len == 0 || port_len >= FETCH_PORT_LEN)
+            return -1;
+        memcpy(port, rest + 1, port_len);
+        port[port_len] = '\0';
+        rest += 1 + port_len;
+    } else {
+        strcpy(port, "80");
+    }
+    if (*rest != '/' && *rest != '\0')
+        return -1;
+    *path = (*rest == '/') ? (size_t)(rest - uri) : 0;
+    return 0;
+}
+
+ssize_t fetch_get(const char *host, const char *port, const char *path,
+                  char *buf, size_t cap) {
+    char request[FETCH_REQUEST_LEN];
+    const bool default_port = strcmp(port, "80") == 0;
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.0\r\n"
+                       "Host: %s%s%s\r\n"
+                       "Connection: close\r\n"
+                       "Proxy-Connection: close\r\n\r\n",
+                       path, host, default_port ? "" : ":",
+                       default_port ? "" : port);
+    if (len < 0 || (size_t)len >= sizeof(request))
+        return -1;
+
+    const char *unix_path = unixsock_route(host, port);
+    int fd =
+        unix_path ? unixsock_connect(unix_path) : open_clientfd(host, port);
+    if (fd < 0)
+        return -1;
+    const struct timeval timeout = {.tv_sec = FETCH_TIMEOUT_S};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    ssize_t total = -1;
+    if (rio_writen(fd, request, len) == len) {
+        ssize_t n = 0;
+        total = 0;
+        // Read one byte past the limit to tell a full-size response from a
+        // larger one.
+        while ((size_t)total <= cap) {
+            char extra;
+            char *dst = (size_t)total < cap ? buf + total : &extra;
+            n = read(fd, dst, (size_t)total < cap ? cap - total : 1);
+            if (n <= 0)
+                break;
+            total += n;
+        }
+        if (n < 0 || (size_t)total > cap || total == 0)
+            total = -1;
+    }
+    close(fd);
+    return total;
+}
@@ -0,0 +1,39 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Background fetches from origins, outside of any client relay: the proxy's
+ * own requests for objects nobody has asked for yet (cf. warmup.h,
+ * prefetch.h). These are plain blocking HTTP/1.0 GETs with a timeout, meant
+ * for threads of their own.
+ */
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FETCH_HOST_LEN 256
+#define FETCH_PORT_LEN 8
+#define FETCH_TIMEOUT_S 10
+
+/**
+ * Split an absolute http URL into host, port and path.
+ *
+ * @param[out]  host  FETCH_HOST_LEN bytes.
+ * @param[out]  port  FETCH_PORT_LEN bytes; "80" if the URL has none.
+ * @param[out]  path  Offset of the path in `uri`, or 0 if it has none.
+ *
+ * @return 0 on success, -1 if `uri` is not an absolute http URL.
+ */
+int fetch_parse_url(const char *uri, char *host, char *port, size_t *path);
+
+/**
+ * Fetch `path` from an origin into `buf`, status line and headers included.
+ *
+ * @return Bytes of the response, or -1 if the fetch failed, timed out or the
+ *         response was larger than `cap`.
+ */
+ssize_t fetch_get(const char *host, const char *port, const char *path,
+                  char *buf, size_t cap);
+
+#endif
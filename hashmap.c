@@ -11,6 +11,7 @@
  * http://www.cse.yorku.ca/~oz/hash.html.
  */
 #include "hashmap.h"
+#include "mem.h"
 
 #include <limits.h> // UINT_MAX
 #include <stdbool.h>
@@ -176,7 +177,7 @@ static int hashmap_resize(hashmap_t *map, size_t size) {
 
     if (size > HASHMAP_MAX)
         return -1;
-    else if ((bins = calloc(size, sizeof(bin_t))) == NULL)
+    else if ((bins = mem_calloc(MEM_HASHMAP_BINS, size, sizeof(bin_t))) == NULL)
         return -1;
 
     map->bins = bins;
@@ -194,7 +195,7 @@ static int hashmap_resize(hashmap_t *map, size_t size) {
     }
 
     if (bins_old)
-        free(bins_old);
+        mem_free(MEM_HASHMAP_BINS, bins_old);
 
     return 0;
 }
@@ -313,6 +314,6 @@ hashmap_t *hashmap_init(size_t size) {
  *          this yourself.
  */
 void hashmap_free(hashmap_t *map) {
-    free(map->bins);
+    mem_free(MEM_HASHMAP_BINS, map->bins);
     free(map);
 }
@@ -0,0 +1,215 @@
+/**
+ * @author Jonathan Helland
+ *
+ * In-tree implementation of the HTTP request parser declared in
+ * http_parser.h, behaving as the course's version does. The request line must
+ * carry an absolute URI, as requests to a proxy do; every value is copied, so
+ * that the lines parsed may be freed right away. Parsers and their copies are
+ * charged to MEM_PARSERS (cf. mem.h).
+ */
+#include "http_parser.h"
+#include "mem.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define PARSER_NVALUES (HTTP_VERSION + 1)
+
+/**
+ * Headers are kept in a list, in the order they were parsed.
+ */
+typedef struct HeaderNode {
+    header_t header;
+    struct HeaderNode *next;
+} header_node_t;
+
+/**
+ * @param  have_request  Whether the request line was parsed; every later
+ *                       line is a header.
+ * @param  values        The parts of the request line, by parser_value_type.
+ * @param  cursor        The header last returned by
+ *                       parser_retrieve_next_header.
+ */
+struct parser {
+    bool have_request;
+    char *values[PARSER_NVALUES];
+    header_node_t *headers, *headers_tail;
+    header_node_t *cursor;
+};
+
+/**************** HELPERS ****************/
+/**
+ * @brief Copy `len` bytes from `start` into a new string.
+ */
+static char *dup_range(const char *start, size_t len) {
+    char *s = mem_malloc(MEM_PARSERS, len + 1);
+    if (s == NULL)
+        return NULL;
+    memcpy(s, start, len);
+    s[len] = '\0';
+    return s;
+}
+
+/**
+ * @brief Length of `line` without its line terminator.
+ */
+static size_t trim_len(const char *line) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+    return len;
+}
+
+/**
+ * @brief Split `METHOD scheme://host[:port][/path] HTTP/version` into its
+ * parts. The port defaults to 80 and the path to "/".
+ */
+static parser_state parse_request_line(parser_t *p, const char *line,
+                                       size_t len) {
+    const char *end = line + len;
+    const char *sp1 = memchr(line, ' ', len);
+    if (sp1 == NULL || sp1 == line)
+        return ERROR;
+    const char *uri = sp1 + 1;
+    const char *sp2 = memchr(uri, ' ', end - uri);
+    if (sp2 == NULL || sp2 == uri)
+        return ERROR;
+    const char *version = sp2 + 1;
+    if ((size_t)(end - version) < 6 || strncmp(version, "HTTP/", 5) != 0)
+        return ERROR;
+
+    const char *scheme_end = strstr(uri, "://");
+    if (scheme_end == NULL || scheme_end > sp2)
+        return ERROR;
+    const char *host = scheme_end + 3;
+    const char *host_end = host;
+    while (host_end < sp2 && *host_end != ':' && *host_end != '/')
+        host_end++;
+    if (host_end == host)
+        return ERROR;
+
+    const char *port = NULL, *port_end = NULL;
+    const char *path = host_end;
+    if (*host_end == ':') {
+        port = host_end + 1;
+        port_end = port;
+        while (port_end < sp2 && isdigit((unsigned char)*port_end))
+            port_end++;
+        if (port_end == port)
+            return ERROR;
+        path = port_end;
+    }
+    if (path < sp2 && *path != '/')
+        return ERROR;
+
+    char *values[PARSER_NVALUES];
+    values[METHOD] = dup_range(line, sp1 - line);
+    values[SCHEME] = dup_range(uri, scheme_end - uri);
+    values[HOST] = dup_range(host, host_end - host);
+    values[URI] = dup_range(uri, sp2 - uri);
+    values[PORT] = port ? dup_range(port, port_end - port) : dup_range("80", 2);
+    values[PATH] = (path < sp2) ? dup_range(path, sp2 - path)
+                                : dup_range("/", 1);
+    values[HTTP_VERSION] = dup_range(version + 5, end - (version + 5));
+
+    for (int i = 0; i < PARSER_NVALUES; ++i) {
+        mem_free(MEM_PARSERS, p->values[i]);
+        p->values[i] = values[i];
+    }
+    p->have_request = true;
+    return REQUEST;
+}
+
+/**
+ * @brief Store `Name: value`, without the whitespace before the value.
+ */
+static parser_state parse_header_line(parser_t *p, const char *line,
+                                      size_t len) {
+    // The blank line terminating the request is accepted without storage.
+    if (len == 0)
+        return HEADER;
+
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL || colon == line)
+        return ERROR;
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+
+    header_node_t *node = mem_malloc(MEM_PARSERS, sizeof(header_node_t));
+    if (node == NULL)
+        return ERROR;
+    node->header.name = dup_range(line, colon - line);
+    node->header.value = dup_range(value, end - value);
+    node->next = NULL;
+    if (p->headers_tail)
+        p->headers_tail->next = node;
+    else
+        p->headers = node;
+    p->headers_tail = node;
+    return HEADER;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+parser_t *parser_new(void) {
+    return mem_calloc(MEM_PARSERS, 1, sizeof(parser_t));
+}
+
+void parser_free(parser_t *p) {
+    if (p == NULL)
+        return;
+    for (int i = 0; i < PARSER_NVALUES; ++i)
+        mem_free(MEM_PARSERS, p->values[i]);
+    header_node_t *h = p->headers;
+    while (h) {
+        header_node_t *next = h->next;
+        mem_free(MEM_PARSERS, (char *)h->header.name);
+        mem_free(MEM_PARSERS, (char *)h->header.value);
+        mem_free(MEM_PARSERS, h);
+        h = next;
+    }
+    mem_free(MEM_PARSERS, p);
+}
+
+parser_state parser_parse_line(parser_t *p, const char *line) {
+    if (p == NULL || line == NULL)
+        return ERROR;
+    size_t len = trim_len(line);
+    if (len > PARSER_MAXLINE)
+        return ERROR;
+    if (!p->have_request)
+        return parse_request_line(p, line, len);
+    return parse_header_line(p, line, len);
+}
+
+int parser_retrieve(parser_t *p, parser_value_type type, const char **val) {
+    if (p == NULL || val == NULL || (int)type < 0 || type >= PARSER_NVALUES)
+        return -1;
+    if (!p->have_request || p->values[type] == NULL)
+        return -2;
+    *val = p->values[type];
+    return 0;
+}
+
+header_t *parser_lookup_header(parser_t *p, const char *name) {
+    if (p == NULL || name == NULL)
+        return NULL;
+    for (header_node_t *h = p->headers; h; h = h->next)
+        if (strcasecmp(h->header.name, name) == 0)
+            return &h->header;
+    return NULL;
+}
+
+header_t *parser_retrieve_next_header(parser_t *p) {
+    if (p == NULL)
+        return NULL;
+    header_node_t *next = (p->cursor != NULL) ? p->cursor->next : p->headers;
+    if (next == NULL)
+        return NULL;
+    p->cursor = next;
+    return &next->header;
+}
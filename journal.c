@@ -0,0 +1,462 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Append-only journal of cache insertions and evictions.
+ */
+#define _GNU_SOURCE
+#include "journal.h"
+#include "changeq.h"
+#include "hashmap.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Records with longer keys are taken for corruption during replay.
+ */
+#define JOURNAL_MAX_KEY (64 * 1024)
+
+/**************** STRUCTS ****************/
+/**
+ * An entry found during replay.
+ *
+ * @param  body  Offset of its body in the journal.
+ */
+typedef struct {
+    char *key;
+    size_t keylen;
+    off_t body;
+    uint64_t size;
+    uint32_t crc;
+    bool live;
+} entry_t;
+
+/**************** GLOBALS ****************/
+/*
+ * The journal file and the end of its last complete record, the records
+ * waiting to be written, and the stats. `live` is the size the journal would
+ * have if it held the cached entries only.
+ */
+static struct {
+    journal_cfg_t cfg;
+    cache_t *cache;
+    plock_t *lock;
+    int fd;
+    off_t offset;
+
+    pthread_mutex_t mutex;
+    changeq_t queue;
+    size_t live;
+    bool replaying;
+
+    uint32_t crc_table[256];
+
+    stat_counter_t *stat_records;
+    stat_counter_t *stat_bytes;
+    stat_counter_t *stat_batches;
+    stat_counter_t *stat_skipped;
+    stat_counter_t *stat_errors;
+    stat_counter_t *stat_compactions;
+    stat_counter_t *stat_replayed;
+    stat_counter_t *stat_corrupt;
+    stat_counter_t *stat_replay_ms;
+} g_journal = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**************** HELPERS ****************/
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        g_journal.crc_table[i] = c;
+    }
+}
+
+/**
+ * @brief CRC-32 of `len` bytes, continuing from `crc` (0 to start).
+ */
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len--)
+        crc = g_journal.crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static inline size_t record_bytes(size_t keylen, size_t size) {
+    return sizeof(journal_record_t) + keylen + size;
+}
+
+static void fill_record(journal_record_t *rec, uint32_t type, const void *key,
+                        size_t keylen, const void *body, size_t size) {
+    rec->type = type;
+    rec->keylen = keylen;
+    rec->size = size;
+    rec->body_crc = crc32(0, body, size);
+    rec->head_crc = 0;
+    rec->head_crc = crc32(crc32(0, rec, sizeof(*rec)), key, keylen);
+}
+
+/**
+ * @brief Write every iovec at `offset`, however many calls it takes.
+ */
+static int pwritev_all(int fd, struct iovec *iov, int n, off_t offset) {
+    while (n > 0) {
+        ssize_t w = pwritev(fd, iov, n, offset);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return -1;
+        offset += w;
+        changeq_iov_advance(&iov, &n, w);
+    }
+    return 0;
+}
+
+static size_t journal_header(void *header, const change_t *c,
+                             const void *key, size_t keylen, const void *body,
+                             size_t size) {
+    fill_record(header, c->type, key, keylen, body, size);
+    return sizeof(journal_record_t);
+}
+
+/**
+ * Where the next batch of records goes.
+ */
+typedef struct {
+    int fd;
+    off_t end;
+} journal_out_t;
+
+static int journal_writev(struct iovec *iov, int niov, int nrec, size_t bytes,
+                          void *arg) {
+    journal_out_t *out = arg;
+    if (pwritev_all(out->fd, iov, niov, out->end) < 0)
+        return -1;
+    out->end += bytes;
+    stats_add(g_journal.stat_records, nrec);
+    return 0;
+}
+
+/**
+ * @brief Append a list of records to `fd`, at `*offset`, which is moved past
+ * them.
+ *
+ * @return 0 on success, -1 on a write error, in which case the file is cut
+ *         back to `*offset` so that it ends with a complete record.
+ */
+static int write_records(int fd, off_t *offset, const change_t *list) {
+    journal_out_t out = {.fd = fd, .end = *offset};
+    if (changeq_write(list, journal_header, journal_writev, &out) < 0) {
+        if (ftruncate(fd, *offset) < 0)
+            stats_add(g_journal.stat_errors, 1);
+        return -1;
+    }
+    *offset = out.end;
+    return 0;
+}
+
+/**
+ * @brief Make a rename in the journal's directory durable.
+ */
+static void sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**************** LISTENER ****************/
+/**
+ * @brief cache_listener_fn queueing a record for every insertion and
+ * eviction. Runs under the cache lock, so it only links the record in.
+ */
+static void on_cache_event(cache_t *cache, block_t *block,
+                           cache_event_t event, void *arg) {
+    const size_t bytes = record_bytes(block->keylen, block->size);
+
+    pthread_mutex_lock(&g_journal.mutex);
+    if (event == CACHE_INSERTED)
+        g_journal.live += bytes;
+    else
+        g_journal.live -= bytes;
+    if (g_journal.replaying) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        return;
+    }
+
+    const int res = changeq_push(&g_journal.queue, block, event,
+                                 event == CACHE_INSERTED ? JOURNAL_INSERT
+                                                         : JOURNAL_EVICT);
+    if (res == 0)
+        stats_add(g_journal.stat_skipped, 1);
+    else if (res < 0)
+        stats_add(g_journal.stat_errors, 1);
+    pthread_mutex_unlock(&g_journal.mutex);
+}
+
+/**************** COMPACTION ****************/
+/**
+ * @brief Replace the journal by a checkpoint of the cache: one insertion per
+ * cached block, least recently used first. Records queued before the
+ * snapshot are covered by it; those queued while it is written go to the
+ * new journal afterwards.
+ */
+static void compact(void) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%.*s.tmp", PATH_MAX - 8, g_journal.cfg.path);
+
+    size_t n;
+    plock_lock(g_journal.lock);
+    pthread_mutex_lock(&g_journal.mutex);
+    block_t **blocks = cache_snapshot(g_journal.cache, &n);
+    const bool failed = blocks == NULL && g_journal.cache->lru_list->length;
+    change_t *covered = failed ? NULL : changeq_take(&g_journal.queue);
+    pthread_mutex_unlock(&g_journal.mutex);
+    plock_unlock(g_journal.lock);
+    if (failed) {
+        stats_add(g_journal.stat_errors, 1);
+        return;
+    }
+
+    change_t *list;
+    const int listed = changeq_from_snapshot(&g_journal.queue, blocks, n,
+                                             JOURNAL_INSERT, &list);
+    free(blocks);
+
+    const journal_file_header_t header = {.magic = JOURNAL_MAGIC};
+    off_t offset = sizeof(header);
+    int fd = listed < 0 ? -1 : open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 &&
+              pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+              write_records(fd, &offset, list) == 0 && fdatasync(fd) == 0 &&
+              rename(tmp, g_journal.cfg.path) == 0;
+    if (ok) {
+        sync_dir(g_journal.cfg.path);
+        close(g_journal.fd);
+        g_journal.fd = fd;
+        g_journal.offset = offset;
+        stats_add(g_journal.stat_compactions, 1);
+    } else {
+        // Keep the old journal, which still needs the covered records.
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        stats_add(g_journal.stat_errors, 1);
+        if (write_records(g_journal.fd, &g_journal.offset, covered) < 0 ||
+            fdatasync(g_journal.fd) < 0)
+            stats_add(g_journal.stat_errors, 1);
+    }
+    stats_set(g_journal.stat_bytes, g_journal.offset);
+    changeq_release(&g_journal.queue, list);
+    changeq_release(&g_journal.queue, covered);
+}
+
+/**************** WRITER ****************/
+static void *thread_journal(void *vargp) {
+    const struct timespec interval = {
+        .tv_sec = g_journal.cfg.interval_ms / 1000,
+        .tv_nsec = (long)(g_journal.cfg.interval_ms % 1000) * 1000000,
+    };
+    while (1) {
+        nanosleep(&interval, NULL);
+
+        pthread_mutex_lock(&g_journal.mutex);
+        change_t *list = changeq_take(&g_journal.queue);
+        const size_t live = g_journal.live;
+        pthread_mutex_unlock(&g_journal.mutex);
+
+        if (list) {
+            if (write_records(g_journal.fd, &g_journal.offset, list) < 0 ||
+                fdatasync(g_journal.fd) < 0)
+                stats_add(g_journal.stat_errors, 1);
+            stats_add(g_journal.stat_batches, 1);
+            stats_set(g_journal.stat_bytes, g_journal.offset);
+            changeq_release(&g_journal.queue, list);
+        }
+
+        if ((size_t)g_journal.offset > g_journal.cfg.compact_min &&
+            (size_t)g_journal.offset > g_journal.cfg.compact_ratio * live)
+            compact();
+    }
+    return NULL;
+}
+
+/**************** REPLAY ****************/
+/**
+ * @brief Rebuild the cache from the journal open at `fd`: find the live
+ * entries from the record headers and keys, then read their bodies.
+ *
+ * @param[out]  end  End of the last complete record.
+ *
+ * @return 0 on success, -1 if `fd` is not a journal.
+ */
+static int replay(int fd, off_t *end) {
+    struct stat st;
+    journal_file_header_t header;
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if (st.st_size == 0) {
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+            return -1;
+        *end = sizeof(header);
+        return 0;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0)
+        return -1;
+
+    // Index pass: headers and keys only.
+    FILE *f = fdopen(dup(fd), "r");
+    if (f == NULL)
+        return -1;
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    fseeko(f, sizeof(header), SEEK_SET);
+    hashmap_t *index = hashmap_init(1024);
+    entry_t *entries = NULL;
+    size_t nentries = 0, cap = 0;
+    off_t good = sizeof(header);
+    journal_record_t rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if ((rec.type != JOURNAL_INSERT && rec.type != JOURNAL_EVICT) ||
+            rec.keylen == 0 || rec.keylen > JOURNAL_MAX_KEY ||
+            good + (off_t)record_bytes(rec.keylen, rec.size) > st.st_size)
+            break;
+        char *key = malloc(rec.keylen);
+        const uint32_t crc = rec.head_crc;
+        rec.head_crc = 0;
+        if (key == NULL || fread(key, rec.keylen, 1, f) != 1 ||
+            crc32(crc32(0, &rec, sizeof(rec)), key, rec.keylen) != crc) {
+            free(key);
+            break;
+        }
+
+        uintptr_t idx = (uintptr_t)hashmap_find(index, key, rec.keylen);
+        if (idx) {
+            entries[idx - 1].live = false;
+            hashmap_delete(index, key, rec.keylen);
+        }
+        if (rec.type == JOURNAL_INSERT) {
+            if (nentries == cap) {
+                cap = cap ? 2 * cap : 1024;
+                entries = realloc(entries, cap * sizeof(entry_t));
+            }
+            entries[nentries] = (entry_t){
+                .key = key,
+                .keylen = rec.keylen,
+                .body = good + sizeof(rec) + rec.keylen,
+                .size = rec.size,
+                .crc = rec.body_crc,
+                .live = true,
+            };
+            hashmap_insert(index, key, rec.keylen,
+                           (void *)(uintptr_t)++nentries);
+            fseeko(f, rec.size, SEEK_CUR);
+        } else {
+            free(key);
+        }
+        good += record_bytes(rec.keylen, rec.size);
+    }
+    fclose(f);
+    hashmap_free(index);
+
+    // Cut off whatever a crash left after the last complete record.
+    if (good < st.st_size && ftruncate(fd, good) < 0)
+        stats_add(g_journal.stat_errors, 1);
+    *end = good;
+
+    // Load pass: the bodies of live entries, oldest first.
+    char *buf = NULL;
+    size_t buflen = 0;
+    for (size_t i = 0; i < nentries; ++i) {
+        entry_t *e = &entries[i];
+        if (e->live && e->size > buflen) {
+            free(buf);
+            buflen = e->size;
+            buf = malloc(buflen);
+        }
+        if (e->live && buf &&
+            pread(fd, buf, e->size, e->body) == (ssize_t)e->size &&
+            crc32(0, buf, e->size) == e->crc) {
+            plock_lock(g_journal.lock);
+            cache_insert(g_journal.cache, e->key, e->keylen, buf, e->size);
+            plock_unlock(g_journal.lock);
+            stats_add(g_journal.stat_replayed, 1);
+        } else if (e->live) {
+            stats_add(g_journal.stat_corrupt, 1);
+        }
+        free(e->key);
+    }
+    free(buf);
+    free(entries);
+    return 0;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int journal_open(const journal_cfg_t *cfg, cache_t *cache, plock_t *lock) {
+    if (cfg->interval_ms == 0 || cfg->compact_ratio == 0)
+        return -1;
+    g_journal.cfg = *cfg;
+    g_journal.cache = cache;
+    g_journal.lock = lock;
+    changeq_init(&g_journal.queue, cache, lock, cfg->max_pending);
+    crc32_init();
+
+    g_journal.stat_records = stats_counter("journal.records");
+    g_journal.stat_bytes = stats_counter("journal.bytes");
+    g_journal.stat_batches = stats_counter("journal.batches");
+    g_journal.stat_skipped = stats_counter("journal.skipped");
+    g_journal.stat_errors = stats_counter("journal.errors");
+    g_journal.stat_compactions = stats_counter("journal.compactions");
+    g_journal.stat_replayed = stats_counter("journal.replayed");
+    g_journal.stat_corrupt = stats_counter("journal.corrupt");
+    g_journal.stat_replay_ms = stats_counter("journal.replay_ms");
+
+    g_journal.fd = open(cfg->path, O_RDWR | O_CREAT, 0644);
+    if (g_journal.fd < 0)
+        return -1;
+
+    // Replay with the listener in, to count the live bytes, but queueing
+    // nothing: the records are in the journal already.
+    const uint64_t start_us = stats_now_us();
+    g_journal.replaying = true;
+    plock_lock(lock);
+    int added = cache_add_listener(cache, on_cache_event, NULL);
+    plock_unlock(lock);
+    if (added < 0 || replay(g_journal.fd, &g_journal.offset) < 0) {
+        close(g_journal.fd);
+        plock_lock(lock);
+        cache_remove_listener(cache, on_cache_event, NULL);
+        plock_unlock(lock);
+        return -1;
+    }
+    pthread_mutex_lock(&g_journal.mutex);
+    g_journal.replaying = false;
+    pthread_mutex_unlock(&g_journal.mutex);
+    stats_set(g_journal.stat_replay_ms, (stats_now_us() - start_us) / 1000);
+    stats_set(g_journal.stat_bytes, g_journal.offset);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_journal, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
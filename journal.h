@@ -0,0 +1,92 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Crash-consistent cache persistence through an append-only journal. Every
+ * insertion into the cache appends a record with the key and the response,
+ * and every eviction one with the key alone; a restarted proxy replays the
+ * journal to get its cache back.
+ *
+ * Records are appended by a background thread in batches, every `interval_ms`
+ * milliseconds, and synced to disk after each batch. Relays only queue them:
+ * the response is not copied, the queued record holds a reference on the
+ * cache block instead. Each record carries a CRC of its header and key and
+ * one of its body, so that replay stops at the first torn or corrupt record
+ * a crash may have left and cuts the journal there.
+ *
+ * Replay reads record headers and keys only, skipping over bodies, to find
+ * which entries are still live, then reads the bodies of those alone. Startup
+ * time is thus bounded by the index and the cache size, not by the journal.
+ *
+ * Since evicted entries stay in the journal, it is compacted once it grows
+ * past `compact_ratio` times the live data: a checkpoint with one insertion
+ * per cached block is written aside and renamed over the journal.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "cache.h"
+#include "plock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "PXJRNL01"
+#define JOURNAL_DEFAULT_INTERVAL_MS 100
+#define JOURNAL_DEFAULT_MAX_PENDING (16 * 1024 * 1024)
+#define JOURNAL_DEFAULT_COMPACT_RATIO 2
+#define JOURNAL_DEFAULT_COMPACT_MIN (4 * 1024 * 1024)
+
+/**
+ * @param  path           The journal. Created if it does not exist.
+ * @param  interval_ms    How often queued records are written and synced,
+ *                        i.e. at most how much a crash loses.
+ * @param  max_pending    Response bytes queued at most; insertions past that
+ *                        are not journaled (evictions always are).
+ * @param  compact_ratio  Compact once the journal is this many times larger
+ *                        than the cached data...
+ * @param  compact_min    ...and larger than this.
+ */
+typedef struct {
+    const char *path;
+    unsigned interval_ms;
+    size_t max_pending;
+    unsigned compact_ratio;
+    size_t compact_min;
+} journal_cfg_t;
+
+/**
+ * File header of a journal.
+ */
+typedef struct {
+    char magic[8];
+} journal_file_header_t;
+
+/**
+ * Header of a record, followed by `keylen` bytes of key and, for insertions,
+ * `size` bytes of body.
+ *
+ * @param  type      JOURNAL_INSERT or JOURNAL_EVICT.
+ * @param  body_crc  CRC-32 of the body.
+ * @param  head_crc  CRC-32 of this header, with head_crc zero, and the key.
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t keylen;
+    uint64_t size;
+    uint32_t body_crc;
+    uint32_t head_crc;
+} journal_record_t;
+
+#define JOURNAL_INSERT 0x534e494a /* "JINS" */
+#define JOURNAL_EVICT 0x5645494a  /* "JIEV" */
+
+/**
+ * Replay the journal into `cache`, then journal every change to it from here
+ * on. `lock` is the lock that callers of `cache` hold. Progress is exported
+ * as `journal.*` stats.
+ *
+ * @return 0 on success, -1 if the journal cannot be opened or created.
+ */
+int journal_open(const journal_cfg_t *cfg, cache_t *cache, plock_t *lock);
+
+#endif
@@ -5,6 +5,7 @@
  * This is handy for enforcing an LRU policy in a cache.
  */
 #include "list.h"
+#include "mem.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -36,7 +37,7 @@ static node_t *list_insert_head(list_t *list, node_t *node) {
  * Insert a node at the head of the list.
  */
 node_t *list_insert(list_t *list, void *value) {
-    node_t *node = malloc(sizeof(node_t));
+    node_t *node = mem_malloc(MEM_LIST_NODES, sizeof(node_t));
     node->value = value;
     return list_insert_head(list, node);
 }
@@ -50,6 +51,8 @@ node_t *list_delete(list_t *list, node_t *node) {
     } else {
         node->prev->next = node->next;
         node->next->prev = node->prev;
+        if (list->head == node)
+            list->head = node->next;
     }
 
     list->length--;
@@ -106,7 +109,7 @@ void list_free(list_t *list) {
     node_t *n = list->head;
     for (bool looped = false; n != NULL && !looped;) {
         node_t *next = n->next;
-        free(n);
+        mem_free(MEM_LIST_NODES, n);
         n = next;
 
         looped = (n == list->head);
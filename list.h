@@ -31,7 +31,8 @@ typedef struct List {
 node_t *list_insert(list_t *list, void *value);
 
 /**
- * Remove a node from the list. Does not free iany memory.
+ * Remove a node from the list. Does not free any memory; nodes are charged to
+ * MEM_LIST_NODES, so free them with mem_free(MEM_LIST_NODES, node).
  */
 node_t *list_delete(list_t *list, node_t *node);
 
@@ -0,0 +1,84 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Memory totals by subsystem, exported with the RSS.
+ */
+#include "mem.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**************** GLOBALS ****************/
+mem_total_t g_mem_totals[MEM_NUM_TAGS];
+
+static const char *g_tag_names[MEM_NUM_TAGS] = {
+    [MEM_CACHE_VALUES] = "cache_values", [MEM_CACHE_KEYS] = "cache_keys",
+    [MEM_CACHE_BLOCKS] = "cache_blocks", [MEM_HASHMAP_BINS] = "hashmap_bins",
+    [MEM_LIST_NODES] = "list_nodes",     [MEM_BUFFERS] = "buffers",
+    [MEM_RELAYS] = "relays",             [MEM_PARSERS] = "parsers",
+};
+
+static struct {
+    stat_counter_t *tags[MEM_NUM_TAGS];
+    stat_counter_t *tracked;
+    stat_counter_t *rss;
+    stat_counter_t *untracked;
+} g_mem;
+
+/**************** HELPERS ****************/
+static void publish(void) {
+    size_t tracked = 0;
+    for (int i = 0; i < MEM_NUM_TAGS; ++i) {
+        const size_t bytes = mem_tag_bytes(i);
+        stats_set(g_mem.tags[i], bytes);
+        tracked += bytes;
+    }
+    const size_t rss = mem_rss();
+    stats_set(g_mem.tracked, tracked);
+    stats_set(g_mem.rss, rss);
+    stats_set(g_mem.untracked, rss > tracked ? rss - tracked : 0);
+}
+
+static void *thread_mem(void *vargp) {
+    const struct timespec interval = {
+        .tv_sec = MEM_SAMPLE_MS / 1000,
+        .tv_nsec = (long)(MEM_SAMPLE_MS % 1000) * 1000000,
+    };
+    while (1) {
+        nanosleep(&interval, NULL);
+        publish();
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+size_t mem_rss(void) {
+    unsigned long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    int n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    return n == 2 ? resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+int mem_init(void) {
+    char name[STATS_NAME_LEN];
+    for (int i = 0; i < MEM_NUM_TAGS; ++i) {
+        snprintf(name, sizeof(name), "mem.%s_bytes", g_tag_names[i]);
+        g_mem.tags[i] = stats_counter(name);
+    }
+    g_mem.tracked = stats_counter("mem.tracked_bytes");
+    g_mem.rss = stats_counter("mem.rss_bytes");
+    g_mem.untracked = stats_counter("mem.untracked_bytes");
+    publish();
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_mem, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
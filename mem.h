@@ -0,0 +1,117 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Memory accounting by subsystem. Allocations made through the wrappers below
+ * are charged to a tag at the size the allocator actually handed out, so the
+ * totals include its rounding. Once mem_init has run, the totals are exported
+ * every second as `mem.<tag>_bytes`, next to the resident set size read from
+ * /proc and what is left of it once the tracked bytes are taken out:
+ *
+ *     mem.tracked_bytes    sum of every tag
+ *     mem.rss_bytes        resident set size of the process
+ *     mem.untracked_bytes  RSS minus tracked bytes: stacks, code, allocator
+ *                          free lists and fragmentation, libraries
+ *
+ * Counting starts at the first allocation, mem_init or not, so memory freed
+ * after mem_init is never subtracted from a total it was not added to.
+ */
+#ifndef MEM_H
+#define MEM_H
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MEM_SAMPLE_MS 1000
+
+typedef enum {
+    MEM_CACHE_VALUES, /* Cached responses. */
+    MEM_CACHE_KEYS,   /* Their URIs. */
+    MEM_CACHE_BLOCKS, /* block_t headers. */
+    MEM_HASHMAP_BINS, /* bin_t arrays of hash tables. */
+    MEM_LIST_NODES,   /* Linked list nodes. */
+    MEM_BUFFERS,      /* Pooled I/O, object and spill buffers, borrowed or
+                         free. */
+    MEM_RELAYS,       /* Per-request relay state. */
+    MEM_PARSERS,      /* Request parsers and the values they copied. */
+    MEM_NUM_TAGS
+} mem_tag_t;
+
+/**
+ * Bytes charged to each tag, a cache line apart so that subsystems on
+ * different threads do not contend on one line.
+ */
+typedef struct {
+    _Alignas(64) _Atomic int64_t bytes;
+} mem_total_t;
+
+extern mem_total_t g_mem_totals[MEM_NUM_TAGS];
+
+/**
+ * Bytes the allocator reserved for `ptr`, at least what was asked for.
+ */
+static inline size_t mem_size(void *ptr) {
+    return ptr ? malloc_usable_size(ptr) : 0;
+}
+
+/**
+ * Charge or refund `bytes` to a tag directly, for memory allocated out of
+ * sight, e.g. inside a library.
+ */
+static inline void mem_charge(mem_tag_t tag, size_t bytes) {
+    atomic_fetch_add_explicit(&g_mem_totals[tag].bytes, bytes,
+                              memory_order_relaxed);
+}
+
+static inline void mem_uncharge(mem_tag_t tag, size_t bytes) {
+    atomic_fetch_sub_explicit(&g_mem_totals[tag].bytes, bytes,
+                              memory_order_relaxed);
+}
+
+static inline void *mem_malloc(mem_tag_t tag, size_t size) {
+    void *ptr = malloc(size);
+    mem_charge(tag, mem_size(ptr));
+    return ptr;
+}
+
+static inline void *mem_calloc(mem_tag_t tag, size_t n, size_t size) {
+    void *ptr = calloc(n, size);
+    mem_charge(tag, mem_size(ptr));
+    return ptr;
+}
+
+/**
+ * Free memory from mem_malloc or mem_calloc, under the tag it was charged to.
+ * NULL is ignored.
+ */
+static inline void mem_free(mem_tag_t tag, void *ptr) {
+    mem_uncharge(tag, mem_size(ptr));
+    free(ptr);
+}
+
+/**
+ * Bytes currently charged to a tag.
+ */
+static inline size_t mem_tag_bytes(mem_tag_t tag) {
+    int64_t bytes = atomic_load_explicit(&g_mem_totals[tag].bytes,
+                                         memory_order_relaxed);
+    return bytes > 0 ? bytes : 0;
+}
+
+/**
+ * Resident set size of the process, from /proc/self/statm.
+ *
+ * @return 0 if it could not be read.
+ */
+size_t mem_rss(void);
+
+/**
+ * Register the memory metrics and start refreshing them every MEM_SAMPLE_MS.
+ *
+ * @return 0 on success, -1 if the sampling thread could not be started.
+ */
+int mem_init(void);
+
+#endif
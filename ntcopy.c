@@ -0,0 +1,132 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Non-temporal copy kernels and their dispatch.
+ */
+#include "ntcopy.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NTCOPY_X86
+#endif
+
+typedef void (*copy_fn_t)(char *dst, const char *src, size_t n);
+
+/**************** KERNELS ****************/
+static void copy_memcpy(char *dst, const char *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+#ifdef NTCOPY_X86
+/*
+ * Both kernels align the destination, since streaming stores must be, copy
+ * 64 or 128 bytes per iteration with unaligned loads, and finish the tail
+ * with memcpy. n is at least NTCOPY_MIN.
+ */
+__attribute__((target("sse2"))) static void copy_sse2(char *dst,
+                                                      const char *src,
+                                                      size_t n) {
+    const size_t head = -(uintptr_t)dst & 15;
+    memcpy(dst, src, head);
+    dst += head, src += head, n -= head;
+    for (; n >= 64; n -= 64, src += 64, dst += 64) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)src);
+        const __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        const __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    memcpy(dst, src, n);
+    _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static void copy_avx2(char *dst,
+                                                      const char *src,
+                                                      size_t n) {
+    const size_t head = -(uintptr_t)dst & 31;
+    memcpy(dst, src, head);
+    dst += head, src += head, n -= head;
+    for (; n >= 128; n -= 128, src += 128, dst += 128) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)src);
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        const __m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+        const __m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+        _mm256_stream_si256((__m256i *)dst, a);
+        _mm256_stream_si256((__m256i *)(dst + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + 96), d);
+    }
+    memcpy(dst, src, n);
+    _mm_sfence();
+}
+#endif
+
+/**************** GLOBALS ****************/
+/**
+ * @param  threshold   Smallest copy made with non-temporal stores, or
+ *                     SIZE_MAX when they are off.
+ * @param  copy        Kernel for copies from the threshold up.
+ * @param  stat_bytes  Bytes copied by `copy`.
+ */
+static struct {
+    _Atomic size_t threshold;
+    pthread_once_t once;
+    copy_fn_t copy;
+    const char *kernel;
+    stat_counter_t *stat_bytes;
+} g_ntcopy = {
+    .threshold = NTCOPY_DEFAULT_THRESHOLD,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+/**
+ * @brief Pick the kernel for the CPU we run on.
+ */
+static void ntcopy_init(void) {
+    g_ntcopy.copy = copy_memcpy;
+    g_ntcopy.kernel = "memcpy";
+#ifdef NTCOPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_ntcopy.copy = copy_avx2;
+        g_ntcopy.kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_ntcopy.copy = copy_sse2;
+        g_ntcopy.kernel = "sse2";
+    }
+#endif
+    g_ntcopy.stat_bytes = stats_counter("ntcopy.bytes");
+}
+
+/**************** PUBLIC INTERFACE ****************/
+void *ntcopy(void *dst, const void *src, size_t n) {
+    if (n < atomic_load_explicit(&g_ntcopy.threshold, memory_order_relaxed))
+        return memcpy(dst, src, n);
+    pthread_once(&g_ntcopy.once, ntcopy_init);
+    g_ntcopy.copy(dst, src, n);
+    stats_add(g_ntcopy.stat_bytes, n);
+    return dst;
+}
+
+void ntcopy_set_threshold(size_t threshold) {
+    if (threshold == 0)
+        threshold = SIZE_MAX;
+    else if (threshold < NTCOPY_MIN)
+        threshold = NTCOPY_MIN;
+    atomic_store_explicit(&g_ntcopy.threshold, threshold,
+                          memory_order_relaxed);
+}
+
+const char *ntcopy_kernel(void) {
+    pthread_once(&g_ntcopy.once, ntcopy_init);
+    return g_ntcopy.kernel;
+}
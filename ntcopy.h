@@ -0,0 +1,45 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Copies that bypass the CPU caches. Filling the cache with a large response
+ * through memcpy pulls every line of it through L1 and L2 on its way to
+ * memory, evicting the hash table bins and the small hot objects that the
+ * next hits need. ntcopy writes copies of at least a threshold size with
+ * non-temporal stores instead: AVX2 where the CPU has it, SSE2 otherwise,
+ * picked at the first large copy. Smaller copies, and every copy on other
+ * architectures, are plain memcpy.
+ *
+ * The non-temporal stores are fenced before ntcopy returns, so the copy is
+ * published to other threads by a later lock release like any other store.
+ */
+#ifndef NTCOPY_H
+#define NTCOPY_H
+
+#include <stddef.h>
+
+#define NTCOPY_DEFAULT_THRESHOLD (32 * 1024)
+
+/*
+ * Copies shorter than this always use memcpy, whatever the threshold.
+ */
+#define NTCOPY_MIN 256
+
+/**
+ * memcpy, with non-temporal stores from the threshold up. Bytes copied that
+ * way are counted under the `ntcopy.bytes` stat.
+ *
+ * @return `dst`.
+ */
+void *ntcopy(void *dst, const void *src, size_t n);
+
+/**
+ * Copy with non-temporal stores from `threshold` bytes up; 0 turns them off.
+ */
+void ntcopy_set_threshold(size_t threshold);
+
+/**
+ * Name of the kernel used for large copies: "avx2", "sse2" or "memcpy".
+ */
+const char *ntcopy_kernel(void);
+
+#endif
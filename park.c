@@ -0,0 +1,218 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Parking lot for idle connections: epoll plus one 32-bit slot per fd.
+ */
+#include "park.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PARK_BATCH 256
+#define PARK_SWEEP_MS 1000
+
+/**************** STRUCTS ****************/
+/**
+ * @param  slots    Per-fd state: 0 if the fd is not parked, otherwise the
+ *                  second (counted from `epoch`, plus one) it was parked in.
+ * @param  max_fd   Highest fd ever parked, to bound the idle sweep.
+ */
+struct ParkLot {
+    int epfd;
+    park_fn_t on_ready;
+    unsigned idle_timeout_s;
+    time_t epoch;
+
+    _Atomic uint32_t *slots;
+    size_t nslots;
+    atomic_int max_fd;
+    atomic_size_t count;
+
+    pthread_t tid;
+    atomic_bool stopping;
+
+    stat_counter_t *stat_idle;
+    stat_counter_t *stat_resumed;
+    stat_counter_t *stat_expired;
+    stat_counter_t *stat_hangups;
+};
+
+/**************** HELPERS ****************/
+static uint32_t now_s(const parklot_t *lot) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec - lot->epoch) + 1;
+}
+
+/**
+ * @brief Take a fd out of the lot. Only the lot's own thread calls this, so a
+ * slot cannot be unparked twice.
+ */
+static void unpark(parklot_t *lot, int fd) {
+    atomic_store(&lot->slots[fd], 0);
+    atomic_fetch_sub(&lot->count, 1);
+    stats_sub(lot->stat_idle, 1);
+}
+
+/**
+ * @brief Whether a socket that reported a hangup or error still has a request
+ * waiting to be read.
+ */
+static bool has_data(int fd) {
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/**
+ * @brief Close connections that have been parked for longer than the timeout.
+ */
+static void sweep(parklot_t *lot) {
+    const uint32_t now = now_s(lot);
+    const int max_fd = atomic_load(&lot->max_fd);
+    for (int fd = 0; fd <= max_fd; ++fd) {
+        uint32_t parked = atomic_load(&lot->slots[fd]);
+        if (parked == 0 || now - parked <= lot->idle_timeout_s)
+            continue;
+        epoll_ctl(lot->epfd, EPOLL_CTL_DEL, fd, NULL);
+        unpark(lot, fd);
+        close(fd);
+        stats_add(lot->stat_expired, 1);
+    }
+}
+
+static void *thread_parklot(void *vargp) {
+    parklot_t *lot = vargp;
+    struct epoll_event events[PARK_BATCH];
+    uint32_t last_sweep = now_s(lot);
+
+    while (!atomic_load(&lot->stopping)) {
+        int n = epoll_wait(lot->epfd, events, PARK_BATCH, PARK_SWEEP_MS);
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (atomic_load(&lot->slots[fd]) == 0)
+                continue;
+            unpark(lot, fd);
+
+            // Idle clients usually just go away; don't bother a worker with
+            // those.
+            if ((events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+                !has_data(fd)) {
+                close(fd);
+                stats_add(lot->stat_hangups, 1);
+                continue;
+            }
+            stats_add(lot->stat_resumed, 1);
+            lot->on_ready(fd);
+        }
+
+        uint32_t now = now_s(lot);
+        if (now != last_sweep) {
+            sweep(lot);
+            last_sweep = now;
+        }
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+parklot_t *parklot_init(park_fn_t on_ready, size_t max_fds,
+                        unsigned idle_timeout_s) {
+    parklot_t *lot = calloc(1, sizeof(parklot_t));
+    if (lot == NULL)
+        return NULL;
+
+    // One slot per possible fd. Pages of the array that no parked fd ever
+    // touches are never faulted in.
+    lot->slots = calloc(max_fds, sizeof(uint32_t));
+    lot->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (lot->slots == NULL || lot->epfd < 0) {
+        if (lot->epfd >= 0)
+            close(lot->epfd);
+        free(lot->slots);
+        free(lot);
+        return NULL;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    lot->epoch = ts.tv_sec;
+    lot->on_ready = on_ready;
+    lot->idle_timeout_s = idle_timeout_s;
+    lot->nslots = max_fds;
+    atomic_init(&lot->max_fd, -1);
+    atomic_init(&lot->count, 0);
+    atomic_init(&lot->stopping, false);
+
+    lot->stat_idle = stats_counter("park.idle");
+    lot->stat_resumed = stats_counter("park.resumed");
+    lot->stat_expired = stats_counter("park.expired");
+    lot->stat_hangups = stats_counter("park.hangups");
+
+    if (pthread_create(&lot->tid, NULL, thread_parklot, lot) != 0) {
+        close(lot->epfd);
+        free(lot->slots);
+        free(lot);
+        return NULL;
+    }
+    return lot;
+}
+
+void parklot_free(parklot_t *lot) {
+    atomic_store(&lot->stopping, true);
+    pthread_join(lot->tid, NULL);
+
+    const int max_fd = atomic_load(&lot->max_fd);
+    for (int fd = 0; fd <= max_fd; ++fd) {
+        if (atomic_load(&lot->slots[fd])) {
+            unpark(lot, fd);
+            close(fd);
+        }
+    }
+    close(lot->epfd);
+    free(lot->slots);
+    free(lot);
+}
+
+int parklot_park(parklot_t *lot, int fd) {
+    if (fd < 0 || (size_t)fd >= lot->nslots)
+        return -1;
+
+    int max_fd = atomic_load(&lot->max_fd);
+    while (fd > max_fd &&
+           !atomic_compare_exchange_weak(&lot->max_fd, &max_fd, fd))
+        ;
+
+    // The slot must be set before the fd can fire. A fd that was parked
+    // before is usually still registered, with its one-shot disarmed.
+    atomic_store(&lot->slots[fd], now_s(lot));
+    atomic_fetch_add(&lot->count, 1);
+    stats_add(lot->stat_idle, 1);
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.fd = fd,
+    };
+    int res = epoll_ctl(lot->epfd, EPOLL_CTL_MOD, fd, &ev);
+    if (res < 0 && errno == ENOENT)
+        res = epoll_ctl(lot->epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (res < 0) {
+        atomic_store(&lot->slots[fd], 0);
+        atomic_fetch_sub(&lot->count, 1);
+        stats_sub(lot->stat_idle, 1);
+        return -1;
+    }
+    return 0;
+}
+
+size_t parklot_count(parklot_t *lot) {
+    return atomic_load(&lot->count);
+}
@@ -0,0 +1,52 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A parking lot for idle keep-alive connections. A parked connection is just
+ * its file descriptor plus one 32-bit slot, indexed by fd, holding the time it
+ * was parked; it owns no buffers, no thread and no coroutine. A single thread
+ * waits on all parked sockets with epoll and hands each one back as soon as it
+ * becomes readable, or closes it once it has been idle for too long.
+ */
+#ifndef PARK_H
+#define PARK_H
+
+#include <stddef.h>
+
+/**
+ * Called on the parking lot's thread when a parked connection becomes
+ * readable. The connection is no longer parked and belongs to the callee,
+ * which should hand it off quickly.
+ */
+typedef void (*park_fn_t)(int fd);
+
+typedef struct ParkLot parklot_t;
+
+/**
+ * Start a parking lot for descriptors below `max_fds`. Connections idle for
+ * more than `idle_timeout_s` seconds are closed.
+ *
+ * @return NULL on failure.
+ */
+parklot_t *parklot_init(park_fn_t on_ready, size_t max_fds,
+                        unsigned idle_timeout_s);
+
+/**
+ * Stop the parking lot's thread and close every connection still parked.
+ */
+void parklot_free(parklot_t *lot);
+
+/**
+ * Park an idle connection. Thread-safe. Ownership of `fd` passes to the
+ * parking lot until it is handed back through the callback.
+ *
+ * @return 0 on success, -1 if the fd cannot be parked; it is still owned by
+ *         the caller in that case.
+ */
+int parklot_park(parklot_t *lot, int fd);
+
+/**
+ * Number of connections currently parked.
+ */
+size_t parklot_count(parklot_t *lot);
+
+#endif
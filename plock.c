@@ -0,0 +1,265 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Profiled mutexes with sampled hold times and long-hold call sites.
+ */
+#include "plock.h"
+#include "admin.h"
+
+#include <execinfo.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLOCK_MAX_CLASSES 64
+#define PLOCK_MAX_SITES 256
+#define PLOCK_REPORT_LINE 256
+
+/**************** STRUCTS ****************/
+/**
+ * A call site that held a lock for PLOCK_LONG_HOLD_NS or more. Sites are
+ * claimed once, by address, and never removed.
+ */
+typedef struct {
+    _Atomic(void *) site;
+    _Atomic(plock_class_t *) cls;
+    _Atomic uint64_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+} plock_site_t;
+
+/**************** GLOBALS ****************/
+static struct {
+    pthread_mutex_t mutex;
+    _Atomic size_t nclasses;
+    plock_class_t classes[PLOCK_MAX_CLASSES];
+} g_classes = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Class of the locks created once the class table is full: no metrics.
+ */
+static plock_class_t g_overflow_class = {.name = "overflow"};
+
+static plock_site_t g_sites[PLOCK_MAX_SITES];
+
+/*
+ * Acquisitions made by this thread, to pick the ones that are timed.
+ */
+static __thread unsigned t_ticks;
+
+/**************** HELPERS ****************/
+/**
+ * @brief Find or claim the slot of a call site, by open addressing on its
+ * address.
+ *
+ * @return NULL if every slot is taken by other sites.
+ */
+static plock_site_t *site_slot(plock_class_t *cls, void *site) {
+    size_t i = ((uintptr_t)site >> 4) * 0x9E3779B97F4A7C15ULL >> 56;
+    for (size_t probe = 0; probe < PLOCK_MAX_SITES; ++probe) {
+        plock_site_t *slot = &g_sites[(i + probe) % PLOCK_MAX_SITES];
+        void *cur = atomic_load_explicit(&slot->site, memory_order_acquire);
+        if (cur == site)
+            return slot;
+        if (cur == NULL) {
+            if (atomic_compare_exchange_strong(&slot->site, &cur, site)) {
+                atomic_store(&slot->cls, cls);
+                return slot;
+            }
+            if (cur == site)
+                return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start timing a hold if it is contended or its turn has come.
+ */
+static inline void hold_begin(plock_t *lock, void *site, bool contended,
+                              uint64_t now) {
+    // Threads that take only a few locks, such as one per connection, would
+    // never be sampled if every count started at 0.
+    if (t_ticks == 0)
+        t_ticks = ((uintptr_t)&t_ticks * 0x9E3779B97F4A7C15ULL) >> 40 | 1;
+    if (!contended && (++t_ticks & (PLOCK_SAMPLE_EVERY - 1)) != 0)
+        return;
+    if (!contended) {
+        stats_add(lock->cls->acquired, PLOCK_SAMPLE_EVERY);
+        now = plock_now_ns();
+    } else {
+        stats_add(lock->cls->acquired, 1);
+    }
+    lock->hold_start = now;
+    lock->site = site;
+}
+
+/**
+ * @brief Stop timing the current hold, if it is timed.
+ *
+ * @return Length of the hold, 0 if it was not timed.
+ */
+static inline uint64_t hold_end(plock_t *lock) {
+    if (lock->hold_start == 0)
+        return 0;
+    uint64_t ns = plock_now_ns() - lock->hold_start;
+    lock->hold_start = 0;
+    return ns ? ns : 1;
+}
+
+static int cmp_sites(const void *a, const void *b) {
+    uint64_t x = atomic_load(&(*(plock_site_t *const *)a)->count);
+    uint64_t y = atomic_load(&(*(plock_site_t *const *)b)->count);
+    return (x < y) - (x > y);
+}
+
+/**************** PUBLIC INTERFACE ****************/
+plock_class_t *plock_class(const char *name) {
+    plock_class_t *cls = NULL;
+    pthread_mutex_lock(&g_classes.mutex);
+
+    size_t n = atomic_load(&g_classes.nclasses);
+    for (size_t i = 0; i < n; ++i) {
+        if (strncmp(g_classes.classes[i].name, name, STATS_NAME_LEN) == 0) {
+            cls = &g_classes.classes[i];
+            break;
+        }
+    }
+    if (cls == NULL && n < PLOCK_MAX_CLASSES) {
+        char metric[STATS_NAME_LEN + 32];
+        cls = &g_classes.classes[n];
+        strncpy(cls->name, name, STATS_NAME_LEN - 1);
+        snprintf(metric, sizeof(metric), "lock.%s.acquired", name);
+        cls->acquired = stats_counter(metric);
+        snprintf(metric, sizeof(metric), "lock.%s.contended", name);
+        cls->contended = stats_counter(metric);
+        snprintf(metric, sizeof(metric), "lock.%s.wait_ns", name);
+        cls->wait_ns = stats_hist(metric);
+        snprintf(metric, sizeof(metric), "lock.%s.hold_ns", name);
+        cls->hold_ns = stats_hist(metric);
+        atomic_store(&g_classes.nclasses, n + 1);
+    }
+
+    pthread_mutex_unlock(&g_classes.mutex);
+    return cls;
+}
+
+void plock_record_hold(plock_class_t *cls, void *site, uint64_t ns) {
+    stats_hist_record(cls->hold_ns, ns);
+    if (ns < PLOCK_LONG_HOLD_NS || site == NULL)
+        return;
+
+    plock_site_t *slot = site_slot(cls, site);
+    if (slot == NULL)
+        return;
+    atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->total_ns, ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&slot->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak(&slot->max_ns, &max, ns))
+        ;
+}
+
+int plock_init(plock_t *lock, const char *name) {
+    lock->hold_start = 0;
+    lock->site = NULL;
+    lock->cls = plock_class(name);
+    if (lock->cls == NULL)
+        lock->cls = &g_overflow_class;
+    return pthread_mutex_init(&lock->mutex, NULL);
+}
+
+void plock_destroy(plock_t *lock) {
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+void plock_lock(plock_t *lock) {
+    void *site = __builtin_return_address(0);
+    if (pthread_mutex_trylock(&lock->mutex) == 0) {
+        hold_begin(lock, site, false, 0);
+        return;
+    }
+
+    const uint64_t start = plock_now_ns();
+    pthread_mutex_lock(&lock->mutex);
+    const uint64_t now = plock_now_ns();
+    stats_add(lock->cls->contended, 1);
+    stats_hist_record(lock->cls->wait_ns, now - start);
+    hold_begin(lock, site, true, now);
+}
+
+int plock_trylock(plock_t *lock) {
+    int res = pthread_mutex_trylock(&lock->mutex);
+    if (res == 0)
+        hold_begin(lock, __builtin_return_address(0), false, 0);
+    return res;
+}
+
+void plock_unlock(plock_t *lock) {
+    void *site = lock->site;
+    uint64_t ns = hold_end(lock);
+    pthread_mutex_unlock(&lock->mutex);
+    if (ns)
+        plock_record_hold(lock->cls, site, ns);
+}
+
+int plock_cond_wait(pthread_cond_t *cond, plock_t *lock) {
+    return plock_cond_timedwait(cond, lock, NULL);
+}
+
+int plock_cond_timedwait(pthread_cond_t *cond, plock_t *lock,
+                         const struct timespec *abstime) {
+    void *site = lock->site;
+    uint64_t ns = hold_end(lock);
+    if (ns)
+        plock_record_hold(lock->cls, site, ns);
+
+    int res = abstime ? pthread_cond_timedwait(cond, &lock->mutex, abstime)
+                      : pthread_cond_wait(cond, &lock->mutex);
+
+    // A timed hold goes on being timed once the lock is held again.
+    if (ns) {
+        lock->hold_start = plock_now_ns();
+        lock->site = site;
+    }
+    return res;
+}
+
+void plock_admin_handler(int fd, const char *query) {
+    plock_site_t *sites[PLOCK_MAX_SITES];
+    size_t n = 0;
+    for (size_t i = 0; i < PLOCK_MAX_SITES; ++i)
+        if (atomic_load(&g_sites[i].site) && atomic_load(&g_sites[i].cls))
+            sites[n++] = &g_sites[i];
+    qsort(sites, n, sizeof(plock_site_t *), cmp_sites);
+
+    void *addrs[PLOCK_MAX_SITES];
+    for (size_t i = 0; i < n; ++i)
+        addrs[i] = atomic_load(&sites[i]->site);
+    char **names = n ? backtrace_symbols(addrs, n) : NULL;
+
+    const size_t cap = (n + 1) * PLOCK_REPORT_LINE;
+    char *body = malloc(cap);
+    if (body == NULL) {
+        free(names);
+        admin_respond(fd, "500 Internal Server Error", "text/plain", "", 0);
+        return;
+    }
+    size_t len = snprintf(body, cap, "# lock count mean_us max_us site\n");
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t count = atomic_load(&sites[i]->count);
+        const uint64_t total = atomic_load(&sites[i]->total_ns);
+        int line = snprintf(
+            body + len, cap - len, "%s %lu %lu %lu %.160s\n",
+            atomic_load(&sites[i]->cls)->name, (unsigned long)count,
+            (unsigned long)(count ? total / count / 1000 : 0),
+            (unsigned long)(atomic_load(&sites[i]->max_ns) / 1000),
+            names ? names[i] : "?");
+        if (line > 0 && (size_t)line < cap - len)
+            len += line;
+    }
+    admin_respond(fd, "200 OK", "text/plain", body, len);
+    free(names);
+    free(body);
+}
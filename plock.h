@@ -0,0 +1,102 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Profiled mutexes: a pthread mutex that reports how it is used. Locks are
+ * grouped into classes by name (every worker's inbox mutex is one class), and
+ * each class exports through stats.h:
+ *
+ * - `lock.<name>.acquired`   acquisitions,
+ * - `lock.<name>.contended`  acquisitions that found the lock taken,
+ * - `lock.<name>.wait_ns`    how long those waited,
+ * - `lock.<name>.hold_ns`    how long the lock was held.
+ *
+ * Only contended acquisitions, which are slow anyway, are timed every time.
+ * Uncontended ones are counted and timed once in PLOCK_SAMPLE_EVERY per thread,
+ * so the common path costs a thread-local increment over a bare mutex.
+ *
+ * Holds of PLOCK_LONG_HOLD_NS or more are also charged to the call site that
+ * took the lock; `/locks` on the admin port lists those sites by name.
+ */
+#ifndef PLOCK_H
+#define PLOCK_H
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PLOCK_SAMPLE_EVERY 16
+#define PLOCK_LONG_HOLD_NS (100 * 1000)
+
+/**
+ * The metrics shared by every lock of a class.
+ */
+typedef struct PlockClass {
+    char name[STATS_NAME_LEN];
+    stat_counter_t *acquired;
+    stat_counter_t *contended;
+    stat_hist_t *wait_ns;
+    stat_hist_t *hold_ns;
+} plock_class_t;
+
+/**
+ * @param  hold_start  When the current hold began, if it is being timed,
+ *                     else 0. Only touched by the holder.
+ * @param  site        Return address of the call that took the lock, for
+ *                     timed holds.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    plock_class_t *cls;
+    uint64_t hold_start;
+    void *site;
+} plock_t;
+
+/**
+ * Look up a lock class by name, creating it on first use.
+ *
+ * @return NULL if the class table is full.
+ */
+plock_class_t *plock_class(const char *name);
+
+/**
+ * Record a hold of `ns` nanoseconds taken at `site`, for locks that are not
+ * plock_t's (such as the cache's reader/writer queue).
+ */
+void plock_record_hold(plock_class_t *cls, void *site, uint64_t ns);
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+static inline uint64_t plock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int plock_init(plock_t *lock, const char *name);
+void plock_destroy(plock_t *lock);
+void plock_lock(plock_t *lock);
+
+/**
+ * @return 0 if the lock was taken, like pthread_mutex_trylock.
+ */
+int plock_trylock(plock_t *lock);
+void plock_unlock(plock_t *lock);
+
+/**
+ * pthread_cond_wait and pthread_cond_timedwait on a profiled lock. Time spent
+ * waiting on the condition does not count as holding the lock.
+ */
+int plock_cond_wait(pthread_cond_t *cond, plock_t *lock);
+int plock_cond_timedwait(pthread_cond_t *cond, plock_t *lock,
+                         const struct timespec *abstime);
+
+/**
+ * Admin handler: `/locks` lists the call sites of long holds, most frequent
+ * first.
+ */
+void plock_admin_handler(int fd, const char *query);
+
+#endif
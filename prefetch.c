@@ -0,0 +1,771 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Link prefetching from cached HTML responses.
+ */
+#define _GNU_SOURCE
+#include "prefetch.h"
+#include "fetch.h"
+#include "hashmap.h"
+#include "stats.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * How far back from an `href` the scanner looks for the start of its tag.
+ */
+#define PREFETCH_TAG_LOOKBACK 512
+
+/*
+ * Distinct links per page checked against the admission policy; further
+ * repeats of them are not caught.
+ */
+#define PREFETCH_SEEN 64
+
+/*
+ * Sequences tracked at once, in a lossy table: a new sequence whose slot is
+ * taken replaces the old one. Slots are guarded by striped locks.
+ */
+#define PREFETCH_STREAMS 1024
+#define PREFETCH_STREAM_LOCKS 16
+
+/*
+ * A sequence is prefetched once its stride has held for this many steps in
+ * a row. A single step is too weak a signal: two product pages with adjacent
+ * ids are not a sequence.
+ */
+#define PREFETCH_SEQ_CONFIRM 2
+
+/*
+ * Strides larger than this, and numbers longer than PREFETCH_SEQ_DIGITS, are
+ * not sequences worth following.
+ */
+#define PREFETCH_MAX_STRIDE 16
+#define PREFETCH_SEQ_DIGITS 18
+
+/**************** STRUCTS ****************/
+/**
+ * A page being scanned.
+ *
+ * @param  uri     The page's URI.
+ * @param  origin  Length of its scheme, host and port in `uri`.
+ * @param  dir     Length of `uri` up to the last '/' of its path, inclusive.
+ * @param  seen    Hashes of the links resolved so far.
+ */
+typedef struct {
+    const char *uri;
+    char host[FETCH_HOST_LEN];
+    char port[FETCH_PORT_LEN];
+    size_t origin;
+    size_t dir;
+    size_t seen[PREFETCH_SEEN];
+    int nseen;
+    int queued;
+} page_t;
+
+/**
+ * What queued a prefetch. Each source keeps its own accuracy stats.
+ */
+typedef enum {
+    SOURCE_LINKS,    /* Links of an HTML page. */
+    SOURCE_SEQUENCE, /* A numeric progression of URIs. */
+    NUM_SOURCES
+} source_t;
+
+/**
+ * The stats of a source, and the URIs it prefetched (cf. PREFETCH_SLOTS).
+ */
+typedef struct {
+    stat_counter_t *queued;
+    stat_counter_t *rejected;
+    stat_counter_t *dropped;
+    stat_counter_t *stored;
+    stat_counter_t *failed;
+    stat_counter_t *hits;
+    stat_counter_t *accuracy;
+    _Atomic size_t slots[PREFETCH_SLOTS];
+} source_stats_t;
+
+/**
+ * A queued prefetch.
+ *
+ * @param  stream  Index of the sequence that queued it, or -1.
+ * @param  gen     Generation of that sequence when it did. A sequence that
+ *                 diverges moves on to the next generation, which cancels
+ *                 the prefetches it still has queued.
+ */
+typedef struct {
+    char uri[PREFETCH_URI_LEN];
+    int stream;
+    unsigned gen;
+} job_t;
+
+/**
+ * A client's walk through URIs that differ only in one number, e.g.
+ * `seg_00041.ts`, `seg_00042.ts`.
+ *
+ * @param  key     Hash of the client and of the URI around the number.
+ * @param  last    Number of the last request.
+ * @param  stride  Step between the last two requests.
+ * @param  run     Steps in a row that kept the stride.
+ * @param  ahead   Highest number queued for prefetching so far.
+ * @param  gen     Cf. job_t.
+ */
+typedef struct {
+    uint64_t key;
+    uint64_t last;
+    int64_t stride;
+    int run;
+    uint64_t ahead;
+    _Atomic unsigned gen;
+} stream_t;
+
+/**************** GLOBALS ****************/
+/*
+ * The configuration and callbacks, the queue of prefetches, the sequences
+ * being followed, and the stats.
+ */
+static struct {
+    prefetch_cfg_t cfg;
+    prefetch_admit_fn admit;
+    prefetch_store_fn store;
+    void *arg;
+    bool running;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    job_t *queue;
+    size_t head;
+    size_t count;
+
+    stream_t *streams;
+    pthread_mutex_t stream_locks[PREFETCH_STREAM_LOCKS];
+
+    source_stats_t sources[NUM_SOURCES];
+    stat_counter_t *stat_pages;
+    stat_counter_t *stat_links;
+    stat_counter_t *stat_sequences;
+    stat_counter_t *stat_diverged;
+    stat_counter_t *stat_cancelled;
+} g_prefetch = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER};
+
+/**************** SCANNER ****************/
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+/**
+ * @brief Find `needle` in `len` bytes of `hay`, case-insensitively.
+ */
+static const char *find_ci(const char *hay, size_t len, const char *needle) {
+    const size_t n = strlen(needle);
+    for (size_t i = 0; i + n <= len; ++i)
+        if (strncasecmp(hay + i, needle, n) == 0)
+            return hay + i;
+    return NULL;
+}
+
+/**
+ * @brief Whether the attribute at `attr` sits in a `<link>` tag.
+ */
+static bool in_link_tag(const char *html, const char *attr) {
+    const char *stop =
+        attr - html > PREFETCH_TAG_LOOKBACK ? attr - PREFETCH_TAG_LOOKBACK
+                                            : html;
+    for (const char *p = attr - 1; p >= stop; --p) {
+        if (*p == '>')
+            return false;
+        if (*p == '<')
+            return attr - p > 5 && strncasecmp(p + 1, "link", 4) == 0 &&
+                   is_space(p[5]);
+    }
+    return false;
+}
+
+/**
+ * @brief Check a candidate '=' found by the scan: if it ends a `src` or
+ * `<link href>` attribute, pass its value on.
+ *
+ * @param[out]  next  Where scanning should resume.
+ *
+ * @return Whether to go on scanning.
+ */
+static bool check_candidate(const char *html, size_t len, size_t at,
+                            prefetch_link_fn fn, void *arg, size_t *count,
+                            size_t *next) {
+    *next = at + 1;
+    if ((html[at - 1] | 0x20) == 'c') {
+        if (at < 4 || strncasecmp(html + at - 3, "src", 3) != 0 ||
+            !is_space(html[at - 4]))
+            return true;
+    } else {
+        if (at < 5 || strncasecmp(html + at - 4, "href", 4) != 0 ||
+            !is_space(html[at - 5]) || !in_link_tag(html, html + at - 4))
+            return true;
+    }
+
+    // The value: quoted, or up to the next space or the end of the tag.
+    size_t start = at + 1;
+    while (start < len && is_space(html[start]))
+        start++;
+    if (start == len)
+        return true;
+    const char quote = (html[start] == '"' || html[start] == '\'')
+                           ? html[start++]
+                           : '\0';
+    size_t end = start;
+    while (end < len && (quote ? html[end] != quote
+                               : !is_space(html[end]) && html[end] != '>'))
+        end++;
+    if (end == len)
+        return true;
+    *next = end;
+
+    while (start < end && is_space(html[start]))
+        start++;
+    while (end > start && is_space(html[end - 1]))
+        end--;
+    if (start == end)
+        return true;
+    (*count)++;
+    return fn(html + start, end - start, arg);
+}
+
+#ifdef __SSE2__
+/**
+ * @brief Candidate attribute ends among the 16 bytes at `p`: bit i is set if
+ * p[i] is '=' and p[i - 1] is 'c' or 'f', in either case, which is how "src="
+ * and "href=" end. p[-1] must be readable.
+ */
+static inline unsigned candidates16(const char *p) {
+    const __m128i cur = _mm_loadu_si128((const __m128i *)p);
+    const __m128i before = _mm_loadu_si128((const __m128i *)(p - 1));
+    const __m128i prev = _mm_or_si128(before, _mm_set1_epi8(0x20));
+    const __m128i eq = _mm_cmpeq_epi8(cur, _mm_set1_epi8('='));
+    const __m128i cf = _mm_or_si128(_mm_cmpeq_epi8(prev, _mm_set1_epi8('c')),
+                                    _mm_cmpeq_epi8(prev, _mm_set1_epi8('f')));
+    return (unsigned)_mm_movemask_epi8(_mm_and_si128(eq, cf));
+}
+#endif
+
+size_t prefetch_find_links(const char *html, size_t len, prefetch_link_fn fn,
+                           void *arg) {
+    size_t count = 0, next = 0, i = 1;
+
+#ifdef __SSE2__
+    // Almost every byte of a page is ruled out 16 at a time; only the few
+    // "c=" and "f=" pairs are looked at one by one.
+    while (i + 16 <= len) {
+        unsigned mask = candidates16(html + i);
+        const size_t base = i;
+        i += 16;
+        while (mask) {
+            const size_t at = base + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (at < next)
+                continue;
+            if (!check_candidate(html, len, at, fn, arg, &count, &next))
+                return count;
+            if (next > i) {
+                i = next;
+                break;
+            }
+        }
+    }
+#endif
+    for (; i < len; ++i) {
+        if (i < next || html[i] != '=' ||
+            ((html[i - 1] | 0x20) != 'c' && (html[i - 1] | 0x20) != 'f'))
+            continue;
+        if (!check_candidate(html, len, i, fn, arg, &count, &next))
+            return count;
+    }
+    return count;
+}
+
+/**************** LINKS ****************/
+/**
+ * @brief Resolve the `.` and `..` segments of the path starting at `path`,
+ * in place. The query, if any, is left alone.
+ */
+static void remove_dot_segments(char *path) {
+    char out[PREFETCH_URI_LEN];
+    const size_t plen = strcspn(path, "?");
+    size_t o = 0;
+    for (size_t i = 0; i < plen;) {
+        size_t j = i + 1;
+        while (j < plen && path[j] != '/')
+            j++;
+        const char *seg = path + i + 1;
+        const size_t seglen = j - i - 1;
+        if (seglen == 1 && seg[0] == '.') {
+            if (j == plen)
+                out[o++] = '/';
+        } else if (seglen == 2 && seg[0] == '.' && seg[1] == '.') {
+            while (o > 0 && out[--o] != '/')
+                ;
+            if (j == plen)
+                out[o++] = '/';
+        } else {
+            memcpy(out + o, path + i, j - i);
+            o += j - i;
+        }
+        i = j;
+    }
+    if (o == 0)
+        out[o++] = '/';
+    const size_t qlen = strlen(path + plen);
+    if (o + qlen < PREFETCH_URI_LEN) {
+        memcpy(out + o, path + plen, qlen + 1);
+        memcpy(path, out, o + qlen + 1);
+    }
+}
+
+/**
+ * @brief Resolve a link of `page` into an absolute URI on the page's origin.
+ * `&amp;` is decoded and the fragment dropped.
+ *
+ * @param[out]  uri  PREFETCH_URI_LEN bytes.
+ *
+ * @return 0 on success, -1 if the link leads elsewhere or cannot be
+ *         prefetched.
+ */
+static int resolve_link(const page_t *page, const char *link, size_t len,
+                        char *uri) {
+    char ref[PREFETCH_URI_LEN];
+    size_t n = 0;
+    for (size_t i = 0; i < len && link[i] != '#'; ++i) {
+        if ((unsigned char)link[i] <= ' ' || n + 1 >= sizeof(ref))
+            return -1;
+        ref[n++] = link[i];
+        if (link[i] == '&' && len - i >= 5 &&
+            strncmp(link + i, "&amp;", 5) == 0)
+            i += 4;
+    }
+    ref[n] = '\0';
+    if (n == 0)
+        return -1;
+
+    int res;
+    if (strncmp(ref, "//", 2) == 0 || strncasecmp(ref, "http://", 7) == 0) {
+        // Absolute, or relative to the scheme: only the page's origin counts.
+        char host[FETCH_HOST_LEN], port[FETCH_PORT_LEN];
+        size_t path;
+        res = snprintf(uri, PREFETCH_URI_LEN, "%s%s",
+                       ref[0] == '/' ? "http:" : "", ref);
+        if (res >= PREFETCH_URI_LEN ||
+            fetch_parse_url(uri, host, port, &path) < 0 ||
+            strcasecmp(host, page->host) != 0 || strcmp(port, page->port) != 0)
+            return -1;
+        if (path == 0)
+            return -1;
+    } else if (ref[strcspn(ref, ":/?")] == ':') {
+        // Another scheme: https, data, javascript, mailto...
+        return -1;
+    } else if (ref[0] == '/') {
+        res = snprintf(uri, PREFETCH_URI_LEN, "%.*s%s", (int)page->origin,
+                       page->uri, ref);
+    } else {
+        res = snprintf(uri, PREFETCH_URI_LEN, "%.*s%s", (int)page->dir,
+                       page->uri, ref);
+    }
+    if (res < 0 || res >= PREFETCH_URI_LEN)
+        return -1;
+    remove_dot_segments(uri + strcspn(uri + 7, "/") + 7);
+    return 0;
+}
+
+/**
+ * @brief Queue a prefetch for the prefetch threads.
+ *
+ * @return 0 on success, -1 if the queue is full.
+ */
+static int enqueue(const char *uri, int stream, unsigned gen) {
+    int res = -1;
+    pthread_mutex_lock(&g_prefetch.mutex);
+    if (g_prefetch.count < PREFETCH_QUEUE) {
+        job_t *job =
+            &g_prefetch.queue[(g_prefetch.head + g_prefetch.count) %
+                              PREFETCH_QUEUE];
+        strcpy(job->uri, uri);
+        job->stream = stream;
+        job->gen = gen;
+        g_prefetch.count++;
+        pthread_cond_signal(&g_prefetch.cond);
+        res = 0;
+    }
+    pthread_mutex_unlock(&g_prefetch.mutex);
+    return res;
+}
+
+/**
+ * @brief Queue a prefetch of `uri` if the admission policy lets it in.
+ *
+ * @return 1 if it was queued, 0 if it was rejected, -1 if the queue is full.
+ */
+static int admit_and_enqueue(source_t source, const char *uri, int stream,
+                             unsigned gen) {
+    source_stats_t *stats = &g_prefetch.sources[source];
+    if (!g_prefetch.admit(uri, g_prefetch.arg)) {
+        stats_add(stats->rejected, 1);
+        return 0;
+    }
+    if (enqueue(uri, stream, gen) < 0) {
+        stats_add(stats->dropped, 1);
+        return -1;
+    }
+    stats_add(stats->queued, 1);
+    return 1;
+}
+
+/**
+ * @brief prefetch_link_fn of a page: resolve the link, and queue it if it is
+ * new and admitted, until the page's budget is spent.
+ */
+static bool on_link(const char *link, size_t len, void *arg) {
+    page_t *page = arg;
+    char uri[PREFETCH_URI_LEN];
+    stats_add(g_prefetch.stat_links, 1);
+    if (resolve_link(page, link, len, uri) < 0 || strcmp(uri, page->uri) == 0)
+        return true;
+
+    const size_t hash = get_hash(uri, strlen(uri) + 1);
+    for (int i = 0; i < page->nseen; ++i)
+        if (page->seen[i] == hash)
+            return true;
+    if (page->nseen < PREFETCH_SEEN)
+        page->seen[page->nseen++] = hash;
+
+    const int res = admit_and_enqueue(SOURCE_LINKS, uri, -1, 0);
+    page->queued += res > 0;
+    return res >= 0 && page->queued < g_prefetch.cfg.per_page;
+}
+
+/**
+ * @brief Pass the preload links of a `Link` header value to on_link, e.g.
+ * `</style.css>; rel=preload; as=style, </app.js>; rel="preload"`.
+ *
+ * @return Whether to go on scanning.
+ */
+static bool scan_link_header(page_t *page, const char *value, size_t len) {
+    const char *end = value + len;
+    const char *p = value;
+    while (p < end) {
+        const char *lt = memchr(p, '<', end - p);
+        const char *gt = lt ? memchr(lt, '>', end - lt) : NULL;
+        if (gt == NULL)
+            return true;
+        const char *params = gt + 1;
+        const char *comma = memchr(params, ',', end - params);
+        const char *params_end = comma ? comma : end;
+        const char *rel = find_ci(params, params_end - params, "rel=");
+        if (rel && find_ci(rel, params_end - rel, "preload") &&
+            !on_link(lt + 1, gt - lt - 1, page))
+            return false;
+        p = params_end;
+    }
+    return true;
+}
+
+/**************** SEQUENCES ****************/
+/**
+ * @brief Find the number a sequence of URIs would step through: the last run
+ * of digits after the host.
+ *
+ * @param[out]  at  Offset of the number in `uri`.
+ *
+ * @return Its number of digits, or 0 if there is none.
+ */
+static size_t find_number(const char *uri, size_t *at) {
+    const size_t len = strlen(uri);
+    const size_t path = 7 + strcspn(uri + 7, "/");
+    size_t end = len;
+    while (end > path && !isdigit((unsigned char)uri[end - 1]))
+        end--;
+    size_t start = end;
+    while (start > path && isdigit((unsigned char)uri[start - 1]))
+        start--;
+    *at = start;
+    return end - start;
+}
+
+/**
+ * @brief Move a stream on to its next generation, cancelling its queued
+ * prefetches.
+ */
+static void cancel_stream(stream_t *stream) {
+    if (stream->ahead > stream->last) {
+        atomic_fetch_add(&stream->gen, 1);
+        stats_add(g_prefetch.stat_diverged, 1);
+    }
+}
+
+/**
+ * @brief Record the number of a request in its stream.
+ *
+ * @param[out]  from  First number to prefetch.
+ * @param[out]  to    Last number to prefetch.
+ * @param[out]  gen   Generation to queue them under.
+ *
+ * @return The stride to prefetch with, or 0 if the stream is not (yet) a
+ *         sequence or has been prefetched far enough ahead.
+ */
+static int64_t step_stream(stream_t *stream, uint64_t key, uint64_t n,
+                           uint64_t *from, uint64_t *to, unsigned *gen) {
+    if (stream->key != key) {
+        cancel_stream(stream);
+        stream->key = key;
+        stream->last = stream->ahead = n;
+        stream->stride = 0;
+        stream->run = 0;
+        return 0;
+    }
+    if (n == stream->last)
+        return 0;
+
+    const int64_t stride = (int64_t)(n - stream->last);
+    if (stride == stream->stride) {
+        stream->run++;
+    } else {
+        // The client seeked, skipped or started over: whatever is queued
+        // ahead of it is no longer wanted.
+        cancel_stream(stream);
+        stream->stride = stride;
+        stream->run = 1;
+        stream->ahead = n;
+    }
+    stream->last = n;
+    if (stride <= 0 || stride > PREFETCH_MAX_STRIDE ||
+        stream->run < PREFETCH_SEQ_CONFIRM)
+        return 0;
+    if (stream->run == PREFETCH_SEQ_CONFIRM)
+        stats_add(g_prefetch.stat_sequences, 1);
+
+    *from = (stream->ahead > n ? stream->ahead : n) + stride;
+    *to = n + (uint64_t)g_prefetch.cfg.seq_depth * stride;
+    *gen = atomic_load(&stream->gen);
+    if (*from > *to)
+        return 0;
+    stream->ahead = *to;
+    return stride;
+}
+
+/**************** THREADS ****************/
+static void update_accuracy(source_stats_t *stats) {
+    const uint64_t stored = stats_get(stats->stored);
+    if (stored)
+        stats_set(stats->accuracy, stats_get(stats->hits) * 100 / stored);
+}
+
+static void *thread_prefetch(void *vargp) {
+    // Nice values are per thread on Linux.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), PREFETCH_NICE);
+    char *buf = malloc(g_prefetch.cfg.max_object);
+    job_t job;
+    while (buf) {
+        pthread_mutex_lock(&g_prefetch.mutex);
+        while (g_prefetch.count == 0)
+            pthread_cond_wait(&g_prefetch.cond, &g_prefetch.mutex);
+        job = g_prefetch.queue[g_prefetch.head];
+        g_prefetch.head = (g_prefetch.head + 1) % PREFETCH_QUEUE;
+        g_prefetch.count--;
+        pthread_mutex_unlock(&g_prefetch.mutex);
+
+        source_stats_t *stats =
+            &g_prefetch.sources[job.stream < 0 ? SOURCE_LINKS
+                                               : SOURCE_SEQUENCE];
+        if (job.stream >= 0 &&
+            atomic_load(&g_prefetch.streams[job.stream].gen) != job.gen) {
+            stats_add(g_prefetch.stat_cancelled, 1);
+            continue;
+        }
+        // A client may have asked for it while it was queued.
+        if (!g_prefetch.admit(job.uri, g_prefetch.arg)) {
+            stats_add(stats->rejected, 1);
+            continue;
+        }
+        char host[FETCH_HOST_LEN], port[FETCH_PORT_LEN];
+        size_t path;
+        ssize_t len = -1;
+        if (fetch_parse_url(job.uri, host, port, &path) == 0)
+            len = fetch_get(host, port, job.uri + path, buf,
+                            g_prefetch.cfg.max_object);
+        if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0 ||
+            strncmp(buf + 8, " 200", 4) != 0) {
+            stats_add(stats->failed, 1);
+            continue;
+        }
+        if (g_prefetch.store(job.uri, buf, len, g_prefetch.arg)) {
+            const size_t hash = get_hash(job.uri, strlen(job.uri) + 1);
+            atomic_store(&stats->slots[hash % PREFETCH_SLOTS], hash);
+            stats_add(stats->stored, 1);
+            update_accuracy(stats);
+        }
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int prefetch_start(const prefetch_cfg_t *cfg, prefetch_admit_fn admit,
+                   prefetch_store_fn store, void *arg) {
+    if (cfg->per_page < 0 || cfg->seq_depth < 0 ||
+        (cfg->per_page == 0 && cfg->seq_depth == 0) || cfg->max_object == 0)
+        return -1;
+    g_prefetch.cfg = *cfg;
+    g_prefetch.admit = admit;
+    g_prefetch.store = store;
+    g_prefetch.arg = arg;
+    g_prefetch.queue = malloc(PREFETCH_QUEUE * sizeof(job_t));
+    g_prefetch.streams = calloc(PREFETCH_STREAMS, sizeof(stream_t));
+    if (g_prefetch.queue == NULL || g_prefetch.streams == NULL)
+        return -1;
+    for (int i = 0; i < PREFETCH_STREAM_LOCKS; ++i)
+        pthread_mutex_init(&g_prefetch.stream_locks[i], NULL);
+
+    const char *prefixes[NUM_SOURCES] = {
+        [SOURCE_LINKS] = "prefetch",
+        [SOURCE_SEQUENCE] = "prefetch.seq",
+    };
+    const char *names[] = {"queued", "rejected", "dropped",     "stored",
+                           "failed", "hits",     "accuracy_pct"};
+    for (int i = 0; i < NUM_SOURCES; ++i) {
+        source_stats_t *stats = &g_prefetch.sources[i];
+        stat_counter_t **counters[] = {
+            &stats->queued, &stats->rejected, &stats->dropped,
+            &stats->stored, &stats->failed,   &stats->hits,
+            &stats->accuracy,
+        };
+        for (size_t j = 0; j < sizeof(names) / sizeof(names[0]); ++j) {
+            char name[64];
+            snprintf(name, sizeof(name), "%s.%s", prefixes[i], names[j]);
+            *counters[j] = stats_counter(name);
+        }
+    }
+    g_prefetch.stat_pages = stats_counter("prefetch.pages");
+    g_prefetch.stat_links = stats_counter("prefetch.links");
+    g_prefetch.stat_sequences = stats_counter("prefetch.seq.sequences");
+    g_prefetch.stat_diverged = stats_counter("prefetch.seq.diverged");
+    g_prefetch.stat_cancelled = stats_counter("prefetch.seq.cancelled");
+
+    for (int i = 0; i < PREFETCH_THREADS; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, thread_prefetch, NULL) != 0)
+            return -1;
+        pthread_detach(tid);
+    }
+    g_prefetch.running = true;
+    return 0;
+}
+
+void prefetch_scan(const char *uri, const char *response, size_t len) {
+    if (!g_prefetch.running || g_prefetch.cfg.per_page == 0 || len < 12 ||
+        strncmp(response, "HTTP/1.", 7) != 0 ||
+        strncmp(response + 8, " 200", 4) != 0)
+        return;
+    const char *head_end = memmem(response, len, "\r\n\r\n", 4);
+    if (head_end == NULL)
+        return;
+
+    page_t page = {.uri = uri, .nseen = 0, .queued = 0};
+    size_t path;
+    if (fetch_parse_url(uri, page.host, page.port, &path) < 0 || path == 0)
+        return;
+    page.origin = path;
+    page.dir = path + 1;
+    for (size_t i = path, query = strcspn(uri, "?"); i < query; ++i)
+        if (uri[i] == '/')
+            page.dir = i + 1;
+
+    // Headers: the content type, and preload links.
+    bool html = false;
+    const char *line = memchr(response, '\n', head_end - response);
+    while (line && line < head_end) {
+        line++;
+        const char *eol = memchr(line, '\n', head_end + 2 - line);
+        if (eol == NULL)
+            break;
+        const size_t n = eol - line;
+        if (n > 13 && strncasecmp(line, "Content-Type:", 13) == 0)
+            html = find_ci(line, n, "text/html") != NULL;
+        else if (n > 5 && strncasecmp(line, "Link:", 5) == 0 &&
+                 !scan_link_header(&page, line + 5, n - 5))
+            return;
+        line = eol;
+    }
+    if (!html)
+        return;
+
+    stats_add(g_prefetch.stat_pages, 1);
+    const char *body = head_end + 4;
+    prefetch_find_links(body, response + len - body, on_link, &page);
+}
+
+void prefetch_observe(uint64_t client, const char *uri) {
+    if (!g_prefetch.running || g_prefetch.cfg.seq_depth == 0 ||
+        strncasecmp(uri, "http://", 7) != 0)
+        return;
+    size_t at;
+    const size_t digits = find_number(uri, &at);
+    if (digits == 0 || digits > PREFETCH_SEQ_DIGITS)
+        return;
+    const char *suffix = uri + at + digits;
+    const uint64_t n = strtoull(uri + at, NULL, 10);
+    const uint64_t key = (get_hash(uri, at) * 31 +
+                          get_hash(suffix, strlen(suffix))) ^
+                         (client * 0x9e3779b97f4a7c15ULL);
+
+    const int idx = key % PREFETCH_STREAMS;
+    pthread_mutex_t *lock =
+        &g_prefetch.stream_locks[idx % PREFETCH_STREAM_LOCKS];
+    uint64_t from, to;
+    unsigned gen;
+    pthread_mutex_lock(lock);
+    const int64_t stride =
+        step_stream(&g_prefetch.streams[idx], key, n, &from, &to, &gen);
+    pthread_mutex_unlock(lock);
+    if (stride == 0)
+        return;
+
+    // Keep the zero padding, e.g. seg_00041.ts -> seg_00042.ts.
+    char next[PREFETCH_URI_LEN];
+    for (uint64_t m = from; m <= to; m += stride) {
+        int res = snprintf(next, sizeof(next), "%.*s%0*" PRIu64 "%s", (int)at,
+                           uri, (int)digits, m, suffix);
+        if (res < 0 || res >= PREFETCH_URI_LEN ||
+            admit_and_enqueue(SOURCE_SEQUENCE, next, idx, gen) < 0)
+            break;
+    }
+}
+
+void prefetch_note_hit(const char *uri) {
+    if (!g_prefetch.running)
+        return;
+    const size_t hash = get_hash(uri, strlen(uri) + 1);
+    for (int i = 0; i < NUM_SOURCES; ++i) {
+        source_stats_t *stats = &g_prefetch.sources[i];
+        _Atomic size_t *slot = &stats->slots[hash % PREFETCH_SLOTS];
+        size_t expected = hash;
+        if (atomic_load(slot) == hash &&
+            atomic_compare_exchange_strong(slot, &expected, 0)) {
+            stats_add(stats->hits, 1);
+            update_accuracy(stats);
+            return;
+        }
+    }
+}
@@ -0,0 +1,127 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Link and sequence prefetching. When a client loads an HTML page through
+ * the proxy, the browser asks for the page's stylesheets, scripts and images
+ * milliseconds later, and every one of them misses. The prefetcher scans HTML
+ * responses as they are cached and fetches their subresources ahead of the
+ * browser.
+ *
+ * Links are taken from `src` attributes of any tag, `href` attributes of
+ * `<link>` tags (navigation links of `<a>` tags are left alone) and
+ * `Link: <...>; rel=preload` response headers. Only links to the page's own
+ * origin count, and at most `per_page` of them per page are queued.
+ *
+ * Fetches are queued to a few threads of their own, running at a lower CPU
+ * priority than the relays, so that prefetching never takes a worker away
+ * from a client. The queue is bounded; when it is full, links are dropped.
+ *
+ * Sequences are prefetched too: segmented media (HLS/DASH) and paginated
+ * APIs walk through URIs that differ in one number, `seg_00041.ts`,
+ * `seg_00042.ts`... For every client and every such URI pattern, the
+ * prefetcher follows the last number of the URI; once it has moved by the
+ * same small stride twice in a row, the next `seq_depth` numbers are queued
+ * ahead of the client. When the client leaves the
+ * progression (it seeks, skips or starts over), whatever is still queued for
+ * it is cancelled.
+ *
+ * Accuracy is exported as `prefetch.hits`, the prefetched objects that a
+ * client later asked for, against `prefetch.stored`, with their ratio in
+ * `prefetch.accuracy_pct`; sequences have the same stats under
+ * `prefetch.seq.*`. A prefetched object that is evicted before anyone asks
+ * for it counts as a miss.
+ */
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PREFETCH_DEFAULT_PER_PAGE 8
+#define PREFETCH_DEFAULT_SEQ_DEPTH 3
+#define PREFETCH_QUEUE 256
+#define PREFETCH_THREADS 2
+#define PREFETCH_NICE 10
+#define PREFETCH_URI_LEN 1024
+
+/*
+ * Prefetched URIs remembered for the accuracy count. Lossy: a colliding URI
+ * simply replaces the slot, and its hit goes uncounted.
+ */
+#define PREFETCH_SLOTS 4096
+
+/**
+ * @param  per_page    Links queued per page at most (0 = links off).
+ * @param  seq_depth   How far ahead of a client to prefetch a sequence
+ *                     (0 = sequences off).
+ * @param  max_object  Responses larger than this are not fetched in full.
+ */
+typedef struct {
+    int per_page;
+    int seq_depth;
+    size_t max_object;
+} prefetch_cfg_t;
+
+/**
+ * Admission policy: whether `uri` is worth prefetching. Called once when a
+ * link is found, and again right before it is fetched.
+ */
+typedef bool (*prefetch_admit_fn)(const char *uri, void *arg);
+
+/**
+ * Called from the prefetch threads with every complete 200 response.
+ *
+ * @return Whether the response was stored.
+ */
+typedef bool (*prefetch_store_fn)(const char *uri, const char *response,
+                                  size_t len, void *arg);
+
+/**
+ * Called by prefetch_find_links with every candidate link, exactly as it
+ * appears in the page, and as long as it returns true.
+ */
+typedef bool (*prefetch_link_fn)(const char *link, size_t len, void *arg);
+
+/**
+ * Start the prefetch threads. Progress is exported as `prefetch.*` stats.
+ *
+ * @return 0 on success, -1 if neither links nor sequences are on or the
+ *         threads could not be started.
+ */
+int prefetch_start(const prefetch_cfg_t *cfg, prefetch_admit_fn admit,
+                   prefetch_store_fn store, void *arg);
+
+/**
+ * Queue prefetches for the subresources of a response being cached for
+ * `uri`. Returns right away for anything but a successful response, and only
+ * scans the body of HTML. Does nothing unless prefetch_start was called with
+ * links on.
+ */
+void prefetch_scan(const char *uri, const char *response, size_t len);
+
+/**
+ * Follow the requests of `client`, any number that identifies it (e.g. its
+ * address), for sequences, and queue prefetches ahead of it. Called with
+ * every request, cached or not. Does nothing unless prefetch_start was
+ * called with sequences on.
+ */
+void prefetch_observe(uint64_t client, const char *uri);
+
+/**
+ * Note a cache hit on `uri`, counting it if `uri` was prefetched. Does
+ * nothing unless prefetch_start was called.
+ */
+void prefetch_note_hit(const char *uri);
+
+/**
+ * Find the `src` and `<link href>` attribute values in an HTML document.
+ * Candidate attributes are located 16 bytes at a time with SSE2 where
+ * available.
+ *
+ * @return The number of links passed to `fn`.
+ */
+size_t prefetch_find_links(const char *html, size_t len, prefetch_link_fn fn,
+                           void *arg);
+
+#endif
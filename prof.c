@@ -0,0 +1,405 @@
+/**
+ * @author Jonathan Helland
+ *
+ * SIGPROF sampling profiler with per-thread sample buffers.
+ */
+#include "prof.h"
+#include "admin.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROF_MAX_DEPTH 48
+#define PROF_CHUNK_SAMPLES 64
+#define PROF_SPARE_CHUNKS 64
+#define PROF_NAMELEN 128
+
+/*
+ * Frames of the signal handler and the kernel's signal trampoline, on top of
+ * the interrupted stack.
+ */
+#define PROF_SKIP_FRAMES 2
+
+/**************** STRUCTS ****************/
+/**
+ * One sampled call stack, innermost frame first. Unused samples have depth 0.
+ */
+typedef struct {
+    _Atomic uint32_t depth;
+    void *frames[PROF_MAX_DEPTH];
+} prof_sample_t;
+
+/**
+ * @param  samples     Every sample slot of the running profile, handed to
+ *                     threads PROF_CHUNK_SAMPLES at a time.
+ * @param  next_chunk  Next chunk to hand out.
+ * @param  session     Bumped by each profile, so that threads notice that
+ *                     the chunk they hold belongs to an older one.
+ * @param  in_handler  Handlers currently running, waited out by prof_stop.
+ */
+typedef struct {
+    prof_sample_t *samples;
+    size_t nchunks;
+    atomic_size_t next_chunk;
+    atomic_uint session;
+    atomic_bool running;
+    atomic_int in_handler;
+    bool installed;
+
+    stat_counter_t *stat_samples;
+    stat_counter_t *stat_dropped;
+} prof_t;
+
+/**
+ * A frame address and its name, for symbolizing. Addresses with the same name
+ * (different call sites within one function) share the `canon` address.
+ */
+typedef struct {
+    void *addr;
+    void *canon;
+    char name[PROF_NAMELEN];
+} prof_symbol_t;
+
+/**************** GLOBALS ****************/
+static prof_t g_prof;
+static pthread_mutex_t g_prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The chunk of samples the current thread fills, and the profile it belongs
+ * to.
+ */
+static __thread unsigned t_session;
+static __thread prof_sample_t *t_chunk;
+static __thread unsigned t_used;
+
+/**************** SAMPLING ****************/
+static void prof_handler(int sig) {
+    const int saved_errno = errno;
+    atomic_fetch_add(&g_prof.in_handler, 1);
+    if (!atomic_load(&g_prof.running))
+        goto out;
+
+    const unsigned session = atomic_load(&g_prof.session);
+    if (t_session != session || t_used == PROF_CHUNK_SAMPLES) {
+        size_t chunk = atomic_fetch_add(&g_prof.next_chunk, 1);
+        t_session = session;
+        t_used = 0;
+        t_chunk = (chunk < g_prof.nchunks)
+                      ? &g_prof.samples[chunk * PROF_CHUNK_SAMPLES]
+                      : NULL;
+    }
+    if (t_chunk == NULL) {
+        stats_add(g_prof.stat_dropped, 1);
+        goto out;
+    }
+
+    void *frames[PROF_MAX_DEPTH + PROF_SKIP_FRAMES];
+    int depth = backtrace(frames, PROF_MAX_DEPTH + PROF_SKIP_FRAMES) -
+                PROF_SKIP_FRAMES;
+    if (depth > 0) {
+        prof_sample_t *sample = &t_chunk[t_used++];
+        memcpy(sample->frames, frames + PROF_SKIP_FRAMES,
+               depth * sizeof(void *));
+        atomic_store(&sample->depth, depth);
+        stats_add(g_prof.stat_samples, 1);
+    }
+
+out:
+    atomic_fetch_sub(&g_prof.in_handler, 1);
+    errno = saved_errno;
+}
+
+/**************** AGGREGATION ****************/
+static int cmp_samples(const void *a, const void *b) {
+    const prof_sample_t *x = *(prof_sample_t *const *)a;
+    const prof_sample_t *y = *(prof_sample_t *const *)b;
+    uint32_t dx = atomic_load(&x->depth), dy = atomic_load(&y->depth);
+    if (dx != dy)
+        return dx < dy ? -1 : 1;
+    return memcmp(x->frames, y->frames, dx * sizeof(void *));
+}
+
+static int cmp_symbols(const void *a, const void *b) {
+    const prof_symbol_t *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int cmp_symbol_names(const void *a, const void *b) {
+    const prof_symbol_t *x = *(prof_symbol_t *const *)a;
+    const prof_symbol_t *y = *(prof_symbol_t *const *)b;
+    return strcmp(x->name, y->name);
+}
+
+/**
+ * @brief Turn a line of backtrace_symbols(3), "path(func+0x1f) [0x...]" or
+ * "path(+0x1f) [0x...]", into "func", or "binary+0x1f" when the function has
+ * no exported name.
+ */
+static void symbol_name(const char *line, char *name, size_t len) {
+    const char *open = strchr(line, '(');
+    const char *close = open ? strchr(open, ')') : NULL;
+    if (open == NULL || close == NULL) {
+        snprintf(name, len, "%s", line);
+        return;
+    }
+    const char *plus = memchr(open, '+', close - open);
+    if (plus && plus > open + 1) {
+        snprintf(name, len, "%.*s", (int)(plus - open - 1), open + 1);
+        return;
+    }
+    const char *base = line;
+    for (const char *p = line; p < open; ++p)
+        if (*p == '/')
+            base = p + 1;
+    snprintf(name, len, "%.*s%.*s", (int)(open - base), base,
+             (int)(close - open - 1), open + 1);
+}
+
+/**
+ * @brief Name every distinct frame address of the given samples.
+ *
+ * @return Symbols sorted by address, for lookup with bsearch.
+ */
+static prof_symbol_t *symbolize(prof_sample_t **samples, size_t n,
+                                size_t *nsymbols) {
+    size_t nframes = 0;
+    for (size_t i = 0; i < n; ++i)
+        nframes += atomic_load(&samples[i]->depth);
+
+    prof_symbol_t *symbols = malloc((nframes + 1) * sizeof(prof_symbol_t));
+    void **addrs = malloc((nframes + 1) * sizeof(void *));
+    if (symbols == NULL || addrs == NULL) {
+        free(symbols);
+        free(addrs);
+        return NULL;
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i)
+        for (uint32_t d = 0; d < atomic_load(&samples[i]->depth); ++d)
+            symbols[k++].addr = samples[i]->frames[d];
+    qsort(symbols, k, sizeof(prof_symbol_t), cmp_symbols);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < k; ++i)
+        if (unique == 0 || symbols[unique - 1].addr != symbols[i].addr)
+            symbols[unique++].addr = symbols[i].addr;
+    for (size_t i = 0; i < unique; ++i)
+        addrs[i] = symbols[i].addr;
+
+    char **lines = backtrace_symbols(addrs, unique);
+    for (size_t i = 0; i < unique; ++i) {
+        if (lines)
+            symbol_name(lines[i], symbols[i].name, PROF_NAMELEN);
+        else
+            snprintf(symbols[i].name, PROF_NAMELEN, "%p", addrs[i]);
+    }
+    free(lines);
+
+    // Reuse the address array to group the symbols by name.
+    prof_symbol_t **by_name = (prof_symbol_t **)addrs;
+    for (size_t i = 0; i < unique; ++i)
+        by_name[i] = &symbols[i];
+    qsort(by_name, unique, sizeof(prof_symbol_t *), cmp_symbol_names);
+    for (size_t i = 0; i < unique; ++i)
+        by_name[i]->canon = (i > 0 && cmp_symbol_names(&by_name[i - 1],
+                                                       &by_name[i]) == 0)
+                                ? by_name[i - 1]->canon
+                                : by_name[i]->addr;
+    free(addrs);
+    *nsymbols = unique;
+    return symbols;
+}
+
+static prof_symbol_t *lookup(prof_symbol_t *symbols, size_t nsymbols,
+                             void *addr) {
+    prof_symbol_t key = {.addr = addr};
+    return bsearch(&key, symbols, nsymbols, sizeof(prof_symbol_t),
+                   cmp_symbols);
+}
+
+/**
+ * @brief Fold the samples: one line per distinct stack of function names,
+ * outermost frame first, frames separated by ';', followed by the number of
+ * samples.
+ */
+static char *fold(prof_sample_t **samples, size_t n, size_t *len) {
+    size_t nsymbols = 0;
+    prof_symbol_t *symbols = symbolize(samples, n, &nsymbols);
+    size_t cap = 4096, used = 0;
+    char *out = malloc(cap);
+    if (symbols == NULL || out == NULL) {
+        free(symbols);
+        free(out);
+        return NULL;
+    }
+    out[0] = '\0';
+
+    for (size_t i = 0; i < n; ++i)
+        for (uint32_t d = 0; d < atomic_load(&samples[i]->depth); ++d)
+            samples[i]->frames[d] =
+                lookup(symbols, nsymbols, samples[i]->frames[d])->canon;
+    qsort(samples, n, sizeof(prof_sample_t *), cmp_samples);
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && cmp_samples(&samples[i], &samples[j]) == 0)
+            ++j;
+
+        const uint32_t depth = atomic_load(&samples[i]->depth);
+        if (cap - used < depth * (PROF_NAMELEN + 1) + 32) {
+            cap = 2 * cap + depth * (PROF_NAMELEN + 1) + 32;
+            char *grown = realloc(out, cap);
+            if (grown == NULL) {
+                free(out);
+                free(symbols);
+                return NULL;
+            }
+            out = grown;
+        }
+        for (uint32_t d = depth; d-- > 0;)
+            used += snprintf(out + used, cap - used, "%s%s",
+                             lookup(symbols, nsymbols,
+                                    samples[i]->frames[d])->name,
+                             d > 0 ? ";" : "");
+        used += snprintf(out + used, cap - used, " %zu\n", j - i);
+        i = j;
+    }
+
+    free(symbols);
+    *len = used;
+    return out;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int prof_start(unsigned hz, unsigned seconds) {
+    pthread_mutex_lock(&g_prof_mutex);
+    if (atomic_load(&g_prof.running) || hz == 0 || hz > PROF_MAX_HZ) {
+        pthread_mutex_unlock(&g_prof_mutex);
+        return -1;
+    }
+
+    // Samples arrive at `hz` per CPU-second, across all CPUs; every thread
+    // that gets sampled may leave a chunk partly unused.
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t expected = (size_t)hz * seconds * (ncpus > 0 ? ncpus : 1);
+    g_prof.nchunks =
+        (expected + PROF_CHUNK_SAMPLES - 1) / PROF_CHUNK_SAMPLES +
+        PROF_SPARE_CHUNKS;
+    g_prof.samples =
+        calloc(g_prof.nchunks * PROF_CHUNK_SAMPLES, sizeof(prof_sample_t));
+    if (g_prof.samples == NULL) {
+        pthread_mutex_unlock(&g_prof_mutex);
+        return -1;
+    }
+    atomic_store(&g_prof.next_chunk, 0);
+    atomic_fetch_add(&g_prof.session, 1);
+
+    // The handler stays installed for good: a SIGPROF still in flight after
+    // a profile ends would otherwise kill the process. backtrace(3) loads the
+    // unwinder on first use, which must not happen inside the handler.
+    if (!g_prof.installed) {
+        void *frame;
+        backtrace(&frame, 1);
+        g_prof.stat_samples = stats_counter("prof.samples");
+        g_prof.stat_dropped = stats_counter("prof.dropped");
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = prof_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, NULL) < 0) {
+            free(g_prof.samples);
+            g_prof.samples = NULL;
+            pthread_mutex_unlock(&g_prof_mutex);
+            return -1;
+        }
+        g_prof.installed = true;
+    }
+
+    atomic_store(&g_prof.running, true);
+    struct itimerval timer = {
+        .it_interval = {.tv_sec = 0, .tv_usec = 1000000 / hz},
+        .it_value = {.tv_sec = 0, .tv_usec = 1000000 / hz},
+    };
+    if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+        atomic_store(&g_prof.running, false);
+        free(g_prof.samples);
+        g_prof.samples = NULL;
+        pthread_mutex_unlock(&g_prof_mutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&g_prof_mutex);
+    return 0;
+}
+
+char *prof_stop(size_t *len) {
+    pthread_mutex_lock(&g_prof_mutex);
+    if (!atomic_load(&g_prof.running)) {
+        pthread_mutex_unlock(&g_prof_mutex);
+        return NULL;
+    }
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+    atomic_store(&g_prof.running, false);
+    while (atomic_load(&g_prof.in_handler) > 0)
+        ;
+
+    const size_t total = g_prof.nchunks * PROF_CHUNK_SAMPLES;
+    prof_sample_t **samples = malloc((total + 1) * sizeof(prof_sample_t *));
+    char *out = NULL;
+    if (samples) {
+        size_t n = 0;
+        for (size_t i = 0; i < total; ++i)
+            if (atomic_load(&g_prof.samples[i].depth) > 0)
+                samples[n++] = &g_prof.samples[i];
+        out = fold(samples, n, len);
+        free(samples);
+    }
+    free(g_prof.samples);
+    g_prof.samples = NULL;
+    pthread_mutex_unlock(&g_prof_mutex);
+    return out;
+}
+
+void prof_admin_handler(int fd, const char *query) {
+    char buf[16];
+    unsigned seconds = 10, hz = PROF_DEFAULT_HZ;
+    if (admin_query_param(query, "seconds", buf, sizeof(buf)))
+        seconds = strtoul(buf, NULL, 10);
+    if (admin_query_param(query, "hz", buf, sizeof(buf)))
+        hz = strtoul(buf, NULL, 10);
+    if (seconds == 0 || seconds > PROF_MAX_SECONDS || hz == 0 ||
+        hz > PROF_MAX_HZ) {
+        admin_respond(fd, "400 Bad Request", "text/plain", "", 0);
+        return;
+    }
+
+    if (prof_start(hz, seconds) < 0) {
+        admin_respond(fd, "409 Conflict", "text/plain", "", 0);
+        return;
+    }
+    // Samples interrupt whichever thread is running, this one included.
+    struct timespec left = {.tv_sec = seconds, .tv_nsec = 0};
+    while (nanosleep(&left, &left) < 0 && errno == EINTR)
+        ;
+    size_t len = 0;
+    char *folded = prof_stop(&len);
+    if (folded == NULL) {
+        admin_respond(fd, "500 Internal Server Error", "text/plain", "", 0);
+        return;
+    }
+    admin_respond(fd, "200 OK", "text/plain", folded, len);
+    free(folded);
+}
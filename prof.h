@@ -0,0 +1,50 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A sampling CPU profiler that lives in the proxy, for hosts where no external
+ * profiler can be attached. While a profile runs, an ITIMER_PROF timer sends
+ * SIGPROF to whichever thread is burning CPU, and the handler records that
+ * thread's call stack into a buffer of its own. Once the profile is over the
+ * stacks are aggregated into the folded format that flamegraph tools read:
+ * one line per distinct stack, outermost frame first, with its sample count.
+ *
+ * The timer only runs while a profile does, so an idle profiler costs
+ * nothing.
+ *
+ * Frames are named through the dynamic symbol table; link with -rdynamic to
+ * see the names of the proxy's own functions rather than offsets into it.
+ */
+#ifndef PROF_H
+#define PROF_H
+
+#include <stddef.h>
+
+#define PROF_DEFAULT_HZ 99
+#define PROF_MAX_HZ 1000
+#define PROF_MAX_SECONDS 60
+
+/**
+ * Start sampling at `hz` samples per CPU-second, with room for `seconds`
+ * worth of samples; later samples are dropped.
+ *
+ * @return 0 on success, -1 if a profile is already running or the timer
+ *         could not be set.
+ */
+int prof_start(unsigned hz, unsigned seconds);
+
+/**
+ * Stop sampling and aggregate the samples into folded stacks.
+ *
+ * @param[out]  len  Length of the result.
+ *
+ * @return The folded stacks as a malloc'd string, NULL on failure.
+ */
+char *prof_stop(size_t *len);
+
+/**
+ * Admin handler: `/profile?seconds=N&hz=H` profiles for N seconds (default
+ * 10) and responds with the folded stacks. Busy for as long as it profiles.
+ */
+void prof_admin_handler(int fd, const char *query);
+
+#endif
@@ -4,26 +4,61 @@
  * Multithreaded web proxy with caching.
  *
  * The cache is implemented using a hash table (using Robin Hood hashing) and a
- * doubly linked circular list for the LRU eviction policy. Cache access is
- * synchronized using a LIFO queue with a mutex.
+ * doubly linked circular list for the LRU eviction policy. Every cache call
+ * is made under one lock, g_cache_lock (cf. plock.h), held only for the
+ * lookup or insertion itself: a hit takes a reference on its block and sends
+ * it to the client outside the lock, and a block evicted meanwhile is freed
+ * when its last reference is dropped (cf. cache_release).
  *
- * Known bug: sometimes objects will be evicted from the cache before they are
- * finished being referenced. I cannot for the life of me figure out why -- the
- * whole point of the LIFO queue was to track the count of readers and prevent
- * any writes (which cause evictions) while readers are still accessing the
- * cache.
+ * Connections are relayed either on a thread each (the default) or, with `-c`,
+ * as coroutines multiplexed over a handful of event loop threads. The relay
+ * code is the same in both cases; see coro.h.
+ *
+ * With `-k`, clients may keep their connection open between requests. An idle
+ * connection holds no buffers, thread or coroutine: it waits in a parking lot
+ * (cf. park.h) until its next request arrives, and I/O buffers are borrowed
+ * from shared pools (cf. bufpool.h) only while a request is being relayed.
+ *
+ * Responses are streamed with the origin and the client each going at its own
+ * pace (cf. relay_stream): the origin is drained into the cache buffer and a
+ * bounded spill queue (cf. spill.h), and released as soon as it is done.
  */
 
 #include "csapp.h"
 #include "http_parser.h"
+#include "admin.h"
+#include "alog.h"
+#include "bufpool.h"
 #include "cache.h"
+#include "cacheshm.h"
+#include "cgmem.h"
+#include "coro.h"
+#include "journal.h"
+#include "mem.h"
+#include "ntcopy.h"
+#include "park.h"
+#include "plock.h"
+#include "prefetch.h"
+#include "prof.h"
+#include "purge.h"
+#include "repl.h"
+#include "ring.h"
+#include "sched.h"
+#include "spill.h"
+#include "stats.h"
+#include "statshm.h"
+#include "tcpstat.h"
+#include "unixsock.h"
+#include "warmup.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +70,7 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -57,6 +93,44 @@
 #define MAX_CACHE_SIZE (1024 * 1024)
 #define MAX_OBJECT_SIZE (100 * 1024)
 
+/*
+ * Cached responses at least this large are served from the large-transfer
+ * lane rather than inline by the lookup.
+ */
+#define LARGE_HIT_SIZE (64 * 1024)
+
+/*
+ * Slots of the table remembering URIs whose responses were too large to cache.
+ */
+#define LARGE_URI_SLOTS 1024
+
+/*
+ * Entries evicted per hold of the cache lock when the cache budget shrinks.
+ */
+#define CACHE_TRIM_BATCH 32
+
+/*
+ * Buffers borrowed from g_io_pool hold a rio_t, a request line or a request.
+ */
+#define IO_BUFSIZE (sizeof(rio_t) > MAXLINE ? sizeof(rio_t) : MAXLINE)
+#define IO_POOL_MAX_FREE 256
+#define OBJECT_POOL_MAX_FREE 64
+
+/*
+ * Responses larger than an object are queued for slow clients in chunks of
+ * SPILL_CHUNK_SIZE, up to the per-connection cap set by `-b`.
+ */
+#define SPILL_CHUNK_SIZE (16 * 1024)
+#define SPILL_POOL_MAX_FREE 256
+#define DEFAULT_SPILL_CAP (256 * 1024)
+
+/*
+ * Access log defaults: rotate at 64 MB and keep four old files.
+ */
+#define ALOG_ROTATE_MB 64
+#define ALOG_KEEP 4
+#define ALOG_RING_RECORDS 1024
+
 /**************** STRUCTS, TYPES, & ENUMS ****************/
 /**
  * Convenient shorthand for socket addresses.
@@ -67,10 +141,50 @@ typedef struct sockaddr SA;
  * @brief Struct to hold user-specified options for runtime.
  */
 typedef struct {
-    bool verbose; /* Display errors, primarily. */
-    char *port;   /* Port to listen to for client connections. */
+    bool verbose;   /* Display errors, primarily. */
+    char *port;     /* Port to listen to for client connections. */
+    char *unix_path; /* UNIX socket to listen to as well (NULL = off). */
+    int coro_loops; /* Event loop threads running coroutines (0 = off). */
+    int workers;    /* Worker pool threads (0 = thread per connection). */
+    char *admin_port; /* Port for the admin interface (NULL = off). */
+    int reserve[3]; /* Workers reserved for each lane_t (-1 = default). */
+    int min_workers; /* Bounds of the self-sizing pool (0 = fixed size). */
+    int max_workers;
+    int keepalive_s; /* Idle timeout of keep-alive connections (0 = off). */
+    size_t spill_cap; /* Response bytes queued per slow client. */
+    alog_cfg_t alog; /* Access log (path NULL = off). */
+    char *metrics_path; /* Metrics segment (NULL = off). */
+    unsigned metrics_interval_ms; /* How often to publish it. */
+    unsigned tcp_samples; /* TCP_INFO samples per second (0 = off). */
+    cache_budget_t cache_budget; /* What MAX_CACHE_SIZE applies to. */
+    size_t cache_min; /* Bounds of the adaptive cache budget (0 = fixed). */
+    size_t cache_max;
+    char *cgroup_dir; /* Where to read memory usage (NULL = own cgroup). */
+    warmup_cfg_t warmup; /* Cache warm-up (path NULL = off). */
+    prefetch_cfg_t prefetch; /* Link and sequence prefetching (0 = off). */
+    journal_cfg_t journal; /* Cache journal (path NULL = off). */
+    char *repl_to;   /* Standby to replicate the cache to (NULL = off). */
+    char *repl_from; /* Where to accept replication as a standby. */
+    purge_cfg_t purge; /* Purge broadcast (port NULL = local purges only). */
+    ring_cfg_t ring; /* Consistent-hashing peer group (path NULL = off). */
+    char *view_path; /* Cache view for co-located readers (NULL = off). */
+    size_t view_size; /* Bytes of responses it holds (0 = default). */
+    size_t ntcopy_threshold; /* Smallest fill copied around the CPU caches
+                                (0 = none). */
 } cfg_t;
 
+/**
+ * Priority lanes of the worker pool. Requests are classified once the cache
+ * has been consulted; until then they count as hits, since the lookup costs
+ * about as much as serving one.
+ */
+typedef enum {
+    LANE_HIT,   /* Cache hits, and lookups that have not been classified. */
+    LANE_MISS,  /* Fetches from the origin. */
+    LANE_LARGE, /* Large cached objects and uncacheable responses. */
+    NUM_LANES
+} lane_t;
+
 /**
  * Copied from tiny.c
  * Holds client connection metadata.
@@ -78,7 +192,7 @@ typedef struct {
 #define HOSTLEN 256
 #define SERVLEN 8
 typedef struct {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen;
     int connfd;
     char host[HOSTLEN];
@@ -98,6 +212,37 @@ typedef struct {
     const char *http_version;
 } request_t;
 
+/**
+ * State of a single relayed request. Carried from the cache lookup to the
+ * server fetch, which may run as a separate task.
+ *
+ * @param  keep_alive  The client may send another request on this connection.
+ *                     Cleared as soon as the response turns out not to allow
+ *                     it.
+ * @param  cached_only The client asked not to go to the server
+ *                     (`only-if-cached`).
+ * @param  start_us    When the relay started, for the access log.
+ * @param  bytes_out   Bytes sent to the client.
+ * @param  status      HTTP status of the response, 0 until known.
+ * @param  outcome     How the request was answered.
+ * @param  tcp_client  TCP telemetry of the client connection, and tcp_origin
+ *                     that of the origin connection.
+ */
+typedef struct {
+    int client_fd;
+    parser_t *parser;
+    request_t request;
+    lane_t lane;
+    bool keep_alive;
+    bool cached_only;
+    uint64_t start_us;
+    uint64_t bytes_out;
+    int status;
+    alog_outcome_t outcome;
+    tcpstat_conn_t tcp_client;
+    tcpstat_conn_t tcp_origin;
+} relay_t;
+
 /**
  * Error codes associated with parsing a client request.
  */
@@ -116,99 +261,69 @@ typedef enum {
 
 /**************** GLOBALS ****************/
 cfg_t g_cfg;
-cache_t *g_cache;
+sched_t *g_sched;
 
-/**************** Attempt at a FIFO queue for readers/writers ****************/
-typedef struct TOK {
-    bool is_reader;
-    struct TOK *next;
-} rw_token_t;
-
-typedef struct {
-    pthread_mutex_t mutex;
-    int reading_count;
-    int writing_count;
-    rw_token_t *head;
-    rw_token_t *tail;
-} rw_queue_t;
-
-void rw_queue_init(rw_queue_t *q) {
-    pthread_mutex_init(&q->mutex, NULL);
-    q->reading_count = q->writing_count = 0;
-    q->head = q->tail = NULL;
-}
+/*
+ * The cache and the lock that serializes every call into it. Cache hits hold
+ * the lock only to look the response up; the block stays valid until it is
+ * released, even if it is evicted while being sent.
+ */
+cache_t *g_cache;
+plock_t g_cache_lock;
 
-static void enqueue(rw_queue_t *q, rw_token_t *t) {
-    if (q->tail == NULL)
-        q->tail = q->head = t;
-    else {
-        q->tail->next = t;
-        q->tail = t;
-    }
-    t->next = NULL;
-}
+/*
+ * Latency budgets of the lanes; tasks within a lane run earliest deadline
+ * first. The number of reserved workers is filled in from the options.
+ */
+sched_lane_t g_lanes[NUM_LANES] = {
+    [LANE_HIT] = {.name = "hit", .budget_us = 5 * 1000},
+    [LANE_MISS] = {.name = "miss", .budget_us = 500 * 1000},
+    [LANE_LARGE] = {.name = "large", .budget_us = 5 * 1000 * 1000},
+};
 
-static void dequeue(rw_queue_t *q) {
-    rw_token_t *t = q->head;
-    if (t == NULL)
-        return;
-    q->head = t->next;
-    if (q->head == NULL)
-        q->tail = NULL;
-}
+/*
+ * Hashes of URIs whose responses turned out too large to cache, so that the
+ * next request for them goes straight to the large-transfer lane. Lossy: a
+ * colliding URI simply replaces the slot.
+ */
+_Atomic size_t g_large_uris[LARGE_URI_SLOTS];
 
-void rw_queue_request_read(rw_queue_t *q, rw_token_t *t) {
-    pthread_mutex_lock(&q->mutex);
-    if (q->head == NULL && q->writing_count == 0)
-        q->reading_count++;
-    else {
-        t->is_reader = true;
-        enqueue(q, t);
-    }
-    pthread_mutex_unlock(&q->mutex);
-}
+/*
+ * I/O buffers, borrowed only while a request is being relayed.
+ */
+bufpool_t *g_io_pool;
+bufpool_t *g_object_pool;
 
-void rw_queue_request_write(rw_queue_t *q, rw_token_t *t) {
-    pthread_mutex_lock(&q->mutex);
-    if (q->head == NULL && q->writing_count == 0 && q->reading_count == 0)
-        q->writing_count++;
-    else {
-        t->is_reader = false;
-        enqueue(q, t);
-    }
-    pthread_mutex_unlock(&q->mutex);
-}
+/*
+ * Idle keep-alive connections (NULL = keep-alive off).
+ */
+parklot_t *g_parklot;
 
-void rw_queue_release(rw_queue_t *q) {
-    rw_token_t *t;
-    pthread_mutex_lock(&q->mutex);
+/*
+ * Chunks of the responses queued for clients slower than their origin.
+ */
+bufpool_t *g_spill_pool;
+stat_counter_t *g_stat_spill_bytes;
+stat_counter_t *g_stat_backpressure;
+stat_counter_t *g_stat_early_release;
 
-    if (q->writing_count > 0)
-        q->writing_count--;
-    else
-        q->reading_count--;
+/*
+ * Misses read through from the previous owner of their URI (cf. ring.h).
+ */
+stat_counter_t *g_stat_readthrough_hits;
+stat_counter_t *g_stat_readthrough_misses;
 
-    t = q->head;
-    if (t == NULL) {
-        pthread_mutex_unlock(&q->mutex);
-        return;
-    }
-    bool want_to_read = t->is_reader;
-    if (!want_to_read && q->reading_count == 0) {
-        q->writing_count++;
-        dequeue(q);
-    } else {
-        while (want_to_read) {
-            q->reading_count++;
-            dequeue(q);
-            t = q->head;
-            want_to_read = t && t->is_reader;
-        }
-    }
-    pthread_mutex_unlock(&q->mutex);
-}
+/*
+ * Access log (NULL = off).
+ */
+alog_t *g_alog;
 
-rw_queue_t g_rw_queue;
+/*
+ * Event loops running coroutines, if any. Connections are dealt to them
+ * round-robin, by the accepting thread and by the parking lot.
+ */
+coro_loop_t **g_loops;
+atomic_size_t g_next_loop;
 
 /*
  * String to use for the User-Agent header.
@@ -224,6 +339,62 @@ static const char *header_user_agent = "Mozilla/5.0"
  *
  * Options are:
  * - `-v` verbose mode.
+ * - `-c <loops>` run each connection as a coroutine on one of `loops` event
+ *   loop threads instead of spawning a thread per connection.
+ * - `-w <workers>` run connections on a work-stealing pool of `workers`
+ *   threads instead of spawning a thread per connection.
+ * - `-a <port>` serve the admin interface (e.g. `/stats`) on `port`.
+ * - `-r <hit>,<miss>,<large>` workers of the pool reserved for each priority
+ *   lane. By default a quarter of the workers are reserved for cache hits.
+ * - `-W <min>,<max>` let the pool size itself between `min` and `max` workers
+ *   based on queueing delay. `-w` then sets the initial size only.
+ * - `-k <seconds>` keep client connections open between requests, closing
+ *   them after `seconds` of idleness.
+ * - `-b <KB>` queue at most this much of a response for a client slower than
+ *   the origin, beyond what fits in the cache; past that, reading from the
+ *   origin pauses.
+ * - `-l <path>[,text|binary[,MB]]` write an access log to `path`, rotating it
+ *   every `MB` megabytes.
+ * - `-m <path>[,ms]` publish every metric into the shared memory segment
+ *   `path` (normally under /dev/shm) every `ms` milliseconds, for proxytop.
+ * - `-t <samples>` read TCP_INFO from client and origin sockets at most
+ *   `samples` times per second (0 turns it off).
+ * - `-F` hold the cache to its size limit counting everything it allocates
+ *   (keys, blocks, list nodes, hash table), not just the cached responses.
+ * - `-M <min KB>,<max KB>[,<dir>]` size the cache between `min` and `max`
+ *   kilobytes after the memory usage and pressure of the proxy's cgroup, or
+ *   of the cgroup directory `dir`, which may also hold simulated files.
+ * - `-u <path>[,<top>[,<rate>[,<per origin>]]]` warm the cache up in the
+ *   background from a URL list or access log, fetching at most the `top` most
+ *   requested URLs, `rate` per second, `per origin` at a time per origin.
+ * - `-p <per page>` prefetch up to `per page` same-origin subresources of
+ *   every HTML page as it is cached.
+ * - `-s <depth>` prefetch `depth` steps ahead of clients walking through
+ *   numbered URIs, such as media segments or pages of an API.
+ * - `-j <path>[,ms]` journal the cache to `path`, writing queued changes out
+ *   every `ms` milliseconds, and replay it on startup.
+ * - `-R <host:port|path>` replicate the cache to a hot standby, over TCP or
+ *   the UNIX socket `path`.
+ * - `-S <port|host:port|path>` act as a hot standby, mirroring the cache of
+ *   the active proxy that connects to `port` on the loopback interface,
+ *   `host:port` or the UNIX socket `path`. The stream is not authenticated.
+ * - `-P <port>[,<host:port>...]` exchange purges with the other proxies of a
+ *   cluster over UDP `port`. Purges are requested on the admin port, at
+ *   `/purge?key=<uri>`, `/purge?prefix=<uri>` or `/purge?tag=<surrogate key>`.
+ * - `-G <self>,<members file>[,<KB/s>]` join a consistent-hashing peer group
+ *   as `self`, handing entries off to their new owner at `KB/s` when the
+ *   members change, and reading misses through from their previous owner.
+ * - `-U <path>` accept clients on the UNIX socket `path` (`@name` for the
+ *   abstract namespace) as well as on the port. The port itself may also be
+ *   a UNIX socket path, or left out.
+ * - `-O <host:port>=<path>` connect to the origin `host:port` over the UNIX
+ *   socket `path` rather than TCP. May be repeated.
+ * - `-V <path>[,<MB>]` mirror the cache into the shared memory segment `path`
+ *   (normally under /dev/shm), with room for `MB` megabytes of responses,
+ *   for processes on the same host to read it in place (cf. cacheview.h).
+ * - `-N <KB>` copy responses of at least `KB` kilobytes into the cache with
+ *   non-temporal stores, which leave the CPU caches to hits (0 turns it off;
+ *   32 by default).
  *
  * @param[out]  cfg   Configuration to determine runtime behavior.
  * @param[in]   argc  Number of commandline arguments passed.
@@ -231,20 +402,311 @@ static const char *header_user_agent = "Mozilla/5.0"
  */
 void parse_args(cfg_t *cfg, const int argc, char *const argv[]) {
     char opt;
-    const char *usage_str = "Usage: %s [port] [-v verbose]\n";
-    if (argc > 3) {
-        fprintf(stderr, usage_str, argv[0]);
-        exit(EXIT_FAILURE);
-    }
+    const char *usage_str =
+        "Usage: %s [port] [-v verbose] [-c loops | -w workers] [-a port] "
+        "[-r hit,miss,large] [-W min,max] [-k seconds] [-b KB] "
+        "[-l path[,text|binary[,MB]]] [-m path[,ms]] [-t samples] [-F] [-M min,max[,dir]] "
+        "[-u path[,top[,rate[,per origin]]]] [-p per page] "
+        "[-s depth] [-j path[,ms]] [-R host:port|path] [-S [host:]port|path] "
+        "[-P port[,host:port...]] [-G self,members[,KB/s]] [-U path] "
+        "[-O host:port=path] [-V path[,MB]] [-N KB]\n";
 
     // Get opt arguments.
     cfg->verbose = false;
-    while ((opt = getopt(argc, argv, "v")) != EOF) {
+    cfg->port = cfg->unix_path = NULL;
+    cfg->coro_loops = 0;
+    cfg->workers = 0;
+    cfg->admin_port = NULL;
+    cfg->reserve[LANE_HIT] = cfg->reserve[LANE_MISS] =
+        cfg->reserve[LANE_LARGE] = -1;
+    cfg->min_workers = cfg->max_workers = 0;
+    cfg->keepalive_s = 0;
+    cfg->spill_cap = DEFAULT_SPILL_CAP;
+    cfg->alog = (alog_cfg_t){
+        .path = NULL,
+        .format = ALOG_TEXT,
+        .rotate_bytes = (size_t)ALOG_ROTATE_MB * 1024 * 1024,
+        .keep = ALOG_KEEP,
+        .ring_records = ALOG_RING_RECORDS,
+    };
+    cfg->metrics_path = NULL;
+    cfg->metrics_interval_ms = STATSHM_DEFAULT_INTERVAL_MS;
+    cfg->tcp_samples = TCPSTAT_DEFAULT_RATE;
+    cfg->cache_budget = CACHE_BUDGET_VALUES;
+    cfg->cache_min = cfg->cache_max = 0;
+    cfg->cgroup_dir = NULL;
+    cfg->warmup = (warmup_cfg_t){
+        .path = NULL,
+        .max_urls = 0,
+        .rate = WARMUP_DEFAULT_RATE,
+        .per_origin = WARMUP_DEFAULT_PER_ORIGIN,
+        .max_object = MAX_OBJECT_SIZE - 1,
+    };
+    cfg->prefetch = (prefetch_cfg_t){
+        .per_page = 0,
+        .seq_depth = 0,
+        .max_object = MAX_OBJECT_SIZE - 1,
+    };
+    cfg->journal = (journal_cfg_t){
+        .path = NULL,
+        .interval_ms = JOURNAL_DEFAULT_INTERVAL_MS,
+        .max_pending = JOURNAL_DEFAULT_MAX_PENDING,
+        .compact_ratio = JOURNAL_DEFAULT_COMPACT_RATIO,
+        .compact_min = JOURNAL_DEFAULT_COMPACT_MIN,
+    };
+    cfg->repl_to = cfg->repl_from = NULL;
+    cfg->purge = (purge_cfg_t){.port = NULL, .npeers = 0};
+    cfg->ring = (ring_cfg_t){.self = NULL, .path = NULL,
+                             .rate = RING_DEFAULT_RATE};
+    cfg->view_path = NULL;
+    cfg->view_size = 0;
+    cfg->ntcopy_threshold = NTCOPY_DEFAULT_THRESHOLD;
+    while ((opt = getopt(
+                argc, argv,
+                "vc:w:a:r:W:k:b:l:m:t:FM:u:p:s:j:R:S:P:G:U:O:V:N:")) != EOF) {
         switch (opt) {
         case 'v':
             cfg->verbose = true;
             break;
 
+        case 'c':
+            cfg->coro_loops = atoi(optarg);
+            if (cfg->coro_loops < 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'w':
+            cfg->workers = atoi(optarg);
+            if (cfg->workers < 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'a':
+            cfg->admin_port = optarg;
+            break;
+
+        case 'r':
+            if (sscanf(optarg, "%d,%d,%d", &cfg->reserve[LANE_HIT],
+                       &cfg->reserve[LANE_MISS],
+                       &cfg->reserve[LANE_LARGE]) != 3) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'W':
+            if (sscanf(optarg, "%d,%d", &cfg->min_workers,
+                       &cfg->max_workers) != 2 ||
+                cfg->min_workers <= 0 ||
+                cfg->max_workers < cfg->min_workers) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'k':
+            cfg->keepalive_s = atoi(optarg);
+            if (cfg->keepalive_s < 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'b':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            cfg->spill_cap = (size_t)atoi(optarg) * 1024;
+            break;
+
+        case 't':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            cfg->tcp_samples = atoi(optarg);
+            break;
+
+        case 'F':
+            cfg->cache_budget = CACHE_BUDGET_FOOTPRINT;
+            break;
+
+        case 'M': {
+            int min_kb, max_kb, dir = 0;
+            if (sscanf(optarg, "%d,%d%n", &min_kb, &max_kb, &dir) != 2 ||
+                min_kb <= 0 || max_kb < min_kb ||
+                (optarg[dir] != '\0' && optarg[dir] != ',')) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            cfg->cache_min = (size_t)min_kb * 1024;
+            cfg->cache_max = (size_t)max_kb * 1024;
+            if (optarg[dir] == ',')
+                cfg->cgroup_dir = optarg + dir + 1;
+            break;
+        }
+
+        case 'u': {
+            char *params = strchr(optarg, ',');
+            int top = 0, rate = cfg->warmup.rate;
+            int per_origin = cfg->warmup.per_origin;
+            if (params) {
+                *params++ = '\0';
+                if (sscanf(params, "%d,%d,%d", &top, &rate, &per_origin) < 1 ||
+                    top < 0 || rate < 0 || per_origin <= 0) {
+                    fprintf(stderr, usage_str, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            cfg->warmup.path = optarg;
+            cfg->warmup.max_urls = top;
+            cfg->warmup.rate = rate;
+            cfg->warmup.per_origin = per_origin;
+            break;
+        }
+
+        case 'p':
+            cfg->prefetch.per_page = atoi(optarg);
+            if (cfg->prefetch.per_page <= 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 's':
+            cfg->prefetch.seq_depth = atoi(optarg);
+            if (cfg->prefetch.seq_depth <= 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'j': {
+            char *interval = strchr(optarg, ',');
+            cfg->journal.path = optarg;
+            if (interval) {
+                *interval++ = '\0';
+                if (atoi(interval) <= 0) {
+                    fprintf(stderr, usage_str, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                cfg->journal.interval_ms = atoi(interval);
+            }
+            break;
+        }
+
+        case 'V': {
+            char *mb = strchr(optarg, ',');
+            cfg->view_path = optarg;
+            if (mb) {
+                *mb++ = '\0';
+                if (atoi(mb) <= 0) {
+                    fprintf(stderr, usage_str, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                cfg->view_size = (size_t)atoi(mb) * 1024 * 1024;
+            }
+            break;
+        }
+
+        case 'N':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            cfg->ntcopy_threshold = (size_t)atoi(optarg) * 1024;
+            break;
+
+        case 'R':
+            cfg->repl_to = optarg;
+            break;
+
+        case 'S':
+            cfg->repl_from = optarg;
+            break;
+
+        case 'P': {
+            char *save = NULL;
+            cfg->purge.port = strtok_r(optarg, ",", &save);
+            char *peer;
+            while ((peer = strtok_r(NULL, ",", &save)) != NULL) {
+                if (cfg->purge.npeers == PURGE_MAX_PEERS) {
+                    fprintf(stderr, usage_str, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                cfg->purge.peers[cfg->purge.npeers++] = peer;
+            }
+            if (cfg->purge.port == NULL) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+
+        case 'G': {
+            char *save = NULL;
+            cfg->ring.self = strtok_r(optarg, ",", &save);
+            cfg->ring.path = strtok_r(NULL, ",", &save);
+            char *rate = strtok_r(NULL, ",", &save);
+            if (rate)
+                cfg->ring.rate = (size_t)atoi(rate) * 1024;
+            if (cfg->ring.path == NULL || cfg->ring.rate == 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+
+        case 'U':
+            cfg->unix_path = optarg;
+            break;
+
+        case 'O':
+            if (unixsock_add_route(optarg) < 0) {
+                fprintf(stderr, usage_str, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'l': {
+            char *format = strchr(optarg, ',');
+            cfg->alog.path = optarg;
+            if (format) {
+                *format++ = '\0';
+                char *mb = strchr(format, ',');
+                if (mb) {
+                    *mb++ = '\0';
+                    cfg->alog.rotate_bytes = (size_t)atoi(mb) * 1024 * 1024;
+                }
+                if (strcmp(format, "binary") == 0) {
+                    cfg->alog.format = ALOG_BINARY;
+                } else if (strcmp(format, "text") != 0) {
+                    fprintf(stderr, usage_str, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+        }
+
+        case 'm': {
+            char *interval = strchr(optarg, ',');
+            cfg->metrics_path = optarg;
+            if (interval) {
+                *interval++ = '\0';
+                if (atoi(interval) <= 0) {
+                    fprintf(stderr, usage_str, argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                cfg->metrics_interval_ms = atoi(interval);
+            }
+            break;
+        }
+
         // Misspecified argument(s).
         default:
             fprintf(stderr, usage_str, argv[0]);
@@ -252,10 +714,30 @@ void parse_args(cfg_t *cfg, const int argc, char *const argv[]) {
         }
     }
 
+    // A self-sizing pool starts out at its lower bound unless told otherwise.
+    if (cfg->max_workers > 0 && cfg->workers == 0)
+        cfg->workers = cfg->min_workers;
+
+    // Coroutines and the worker pool are alternative ways to run relays.
+    if (cfg->coro_loops > 0 && cfg->workers > 0) {
+        fprintf(stderr, usage_str, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->reserve[LANE_HIT] < 0) {
+        cfg->reserve[LANE_HIT] = (cfg->workers > 1) ? (cfg->workers + 3) / 4 : 0;
+        cfg->reserve[LANE_MISS] = cfg->reserve[LANE_LARGE] = 0;
+    }
+
     // Get non-opt arguments.
     if (optind < argc)
         while (optind < argc)
             cfg->port = argv[optind++];
+
+    if (cfg->port == NULL && cfg->unix_path == NULL) {
+        fprintf(stderr, usage_str, argv[0]);
+        exit(EXIT_FAILURE);
+    }
 }
 
 /*
@@ -295,13 +777,13 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
     }
 
     /* Write the headers */
-    if (rio_writen(fd, buf, buflen) < 0) {
+    if (co_rio_writen(fd, buf, buflen) < 0) {
         fprintf(stderr, "Error writing error response headers to client\n");
         return;
     }
 
     /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
+    if (co_rio_writen(fd, body, bodylen) < 0) {
         fprintf(stderr, "Error writing error response body to client\n");
         return;
     }
@@ -384,44 +866,55 @@ static error_t retrieve_request(request_t *request, parser_t *parser,
  *                         data.
  * @param[out]  request    A struct that will be filled with metadata about the
  *                         request.
+ * @param[out]  unread     Set if the client sent more than this request (e.g.
+ *                         a pipelined second one); those bytes were read off
+ *                         the socket and are lost.
  *
  * @return OK (i.e. 0) if parsing was successful.
  * @return Non-zero error code associated with the parsing error (cf. the
  *         error_t enum).
  */
 static error_t get_client_request(int client_fd, parser_t *parser,
-                                  request_t *request) {
-    char buf[PARSER_MAXLINE];
+                                  request_t *request, bool *unread) {
+    error_t status = OK;
     ssize_t res;
     int parse_state;
-    rio_t rio;
-    rio_readinitb(&rio, client_fd);
+    rio_t *rio = bufpool_get(g_io_pool);
+    char *buf = bufpool_get(g_io_pool);
+    if (rio == NULL || buf == NULL) {
+        bufpool_put(g_io_pool, rio);
+        bufpool_put(g_io_pool, buf);
+        return PARSER_ERROR;
+    }
+    rio_readinitb(rio, client_fd);
 
-    while ((res = rio_readlineb(&rio, buf, sizeof(buf))) > 0) {
+    while ((res = co_rio_readlineb(rio, buf, PARSER_MAXLINE)) > 0) {
         parse_state = parser_parse_line(parser, buf);
         switch (parse_state) {
-        case REQUEST: {
-            error_t status = retrieve_request(request, parser, client_fd);
-            if (status != OK)
-                return status;
+        case REQUEST:
+            status = retrieve_request(request, parser, client_fd);
             break;
-        }
-
         case HEADER:
             break;
         case ERROR:
-            return PARSER_ERROR;
+            status = PARSER_ERROR;
+            break;
         }
+        if (status != OK)
+            break;
 
         // Halt at HTTP end of request line.
         if (strcmp(buf, "\r\n") == 0)
             break;
     }
+    *unread = rio->rio_cnt > 0;
+    bufpool_put(g_io_pool, rio);
+    bufpool_put(g_io_pool, buf);
 
     // In case we broke out of the while loop right away due to a parser error.
-    if (res < 0)
+    if (status == OK && res < 0)
         return PARSER_ERROR;
-    return OK;
+    return status;
 }
 
 /**
@@ -520,136 +1013,957 @@ static inline bool is_request_filled(request_t *request) {
 }
 
 /**
- * @brief Function that encompasses the runtime of each thread that is spawned
- * to manage relaying client requests and server responses to said requests.
- * Each thread detaches itself, thereby causing cleanup to happen automatically
- * upon exiting.
+ * @brief Whether a comma-separated header value such as "keep-alive, Upgrade"
+ * lists `token`, case-insensitively.
+ */
+static bool has_token(const char *value, const char *token) {
+    const size_t n = strlen(token);
+    while (*value) {
+        value += strspn(value, " \t,");
+        size_t len = strcspn(value, " \t,");
+        if (len == n && strncasecmp(value, token, n) == 0)
+            return true;
+        value += len;
+    }
+    return false;
+}
+
+/**
+ * @brief Whether the client asked to keep its connection open: HTTP/1.1
+ * unless it says "close", HTTP/1.0 only if it says "keep-alive".
+ */
+static bool wants_keep_alive(parser_t *parser, const request_t *request) {
+    header_t *header = parser_lookup_header(parser, "Connection");
+    if (header == NULL)
+        header = parser_lookup_header(parser, "Proxy-Connection");
+    if (header)
+        return has_token(header->value, "keep-alive");
+    return strcmp(request->http_version, "1.1") == 0;
+}
+
+/**
+ * @brief End of the header of a response, i.e. its blank line, or NULL if
+ * the header does not end within `len` bytes.
+ */
+static const char *find_header_end(const char *buf, size_t len) {
+    for (size_t i = 0; i + 4 <= len; ++i)
+        if (memcmp(buf + i, "\r\n\r\n", 4) == 0)
+            return buf + i;
+    return NULL;
+}
+
+/**
+ * @brief Whether a response header line is `name`, case-insensitively.
+ */
+static inline bool is_header(const char *line, size_t len, const char *name) {
+    size_t n = strlen(name);
+    return len > n && line[n] == ':' && strncasecmp(line, name, n) == 0;
+}
+
+/**
+ * @brief HTTP status code of a response, from its status line, or 0.
+ */
+static int response_status(const char *buf, size_t len) {
+    const char *sp = memchr(buf, ' ', len < 16 ? len : 16);
+    if (sp == NULL || buf + len - sp < 4 || !isdigit(sp[1]) ||
+        !isdigit(sp[2]) || !isdigit(sp[3]))
+        return 0;
+    return (sp[1] - '0') * 100 + (sp[2] - '0') * 10 + (sp[3] - '0');
+}
+
+/**
+ * @brief Rewrite the header of a response for a client that keeps its
+ * connection open: the origin's connection headers are swapped for
+ * "Connection: keep-alive". That is only possible if the whole header is in
+ * `buf` and has a Content-Length; otherwise the client can only tell where the
+ * response ends by the connection closing, and relay->keep_alive is cleared.
  *
- * @shared  g_cfg  Constant user configuration for runtime of entire proxy.
+ * @param[out]  head            IO_BUFSIZE bytes for the rewritten header, or
+ *                              NULL to send every response as is.
+ * @param[out]  head_len        Length of the rewritten header.
+ * @param[out]  content_length  Body length announced by the origin.
  *
- * @param  vargp  Passed argument from the main thread. This will just be the
- * client file descriptor value stored in a pointer.
+ * @return Length of the origin's header in `buf`, which `head` replaces.
+ * @return 0 if the response goes to the client as is.
  */
-static void *thread_handle_relay(void *vargp) {
-    // Detach thread so that it'll clean up after itself after exiting.
-    pthread_detach(pthread_self());
+static size_t rewrite_response_head(relay_t *relay, const char *buf,
+                                    size_t len, char *head, size_t *head_len,
+                                    long long *content_length) {
+    const char *end =
+        (relay->keep_alive && head) ? find_header_end(buf, len) : NULL;
+    *head_len = 0;
+    *content_length = -1;
+
+    // Copy the status line and headers, minus those about the connection.
+    const char *line = buf;
+    while (end && line < end + 2) {
+        const char *eol = memchr(line, '\n', end + 2 - line);
+        size_t n = eol - line + 1;
+        if (is_header(line, n, "Content-Length"))
+            *content_length =
+                strtoll(line + strlen("Content-Length:"), NULL, 10);
+        if (!is_header(line, n, "Connection") &&
+            !is_header(line, n, "Proxy-Connection") &&
+            !is_header(line, n, "Keep-Alive")) {
+            if (*head_len + n >= IO_BUFSIZE - 32)
+                break;
+            memcpy(head + *head_len, line, n);
+            *head_len += n;
+        }
+        line = eol + 1;
+    }
 
-    rw_token_t reader_tok;
-    rw_token_t writer_tok;
+    if (end == NULL || line < end + 2 || *content_length < 0) {
+        relay->keep_alive = false;
+        return 0;
+    }
+    *head_len += sprintf(head + *head_len, "Connection: keep-alive\r\n\r\n");
+    return end + 4 - buf;
+}
 
-    size_t client_fd = (size_t)vargp;
+/**
+ * @brief Write the first chunk of a response to the client, with its header
+ * rewritten if the client keeps its connection open (cf.
+ * rewrite_response_head).
+ *
+ * @param[out]  body_left  Body bytes still to come after this chunk, if the
+ *                         connection is kept open.
+ *
+ * @return 0 on success, -1 if writing to the client failed.
+ */
+static int write_response_head(relay_t *relay, const char *buf, size_t len,
+                               long long *body_left) {
+    char *head = relay->keep_alive ? bufpool_get(g_io_pool) : NULL;
+    size_t head_len;
+    long long content_length;
+    size_t skip = rewrite_response_head(relay, buf, len, head, &head_len,
+                                        &content_length);
+
+    int res = 0;
+    relay->status = response_status(buf, len);
+    if ((skip > 0 && co_rio_writen(relay->client_fd, head, head_len) < 0) ||
+        co_rio_writen(relay->client_fd, buf + skip, len - skip) < 0)
+        res = -1;
+    else
+        relay->bytes_out += head_len + len - skip;
+    if (skip > 0)
+        *body_left = content_length - (long long)(len - skip);
+    bufpool_put(g_io_pool, head);
+    return res;
+}
+
+/**
+ * @brief Whether the response to `uri` was too large to cache last time.
+ */
+static inline bool is_large_uri(const char *uri) {
+    size_t hash = get_hash(uri, strlen(uri) + 1);
+    return atomic_load(&g_large_uris[hash % LARGE_URI_SLOTS]) == hash;
+}
+
+static inline void mark_large_uri(const char *uri) {
+    size_t hash = get_hash(uri, strlen(uri) + 1);
+    atomic_store(&g_large_uris[hash % LARGE_URI_SLOTS], hash);
+}
+
+/**
+ * @brief Queue an access log record for a relay whose request was parsed.
+ */
+static void relay_log(relay_t *relay) {
+    if (g_alog == NULL || relay->request.uri == NULL)
+        return;
+
+    struct timespec ts;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    alog_record_t rec;
+    const uint64_t latency_us = stats_now_us() - relay->start_us;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.time_us =
+        (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - latency_us;
+    rec.latency_us = latency_us > UINT32_MAX ? UINT32_MAX : latency_us;
+    rec.bytes = relay->bytes_out;
+    rec.client = (getpeername(relay->client_fd, (SA *)&addr, &addrlen) == 0 &&
+                  addr.sin_family == AF_INET)
+                     ? addr.sin_addr.s_addr
+                     : 0;
+    rec.status = relay->status;
+    rec.outcome = relay->outcome;
+    rec.lane = relay->lane;
+    strncpy(rec.uri, relay->request.uri, ALOG_URI_LEN - 1);
+    rec.uri[ALOG_URI_LEN - 1] = '\0';
+    alog_write(g_alog, &rec);
+}
+
+/**
+ * @brief Identify the client on the other end of a connection by its
+ * address, port aside, so that its connections all count as one client.
+ */
+static uint64_t client_key(int client_fd) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(client_fd, (SA *)&addr, &addrlen) < 0)
+        return 0;
+    if (addr.ss_family == AF_INET)
+        return ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+    if (addr.ss_family == AF_INET6)
+        return get_hash(&((struct sockaddr_in6 *)&addr)->sin6_addr,
+                        sizeof(struct in6_addr));
+    // Co-located clients have no address; tell them apart by process.
+    if (addr.ss_family == AF_UNIX) {
+        const pid_t pid = unixsock_peer_pid(client_fd);
+        return pid > 0 ? ((uint64_t)1 << 32) | (uint64_t)pid : 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Release the memory of a relay, but not its client connection.
+ */
+static void relay_release(relay_t *relay) {
+    parser_free(relay->parser);
+    mem_free(MEM_RELAYS, relay);
+}
+
+/**
+ * @brief Release everything a relay holds, including the client connection.
+ */
+static void relay_free(relay_t *relay) {
+    close(relay->client_fd);
+    relay_release(relay);
+}
+
+/**
+ * @brief Release a relay whose response has been sent in full. A keep-alive
+ * connection is parked until the client's next request instead of closed.
+ */
+static void relay_done(relay_t *relay) {
+    relay_log(relay);
+    if (relay->keep_alive && g_parklot) {
+        // The next request may be served by another loop.
+        coro_forget_fd(relay->client_fd);
+        if (parklot_park(g_parklot, relay->client_fd) == 0) {
+            relay_release(relay);
+            return;
+        }
+    }
+    relay_free(relay);
+}
+
+/**
+ * @brief Answer a parsed request from the cache.
+ *
+ * @param  relay     Relay whose request has been parsed.
+ * @param  max_size  Cached responses larger than this are left alone.
+ *
+ * @return 1 if the response was cached and has been written to the client.
+ *         relay->keep_alive tells whether the connection can be reused.
+ * @return 0 if the response is not cached.
+ * @return -1 if the response is cached but larger than `max_size`.
+ */
+static int relay_serve_cached(relay_t *relay, size_t max_size) {
+    long long body_left = 0;
+    int res = 0;
+
+    plock_lock(&g_cache_lock);
+    block_t *response = get_cached_response(&relay->request);
+    plock_unlock(&g_cache_lock);
+    if (response && response->size > max_size) {
+        res = -1;
+    } else if (response) {
+        relay->outcome = ALOG_HIT;
+        if (write_response_head(relay, response->value, response->size,
+                                &body_left) < 0) {
+            if (g_cfg.verbose)
+                perror("rio_writen client");
+            relay->keep_alive = false;
+        }
+        if (body_left != 0)
+            relay->keep_alive = false;
+        tcpstat_sample(&relay->tcp_client, relay->client_fd);
+        prefetch_note_hit(relay->request.uri);
+        res = 1;
+    }
+    if (response) {
+        plock_lock(&g_cache_lock);
+        cache_release(g_cache, response);
+        plock_unlock(&g_cache_lock);
+    }
+    return res;
+}
+
+/**
+ * @brief Answer an `only-if-cached` request that the cache cannot answer with
+ * a 504, and free the relay.
+ */
+static void relay_not_cached(relay_t *relay) {
+    clienterror(relay->client_fd, "504", "Gateway Timeout", "Not cached");
+    relay->status = 504;
+    relay->keep_alive = false;
+    relay_log(relay);
+    relay_free(relay);
+}
+
+/**
+ * @brief First half of relaying a request: read and parse it from the client,
+ * then answer it straight from the cache if possible.
+ *
+ * @shared  g_cfg  Constant user configuration for runtime of entire proxy.
+ *
+ * @param  client_fd     Connected client socket. Owned by the relay from here
+ *                       on.
+ * @param  max_hit_size  Cache hits larger than this are not served here, but
+ *                       returned classified as LANE_LARGE.
+ *
+ * @return The relay, classified into a lane, if the response has to be
+ *         fetched from the server (cf. relay_fetch) or is a large hit (cf.
+ *         relay_continue).
+ * @return NULL if the request has been fully handled, from the cache or by
+ *         failing. The client socket has been closed in that case.
+ */
+static relay_t *relay_lookup(int client_fd, size_t max_hit_size) {
+    relay_t *relay = mem_malloc(MEM_RELAYS, sizeof(relay_t));
+    if (relay == NULL) {
+        close(client_fd);
+        return NULL;
+    }
+    relay->client_fd = client_fd;
+    relay->lane = LANE_HIT;
+    relay->keep_alive = false;
+    relay->start_us = stats_now_us();
+    relay->bytes_out = 0;
+    relay->status = 0;
+    relay->outcome = ALOG_ERROR;
+    tcpstat_conn_init(&relay->tcp_client, TCPSTAT_CLIENT, NULL);
 
     // Retrieve HTTP request from the client.
     // Assume that request is sent in one chunk.
-    parser_t *parser = parser_new();
-    request_t request;
-    request_init(&request);
-    if (get_client_request(client_fd, parser, &request) != OK) {
+    bool unread = false;
+    relay->parser = parser_new();
+    request_init(&relay->request);
+    if (get_client_request(client_fd, relay->parser, &relay->request,
+                           &unread) != OK) {
         if (g_cfg.verbose)
             perror("parser");
-        close(client_fd);
-        parser_free(parser);
-        pthread_exit(NULL);
+        relay_free(relay);
+        return NULL;
     }
 
     // If the client has prematurely closed the socket, we'll end up with an
-    // unitialized request. We should immediately close the connection and
-    // exit the thread.
-    if (!is_request_filled(&request)) {
-        close(client_fd);
-        parser_free(parser);
-        pthread_exit(NULL);
+    // unitialized request. We should immediately close the connection.
+    if (!is_request_filled(&relay->request)) {
+        relay_free(relay);
+        return NULL;
     }
 
+    if (g_cfg.prefetch.seq_depth > 0)
+        prefetch_observe(client_key(client_fd), relay->request.uri);
+
+    // Pipelined requests are not supported: whatever followed this request
+    // is gone, so the connection cannot be reused.
+    relay->keep_alive = g_parklot && !unread &&
+                        wants_keep_alive(relay->parser, &relay->request);
+
+    // Peers reading through ask for cached responses only (RFC 9111 5.2.1.7).
+    header_t *cc = parser_lookup_header(relay->parser, "Cache-Control");
+    relay->cached_only = cc && has_token(cc->value, "only-if-cached");
+
     // Check for cached server response.
-    rw_queue_request_read(&g_rw_queue, &reader_tok);
-    block_t *response = get_cached_response(&request);
-    if (response) {
-        if (rio_writen(client_fd, response->value, response->size) < 0) {
+    switch (relay_serve_cached(relay, max_hit_size)) {
+    case 1:
+        relay_done(relay);
+        return NULL;
+    case -1:
+        relay->lane = LANE_LARGE;
+        break;
+    default:
+        if (relay->cached_only) {
+            relay_not_cached(relay);
+            return NULL;
+        }
+        relay->lane =
+            is_large_uri(relay->request.uri) ? LANE_LARGE : LANE_MISS;
+        break;
+    }
+    return relay;
+}
+
+/**
+ * @brief Whether a failed non-blocking socket call only has to be retried.
+ */
+static inline bool would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+/**
+ * @brief Stream a response from the server to the client without tying the
+ * pace of one to the other. The server is read as fast as it sends: into
+ * `object` while the response may still be small enough to cache, then into a
+ * spill queue of at most g_cfg.spill_cap bytes. The client is fed from both at
+ * its own pace. The server connection is closed as soon as the response is
+ * complete, however far behind the client is; only while the spill queue is
+ * full does reading stop, which pushes back on the server through TCP flow
+ * control.
+ *
+ * Both sockets are used with MSG_DONTWAIT and waited on together, so this runs
+ * alike on a thread, a pool worker or a coroutine. If the client goes away, a
+ * response that may still be cached is read to the end anyway.
+ *
+ * @param[in,out]  server_fd   Connected server socket. Closed, and set to -1,
+ *                             once the server is done.
+ * @param[out]     object      MAX_OBJECT_SIZE bytes receiving the start of the
+ *                             response.
+ * @param[out]     object_len  Bytes of the response in `object`. If this is
+ *                             MAX_OBJECT_SIZE the response is too large to
+ *                             cache.
+ *
+ * @return 0 if the whole response was received from the server, -1 otherwise.
+ *         relay->keep_alive is cleared unless the client got exactly the
+ *         response announced to it.
+ */
+static int relay_stream(relay_t *relay, int *server_fd, char *object,
+                        size_t *object_len) {
+    const int client_fd = relay->client_fd;
+    char *head = relay->keep_alive ? bufpool_get(g_io_pool) : NULL;
+    size_t head_len = 0, head_sent = 0, skip = 0;
+    long long content_length = -1;
+    size_t offset = 0, sent = 0;
+    unsigned long long received = 0;
+    bool head_done = false, client_ok = true, complete = false;
+    bool throttled = false;
+    spill_t spill;
+    spill_init(&spill, g_spill_pool, g_cfg.spill_cap);
+
+    while (1) {
+        bool progress = false;
+
+        // Server -> object, then spill once the object no longer fits.
+        if (*server_fd >= 0) {
+            char *dst = NULL;
+            size_t avail = 0;
+            if (offset < MAX_OBJECT_SIZE) {
+                dst = object + offset;
+                avail = MAX_OBJECT_SIZE - offset;
+            } else if (client_ok) {
+                dst = spill_reserve(&spill, &avail);
+            }
+
+            ssize_t n = -1;
+            if (dst) {
+                n = recv(*server_fd, dst, avail, MSG_DONTWAIT);
+                throttled = false;
+            }
+            if (dst == NULL && client_ok && spill_full(&spill)) {
+                if (!throttled)
+                    stats_add(g_stat_backpressure, 1);
+                throttled = true;
+            } else if (dst == NULL) {
+                // Too large to cache and no one left to send it to, or out
+                // of memory.
+                close(*server_fd);
+                *server_fd = -1;
+            } else if (n > 0) {
+                if (received == 0)
+                    tcpstat_sample(&relay->tcp_origin, *server_fd);
+                else
+                    tcpstat_periodic(&relay->tcp_origin, *server_fd);
+                if (offset < MAX_OBJECT_SIZE) {
+                    offset += n;
+                } else {
+                    spill_commit(&spill, n);
+                    stats_add(g_stat_spill_bytes, n);
+                }
+                received += n;
+                progress = true;
+            } else if (n == 0 || !would_block()) {
+                if (n < 0 && g_cfg.verbose)
+                    perror("recv server");
+                complete = (n == 0);
+                tcpstat_sample(&relay->tcp_origin, *server_fd);
+                close(*server_fd);
+                *server_fd = -1;
+                progress = true;
+                if (client_ok && (head_sent < head_len || sent < offset ||
+                                  spill_len(&spill) > 0))
+                    stats_add(g_stat_early_release, 1);
+            }
+        }
+
+        // Once the header is in, settle what the client gets in its place.
+        if (!head_done &&
+            (*server_fd < 0 || offset == MAX_OBJECT_SIZE ||
+             find_header_end(object, offset))) {
+            skip = rewrite_response_head(relay, object, offset, head,
+                                         &head_len, &content_length);
+            relay->status = response_status(object, offset);
+            sent = skip;
+            head_done = true;
+        }
+
+        // Client <- rewritten header, object, spill, in that order.
+        if (head_done && client_ok) {
+            const char *src;
+            size_t n;
+            if (head_sent < head_len) {
+                src = head + head_sent;
+                n = head_len - head_sent;
+            } else if (sent < offset) {
+                src = object + sent;
+                n = offset - sent;
+            } else {
+                src = spill_peek(&spill, &n);
+            }
+
+            ssize_t w =
+                n ? send(client_fd, src, n, MSG_DONTWAIT | MSG_NOSIGNAL) : 0;
+            if (w > 0) {
+                if (relay->bytes_out == 0)
+                    tcpstat_sample(&relay->tcp_client, client_fd);
+                else
+                    tcpstat_periodic(&relay->tcp_client, client_fd);
+                relay->bytes_out += w;
+                if (head_sent < head_len) {
+                    head_sent += w;
+                } else if (sent < offset) {
+                    sent += w;
+                } else {
+                    spill_consume(&spill, w);
+                    stats_sub(g_stat_spill_bytes, w);
+                }
+                progress = true;
+            } else if (w < 0 && !would_block()) {
+                if (g_cfg.verbose)
+                    perror("send client");
+                client_ok = relay->keep_alive = false;
+                stats_sub(g_stat_spill_bytes, spill_len(&spill));
+                spill_clear(&spill);
+                progress = true;
+            }
+        }
+
+        const bool pending =
+            client_ok && head_done &&
+            (head_sent < head_len || sent < offset || spill_len(&spill) > 0);
+        if (*server_fd < 0 && !pending)
+            break;
+        if (progress)
+            continue;
+
+        // Nothing to do until one of the sockets is ready.
+        struct pollfd fds[2] = {
+            {.fd = (*server_fd >= 0 && !throttled) ? *server_fd : -1,
+             .events = POLLIN},
+            {.fd = pending ? client_fd : -1, .events = POLLOUT},
+        };
+        if (coro_poll(fds, 2) < 0) {
             if (g_cfg.verbose)
-                perror("rio_writen client");
+                perror("poll");
+            break;
         }
-        rw_queue_release(&g_rw_queue);
+    }
 
-        close(client_fd);
-        parser_free(parser);
-        pthread_exit(NULL);
+    if (*server_fd >= 0) {
+        close(*server_fd);
+        *server_fd = -1;
+    }
+    stats_sub(g_stat_spill_bytes, spill_len(&spill));
+    spill_clear(&spill);
+    bufpool_put(g_io_pool, head);
+    if (client_ok && relay->bytes_out > 0)
+        tcpstat_sample(&relay->tcp_client, client_fd);
+
+    // The client connection survives only if it got exactly the response it
+    // was promised.
+    if (!complete || !client_ok ||
+        (long long)(received - skip) != content_length)
+        relay->keep_alive = false;
+    *object_len = offset;
+    return complete ? 0 : -1;
+}
+
+/**
+ * @brief Ask the node that owned the requested URI before the last change of
+ * the peer group for its cached response, and cache and serve it from here.
+ * The request carries `Cache-Control: only-if-cached`, so a miss there costs
+ * no origin fetch.
+ *
+ * @return 0 if the client was served, -1 if the origin must be asked.
+ */
+static int relay_read_through(relay_t *relay) {
+    const char *uri = relay->request.uri;
+    char host[RING_ADDR_LEN], port[RING_ADDR_LEN];
+    if (!ring_previous_owner(uri, host, port))
+        return -1;
+
+    char request[MAXLINE];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.0\r\n"
+                       "Host: %s:%s\r\n"
+                       "Cache-Control: only-if-cached\r\n"
+                       "Connection: close\r\n\r\n",
+                       uri, relay->request.host, relay->request.port);
+    if (len < 0 || (size_t)len >= sizeof(request))
+        return -1;
+    int fd = co_open_clientfd(host, port);
+    if (fd < 0)
+        return -1;
+
+    char *object = bufpool_get(g_object_pool);
+    ssize_t n = -1;
+    if (object && co_rio_writen(fd, request, len) == len) {
+        rio_t rio;
+        rio_readinitb(&rio, fd);
+        n = co_rio_readnb(&rio, object, MAX_OBJECT_SIZE);
+    }
+    close(fd);
+    const bool hit = n > 0 && n < MAX_OBJECT_SIZE &&
+                     response_status(object, n) == 200;
+    if (hit) {
+        plock_lock(&g_cache_lock);
+        cache_insert(g_cache, uri, strlen(uri) + 1, object, n);
+        plock_unlock(&g_cache_lock);
+    }
+    bufpool_put(g_object_pool, object);
+    stats_add(hit ? g_stat_readthrough_hits : g_stat_readthrough_misses, 1);
+    return hit && relay_serve_cached(relay, SIZE_MAX) == 1 ? 0 : -1;
+}
+
+/**
+ * @brief Second half of relaying a request: forward it to the server, stream
+ * the response back to the client, and cache it if it is small enough.
+ *
+ * @shared  g_cfg  Constant user configuration for runtime of entire proxy.
+ *
+ * @param  relay  Relay returned by relay_lookup. Freed before returning.
+ */
+static void relay_fetch(relay_t *relay) {
+    request_t *request = &relay->request;
+    char *request_str = NULL;
+    char *object = NULL;
+    int server_fd = -1;
+
+    if (g_cfg.ring.path && relay_read_through(relay) == 0) {
+        relay_done(relay);
+        return;
     }
-    rw_queue_release(&g_rw_queue);
 
     // Assemble HTTP request to server.
-    char request_str[MAXLINE];
-    if (assemble_request_str(request_str, MAXLINE, parser, &request)) {
+    request_str = bufpool_get(g_io_pool);
+    if (request_str == NULL ||
+        assemble_request_str(request_str, MAXLINE, relay->parser, request)) {
         if (g_cfg.verbose)
             perror("sprintf assemble");
-        close(client_fd);
-        parser_free(parser);
-        pthread_exit(NULL);
+        goto fail;
     }
 
     // Establish connection to server.
-    int server_fd = open_clientfd(request.host, request.port);
+    server_fd = co_open_clientfd(request->host, request->port);
     if (server_fd < 0) {
         if (g_cfg.verbose)
             fprintf(stderr, "[PROXY] Failed to connect to server %s:%s\n",
-                    request.host, request.port);
-        close(client_fd);
-        parser_free(parser);
-        pthread_exit(NULL);
+                    request->host, request->port);
+        goto fail;
     }
+    tcpstat_conn_init(&relay->tcp_origin, TCPSTAT_ORIGIN, request->host);
 
     // Relay assembled request to server.
     // Assume that the request can be sent in one chunk.
-    if (rio_writen(server_fd, request_str, strlen(request_str)) < 0) {
+    if (co_rio_writen(server_fd, request_str, strlen(request_str)) < 0) {
         if (g_cfg.verbose)
             perror("rio_writen server");
-        close(client_fd);
+        goto fail;
+    }
+    bufpool_put(g_io_pool, request_str);
+    request_str = NULL;
+
+    // Relay the response to the client, keeping its start for the cache.
+    object = bufpool_get(g_object_pool);
+    if (object == NULL)
+        goto fail;
+    size_t object_len;
+    int res = relay_stream(relay, &server_fd, object, &object_len);
+    if (res == 0)
+        relay->outcome = ALOG_MISS;
+
+    // Cache the response if it is complete and isn't too large.
+    // This will not re-insert duplicates.
+    if (object_len == MAX_OBJECT_SIZE) {
+        mark_large_uri(request->uri);
+    } else if (res == 0) {
+        plock_lock(&g_cache_lock);
+        cache_insert(g_cache, request->uri, strlen(request->uri) + 1, object,
+                     object_len);
+        plock_unlock(&g_cache_lock);
+        prefetch_scan(request->uri, object, object_len);
+    }
+
+    bufpool_put(g_object_pool, object);
+    relay_done(relay);
+    return;
+
+fail:
+    bufpool_put(g_io_pool, request_str);
+    if (server_fd >= 0)
         close(server_fd);
-        parser_free(parser);
-        pthread_exit(NULL);
-    }
-
-    // Read response(s) from server and relay to client.
-    // We account for the server splitting its response into multiple
-    // chunks.
-    rio_t rio_server;
-    rio_readinitb(&rio_server, server_fd);
-    char buf_accum[MAX_OBJECT_SIZE];
-    ssize_t rsize;
-    size_t offset = 0;
-    bool cache_buf = true;
-    while ((rsize = rio_readnb(&rio_server, &buf_accum[offset],
-                               MAX_OBJECT_SIZE - offset)) > 0) {
-        // Relay response chunk to client.
-        if (rio_writen(client_fd, &buf_accum[offset], rsize) < 0) {
+    relay_log(relay);
+    relay_free(relay);
+}
+
+/**
+ * @brief Relay a single client request and the server's response to it. This
+ * is straight-line blocking code; it runs either on its own thread or as a
+ * coroutine, in which case every socket operation is a yield point.
+ *
+ * @param  client_fd  Connected client socket. Closed before returning.
+ */
+static void handle_relay(int client_fd) {
+    relay_t *relay = relay_lookup(client_fd, SIZE_MAX);
+    if (relay)
+        relay_fetch(relay);
+}
+
+/**
+ * @brief Function that encompasses the runtime of each thread that is spawned
+ * to manage relaying client requests and server responses to said requests.
+ * Each thread detaches itself, thereby causing cleanup to happen automatically
+ * upon exiting.
+ *
+ * @param  vargp  Passed argument from the main thread. This will just be the
+ * client file descriptor value stored in a pointer.
+ */
+static void *thread_handle_relay(void *vargp) {
+    // Detach thread so that it'll clean up after itself after exiting.
+    pthread_detach(pthread_self());
+    handle_relay((size_t)vargp);
+    return NULL;
+}
+
+/**
+ * @brief Coroutine body for a client connection.
+ */
+static void coro_handle_relay(void *arg) {
+    handle_relay((size_t)arg);
+}
+
+/**
+ * @brief Second half of a relay classified by relay_lookup. A large hit is
+ * looked up again, since it may have been evicted in the meantime.
+ */
+static void relay_continue(relay_t *relay) {
+    if (relay->lane == LANE_LARGE && relay_serve_cached(relay, SIZE_MAX) == 1) {
+        relay_done(relay);
+        return;
+    }
+    if (relay->cached_only) {
+        relay_not_cached(relay);
+        return;
+    }
+    relay_fetch(relay);
+}
+
+/**
+ * @brief Pool task for the second half of a relay.
+ */
+static void task_relay_continue(void *arg) {
+    relay_continue((relay_t *)arg);
+}
+
+/**
+ * @brief Pool task for a freshly accepted connection, queued on the hit lane.
+ * Whatever the cache cannot answer right away continues on the lane it was
+ * classified into, so misses and large transfers never occupy the workers
+ * reserved for hits.
+ */
+static void task_relay_lookup(void *arg) {
+    relay_t *relay = relay_lookup((size_t)arg, LARGE_HIT_SIZE);
+    if (relay &&
+        sched_submit_lane(g_sched, relay->lane, task_relay_continue, relay) < 0)
+        relay_continue(relay);
+}
+
+/**
+ * @brief Event loop thread. Runs coroutines until the process exits.
+ */
+static void *thread_coro_loop(void *vargp) {
+    coro_loop_run((coro_loop_t *)vargp);
+    return NULL;
+}
+
+/**
+ * @brief Hand a connection with a request to read to whatever runs relays:
+ * an event loop (round-robin), the worker pool, or a thread of its own. Called
+ * for new connections and for parked ones that became readable.
+ */
+static void dispatch_connection(int fd) {
+    size_t client_fd = fd;
+
+    if (g_loops) {
+        size_t i = atomic_fetch_add(&g_next_loop, 1) % g_cfg.coro_loops;
+        if (coro_spawn(g_loops[i], coro_handle_relay, (void *)client_fd) < 0) {
             if (g_cfg.verbose)
-                perror("rio_writen client");
-            break;
+                perror("coro_spawn");
+            close(fd);
         }
+        return;
+    }
 
-        // Accumulate server response chunks for caching.
-        if (offset + rsize >= MAX_OBJECT_SIZE)
-            cache_buf = false;
-        offset += rsize;
-        offset %= MAX_OBJECT_SIZE - 1;
+    if (g_sched) {
+        if (sched_submit_lane(g_sched, LANE_HIT, task_relay_lookup,
+                              (void *)client_fd) < 0) {
+            if (g_cfg.verbose)
+                perror("sched_submit");
+            close(fd);
+        }
+        return;
     }
 
-    // Cache the response if it isn't too large.
-    // This will not re-insert duplicates.
-    if (cache_buf) {
-        rw_queue_request_write(&g_rw_queue, &writer_tok);
-        cache_insert(g_cache, request.uri, strlen(request.uri) + 1, buf_accum,
-                     offset);
-        rw_queue_release(&g_rw_queue);
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, thread_handle_relay,
+                       (void *)client_fd) != 0) {
+        if (g_cfg.verbose)
+            perror("pthread_create");
+        close(fd);
+    }
+}
+
+/**
+ * @brief Open a listener for clients on the TCP port or UNIX socket `addr`.
+ */
+static int open_client_listener(const char *addr) {
+    if (unixsock_is_path(addr))
+        return unixsock_listen(addr, UNIXSOCK_BACKLOG);
+    return open_listenfd(addr);
+}
+
+/**
+ * @brief Accept clients on `listenfd` until the process exits, handing each
+ * connection over to dispatch_connection.
+ */
+static void accept_clients(int listenfd) {
+    while (1) {
+        client_info_t client;
+        client.addrlen = sizeof(client.addr);
+
+        // Wait until client connects.
+        // @note The client file will become the responsibility of the thread
+        // spawned to handle it.
+        //       This means that we will not close it here in the main thread.
+        client.connfd = accept(listenfd, (SA *)&client.addr, &client.addrlen);
+        if (client.connfd < 0) {
+            if (g_cfg.verbose)
+                perror("accept");
+            continue;
+        }
+
+        // Retrieve connected client info.
+        // Not doing this in a separate thread because I don't want to deal with
+        // locking on the `client` struct. UNIX socket clients have no name.
+        int res = 0;
+        if (client.addr.ss_family != AF_UNIX)
+            res = getnameinfo((SA *)&client.addr, client.addrlen, client.host,
+                              sizeof(client.host), client.serv,
+                              sizeof(client.serv), 0);
+        if (res) {
+            if (g_cfg.verbose)
+                perror("getnameinfo client");
+            close(client.connfd);
+            continue;
+        }
+
+        // Coroutine sockets must be non-blocking so that the coroutine
+        // yields instead of stalling every other connection on its loop.
+        if (g_loops)
+            fcntl(client.connfd, F_SETFL,
+                  fcntl(client.connfd, F_GETFL) | O_NONBLOCK);
+        dispatch_connection(client.connfd);
     }
+}
+
+/**
+ * @brief Accepting thread of a second listener.
+ */
+static void *thread_accept_clients(void *vargp) {
+    accept_clients((int)(size_t)vargp);
+    return NULL;
+}
 
-    // Cleanup thread resources.
-    close(client_fd);
-    close(server_fd);
-    parser_free(parser);
+/**
+ * @brief Apply a new cache budget from the cgroup controller. Shrinking evicts
+ * a batch at a time, letting hits in between, and hands the freed memory back
+ * to the system so that the cgroup sees it go.
+ */
+static void apply_cache_budget(size_t budget, void *arg) {
+    plock_lock(&g_cache_lock);
+    const bool shrink = budget < g_cache->max_size;
+    cache_set_max_size(g_cache, budget);
+    plock_unlock(&g_cache_lock);
+    if (!shrink)
+        return;
 
-    // We must allow other threads to continue execution when exiting this one.
-    pthread_exit(NULL);
+    int more;
+    do {
+        plock_lock(&g_cache_lock);
+        more = cache_trim(g_cache, CACHE_TRIM_BATCH);
+        plock_unlock(&g_cache_lock);
+    } while (more);
+    malloc_trim(0);
+}
+
+/**
+ * @brief Store a response fetched by the warm-up, unless the cache is full:
+ * what comes next is less popular than anything it would evict.
+ */
+static warmup_result_t warmup_store(const char *uri, const char *response,
+                                    size_t len, void *arg) {
+    warmup_result_t res = WARMUP_STORED;
+    plock_lock(&g_cache_lock);
+    if (cache_used(g_cache) + len > g_cache->max_size)
+        res = WARMUP_FULL;
+    else if (cache_insert(g_cache, uri, strlen(uri) + 1, response, len) < 0)
+        res = WARMUP_SKIPPED;
+    plock_unlock(&g_cache_lock);
+    return res;
+}
+
+/**
+ * @brief Admission policy of the prefetcher: fetch what is neither cached
+ * nor known to be too large to cache.
+ */
+static bool prefetch_admit(const char *uri, void *arg) {
+    if (is_large_uri(uri))
+        return false;
+    plock_lock(&g_cache_lock);
+    const bool cached = hashmap_find(g_cache->map, uri, strlen(uri) + 1);
+    plock_unlock(&g_cache_lock);
+    return !cached;
+}
+
+/**
+ * @brief Store a prefetched response, unless a client fetched it first.
+ */
+static bool prefetch_store(const char *uri, const char *response, size_t len,
+                           void *arg) {
+    plock_lock(&g_cache_lock);
+    const bool stored =
+        hashmap_find(g_cache->map, uri, strlen(uri) + 1) == NULL &&
+        cache_insert(g_cache, uri, strlen(uri) + 1, response, len) == 0;
+    plock_unlock(&g_cache_lock);
+    return stored;
+}
+
+/**
+ * @brief Raise the soft limit on open files as far as allowed, since every
+ * idle keep-alive connection holds one.
+ *
+ * @return The new limit.
+ */
+static size_t raise_nofile_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return FD_SETSIZE;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        getrlimit(RLIMIT_NOFILE, &rl);
+    return rl.rlim_cur;
 }
 
 /**
@@ -674,58 +1988,211 @@ int main(int argc, char **argv) {
     if (g_cfg.verbose)
         printf("header: %s"
                "port:   %s\n",
-               header_user_agent, g_cfg.port);
+               header_user_agent,
+               g_cfg.port ? g_cfg.port : g_cfg.unix_path);
+
+    if (mem_init() < 0) {
+        perror("mem_init");
+        exit(EXIT_FAILURE);
+    }
 
-    g_cache = cache_init(MAX_CACHE_SIZE);
-    rw_queue_init(&g_rw_queue);
+    ntcopy_set_threshold(g_cfg.ntcopy_threshold);
+    g_cache = cache_init_budget(g_cfg.cache_max ? g_cfg.cache_max
+                                                : MAX_CACHE_SIZE,
+                                g_cfg.cache_budget);
+    plock_init(&g_cache_lock, "cache");
+    g_io_pool = bufpool_init("io", IO_BUFSIZE, IO_POOL_MAX_FREE);
+    g_object_pool =
+        bufpool_init("object", MAX_OBJECT_SIZE, OBJECT_POOL_MAX_FREE);
+    g_spill_pool =
+        bufpool_init("spill", SPILL_CHUNK_SIZE, SPILL_POOL_MAX_FREE);
+    if (g_io_pool == NULL || g_object_pool == NULL || g_spill_pool == NULL) {
+        perror("bufpool_init");
+        exit(EXIT_FAILURE);
+    }
+    g_stat_spill_bytes = stats_counter("relay.spill_bytes");
+    g_stat_backpressure = stats_counter("relay.backpressure");
+    g_stat_early_release = stats_counter("relay.origin_released_early");
+    g_stat_readthrough_hits = stats_counter("ring.readthrough_hits");
+    g_stat_readthrough_misses = stats_counter("ring.readthrough_misses");
+    tcpstat_init(g_cfg.tcp_samples);
 
     // Install signal handlers.
     // When sockets disconnect, the kernel may send SIGPIPE to this process --
     // we need to make sure we don't exit as a result.
     Signal(SIGPIPE, sigpipe_handler);
 
-    // Start listening to specified port.
-    int listenfd = open_listenfd(g_cfg.port);
-    if (listenfd < 0) {
-        perror("open_listenfd");
+    // Start the event loops if connections are to be run as coroutines.
+    if (g_cfg.coro_loops > 0) {
+        g_loops = malloc(g_cfg.coro_loops * sizeof(coro_loop_t *));
+        for (int i = 0; i < g_cfg.coro_loops; ++i) {
+            pthread_t thread_id;
+            g_loops[i] = coro_loop_init(CORO_STACK_SIZE);
+            if (g_loops[i] == NULL ||
+                pthread_create(&thread_id, NULL, thread_coro_loop,
+                               g_loops[i])) {
+                perror("coro_loop_init");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Start the worker pool if connections are to be run as pool tasks.
+    if (g_cfg.workers > 0) {
+        for (int i = 0; i < NUM_LANES; ++i)
+            g_lanes[i].reserved = g_cfg.reserve[i];
+        g_sched = sched_init_lanes(g_cfg.workers, SCHED_STEAL, g_lanes,
+                                   NUM_LANES);
+        if (g_sched == NULL) {
+            perror("sched_init");
+            exit(EXIT_FAILURE);
+        }
+
+        if (g_cfg.max_workers > 0) {
+            sched_tune_t tune = {
+                .min_workers = g_cfg.min_workers,
+                .max_workers = g_cfg.max_workers,
+                .interval_us = 100 * 1000,
+                .target_wait_us = 2 * 1000,
+                .grow_step = 2,
+            };
+            if (sched_autosize(g_sched, &tune) < 0) {
+                fprintf(stderr, "sched_autosize: invalid pool bounds\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Park idle keep-alive connections until their next request.
+    if (g_cfg.keepalive_s > 0) {
+        g_parklot = parklot_init(dispatch_connection, raise_nofile_limit(),
+                                 g_cfg.keepalive_s);
+        if (g_parklot == NULL) {
+            perror("parklot_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (g_cfg.alog.path && (g_alog = alog_open(&g_cfg.alog)) == NULL) {
+        perror("alog_open");
         exit(EXIT_FAILURE);
     }
 
-    while (1) {
-        client_info_t client;
-        client.addrlen = sizeof(client.addr);
+    // Get the cache back from the journal before anything else fills it.
+    if (g_cfg.journal.path &&
+        journal_open(&g_cfg.journal, g_cache, &g_cache_lock) < 0) {
+        perror("journal_open");
+        exit(EXIT_FAILURE);
+    }
 
-        // Wait until client connects.
-        // @note The client file will become the responsibility of the thread
-        // spawned to handle it.
-        //       This means that we will not close it here in the main thread.
-        client.connfd = accept(listenfd, (SA *)&client.addr, &client.addrlen);
-        if (client.connfd < 0) {
-            if (g_cfg.verbose)
-                perror("accept");
-            continue;
+    // Room for the whole cache, plus what the buddy allocator of the view
+    // rounds up and what is inserted before the evictions it makes room for.
+    if (g_cfg.view_path) {
+        const size_t size =
+            g_cfg.view_size ? g_cfg.view_size
+                            : 4 * (g_cfg.cache_max ? g_cfg.cache_max
+                                                   : MAX_CACHE_SIZE);
+        if (cacheshm_start(g_cfg.view_path, size, g_cache, &g_cache_lock) <
+            0) {
+            perror("cacheshm_start");
+            exit(EXIT_FAILURE);
         }
+    }
 
-        // Retrieve connected client info.
-        // Not doing this in a separate thread because I don't want to deal with
-        // locking on the `client` struct.
-        int res = getnameinfo((SA *)&client.addr, client.addrlen, client.host,
-                              sizeof(client.host), client.serv,
-                              sizeof(client.serv), 0);
-        if (res) {
-            if (g_cfg.verbose)
-                perror("getnameinfo client");
-            close(client.connfd);
-            continue;
+    if (g_cfg.repl_from &&
+        repl_start_standby(g_cfg.repl_from, g_cache, &g_cache_lock) < 0) {
+        perror("repl_start_standby");
+        exit(EXIT_FAILURE);
+    }
+    if (g_cfg.repl_to &&
+        repl_start_active(g_cfg.repl_to, REPL_DEFAULT_MAX_PENDING, g_cache,
+                          &g_cache_lock) < 0) {
+        fprintf(stderr, "repl_start_active: bad standby address %s\n",
+                g_cfg.repl_to);
+        exit(EXIT_FAILURE);
+    }
+
+    if (g_cfg.ring.path &&
+        ring_start(&g_cfg.ring, g_cache, &g_cache_lock) < 0) {
+        fprintf(stderr, "ring_start: no members in %s\n", g_cfg.ring.path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Size the cache after the memory the cgroup can spare.
+    if (g_cfg.cache_max > 0) {
+        cgmem_tune_t tune;
+        cgmem_tune_defaults(&tune, g_cfg.cache_min, g_cfg.cache_max);
+        tune.dir = g_cfg.cgroup_dir;
+        if (cgmem_start(&tune, apply_cache_budget, NULL) < 0) {
+            fprintf(stderr, "cgmem_start: no cgroup v2 memory controller "
+                            "found\n");
+            exit(EXIT_FAILURE);
         }
+    }
 
-        // Launch a thread to handle relay of client request and server
-        // response.
-        size_t client_fd = client.connfd;
-        pthread_t thread_id;
-        pthread_create(&thread_id, NULL, thread_handle_relay,
-                       (void *)client_fd);
+    if (g_cfg.warmup.path &&
+        warmup_start(&g_cfg.warmup, warmup_store, NULL) < 0) {
+        perror("warmup_start");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((g_cfg.prefetch.per_page > 0 || g_cfg.prefetch.seq_depth > 0) &&
+        prefetch_start(&g_cfg.prefetch, prefetch_admit, prefetch_store,
+                       NULL) < 0) {
+        perror("prefetch_start");
+        exit(EXIT_FAILURE);
+    }
+
+    if (g_cfg.metrics_path &&
+        statshm_start(g_cfg.metrics_path, g_cfg.metrics_interval_ms) < 0) {
+        perror("statshm_start");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((g_cfg.admin_port || g_cfg.purge.port) &&
+        purge_start(&g_cfg.purge, g_cache, &g_cache_lock) < 0) {
+        perror("purge_start");
+        exit(EXIT_FAILURE);
+    }
+
+    if (g_cfg.admin_port) {
+        admin_register("/profile", prof_admin_handler);
+        admin_register("/locks", plock_admin_handler);
+        admin_register("/purge", purge_admin_handler);
+        if (g_cfg.ring.path)
+            admin_register("/ring", ring_admin_handler);
+    }
+    if (g_cfg.admin_port && admin_start(g_cfg.admin_port) < 0) {
+        perror("admin_start");
+        exit(EXIT_FAILURE);
+    }
+
+    // Start listening to specified port and UNIX socket. When there are
+    // both, the UNIX socket gets an accepting thread of its own.
+    int listenfd = -1;
+    if (g_cfg.port) {
+        listenfd = open_client_listener(g_cfg.port);
+        if (listenfd < 0) {
+            perror("open_listenfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (g_cfg.unix_path) {
+        int unixfd = unixsock_listen(g_cfg.unix_path, UNIXSOCK_BACKLOG);
+        if (unixfd < 0) {
+            perror("unixsock_listen");
+            exit(EXIT_FAILURE);
+        }
+        pthread_t tid;
+        if (listenfd < 0) {
+            listenfd = unixfd;
+        } else if (pthread_create(&tid, NULL, thread_accept_clients,
+                                  (void *)(size_t)unixfd) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
     }
+    accept_clients(listenfd);
 
     // Final resource cleanup.
     close(listenfd);
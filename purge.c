@@ -0,0 +1,616 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache purges, fanned out to every proxy of a cluster.
+ */
+#define _GNU_SOURCE
+#include "purge.h"
+#include "admin.h"
+#include "hashmap.h"
+#include "stats.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Longest argument a datagram can carry.
+ */
+#define PURGE_MAX_ARG \
+    (PURGE_DATAGRAM - sizeof(purge_header_t) - sizeof(purge_entry_t))
+
+/*
+ * Sequence numbers remembered per sender, behind the highest one seen.
+ */
+#define PURGE_DEDUP_WINDOW 64
+
+#define SURROGATE_KEY "Surrogate-Key:"
+
+/**************** STRUCTS ****************/
+/**
+ * A purge waiting to be broadcast.
+ */
+typedef struct Queued {
+    struct Queued *next;
+    purge_type_t type;
+    size_t len;
+    char arg[];
+} queued_t;
+
+/**
+ * A datagram waiting for acknowledgements.
+ *
+ * @param  seq      Its sequence number (0 = free slot).
+ * @param  acked    Bit i is set once peer i acknowledged it.
+ * @param  next_us  When to send it again to the peers that have not.
+ */
+typedef struct {
+    uint64_t seq;
+    uint64_t sent_us;
+    uint64_t next_us;
+    unsigned attempts;
+    uint32_t acked;
+    size_t len;
+    char data[PURGE_DATAGRAM];
+} flight_t;
+
+/**
+ * The sequence numbers seen from one sender: the highest, and a bitmap of
+ * the PURGE_DEDUP_WINDOW below it (bit i = high - i).
+ */
+typedef struct {
+    uint32_t node;
+    uint64_t high;
+    uint64_t seen;
+} sender_t;
+
+/**************** GLOBALS ****************/
+static struct {
+    cache_t *cache;
+    plock_t *lock;
+
+    int fd; /* -1 = local purges only. */
+    uint32_t node;
+    uint64_t seq;
+    struct sockaddr_storage peers[PURGE_MAX_PEERS];
+    socklen_t peerlens[PURGE_MAX_PEERS];
+    size_t npeers;
+    uint32_t all_acked;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    queued_t *head;
+    queued_t **tail;
+    flight_t window[PURGE_WINDOW];
+
+    // Receiving thread only.
+    sender_t senders[PURGE_MAX_PEERS];
+
+    stat_counter_t *stat_requests;
+    stat_counter_t *stat_purged;
+    stat_counter_t *stat_sent;
+    stat_counter_t *stat_retransmits;
+    stat_counter_t *stat_acked;
+    stat_counter_t *stat_unacked;
+    stat_counter_t *stat_received;
+    stat_counter_t *stat_duplicates;
+    stat_counter_t *stat_rejected;
+    stat_hist_t *stat_ack_us;
+} g_purge = {.fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**************** MATCHING ****************/
+typedef struct {
+    const char *arg;
+    size_t len;
+} pattern_t;
+
+static bool match_prefix(const block_t *block, void *arg) {
+    const pattern_t *p = arg;
+    // Keys are NUL-terminated URIs.
+    return block->keylen > p->len && memcmp(block->key, p->arg, p->len) == 0;
+}
+
+/**
+ * @brief Whether the response of a block lists the surrogate key in
+ * `arg` in one of its `Surrogate-Key` headers.
+ */
+static bool match_tag(const block_t *block, void *arg) {
+    const pattern_t *p = arg;
+    const char *response = block->value;
+    const char *end = memmem(response, block->size, "\r\n\r\n", 4);
+    if (end == NULL)
+        end = response + block->size;
+
+    const char *line = memmem(response, end - response, "\r\n", 2);
+    while (line && line < end) {
+        line += 2;
+        const char *eol = memmem(line, end - line, "\r\n", 2);
+        if (eol == NULL)
+            eol = end;
+        const size_t n = sizeof(SURROGATE_KEY) - 1;
+        if ((size_t)(eol - line) > n &&
+            strncasecmp(line, SURROGATE_KEY, n) == 0) {
+            // Space-separated keys.
+            const char *tok = line + n;
+            while (tok < eol) {
+                while (tok < eol && (*tok == ' ' || *tok == '\t'))
+                    tok++;
+                const char *tok_end = tok;
+                while (tok_end < eol && *tok_end != ' ' && *tok_end != '\t')
+                    tok_end++;
+                if ((size_t)(tok_end - tok) == p->len &&
+                    memcmp(tok, p->arg, p->len) == 0)
+                    return true;
+                tok = tok_end;
+            }
+        }
+        line = eol;
+    }
+    return false;
+}
+
+/**
+ * @brief Remove the entries a purge applies to from the local cache.
+ *
+ * @return The number of entries removed.
+ */
+static size_t apply(purge_type_t type, const char *arg, size_t len) {
+    pattern_t pattern = {arg, len};
+    size_t purged = 0;
+    plock_lock(g_purge.lock);
+    if (type == PURGE_KEY) {
+        char key[PURGE_MAX_ARG + 1];
+        memcpy(key, arg, len);
+        key[len] = '\0';
+        block_t *block = hashmap_find(g_purge.cache->map, key, len + 1);
+        purged = block && cache_delete(g_purge.cache, block) == 0;
+    } else if (type == PURGE_PREFIX) {
+        purged = cache_purge(g_purge.cache, match_prefix, &pattern);
+    } else if (type == PURGE_TAG) {
+        purged = cache_purge(g_purge.cache, match_tag, &pattern);
+    }
+    plock_unlock(g_purge.lock);
+    stats_add(g_purge.stat_purged, purged);
+    return purged;
+}
+
+/**************** SENDING ****************/
+static void deadline(struct timespec *ts, uint64_t us) {
+    ts->tv_sec = us / 1000000;
+    ts->tv_nsec = (long)(us % 1000000) * 1000;
+}
+
+/**
+ * @brief Send a datagram to every peer that has not acknowledged it.
+ */
+static void send_flight(const flight_t *f) {
+    for (size_t i = 0; i < g_purge.npeers; ++i)
+        if (!(f->acked & (1u << i)))
+            sendto(g_purge.fd, f->data, f->len, 0,
+                   (struct sockaddr *)&g_purge.peers[i], g_purge.peerlens[i]);
+}
+
+/**
+ * @brief Give a datagram a sequence number and a window slot, and send it.
+ * The caller holds g_purge.mutex.
+ */
+static void launch(const char *data, size_t len, uint16_t count) {
+    const uint64_t seq = ++g_purge.seq;
+    flight_t *f = &g_purge.window[seq % PURGE_WINDOW];
+    if (f->seq)
+        stats_add(g_purge.stat_unacked, 1);
+    memcpy(f->data, data, len);
+    purge_header_t *header = (purge_header_t *)f->data;
+    header->seq = seq;
+    header->count = count;
+    f->seq = seq;
+    f->len = len;
+    f->acked = 0;
+    f->attempts = 1;
+    f->sent_us = stats_now_us();
+    f->next_us = f->sent_us + PURGE_RETRY_MS * 1000;
+    send_flight(f);
+    stats_add(g_purge.stat_sent, 1);
+}
+
+/**
+ * @brief Pack a list of purges into as few datagrams as they fit in, and
+ * send them. The caller holds g_purge.mutex.
+ */
+static void launch_all(queued_t *list) {
+    char data[PURGE_DATAGRAM];
+    const purge_header_t header = {
+        .magic = PURGE_MAGIC,
+        .node = g_purge.node,
+        .kind = PURGE_MSG,
+    };
+    memcpy(data, &header, sizeof(header));
+    size_t len = sizeof(header);
+    uint16_t count = 0;
+    while (list) {
+        queued_t *q = list;
+        if (len + sizeof(purge_entry_t) + q->len > sizeof(data)) {
+            launch(data, len, count);
+            len = sizeof(header);
+            count = 0;
+        }
+        const purge_entry_t entry = {.type = q->type, .len = q->len};
+        memcpy(data + len, &entry, sizeof(entry));
+        memcpy(data + len + sizeof(entry), q->arg, q->len);
+        len += sizeof(entry) + q->len;
+        count++;
+        list = q->next;
+        free(q);
+    }
+    if (count)
+        launch(data, len, count);
+}
+
+/**
+ * @brief Send datagrams again to the peers that have not acknowledged them,
+ * backing off exponentially, and give up after PURGE_ATTEMPTS. The caller
+ * holds g_purge.mutex.
+ *
+ * @return When the next one is due (UINT64_MAX = none in flight).
+ */
+static uint64_t retransmit(uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < PURGE_WINDOW; ++i) {
+        flight_t *f = &g_purge.window[i];
+        if (f->seq == 0)
+            continue;
+        if (f->next_us <= now) {
+            if (f->attempts == PURGE_ATTEMPTS) {
+                f->seq = 0;
+                stats_add(g_purge.stat_unacked, 1);
+                continue;
+            }
+            send_flight(f);
+            f->next_us = now + ((uint64_t)PURGE_RETRY_MS * 1000 << f->attempts);
+            f->attempts++;
+            stats_add(g_purge.stat_retransmits, 1);
+        }
+        if (f->next_us < next)
+            next = f->next_us;
+    }
+    return next;
+}
+
+static void *thread_send(void *vargp) {
+    pthread_mutex_lock(&g_purge.mutex);
+    while (1) {
+        if (g_purge.head) {
+            queued_t *list = g_purge.head;
+            g_purge.head = NULL;
+            g_purge.tail = &g_purge.head;
+            launch_all(list);
+        }
+        const uint64_t next = retransmit(stats_now_us());
+        if (g_purge.head)
+            continue;
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&g_purge.cond, &g_purge.mutex);
+        } else {
+            struct timespec ts;
+            deadline(&ts, next);
+            pthread_cond_timedwait(&g_purge.cond, &g_purge.mutex, &ts);
+        }
+    }
+    return NULL;
+}
+
+/**************** RECEIVING ****************/
+/**
+ * @brief Whether a datagram from `node` has not been applied yet, marking it
+ * as applied.
+ */
+static bool first_time(uint32_t node, uint64_t seq) {
+    sender_t *s = NULL;
+    for (size_t i = 0; i < PURGE_MAX_PEERS && s == NULL; ++i)
+        if (g_purge.senders[i].node == node || g_purge.senders[i].high == 0)
+            s = &g_purge.senders[i];
+    if (s == NULL)
+        s = &g_purge.senders[node % PURGE_MAX_PEERS];
+    if (s->node != node)
+        *s = (sender_t){.node = node};
+
+    if (seq > s->high) {
+        const uint64_t shift = seq - s->high;
+        s->seen = shift >= PURGE_DEDUP_WINDOW ? 0 : s->seen << shift;
+        s->seen |= 1;
+        s->high = seq;
+        return true;
+    }
+    const uint64_t age = s->high - seq;
+    if (age >= PURGE_DEDUP_WINDOW || (s->seen & ((uint64_t)1 << age)))
+        return false;
+    s->seen |= (uint64_t)1 << age;
+    return true;
+}
+
+/**
+ * @brief Apply the purges of a datagram, once per sequence number.
+ */
+static void receive_purges(const char *data, size_t len) {
+    const purge_header_t *header = (const purge_header_t *)data;
+    if (!first_time(header->node, header->seq)) {
+        stats_add(g_purge.stat_duplicates, 1);
+        return;
+    }
+    size_t off = sizeof(*header);
+    for (uint16_t i = 0; i < header->count; ++i) {
+        purge_entry_t entry;
+        if (off + sizeof(entry) > len)
+            break;
+        memcpy(&entry, data + off, sizeof(entry));
+        off += sizeof(entry);
+        if (off + entry.len > len || entry.len > PURGE_MAX_ARG)
+            break;
+        apply(entry.type, data + off, entry.len);
+        off += entry.len;
+        stats_add(g_purge.stat_received, 1);
+    }
+}
+
+/**
+ * @brief Index of the peer at `addr`, or -1.
+ */
+static int find_peer(const struct sockaddr_storage *addr, socklen_t len) {
+    for (size_t i = 0; i < g_purge.npeers; ++i)
+        if (g_purge.peerlens[i] == len &&
+            memcmp(&g_purge.peers[i], addr, len) == 0)
+            return i;
+    return -1;
+}
+
+static void receive_ack(const purge_header_t *header, int peer) {
+    pthread_mutex_lock(&g_purge.mutex);
+    flight_t *f = &g_purge.window[header->seq % PURGE_WINDOW];
+    if (f->seq == header->seq && header->node == g_purge.node) {
+        f->acked |= 1u << peer;
+        if (f->acked == g_purge.all_acked) {
+            stats_hist_record(g_purge.stat_ack_us,
+                              stats_now_us() - f->sent_us);
+            stats_add(g_purge.stat_acked, 1);
+            f->seq = 0;
+        }
+    }
+    pthread_mutex_unlock(&g_purge.mutex);
+}
+
+static void *thread_receive(void *vargp) {
+    char data[PURGE_DATAGRAM];
+    while (1) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(g_purge.fd, data, sizeof(data), 0,
+                             (struct sockaddr *)&from, &fromlen);
+        purge_header_t header;
+        if (n < (ssize_t)sizeof(header))
+            continue;
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != PURGE_MAGIC)
+            continue;
+
+        if (header.kind == PURGE_ACK) {
+            int peer = find_peer(&from, fromlen);
+            if (peer >= 0)
+                receive_ack(&header, peer);
+        } else if (header.kind == PURGE_MSG) {
+            // Purges are not authenticated; only take them from peers.
+            if (find_peer(&from, fromlen) < 0) {
+                stats_add(g_purge.stat_rejected, 1);
+                continue;
+            }
+            receive_purges(data, n);
+            header.kind = PURGE_ACK;
+            header.count = 0;
+            sendto(g_purge.fd, &header, sizeof(header), 0,
+                   (struct sockaddr *)&from, fromlen);
+        }
+    }
+    return NULL;
+}
+
+/**************** SETUP ****************/
+/**
+ * @brief Resolve `host:port` into `addr`.
+ */
+static int resolve(const char *peer, struct sockaddr_storage *addr,
+                   socklen_t *len) {
+    char host[256];
+    const char *colon = strrchr(peer, ':');
+    if (colon == NULL || (size_t)(colon - peer) >= sizeof(host))
+        return -1;
+    memcpy(host, peer, colon - peer);
+    host[colon - peer] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        return -1;
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**
+ * @brief Bind a UDP socket to `port` on every IPv4 address.
+ */
+static int bind_port(const char *port) {
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *res;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int purge_start(const purge_cfg_t *cfg, cache_t *cache, plock_t *lock) {
+    g_purge.cache = cache;
+    g_purge.lock = lock;
+    g_purge.tail = &g_purge.head;
+
+    g_purge.stat_requests = stats_counter("purge.requests");
+    g_purge.stat_purged = stats_counter("purge.purged");
+    g_purge.stat_sent = stats_counter("purge.sent");
+    g_purge.stat_retransmits = stats_counter("purge.retransmits");
+    g_purge.stat_acked = stats_counter("purge.acked");
+    g_purge.stat_unacked = stats_counter("purge.unacked");
+    g_purge.stat_received = stats_counter("purge.received");
+    g_purge.stat_duplicates = stats_counter("purge.duplicates");
+    g_purge.stat_rejected = stats_counter("purge.rejected");
+    g_purge.stat_ack_us = stats_hist("purge.ack_us");
+    if (cfg->port == NULL)
+        return 0;
+
+    if (cfg->npeers > PURGE_MAX_PEERS)
+        return -1;
+    for (size_t i = 0; i < cfg->npeers; ++i)
+        if (resolve(cfg->peers[i], &g_purge.peers[i], &g_purge.peerlens[i]))
+            return -1;
+    g_purge.npeers = cfg->npeers;
+    g_purge.all_acked = (uint32_t)(((uint64_t)1 << cfg->npeers) - 1);
+    if (getrandom(&g_purge.node, sizeof(g_purge.node), 0) < 0)
+        g_purge.node = getpid() ^ (uint32_t)stats_now_us();
+
+    // Retransmission deadlines are on the monotonic clock.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_purge.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if ((g_purge.fd = bind_port(cfg->port)) < 0)
+        return -1;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_receive, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    if (pthread_create(&tid, NULL, thread_send, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+/**
+ * @brief purge_submit, waking the sending thread only if `wake`.
+ */
+static ssize_t submit(purge_type_t type, const char *arg, size_t len,
+                      bool wake) {
+    if (len > PURGE_MAX_ARG)
+        return -1;
+    stats_add(g_purge.stat_requests, 1);
+    const size_t purged = apply(type, arg, len);
+    if (g_purge.fd < 0 || g_purge.npeers == 0)
+        return purged;
+
+    queued_t *q = malloc(sizeof(queued_t) + len);
+    if (q == NULL)
+        return purged;
+    q->next = NULL;
+    q->type = type;
+    q->len = len;
+    memcpy(q->arg, arg, len);
+    pthread_mutex_lock(&g_purge.mutex);
+    *g_purge.tail = q;
+    g_purge.tail = &q->next;
+    if (wake)
+        pthread_cond_signal(&g_purge.cond);
+    pthread_mutex_unlock(&g_purge.mutex);
+    return purged;
+}
+
+ssize_t purge_submit(purge_type_t type, const char *arg, size_t len) {
+    return submit(type, arg, len, true);
+}
+
+/**
+ * @brief Decode `%XX` escapes and `+` of a query value in place.
+ *
+ * @return The decoded length.
+ */
+static size_t percent_decode(char *s, size_t len) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (s[i] == '%' && i + 2 < len &&
+            isxdigit((unsigned char)s[i + 1]) &&
+            isxdigit((unsigned char)s[i + 2])) {
+            char hex[3] = {s[i + 1], s[i + 2], '\0'};
+            s[out++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            s[out++] = s[i] == '+' ? ' ' : s[i];
+        }
+    }
+    return out;
+}
+
+void purge_admin_handler(int fd, const char *query) {
+    size_t purged = 0, submitted = 0;
+    bool bad = false;
+    char value[PURGE_DATAGRAM];
+    const char *p = query;
+    while (*p) {
+        const size_t n = strcspn(p, "&");
+        const char *eq = memchr(p, '=', n);
+        purge_type_t type = 0;
+        if (eq && eq - p == 3 && strncmp(p, "key", 3) == 0)
+            type = PURGE_KEY;
+        else if (eq && eq - p == 6 && strncmp(p, "prefix", 6) == 0)
+            type = PURGE_PREFIX;
+        else if (eq && eq - p == 3 && strncmp(p, "tag", 3) == 0)
+            type = PURGE_TAG;
+
+        const size_t vlen = eq ? n - (eq + 1 - p) : 0;
+        if (type == 0 || vlen == 0 || vlen >= sizeof(value)) {
+            bad = true;
+        } else {
+            memcpy(value, eq + 1, vlen);
+            ssize_t res = submit(type, value, percent_decode(value, vlen),
+                                 false);
+            if (res < 0) {
+                bad = true;
+            } else {
+                purged += res;
+                submitted++;
+            }
+        }
+        p += n;
+        if (*p == '&')
+            p++;
+    }
+    if (submitted && g_purge.fd >= 0) {
+        pthread_mutex_lock(&g_purge.mutex);
+        pthread_cond_signal(&g_purge.cond);
+        pthread_mutex_unlock(&g_purge.mutex);
+    }
+
+    char body[64];
+    int len = snprintf(body, sizeof(body), "purged %zu\n", purged);
+    if (bad || submitted == 0)
+        admin_respond(fd, "400 Bad Request", "text/plain", body, len);
+    else
+        admin_respond(fd, "200 OK", "text/plain", body, len);
+}
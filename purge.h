@@ -0,0 +1,109 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache purges, fanned out to every proxy of a cluster. A purge removes the
+ * entry for an exact key (URI), every entry whose key starts with a prefix,
+ * or every entry whose response carries a surrogate key, i.e. lists it in a
+ * `Surrogate-Key` header.
+ *
+ * A purge is applied locally first, then broadcast to the configured peers
+ * over UDP. Purges submitted together, or while the previous datagram was
+ * being sent, share datagrams, so a mass purge takes a few packets. Every
+ * datagram has a sequence number, unique per sender, and is acknowledged by
+ * each peer; unacknowledged datagrams are sent again with exponential
+ * backoff, and peers apply each sequence number once however many times
+ * it arrives. Peers do not forward purges: each node sends to all others.
+ * Datagrams are not authenticated, so a node only applies those coming from
+ * the address of one of its peers; others count as `purge.rejected`.
+ *
+ * Convergence is exported as `purge.ack_us`, the time from sending a datagram
+ * to the last peer's acknowledgement.
+ */
+#ifndef PURGE_H
+#define PURGE_H
+
+#include "cache.h"
+#include "plock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PURGE_MAX_PEERS 32
+#define PURGE_DATAGRAM 1400
+#define PURGE_RETRY_MS 20
+#define PURGE_ATTEMPTS 8
+
+/*
+ * Datagrams waiting for acknowledgements at most; when a new one needs a
+ * slot, the oldest is given up on.
+ */
+#define PURGE_WINDOW 256
+
+typedef enum {
+    PURGE_KEY = 1,    /* The entry for exactly this URI. */
+    PURGE_PREFIX = 2, /* Every entry whose URI starts with this. */
+    PURGE_TAG = 3,    /* Every entry with this surrogate key. */
+} purge_type_t;
+
+/**
+ * @param  port   UDP port to exchange purges on (NULL = local purges only).
+ * @param  peers  The other proxies of the cluster, as `host:port`.
+ */
+typedef struct {
+    const char *port;
+    const char *peers[PURGE_MAX_PEERS];
+    size_t npeers;
+} purge_cfg_t;
+
+/**
+ * Header of a datagram. Purge datagrams are followed by `count` entries,
+ * each a purge_entry_t and its argument; acknowledgements echo the header of
+ * the datagram they acknowledge, with `kind` PURGE_ACK.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t node;
+    uint64_t seq;
+    uint16_t kind;
+    uint16_t count;
+    uint32_t reserved;
+} purge_header_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t len;
+} purge_entry_t;
+
+#define PURGE_MAGIC 0x47505850 /* "PXPG" */
+#define PURGE_MSG 1
+#define PURGE_ACK 2
+
+/**
+ * Purge `cache`, and the caches of the cluster if `cfg->port` is set. `lock`
+ * is the lock that callers of `cache` hold. Progress is exported as
+ * `purge.*` stats.
+ *
+ * @return 0 on success, -1 if a peer cannot be resolved or the port cannot
+ *         be bound.
+ */
+int purge_start(const purge_cfg_t *cfg, cache_t *cache, plock_t *lock);
+
+/**
+ * Apply a purge locally and queue it for the cluster. `arg` is a URI, URI
+ * prefix or surrogate key of `len` bytes, not NUL-terminated.
+ *
+ * @return The number of cached entries removed locally, or -1 if `arg` is
+ *         too long to broadcast.
+ */
+ssize_t purge_submit(purge_type_t type, const char *arg, size_t len);
+
+/**
+ * admin_handler_t for `/purge?key=<uri>`, `/purge?prefix=<uri>` and
+ * `/purge?tag=<surrogate key>`, with values percent-encoded. Any number of
+ * parameters may be given; they are broadcast together.
+ */
+void purge_admin_handler(int fd, const char *query);
+
+#endif
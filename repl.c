@@ -0,0 +1,447 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Hot-standby replication of the cache.
+ */
+#include "repl.h"
+#include "changeq.h"
+#include "csapp.h"
+#include "hashmap.h"
+#include "stats.h"
+#include "unixsock.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Records with longer keys or responses are taken for a broken stream.
+ */
+#define REPL_MAX_KEY (64 * 1024)
+#define REPL_MAX_SIZE ((uint64_t)1 << 30)
+
+/**************** GLOBALS ****************/
+/*
+ * The active side: the standby's address, whether it is connected, and the
+ * changes waiting to be sent to it.
+ */
+static struct {
+    char addr[108];
+    cache_t *cache;
+    plock_t *lock;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool connected;
+    changeq_t queue;
+
+    stat_counter_t *stat_connects;
+    stat_counter_t *stat_disconnects;
+    stat_counter_t *stat_sent;
+    stat_counter_t *stat_bytes_out;
+    stat_counter_t *stat_batches;
+    stat_counter_t *stat_skipped;
+    stat_counter_t *stat_pending;
+} g_active = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * The standby side.
+ */
+static struct {
+    int listenfd;
+    cache_t *cache;
+    plock_t *lock;
+
+    stat_counter_t *stat_applied;
+    stat_counter_t *stat_bytes_in;
+    stat_counter_t *stat_clears;
+    stat_counter_t *stat_errors;
+} g_standby;
+
+/*
+ * Set while the standby applies a record, so that its own listener does not
+ * send the change back out.
+ */
+static __thread bool t_applying;
+
+/**************** SOCKETS ****************/
+/**
+ * @brief Copy the host of `host:port` into `host`.
+ *
+ * @return The port, or NULL if `addr` has no port or too long a host.
+ */
+static const char *split_host(const char *addr, char *host, size_t size) {
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL || (size_t)(colon - addr) >= size)
+        return NULL;
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+    return colon + 1;
+}
+
+/**
+ * @brief Connect to `host:port`, or to the UNIX socket `addr` (cf.
+ * unixsock.h).
+ */
+static int repl_connect(const char *addr) {
+    if (unixsock_is_path(addr))
+        return unixsock_connect(addr);
+
+    char host[256];
+    const char *port = split_host(addr, host, sizeof(host));
+    if (port == NULL)
+        return -1;
+    int fd = open_clientfd(host, port);
+    if (fd >= 0) {
+        // Records are batched here already.
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**
+ * @brief Listen on `host:port`, on the UNIX socket `addr`, or, for a bare
+ *        port, on the loopback interface only (cf. repl.h).
+ */
+static int repl_listen(const char *addr) {
+    if (unixsock_is_path(addr))
+        return unixsock_listen(addr, 4);
+    if (strchr(addr, ':') == NULL)
+        return open_listenfd_at(REPL_DEFAULT_HOST, addr);
+
+    char host[256];
+    const char *port = split_host(addr, host, sizeof(host));
+    if (port == NULL)
+        return -1;
+    return open_listenfd_at(host, port);
+}
+
+/**
+ * @brief Send every iovec, however many calls it takes.
+ */
+static int sendv_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+        ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return -1;
+        changeq_iov_advance(&iov, &n, w);
+    }
+    return 0;
+}
+
+/**************** ACTIVE ****************/
+static size_t repl_header(void *header, const change_t *c, const void *key,
+                          size_t keylen, const void *body, size_t size) {
+    *(repl_record_t *)header = (repl_record_t){
+        .type = c->type,
+        .keylen = keylen,
+        .size = size,
+    };
+    return sizeof(repl_record_t);
+}
+
+static int repl_writev(struct iovec *iov, int niov, int nrec, size_t bytes,
+                       void *arg) {
+    if (sendv_all(*(int *)arg, iov, niov) < 0)
+        return -1;
+    stats_add(g_active.stat_sent, nrec);
+    stats_add(g_active.stat_bytes_out, bytes);
+    stats_add(g_active.stat_batches, 1);
+    return 0;
+}
+
+/**
+ * @brief Send a list of changes to the standby, in batches.
+ */
+static int send_changes(int fd, const change_t *list) {
+    return changeq_write(list, repl_header, repl_writev, &fd);
+}
+
+/**
+ * @brief Take every queued change. The caller holds g_active.mutex.
+ */
+static change_t *take_changes(void) {
+    stats_set(g_active.stat_pending, 0);
+    return changeq_take(&g_active.queue);
+}
+
+/**
+ * @brief cache_listener_fn queueing every change while a standby is
+ * connected. Runs under the cache lock, so it only links the change in.
+ */
+static void on_cache_event(cache_t *cache, block_t *block,
+                           cache_event_t event, void *arg) {
+    if (t_applying)
+        return;
+
+    pthread_mutex_lock(&g_active.mutex);
+    if (!g_active.connected) {
+        pthread_mutex_unlock(&g_active.mutex);
+        return;
+    }
+    const int res = changeq_push(&g_active.queue, block, event,
+                                 event == CACHE_INSERTED ? REPL_INSERT
+                                                         : REPL_EVICT);
+    if (res == 0)
+        stats_add(g_active.stat_skipped, 1);
+    if (res > 0) {
+        stats_set(g_active.stat_pending, g_active.queue.pending_bytes);
+        pthread_cond_signal(&g_active.cond);
+    }
+    pthread_mutex_unlock(&g_active.mutex);
+}
+
+/**
+ * @brief Bring a newly connected standby up to date: a clear record, then one
+ * insertion per cached block, least recently used first. Changes are queued
+ * from the snapshot on.
+ */
+static int send_snapshot(int fd) {
+    size_t n;
+    plock_lock(g_active.lock);
+    pthread_mutex_lock(&g_active.mutex);
+    block_t **blocks = cache_snapshot(g_active.cache, &n);
+    const bool failed = blocks == NULL && g_active.cache->lru_list->length;
+    g_active.connected = !failed;
+    pthread_mutex_unlock(&g_active.mutex);
+    plock_unlock(g_active.lock);
+    if (failed)
+        return -1;
+
+    // The snapshot as a list of insertions after a clear.
+    change_t *list;
+    int res = changeq_from_snapshot(&g_active.queue, blocks, n, REPL_INSERT,
+                                    &list);
+    free(blocks);
+    if (res == 0)
+        res = changeq_prepend(&list, REPL_CLEAR);
+    if (res == 0)
+        res = rio_writen(fd, REPL_MAGIC, 8) == 8 ? send_changes(fd, list)
+                                                 : -1;
+    changeq_release(&g_active.queue, list);
+    return res;
+}
+
+static void *thread_active(void *vargp) {
+    const struct timespec retry = {
+        .tv_sec = REPL_RETRY_MS / 1000,
+        .tv_nsec = (long)(REPL_RETRY_MS % 1000) * 1000000,
+    };
+    while (1) {
+        int fd = repl_connect(g_active.addr);
+        if (fd < 0) {
+            nanosleep(&retry, NULL);
+            continue;
+        }
+        stats_add(g_active.stat_connects, 1);
+
+        int res = send_snapshot(fd);
+        while (res == 0) {
+            pthread_mutex_lock(&g_active.mutex);
+            while (g_active.queue.head == NULL)
+                pthread_cond_wait(&g_active.cond, &g_active.mutex);
+            change_t *list = take_changes();
+            pthread_mutex_unlock(&g_active.mutex);
+
+            res = send_changes(fd, list);
+            changeq_release(&g_active.queue, list);
+        }
+
+        // The next snapshot covers whatever was queued meanwhile.
+        close(fd);
+        pthread_mutex_lock(&g_active.mutex);
+        g_active.connected = false;
+        change_t *list = take_changes();
+        pthread_mutex_unlock(&g_active.mutex);
+        changeq_release(&g_active.queue, list);
+        stats_add(g_active.stat_disconnects, 1);
+        nanosleep(&retry, NULL);
+    }
+    return NULL;
+}
+
+/**************** STANDBY ****************/
+/**
+ * @brief Drop every entry of the cache. The caller holds the cache lock.
+ */
+static void clear_cache(void) {
+    size_t n;
+    block_t **blocks = cache_snapshot(g_standby.cache, &n);
+    for (size_t i = 0; i < n; ++i) {
+        cache_delete(g_standby.cache, blocks[i]);
+        cache_release(g_standby.cache, blocks[i]);
+    }
+    free(blocks);
+}
+
+/**
+ * @brief Apply the records of one active proxy until it disconnects.
+ */
+static void apply_stream(int fd) {
+    rio_t rio;
+    char magic[8];
+    rio_readinitb(&rio, fd);
+    if (rio_readnb(&rio, magic, sizeof(magic)) != sizeof(magic) ||
+        memcmp(magic, REPL_MAGIC, sizeof(magic)) != 0) {
+        stats_add(g_standby.stat_errors, 1);
+        return;
+    }
+
+    char *buf = NULL;
+    size_t buflen = 0;
+    repl_record_t rec;
+    while (rio_readnb(&rio, &rec, sizeof(rec)) == sizeof(rec)) {
+        if (rec.keylen > REPL_MAX_KEY || rec.size > REPL_MAX_SIZE ||
+            (rec.type != REPL_INSERT && rec.size != 0)) {
+            stats_add(g_standby.stat_errors, 1);
+            break;
+        }
+        const size_t len = rec.keylen + rec.size;
+        if (len > buflen) {
+            free(buf);
+            buflen = len;
+            if ((buf = malloc(buflen)) == NULL)
+                break;
+        }
+        if (len && rio_readnb(&rio, buf, len) != (ssize_t)len)
+            break;
+
+        plock_lock(g_standby.lock);
+        t_applying = true;
+        if (rec.type == REPL_INSERT) {
+            cache_insert(g_standby.cache, buf, rec.keylen, buf + rec.keylen,
+                         rec.size);
+        } else if (rec.type == REPL_EVICT) {
+            block_t *block =
+                hashmap_find(g_standby.cache->map, buf, rec.keylen);
+            if (block)
+                cache_delete(g_standby.cache, block);
+        } else if (rec.type == REPL_CLEAR) {
+            clear_cache();
+            stats_add(g_standby.stat_clears, 1);
+        }
+        t_applying = false;
+        plock_unlock(g_standby.lock);
+        stats_add(g_standby.stat_applied, 1);
+        stats_add(g_standby.stat_bytes_in, sizeof(rec) + len);
+    }
+    free(buf);
+}
+
+static void *thread_apply(void *vargp) {
+    int fd = (int)(size_t)vargp;
+    apply_stream(fd);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Accept streams, each applied on a thread of its own: the active
+ * proxy's stream lasts as long as the proxy, while handoffs come and go.
+ */
+static void *thread_standby(void *vargp) {
+    while (1) {
+        int fd = accept(g_standby.listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, thread_apply, (void *)(size_t)fd)) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int repl_open(const char *addr) {
+    int fd = repl_connect(addr);
+    if (fd >= 0 && rio_writen(fd, REPL_MAGIC, 8) != 8) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+int repl_send(int fd, const block_t *block) {
+    repl_record_t rec = {
+        .type = REPL_INSERT,
+        .keylen = block->keylen,
+        .size = block->size,
+    };
+    struct iovec iov[3] = {
+        {&rec, sizeof(rec)},
+        {block->key, block->keylen},
+        {block->value, block->size},
+    };
+    return sendv_all(fd, iov, 3);
+}
+
+int repl_start_active(const char *addr, size_t max_pending, cache_t *cache,
+                      plock_t *lock) {
+    if (strlen(addr) >= sizeof(g_active.addr) ||
+        (!unixsock_is_path(addr) && strrchr(addr, ':') == NULL))
+        return -1;
+    strcpy(g_active.addr, addr);
+    g_active.cache = cache;
+    g_active.lock = lock;
+    changeq_init(&g_active.queue, cache, lock, max_pending);
+
+    g_active.stat_connects = stats_counter("repl.connects");
+    g_active.stat_disconnects = stats_counter("repl.disconnects");
+    g_active.stat_sent = stats_counter("repl.sent");
+    g_active.stat_bytes_out = stats_counter("repl.bytes_out");
+    g_active.stat_batches = stats_counter("repl.batches");
+    g_active.stat_skipped = stats_counter("repl.skipped");
+    g_active.stat_pending = stats_counter("repl.pending_bytes");
+
+    plock_lock(lock);
+    int added = cache_add_listener(cache, on_cache_event, NULL);
+    plock_unlock(lock);
+    if (added < 0)
+        return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_active, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+int repl_start_standby(const char *addr, cache_t *cache, plock_t *lock) {
+    g_standby.cache = cache;
+    g_standby.lock = lock;
+    g_standby.stat_applied = stats_counter("repl.applied");
+    g_standby.stat_bytes_in = stats_counter("repl.bytes_in");
+    g_standby.stat_clears = stats_counter("repl.clears");
+    g_standby.stat_errors = stats_counter("repl.errors");
+
+    g_standby.listenfd = repl_listen(addr);
+    if (g_standby.listenfd < 0)
+        return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_standby, NULL) != 0) {
+        close(g_standby.listenfd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
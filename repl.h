@@ -0,0 +1,95 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Hot-standby replication of the cache. The active proxy of a pair streams
+ * every insertion into its cache and every eviction from it to the standby,
+ * whose cache thus mirrors the active one and is warm when it takes over.
+ *
+ * The active proxy connects to the standby over TCP (`host:port`) or a UNIX
+ * socket (cf. unixsock.h). On every connection it sends a clear record, so
+ * that the standby drops whatever it holds, then a snapshot of its cache,
+ * then every change as it happens. Relays only queue changes, the
+ * queued insertions holding a reference on the cache block; a background
+ * thread sends whatever has been queued in one batch. While the standby is
+ * slow to read, the socket buffer fills, the thread blocks and changes queue
+ * up; past `max_pending` bytes of responses, insertions are no longer
+ * replicated (evictions always are), so the standby misses some entries but
+ * never keeps one the active proxy dropped. While no standby is connected,
+ * nothing is queued: the snapshot covers it.
+ *
+ * The standby applies the records of each connection in order, and accepts
+ * any number of connections: entries can also be pushed to it (cf.
+ * repl_open). Entries it receives are not sent on if it replicates too, so a
+ * pair may replicate both ways and swap roles.
+ *
+ * The stream is not authenticated: whatever connects to a standby can insert
+ * responses it will serve, and evict or clear its cache. Given a bare port,
+ * the standby therefore listens on the loopback interface only. Give it
+ * `host:port` to listen on another interface, e.g. for a pair or a ring
+ * (cf. ring.h) across hosts, only on a network whose hosts are all trusted;
+ * a UNIX socket lets file permissions decide who may connect.
+ */
+#ifndef REPL_H
+#define REPL_H
+
+#include "cache.h"
+#include "plock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPL_MAGIC "PXREPL01"
+#define REPL_DEFAULT_MAX_PENDING (16 * 1024 * 1024)
+#define REPL_RETRY_MS 1000
+#define REPL_DEFAULT_HOST "127.0.0.1"
+
+/**
+ * Header of a record on the wire, in host byte order, followed by `keylen`
+ * bytes of key and, for insertions, `size` bytes of response.
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t keylen;
+    uint64_t size;
+} repl_record_t;
+
+#define REPL_INSERT 1
+#define REPL_EVICT 2
+#define REPL_CLEAR 3
+
+/**
+ * Replicate `cache` to the standby at `addr`, reconnecting every
+ * REPL_RETRY_MS while it is unreachable. `lock` is the lock that callers of
+ * `cache` hold. Progress is exported as `repl.*` stats.
+ *
+ * @return 0 on success, -1 if `addr` is malformed or the thread could not be
+ *         started.
+ */
+int repl_start_active(const char *addr, size_t max_pending, cache_t *cache,
+                      plock_t *lock);
+
+/**
+ * Accept replication into `cache` from an active proxy, on `host:port`, on
+ * a port of REPL_DEFAULT_HOST or on the UNIX socket path `addr`.
+ *
+ * @return 0 on success, -1 if `addr` cannot be listened on.
+ */
+int repl_start_standby(const char *addr, cache_t *cache, plock_t *lock);
+
+/**
+ * Connect to a standby at `addr` to push entries to it with repl_send, e.g.
+ * to hand them off to another proxy.
+ *
+ * @return The connected socket, or -1.
+ */
+int repl_open(const char *addr);
+
+/**
+ * Send an insertion of `block`, which the caller holds a reference on, to a
+ * socket returned by repl_open.
+ *
+ * @return 0 on success, -1 if the connection failed.
+ */
+int repl_send(int fd, const block_t *block);
+
+#endif
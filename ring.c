@@ -0,0 +1,353 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Consistent-hashing peer group, with handoff and read-through on membership
+ * changes.
+ */
+#include "ring.h"
+#include "admin.h"
+#include "hashmap.h"
+#include "repl.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**************** STRUCTS ****************/
+typedef struct {
+    char name[RING_NAME_LEN];
+    char proxy[RING_ADDR_LEN];
+    char standby[RING_ADDR_LEN];
+} member_t;
+
+typedef struct {
+    uint64_t point;
+    size_t member;
+} point_t;
+
+/**
+ * A ring, immutable once built.
+ *
+ * @param  self    Index of this node in `members`, or -1 if it is not one.
+ * @param  points  RING_VNODES points per member, sorted.
+ */
+typedef struct {
+    member_t members[RING_MAX_NODES];
+    size_t nmembers;
+    int self;
+    point_t *points;
+    size_t npoints;
+} ring_t;
+
+/**************** GLOBALS ****************/
+/*
+ * The current ring and the one before it, swapped under the mutex by the
+ * watching thread, which alone frees them.
+ */
+static struct {
+    ring_cfg_t cfg;
+    cache_t *cache;
+    plock_t *lock;
+
+    pthread_mutex_t mutex;
+    ring_t *current;
+    ring_t *previous;
+    uint64_t changed_us;
+    struct timespec mtime;
+
+    stat_counter_t *stat_members;
+    stat_counter_t *stat_changes;
+    stat_counter_t *stat_handoff_entries;
+    stat_counter_t *stat_handoff_bytes;
+    stat_counter_t *stat_handoff_errors;
+    stat_counter_t *stat_handoff_aborted;
+} g_ring = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**************** RING ****************/
+/**
+ * @brief Spread the bits of a hash over the whole ring (splitmix64
+ * finalizer); get_hash alone leaves the high bits of short keys alike.
+ */
+static inline uint64_t mix(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static int compare_points(const void *a, const void *b) {
+    const point_t *pa = a, *pb = b;
+    return (pa->point > pb->point) - (pa->point < pb->point);
+}
+
+static void ring_free(ring_t *ring) {
+    if (ring) {
+        free(ring->points);
+        free(ring);
+    }
+}
+
+/**
+ * @brief Build a ring from the members file.
+ *
+ * @return The ring, or NULL if the file cannot be read or lists no member.
+ */
+static ring_t *ring_load(const char *path, const char *self) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    ring_t *ring = calloc(1, sizeof(ring_t));
+    if (ring == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    ring->self = -1;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f) && ring->nmembers < RING_MAX_NODES) {
+        member_t *m = &ring->members[ring->nmembers];
+        if (line[0] == '#' ||
+            sscanf(line, "%63s %127s %127s", m->name, m->proxy, m->standby) !=
+                3)
+            continue;
+        if (strcmp(m->name, self) == 0)
+            ring->self = ring->nmembers;
+        ring->nmembers++;
+    }
+    fclose(f);
+
+    ring->npoints = ring->nmembers * RING_VNODES;
+    ring->points = malloc(ring->npoints * sizeof(point_t));
+    if (ring->nmembers == 0 || ring->points == NULL) {
+        ring_free(ring);
+        return NULL;
+    }
+    for (size_t i = 0; i < ring->nmembers; ++i) {
+        for (size_t v = 0; v < RING_VNODES; ++v) {
+            char vnode[RING_NAME_LEN + 16];
+            int len = snprintf(vnode, sizeof(vnode), "%s#%zu",
+                               ring->members[i].name, v);
+            ring->points[i * RING_VNODES + v] =
+                (point_t){mix(get_hash(vnode, len)), i};
+        }
+    }
+    qsort(ring->points, ring->npoints, sizeof(point_t), compare_points);
+    return ring;
+}
+
+/**
+ * @brief Index of the member owning `key`: the one with the first point at
+ * or after its hash, wrapping around.
+ */
+static size_t ring_owner(const ring_t *ring, const char *key, size_t len) {
+    const uint64_t h = mix(get_hash(key, len));
+    size_t lo = 0, hi = ring->npoints;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].point < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return ring->points[lo == ring->npoints ? 0 : lo].member;
+}
+
+/**************** HANDOFF ****************/
+/**
+ * @brief Whether the members file changed since it was last loaded.
+ */
+static bool file_changed(struct timespec *mtime) {
+    struct stat st;
+    if (stat(g_ring.cfg.path, &st) < 0)
+        return false;
+    if (st.st_mtim.tv_sec == g_ring.mtime.tv_sec &&
+        st.st_mtim.tv_nsec == g_ring.mtime.tv_nsec)
+        return false;
+    if (mtime)
+        *mtime = st.st_mtim;
+    return true;
+}
+
+/**
+ * @brief Sleep until `sent` bytes are within the handoff rate since `start`.
+ *
+ * @return false if the members file changed meanwhile.
+ */
+static bool throttle(uint64_t start_us, uint64_t sent) {
+    const uint64_t due_us = start_us + sent * 1000000 / g_ring.cfg.rate;
+    uint64_t now;
+    while ((now = stats_now_us()) < due_us) {
+        uint64_t wait = due_us - now;
+        if (wait > RING_POLL_MS * 1000)
+            wait = RING_POLL_MS * 1000;
+        const struct timespec ts = {
+            .tv_sec = wait / 1000000,
+            .tv_nsec = (long)(wait % 1000000) * 1000,
+        };
+        nanosleep(&ts, NULL);
+        if (file_changed(NULL))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Push the cached entries this node owned in `from` and that another
+ * node owns in `to` to their new owner, most recently used first. Gives up
+ * if the membership changes again meanwhile.
+ */
+static void handoff(const ring_t *from, const ring_t *to) {
+    size_t n;
+    plock_lock(g_ring.lock);
+    block_t **blocks = cache_snapshot(g_ring.cache, &n);
+    plock_unlock(g_ring.lock);
+
+    // Sockets to the new owners, by index in `to` (-1 = not open yet,
+    // -2 = failed).
+    int fds[RING_MAX_NODES];
+    for (size_t i = 0; i < RING_MAX_NODES; ++i)
+        fds[i] = -1;
+    const uint64_t start_us = stats_now_us();
+    uint64_t sent = 0;
+    bool go = true;
+
+    for (size_t i = n; i-- > 0;) {
+        block_t *b = blocks[i];
+        const size_t len = b->keylen - 1; // NUL-terminated URIs.
+        if (go && ring_owner(from, b->key, len) == (size_t)from->self) {
+            const size_t dest = ring_owner(to, b->key, len);
+            if (dest != (size_t)to->self && fds[dest] == -1)
+                if ((fds[dest] = repl_open(to->members[dest].standby)) < 0) {
+                    fds[dest] = -2;
+                    stats_add(g_ring.stat_handoff_errors, 1);
+                }
+            if (dest != (size_t)to->self && fds[dest] >= 0) {
+                if (repl_send(fds[dest], b) < 0) {
+                    close(fds[dest]);
+                    fds[dest] = -2;
+                    stats_add(g_ring.stat_handoff_errors, 1);
+                } else {
+                    sent += b->size;
+                    stats_add(g_ring.stat_handoff_entries, 1);
+                    stats_add(g_ring.stat_handoff_bytes, b->size);
+                    if (!throttle(start_us, sent)) {
+                        stats_add(g_ring.stat_handoff_aborted, 1);
+                        go = false;
+                    }
+                }
+            }
+        }
+        plock_lock(g_ring.lock);
+        cache_release(g_ring.cache, b);
+        plock_unlock(g_ring.lock);
+    }
+    free(blocks);
+    for (size_t i = 0; i < RING_MAX_NODES; ++i)
+        if (fds[i] >= 0)
+            close(fds[i]);
+}
+
+static void *thread_ring(void *vargp) {
+    const struct timespec poll = {
+        .tv_sec = RING_POLL_MS / 1000,
+        .tv_nsec = (long)(RING_POLL_MS % 1000) * 1000000,
+    };
+    while (1) {
+        nanosleep(&poll, NULL);
+        struct timespec mtime;
+        if (!file_changed(&mtime))
+            continue;
+        g_ring.mtime = mtime;
+        ring_t *ring = ring_load(g_ring.cfg.path, g_ring.cfg.self);
+        if (ring == NULL)
+            continue;
+
+        pthread_mutex_lock(&g_ring.mutex);
+        ring_t *stale = g_ring.previous;
+        g_ring.previous = g_ring.current;
+        g_ring.current = ring;
+        g_ring.changed_us = stats_now_us();
+        pthread_mutex_unlock(&g_ring.mutex);
+        ring_free(stale);
+        stats_set(g_ring.stat_members, ring->nmembers);
+        stats_add(g_ring.stat_changes, 1);
+
+        if (g_ring.previous->self >= 0)
+            handoff(g_ring.previous, ring);
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int ring_start(const ring_cfg_t *cfg, cache_t *cache, plock_t *lock) {
+    g_ring.cfg = *cfg;
+    g_ring.cache = cache;
+    g_ring.lock = lock;
+    if (cfg->rate == 0 || file_changed(&g_ring.mtime) == false)
+        return -1;
+    g_ring.current = ring_load(cfg->path, cfg->self);
+    if (g_ring.current == NULL)
+        return -1;
+
+    g_ring.stat_members = stats_counter("ring.members");
+    g_ring.stat_changes = stats_counter("ring.changes");
+    g_ring.stat_handoff_entries = stats_counter("ring.handoff_entries");
+    g_ring.stat_handoff_bytes = stats_counter("ring.handoff_bytes");
+    g_ring.stat_handoff_errors = stats_counter("ring.handoff_errors");
+    g_ring.stat_handoff_aborted = stats_counter("ring.handoff_aborted");
+    stats_set(g_ring.stat_members, g_ring.current->nmembers);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_ring, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+bool ring_previous_owner(const char *uri, char *host, char *port) {
+    const size_t len = strlen(uri);
+    bool found = false;
+    pthread_mutex_lock(&g_ring.mutex);
+    const ring_t *cur = g_ring.current, *prev = g_ring.previous;
+    if (prev && cur->self >= 0 &&
+        stats_now_us() - g_ring.changed_us < RING_TRANSITION_S * 1000000ULL &&
+        ring_owner(cur, uri, len) == (size_t)cur->self) {
+        const size_t owner = ring_owner(prev, uri, len);
+        const char *addr = prev->members[owner].proxy;
+        const char *colon = strrchr(addr, ':');
+        if (owner != (size_t)prev->self && colon) {
+            snprintf(host, RING_ADDR_LEN, "%.*s", (int)(colon - addr), addr);
+            snprintf(port, RING_ADDR_LEN, "%s", colon + 1);
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&g_ring.mutex);
+    return found;
+}
+
+void ring_admin_handler(int fd, const char *query) {
+    char uri[RING_ADDR_LEN * 8], body[RING_MAX_NODES * 320];
+    size_t len = 0;
+    pthread_mutex_lock(&g_ring.mutex);
+    const ring_t *ring = g_ring.current;
+    if (ring && admin_query_param(query, "uri", uri, sizeof(uri))) {
+        const member_t *m = &ring->members[ring_owner(ring, uri, strlen(uri))];
+        len = snprintf(body, sizeof(body), "%s %s\n", m->name, m->proxy);
+    } else if (ring) {
+        for (size_t i = 0; i < ring->nmembers && len < sizeof(body); ++i) {
+            const member_t *m = &ring->members[i];
+            len += snprintf(body + len, sizeof(body) - len, "%s %s %s%s\n",
+                            m->name, m->proxy, m->standby,
+                            (int)i == ring->self ? " self" : "");
+        }
+    }
+    pthread_mutex_unlock(&g_ring.mutex);
+    if (len > sizeof(body))
+        len = sizeof(body);
+    admin_respond(fd, "200 OK", "text/plain", body, len);
+}
@@ -0,0 +1,75 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Consistent-hashing peer group. The proxies of a group split the URI space
+ * between them on a hash ring, each node owning the URIs that hash between
+ * its points and the next, the way the load balancer in front of them routes
+ * requests. The members are listed in a file, one per line:
+ *
+ *     <name> <proxy host:port> <standby host:port|path>
+ *
+ * where the standby address is the `-S` replication listener of the member.
+ * The file is watched, and the ring rebuilt whenever it changes.
+ *
+ * When the membership changes, the URIs that move to another node would all
+ * miss there at once. Two things keep that miss storm off the origins:
+ * - Handoff: every entry of the local cache that now belongs to another node
+ *   is pushed to it over the replication protocol, most recently used first,
+ *   at most `rate` bytes per second.
+ * - Read-through: for `RING_TRANSITION_S` seconds after a change, a miss on a
+ *   URI that this node took over is first asked of the node that owned it
+ *   before, with `Cache-Control: only-if-cached` so that a miss there costs
+ *   no origin fetch (cf. ring_previous_owner).
+ */
+#ifndef RING_H
+#define RING_H
+
+#include "cache.h"
+#include "plock.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RING_MAX_NODES 64
+#define RING_VNODES 128
+#define RING_TRANSITION_S 60
+#define RING_DEFAULT_RATE (8 * 1024 * 1024)
+#define RING_POLL_MS 1000
+#define RING_NAME_LEN 64
+#define RING_ADDR_LEN 128
+
+/**
+ * @param  self  This node's name in the members file.
+ * @param  path  The members file.
+ * @param  rate  Handoff bytes per second at most.
+ */
+typedef struct {
+    const char *self;
+    const char *path;
+    size_t rate;
+} ring_cfg_t;
+
+/**
+ * Load the members file and start watching it. `lock` is the lock that
+ * callers of `cache` hold. Progress is exported as `ring.*` stats. `self`
+ * need not be listed yet: a node joins by being started first, then added
+ * to the file.
+ *
+ * @return 0 on success, -1 if the file cannot be read or lists no member.
+ */
+int ring_start(const ring_cfg_t *cfg, cache_t *cache, plock_t *lock);
+
+/**
+ * Whether `uri` was recently taken over by this node from another, whose
+ * proxy address is then copied into `host` and `port` (at least
+ * RING_ADDR_LEN bytes each).
+ */
+bool ring_previous_owner(const char *uri, char *host, char *port);
+
+/**
+ * admin_handler_t for `/ring`, listing the members, or with `?uri=<uri>`,
+ * the member owning `uri`.
+ */
+void ring_admin_handler(int fd, const char *query);
+
+#endif
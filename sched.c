@@ -0,0 +1,979 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Worker pool with per-worker Chase-Lev deques and randomized stealing, plus
+ * earliest-deadline-first priority lanes and an optional controller that sizes
+ * the pool.
+ */
+#include "sched.h"
+#include "plock.h"
+#include "stats.h"
+#include "wsdeque.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCHED_DEQUE_CAPACITY 256
+#define SCHED_IDLE_WAIT_NS (10 * 1000 * 1000)
+#define SCHED_LANE_CAPACITY 64
+#define SCHED_TUNE_BLOCKED_PCT 50
+#define SCHED_TUNE_IDLE_PCT 50
+
+/**************** STRUCTS ****************/
+/**
+ * @param  fn           Task body.
+ * @param  arg          Argument passed to fn.
+ * @param  enqueued_us  When the task was queued, for the queueing delay.
+ * @param  deadline_us  Heap key of lane tasks.
+ * @param  lane         Lane of the task, or -1 if unclassified.
+ * @param  next         Link for the inbox and the shared queue.
+ */
+typedef struct SchedTask {
+    sched_fn_t fn;
+    void *arg;
+    uint64_t enqueued_us;
+    uint64_t deadline_us;
+    int lane;
+    struct SchedTask *next;
+} sched_task_t;
+
+/**
+ * A priority lane: a binary min-heap of tasks ordered by deadline.
+ *
+ * @param  mutex     Guards the heap.
+ * @param  len       Number of queued tasks, readable without the mutex.
+ * @param  earliest  Deadline of the heap's root, or UINT64_MAX if empty, so
+ *                   that unreserved workers can pick a lane without locking.
+ * @param  cond      Reserved workers of the lane sleep here.
+ * @param  sleepers  Number of workers waiting on cond.
+ */
+typedef struct {
+    char name[SCHED_LANE_NAMELEN];
+    int reserved;
+    uint64_t budget_us;
+
+    plock_t mutex;
+    sched_task_t **heap;
+    size_t cap;
+    atomic_size_t len;
+    atomic_uint_fast64_t earliest;
+
+    pthread_cond_t cond;
+    atomic_int sleepers;
+
+    stat_counter_t *stat_tasks;
+    stat_counter_t *stat_late;
+    stat_counter_t *stat_depth;
+    stat_hist_t *stat_queue_wait;
+} sched_lane_queue_t;
+
+/**
+ * @param  deque      Lock-free deque, pushed and popped only by this worker.
+ * @param  inbox      Tasks handed to this worker by other threads. They move
+ *                    to the deque once the worker picks them up, but thieves
+ *                    may take them directly if the worker is busy.
+ * @param  inbox_len  Number of tasks in the inbox.
+ * @param  lane       Lane this worker is reserved for, or -1.
+ * @param  seed       State of the victim-selection PRNG.
+ * @param  busy_us    Wall time spent running tasks, for the controller.
+ */
+typedef struct {
+    struct Sched *sched;
+    int id;
+    int lane;
+    pthread_t tid;
+    wsdeque_t *deque;
+    plock_t inbox_mutex;
+    sched_task_t *inbox_head, *inbox_tail;
+    atomic_size_t inbox_len;
+    uint32_t seed;
+    atomic_uint_fast64_t busy_us;
+} sched_worker_t;
+
+/**
+ * @param  nworkers     Number of worker threads started so far. Workers are
+ *                      never stopped before sched_free, only retired.
+ * @param  nactive      Workers with an id below this take part; the others are
+ *                      retired and wait on retire_cond.
+ * @param  idle_mutex   Guards sleeping workers and, in SCHED_SHARED mode, the
+ *                      shared queue.
+ * @param  sleepers     Number of unreserved workers waiting on idle_cond.
+ * @param  lane_sleepers  Number of reserved workers waiting on a lane.
+ * @param  next_worker  Round-robin cursor for sched_submit.
+ * @param  wait_sum_us  Queueing delay of the tasks started since the
+ *                      controller last looked, and their number.
+ */
+struct Sched {
+    sched_mode_t mode;
+    atomic_int nworkers;
+    atomic_int nactive;
+    int min_workers;
+    sched_worker_t *workers[SCHED_MAX_WORKERS];
+    int nlanes;
+    sched_lane_queue_t lanes[SCHED_MAX_LANES];
+
+    plock_t idle_mutex;
+    pthread_cond_t idle_cond;
+    pthread_cond_t retire_cond;
+    atomic_int sleepers;
+    atomic_int lane_sleepers;
+    atomic_bool stopping;
+    atomic_size_t next_worker;
+
+    sched_task_t *shared_head, *shared_tail;
+
+    sched_tune_t tune;
+    bool tuning;
+    pthread_t tune_tid;
+    atomic_uint_fast64_t wait_sum_us;
+    atomic_uint_fast64_t wait_count;
+
+    stat_counter_t *stat_tasks;
+    stat_counter_t *stat_steals;
+    stat_counter_t *stat_steal_fails;
+    stat_counter_t *stat_queue_depth;
+    stat_hist_t *stat_queue_wait;
+    stat_counter_t *stat_workers;
+    stat_counter_t *stat_grows;
+    stat_counter_t *stat_shrinks;
+    stat_counter_t *stat_tune_wait;
+    stat_counter_t *stat_tune_blocked;
+    stat_counter_t *stat_tune_util;
+};
+
+/**
+ * Worker running on this thread, if any.
+ */
+static __thread sched_worker_t *t_worker;
+
+/**************** HELPERS ****************/
+/**
+ * @brief xorshift32; plenty for picking steal victims.
+ */
+static inline uint32_t next_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static sched_task_t *task_new(sched_fn_t fn, void *arg) {
+    sched_task_t *task = malloc(sizeof(sched_task_t));
+    if (task == NULL)
+        return NULL;
+    task->fn = fn;
+    task->arg = arg;
+    task->enqueued_us = stats_now_us();
+    task->deadline_us = UINT64_MAX;
+    task->lane = -1;
+    task->next = NULL;
+    return task;
+}
+
+/**
+ * @brief Run a dequeued task and account for it.
+ */
+static void task_run(sched_t *sched, sched_task_t *task) {
+    const uint64_t now = stats_now_us();
+    stats_sub(sched->stat_queue_depth, 1);
+    stats_add(sched->stat_tasks, 1);
+    stats_hist_record(sched->stat_queue_wait, now - task->enqueued_us);
+    atomic_fetch_add(&sched->wait_sum_us, now - task->enqueued_us);
+    atomic_fetch_add(&sched->wait_count, 1);
+    if (task->lane >= 0) {
+        sched_lane_queue_t *lane = &sched->lanes[task->lane];
+        stats_add(lane->stat_tasks, 1);
+        stats_hist_record(lane->stat_queue_wait, now - task->enqueued_us);
+        if (now > task->deadline_us)
+            stats_add(lane->stat_late, 1);
+    }
+    task->fn(task->arg);
+    free(task);
+    atomic_fetch_add(&t_worker->busy_us, stats_now_us() - now);
+}
+
+/**
+ * @brief Wake a sleeping worker for an unclassified task, if there is one.
+ * Reserved workers take unclassified tasks too, so they are woken when no
+ * unreserved worker sleeps. In static mode the task is bound to one
+ * particular worker, so everyone has to be woken.
+ */
+static void wake_idle(sched_t *sched) {
+    if (atomic_load(&sched->sleepers) == 0 &&
+        atomic_load(&sched->lane_sleepers) == 0)
+        return;
+    plock_lock(&sched->idle_mutex);
+    if (sched->mode == SCHED_STATIC) {
+        pthread_cond_broadcast(&sched->idle_cond);
+        for (int i = 0; i < sched->nlanes; ++i)
+            pthread_cond_broadcast(&sched->lanes[i].cond);
+    } else if (atomic_load(&sched->sleepers) > 0) {
+        pthread_cond_signal(&sched->idle_cond);
+    } else {
+        for (int i = 0; i < sched->nlanes; ++i) {
+            if (atomic_load(&sched->lanes[i].sleepers) > 0) {
+                pthread_cond_signal(&sched->lanes[i].cond);
+                break;
+            }
+        }
+    }
+    plock_unlock(&sched->idle_mutex);
+}
+
+/**
+ * @brief Wake a worker for a task on `lane`: one of its reserved workers if
+ * any sleeps, an unreserved one otherwise.
+ */
+static void wake_lane(sched_t *sched, sched_lane_queue_t *lane) {
+    if (atomic_load(&lane->sleepers) == 0 &&
+        atomic_load(&sched->sleepers) == 0)
+        return;
+    plock_lock(&sched->idle_mutex);
+    if (atomic_load(&lane->sleepers) > 0)
+        pthread_cond_signal(&lane->cond);
+    else
+        pthread_cond_signal(&sched->idle_cond);
+    plock_unlock(&sched->idle_mutex);
+}
+
+/**************** LANES ****************/
+static inline bool heap_before(const sched_task_t *a, const sched_task_t *b) {
+    return a->deadline_us < b->deadline_us;
+}
+
+/**
+ * @brief Insert into a lane's heap. Lane mutex must be held.
+ */
+static int heap_push(sched_lane_queue_t *lane, sched_task_t *task) {
+    size_t i = atomic_load(&lane->len);
+    if (i == lane->cap) {
+        size_t cap = lane->cap ? 2 * lane->cap : SCHED_LANE_CAPACITY;
+        sched_task_t **heap = realloc(lane->heap, cap * sizeof(sched_task_t *));
+        if (heap == NULL)
+            return -1;
+        lane->heap = heap;
+        lane->cap = cap;
+    }
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!heap_before(task, lane->heap[parent]))
+            break;
+        lane->heap[i] = lane->heap[parent];
+        i = parent;
+    }
+    lane->heap[i] = task;
+    atomic_fetch_add(&lane->len, 1);
+    atomic_store(&lane->earliest, lane->heap[0]->deadline_us);
+    return 0;
+}
+
+/**
+ * @brief Remove the most urgent task of a lane's heap. Lane mutex must be
+ * held.
+ */
+static sched_task_t *heap_pop(sched_lane_queue_t *lane) {
+    size_t len = atomic_load(&lane->len);
+    if (len == 0)
+        return NULL;
+    sched_task_t *top = lane->heap[0];
+    sched_task_t *last = lane->heap[--len];
+    size_t i = 0;
+    while (2 * i + 1 < len) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < len && heap_before(lane->heap[child + 1],
+                                           lane->heap[child]))
+            child++;
+        if (!heap_before(lane->heap[child], last))
+            break;
+        lane->heap[i] = lane->heap[child];
+        i = child;
+    }
+    lane->heap[i] = last;
+    atomic_store(&lane->len, len);
+    atomic_store(&lane->earliest, len ? lane->heap[0]->deadline_us
+                                      : UINT64_MAX);
+    return top;
+}
+
+static sched_task_t *lane_pop(sched_lane_queue_t *lane) {
+    if (atomic_load(&lane->len) == 0)
+        return NULL;
+    plock_lock(&lane->mutex);
+    sched_task_t *task = heap_pop(lane);
+    plock_unlock(&lane->mutex);
+    if (task)
+        stats_sub(lane->stat_depth, 1);
+    return task;
+}
+
+/**
+ * @brief For unreserved workers: the most urgent task across every lane.
+ */
+static sched_task_t *lanes_pop_earliest(sched_t *sched) {
+    while (1) {
+        sched_lane_queue_t *best = NULL;
+        uint64_t best_deadline = UINT64_MAX;
+        for (int i = 0; i < sched->nlanes; ++i) {
+            uint64_t deadline = atomic_load(&sched->lanes[i].earliest);
+            if (deadline < best_deadline) {
+                best_deadline = deadline;
+                best = &sched->lanes[i];
+            }
+        }
+        if (best == NULL)
+            return NULL;
+        // Another worker may have emptied the lane since we looked.
+        sched_task_t *task = lane_pop(best);
+        if (task)
+            return task;
+    }
+}
+
+static void inbox_push(sched_worker_t *w, sched_task_t *task) {
+    plock_lock(&w->inbox_mutex);
+    if (w->inbox_tail)
+        w->inbox_tail->next = task;
+    else
+        w->inbox_head = task;
+    w->inbox_tail = task;
+    atomic_fetch_add(&w->inbox_len, 1);
+    plock_unlock(&w->inbox_mutex);
+}
+
+/**
+ * @brief Put a list of tasks back at the front of a worker's inbox, ahead of
+ * any that arrived since they were taken.
+ */
+static void inbox_requeue(sched_worker_t *w, sched_task_t *list) {
+    size_t n = 1;
+    sched_task_t *tail = list;
+    for (; tail->next; tail = tail->next)
+        n++;
+    plock_lock(&w->inbox_mutex);
+    tail->next = w->inbox_head;
+    if (w->inbox_tail == NULL)
+        w->inbox_tail = tail;
+    w->inbox_head = list;
+    atomic_fetch_add(&w->inbox_len, n);
+    plock_unlock(&w->inbox_mutex);
+}
+
+/**
+ * @brief Take one task out of a worker's inbox. With `all`, the remaining
+ * tasks are moved onto the caller's own deque so that they become stealable.
+ */
+static sched_task_t *inbox_take(sched_worker_t *w, bool all, bool trylock) {
+    if (atomic_load(&w->inbox_len) == 0)
+        return NULL;
+    if (trylock) {
+        if (plock_trylock(&w->inbox_mutex) != 0)
+            return NULL;
+    } else {
+        plock_lock(&w->inbox_mutex);
+    }
+
+    sched_task_t *task = w->inbox_head;
+    sched_task_t *rest = NULL;
+    if (task) {
+        if (all) {
+            rest = task->next;
+            w->inbox_head = w->inbox_tail = NULL;
+            atomic_store(&w->inbox_len, 0);
+        } else {
+            w->inbox_head = task->next;
+            if (w->inbox_head == NULL)
+                w->inbox_tail = NULL;
+            atomic_fetch_sub(&w->inbox_len, 1);
+        }
+    }
+    plock_unlock(&w->inbox_mutex);
+
+    while (rest) {
+        sched_task_t *next = rest->next;
+        if (wsdeque_push(t_worker->deque, rest) < 0) {
+            // The deque could not grow; whatever is left waits in the inbox.
+            inbox_requeue(w, rest);
+            break;
+        }
+        rest = next;
+    }
+    return task;
+}
+
+/**
+ * @brief Try to take work from other workers, starting at a random victim.
+ */
+static sched_task_t *steal(sched_t *sched, sched_worker_t *self) {
+    const int n = atomic_load(&sched->nworkers);
+    if (n <= 1)
+        return NULL;
+    const int start = next_rand(&self->seed) % n;
+
+    for (int k = 0; k < n; ++k) {
+        sched_worker_t *victim = sched->workers[(start + k) % n];
+        if (victim == self)
+            continue;
+
+        void *item;
+        while ((item = wsdeque_steal(victim->deque)) == WSDEQUE_ABORT)
+            stats_add(sched->stat_steal_fails, 1);
+        if (item == NULL)
+            item = inbox_take(victim, false, true);
+        if (item) {
+            stats_add(sched->stat_steals, 1);
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Whether any queue this worker may take from is non-empty.
+ */
+static bool has_work(sched_t *sched, sched_worker_t *self) {
+    if (sched->mode == SCHED_SHARED)
+        return sched->shared_head != NULL;
+
+    if (self->lane >= 0) {
+        if (atomic_load(&sched->lanes[self->lane].len))
+            return true;
+    } else {
+        for (int i = 0; i < sched->nlanes; ++i)
+            if (atomic_load(&sched->lanes[i].len))
+                return true;
+    }
+    if (sched->mode == SCHED_STATIC)
+        return wsdeque_size(self->deque) || atomic_load(&self->inbox_len);
+
+    const int n = atomic_load(&sched->nworkers);
+    for (int i = 0; i < n; ++i) {
+        sched_worker_t *w = sched->workers[i];
+        if (wsdeque_size(w->deque) || atomic_load(&w->inbox_len))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Sleep until there might be work. The sleeper count is raised before
+ * the final check, so a concurrent submitter either sees it and signals, or
+ * its task is seen by the check. The timeout is only a safety net.
+ *
+ * @return false once the pool is stopping and there is nothing left to run.
+ */
+static bool park(sched_t *sched, sched_worker_t *self) {
+    bool keep_going = true;
+    sched_lane_queue_t *lane =
+        (self->lane >= 0) ? &sched->lanes[self->lane] : NULL;
+    pthread_cond_t *cond = lane ? &lane->cond : &sched->idle_cond;
+
+    plock_lock(&sched->idle_mutex);
+    if (lane) {
+        atomic_fetch_add(&lane->sleepers, 1);
+        atomic_fetch_add(&sched->lane_sleepers, 1);
+    } else {
+        atomic_fetch_add(&sched->sleepers, 1);
+    }
+
+    if (!has_work(sched, self)) {
+        if (atomic_load(&sched->stopping)) {
+            keep_going = false;
+        } else {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += SCHED_IDLE_WAIT_NS;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            plock_cond_timedwait(cond, &sched->idle_mutex, &ts);
+        }
+    }
+
+    if (lane) {
+        atomic_fetch_sub(&lane->sleepers, 1);
+        atomic_fetch_sub(&sched->lane_sleepers, 1);
+    } else {
+        atomic_fetch_sub(&sched->sleepers, 1);
+    }
+    plock_unlock(&sched->idle_mutex);
+    return keep_going;
+}
+
+static inline bool is_retired(sched_t *sched, sched_worker_t *self) {
+    return self->id >= atomic_load(&sched->nactive) &&
+           !atomic_load(&sched->stopping);
+}
+
+/**
+ * @brief Sleep while this worker is retired by the controller.
+ */
+static void retire(sched_t *sched, sched_worker_t *self) {
+    plock_lock(&sched->idle_mutex);
+    while (is_retired(sched, self))
+        plock_cond_wait(&sched->retire_cond, &sched->idle_mutex);
+    plock_unlock(&sched->idle_mutex);
+}
+
+/**************** WORKERS ****************/
+/**
+ * @brief Worker loop for SCHED_SHARED: a classic mutex and condition variable
+ * pool.
+ */
+static void run_shared(sched_t *sched) {
+    while (1) {
+        plock_lock(&sched->idle_mutex);
+        while (sched->shared_head == NULL && !atomic_load(&sched->stopping)) {
+            atomic_fetch_add(&sched->sleepers, 1);
+            plock_cond_wait(&sched->idle_cond, &sched->idle_mutex);
+            atomic_fetch_sub(&sched->sleepers, 1);
+        }
+        sched_task_t *task = sched->shared_head;
+        if (task == NULL) {
+            plock_unlock(&sched->idle_mutex);
+            return;
+        }
+        sched->shared_head = task->next;
+        if (sched->shared_head == NULL)
+            sched->shared_tail = NULL;
+        plock_unlock(&sched->idle_mutex);
+
+        task_run(sched, task);
+    }
+}
+
+/**
+ * @brief Worker loop for SCHED_STEAL and SCHED_STATIC. A reserved worker
+ * serves its lane before anything else. Then own deque (most recent task,
+ * warm caches), own inbox, other workers, and for unreserved workers the most
+ * urgent lane. A retired worker only finishes what it still holds itself.
+ */
+static void run_deque(sched_t *sched, sched_worker_t *self) {
+    while (1) {
+        if (is_retired(sched, self)) {
+            sched_task_t *task = wsdeque_pop(self->deque);
+            if (task == NULL)
+                task = inbox_take(self, true, false);
+            if (task)
+                task_run(sched, task);
+            else
+                retire(sched, self);
+            continue;
+        }
+
+        sched_task_t *task = NULL;
+        if (self->lane >= 0)
+            task = lane_pop(&sched->lanes[self->lane]);
+        if (task == NULL)
+            task = wsdeque_pop(self->deque);
+        if (task == NULL)
+            task = inbox_take(self, true, false);
+        if (task == NULL && sched->mode == SCHED_STEAL)
+            task = steal(sched, self);
+        if (task == NULL && self->lane < 0)
+            task = lanes_pop_earliest(sched);
+
+        if (task) {
+            task_run(sched, task);
+            continue;
+        }
+        if (!park(sched, self))
+            return;
+    }
+}
+
+static void *thread_worker(void *vargp) {
+    sched_worker_t *self = vargp;
+    t_worker = self;
+    if (self->sched->mode == SCHED_SHARED)
+        run_shared(self->sched);
+    else
+        run_deque(self->sched, self);
+    t_worker = NULL;
+    return NULL;
+}
+
+/**
+ * @brief Set up lane queues and register their stats.
+ */
+static void lane_init(sched_lane_queue_t *lane, const sched_lane_t *cfg) {
+    char name[STATS_NAME_LEN];
+    strncpy(lane->name, cfg->name, SCHED_LANE_NAMELEN - 1);
+    lane->reserved = cfg->reserved;
+    lane->budget_us = cfg->budget_us;
+    plock_init(&lane->mutex, "sched.lane");
+    pthread_cond_init(&lane->cond, NULL);
+    atomic_init(&lane->len, 0);
+    atomic_init(&lane->earliest, UINT64_MAX);
+    atomic_init(&lane->sleepers, 0);
+
+    snprintf(name, sizeof(name), "sched.%s.tasks", lane->name);
+    lane->stat_tasks = stats_counter(name);
+    snprintf(name, sizeof(name), "sched.%s.late", lane->name);
+    lane->stat_late = stats_counter(name);
+    snprintf(name, sizeof(name), "sched.%s.queue_depth", lane->name);
+    lane->stat_depth = stats_counter(name);
+    snprintf(name, sizeof(name), "sched.%s.queue_wait_us", lane->name);
+    lane->stat_queue_wait = stats_hist(name);
+}
+
+/**
+ * @brief Create worker `id` and start its thread.
+ */
+static int worker_start(sched_t *sched, int id, int lane) {
+    sched_worker_t *w = calloc(1, sizeof(sched_worker_t));
+    if (w == NULL)
+        return -1;
+    w->sched = sched;
+    w->id = id;
+    w->lane = lane;
+    w->seed = 2654435761U * (id + 1);
+    w->deque = wsdeque_init(SCHED_DEQUE_CAPACITY);
+    plock_init(&w->inbox_mutex, "sched.inbox");
+    atomic_init(&w->inbox_len, 0);
+    atomic_init(&w->busy_us, 0);
+    if (w->deque == NULL) {
+        free(w);
+        return -1;
+    }
+
+    // Publish the worker before its thread can look for victims.
+    sched->workers[id] = w;
+    if (pthread_create(&w->tid, NULL, thread_worker, w) != 0) {
+        sched->workers[id] = NULL;
+        wsdeque_free(w->deque);
+        free(w);
+        return -1;
+    }
+    atomic_fetch_add(&sched->nworkers, 1);
+    return 0;
+}
+
+/**************** CONTROLLER ****************/
+/**
+ * @brief CPU time consumed by a thread, in microseconds.
+ */
+static uint64_t thread_cpu_us(pthread_t tid) {
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(tid, &clock) != 0 ||
+        clock_gettime(clock, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Move the pool to `target` workers, starting threads as needed.
+ */
+static void resize(sched_t *sched, int target) {
+    const int active = atomic_load(&sched->nactive);
+    if (target > sched->tune.max_workers)
+        target = sched->tune.max_workers;
+    if (target < sched->min_workers)
+        target = sched->min_workers;
+    if (target == active)
+        return;
+
+    while (atomic_load(&sched->nworkers) < target)
+        if (worker_start(sched, atomic_load(&sched->nworkers), -1) < 0)
+            target = atomic_load(&sched->nworkers);
+
+    plock_lock(&sched->idle_mutex);
+    atomic_store(&sched->nactive, target);
+    pthread_cond_broadcast(&sched->retire_cond);
+    plock_unlock(&sched->idle_mutex);
+
+    stats_set(sched->stat_workers, target);
+    stats_add(target > active ? sched->stat_grows : sched->stat_shrinks, 1);
+}
+
+/**
+ * @brief Controller thread. Every interval it looks at the mean queueing delay
+ * of the tasks started in that interval, how busy the active workers were, and
+ * which share of their busy time they spent blocked rather than on a CPU.
+ *
+ * - Delay over target and workers mostly blocked (waiting on origins): more
+ *   threads will help, so grow additively -- unless the backlog already
+ *   shrank since the last period, in which case the last step is given time
+ *   to drain it.
+ * - Delay over target but workers mostly on CPU: more threads would only
+ *   thrash, so step back down towards the number of CPUs.
+ * - Delay under target and workers mostly idle: shrink multiplicatively.
+ */
+static void *thread_tune(void *vargp) {
+    sched_t *sched = vargp;
+    const sched_tune_t *tune = &sched->tune;
+    const int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t busy_prev[SCHED_MAX_WORKERS] = {0};
+    uint64_t cpu_prev[SCHED_MAX_WORKERS] = {0};
+    uint64_t last = stats_now_us();
+    uint64_t depth_prev = 0;
+
+    while (!atomic_load(&sched->stopping)) {
+        usleep(tune->interval_us);
+        const uint64_t now = stats_now_us();
+        const uint64_t elapsed = now - last;
+        last = now;
+
+        const uint64_t count = atomic_exchange(&sched->wait_count, 0);
+        const uint64_t wait_sum = atomic_exchange(&sched->wait_sum_us, 0);
+        uint64_t wait = count ? wait_sum / count : 0;
+        // Nothing started at all while tasks are queued: everyone is stuck.
+        if (count == 0 && stats_get(sched->stat_queue_depth) > 0)
+            wait = elapsed;
+
+        const int active = atomic_load(&sched->nactive);
+        const int started = atomic_load(&sched->nworkers);
+        uint64_t busy = 0, cpu = 0;
+        for (int i = 0; i < started; ++i) {
+            sched_worker_t *w = sched->workers[i];
+            uint64_t b = atomic_load(&w->busy_us);
+            uint64_t c = thread_cpu_us(w->tid);
+            if (i < active) {
+                busy += b - busy_prev[i];
+                cpu += c - cpu_prev[i];
+            }
+            busy_prev[i] = b;
+            cpu_prev[i] = c;
+        }
+        // Tasks still running are not accounted for until they finish, so a
+        // pool stuck on long tasks counts as fully busy.
+        uint64_t util = busy * 100 / (active * elapsed);
+        if (wait >= elapsed || util > 100)
+            util = 100;
+        uint64_t blocked = busy ? 100 - (cpu < busy ? cpu * 100 / busy : 100)
+                                : 100;
+
+        const uint64_t depth = stats_get(sched->stat_queue_depth);
+        const bool draining = depth < depth_prev - depth_prev / 8;
+        depth_prev = depth;
+
+        stats_set(sched->stat_tune_wait, wait);
+        stats_set(sched->stat_tune_util, util);
+        stats_set(sched->stat_tune_blocked, blocked);
+
+        if (wait > tune->target_wait_us) {
+            if (blocked < SCHED_TUNE_BLOCKED_PCT) {
+                if (active > ncpu)
+                    resize(sched, active - 1);
+            } else if (!draining) {
+                resize(sched, active + tune->grow_step);
+            }
+        } else if (util < SCHED_TUNE_IDLE_PCT) {
+            resize(sched, active - (active + 3) / 4);
+        }
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+sched_t *sched_init(int nworkers, sched_mode_t mode) {
+    return sched_init_lanes(nworkers, mode, NULL, 0);
+}
+
+sched_t *sched_init_lanes(int nworkers, sched_mode_t mode,
+                          const sched_lane_t *lanes, int nlanes) {
+    if (nworkers <= 0 || nworkers > SCHED_MAX_WORKERS || nlanes < 0 ||
+        nlanes > SCHED_MAX_LANES)
+        return NULL;
+
+    // Every lane needs someone to serve it: its own reserved workers, or the
+    // unreserved ones.
+    int reserved = 0;
+    bool unserved = false;
+    for (int i = 0; i < nlanes; ++i) {
+        if (lanes[i].reserved < 0)
+            return NULL;
+        reserved += lanes[i].reserved;
+        unserved |= (lanes[i].reserved == 0);
+    }
+    if (reserved > nworkers || (reserved == nworkers && unserved))
+        return NULL;
+
+    sched_t *sched = calloc(1, sizeof(sched_t));
+    if (sched == NULL)
+        return NULL;
+
+    sched->mode = mode;
+    sched->min_workers = reserved + (unserved ? 1 : 0);
+    atomic_init(&sched->nworkers, 0);
+    atomic_init(&sched->nactive, nworkers);
+    atomic_init(&sched->wait_sum_us, 0);
+    atomic_init(&sched->wait_count, 0);
+    plock_init(&sched->idle_mutex, "sched.idle");
+    pthread_cond_init(&sched->idle_cond, NULL);
+    pthread_cond_init(&sched->retire_cond, NULL);
+    atomic_init(&sched->sleepers, 0);
+    atomic_init(&sched->lane_sleepers, 0);
+    atomic_init(&sched->stopping, false);
+    atomic_init(&sched->next_worker, 0);
+
+    sched->stat_tasks = stats_counter("sched.tasks");
+    sched->stat_steals = stats_counter("sched.steals");
+    sched->stat_steal_fails = stats_counter("sched.steal_aborts");
+    sched->stat_queue_depth = stats_counter("sched.queue_depth");
+    sched->stat_queue_wait = stats_hist("sched.queue_wait_us");
+    sched->stat_workers = stats_counter("sched.workers");
+    sched->stat_grows = stats_counter("sched.tune.grows");
+    sched->stat_shrinks = stats_counter("sched.tune.shrinks");
+    sched->stat_tune_wait = stats_counter("sched.tune.wait_us");
+    sched->stat_tune_blocked = stats_counter("sched.tune.blocked_pct");
+    sched->stat_tune_util = stats_counter("sched.tune.util_pct");
+    stats_set(sched->stat_workers, nworkers);
+
+    sched->nlanes = nlanes;
+    for (int i = 0; i < nlanes; ++i)
+        lane_init(&sched->lanes[i], &lanes[i]);
+
+    // The first workers are handed out to the lanes' reservations, so that
+    // the controller only ever retires unreserved ones.
+    int lane_of[SCHED_MAX_WORKERS];
+    for (int i = 0; i < nworkers; ++i)
+        lane_of[i] = -1;
+    for (int i = 0, w = 0; i < nlanes; ++i)
+        for (int k = 0; k < lanes[i].reserved; ++k)
+            lane_of[w++] = i;
+    for (int i = 0; i < nworkers; ++i) {
+        if (worker_start(sched, i, lane_of[i]) < 0) {
+            perror("pthread_create worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return sched;
+}
+
+int sched_autosize(sched_t *sched, const sched_tune_t *tune) {
+    if (sched->mode != SCHED_STEAL || sched->tuning)
+        return -1;
+    if (tune->min_workers > tune->max_workers ||
+        tune->max_workers > SCHED_MAX_WORKERS || tune->grow_step <= 0 ||
+        tune->interval_us == 0)
+        return -1;
+
+    sched->tune = *tune;
+    if (tune->min_workers > sched->min_workers)
+        sched->min_workers = tune->min_workers;
+    if (sched->min_workers > tune->max_workers)
+        return -1;
+    resize(sched, atomic_load(&sched->nactive));
+
+    if (pthread_create(&sched->tune_tid, NULL, thread_tune, sched) != 0)
+        return -1;
+    sched->tuning = true;
+    return 0;
+}
+
+int sched_workers(sched_t *sched) {
+    return atomic_load(&sched->nactive);
+}
+
+int sched_submit(sched_t *sched, sched_fn_t fn, void *arg) {
+    sched_task_t *task = task_new(fn, arg);
+    if (task == NULL)
+        return -1;
+    stats_add(sched->stat_queue_depth, 1);
+
+    if (sched->mode == SCHED_SHARED) {
+        plock_lock(&sched->idle_mutex);
+        if (sched->shared_tail)
+            sched->shared_tail->next = task;
+        else
+            sched->shared_head = task;
+        sched->shared_tail = task;
+        pthread_cond_signal(&sched->idle_cond);
+        plock_unlock(&sched->idle_mutex);
+        return 0;
+    }
+
+    size_t i = atomic_fetch_add(&sched->next_worker, 1) %
+               atomic_load(&sched->nactive);
+    inbox_push(sched->workers[i], task);
+    wake_idle(sched);
+    return 0;
+}
+
+int sched_continue(sched_t *sched, sched_fn_t fn, void *arg) {
+    sched_worker_t *self = t_worker;
+    if (self == NULL || self->sched != sched || sched->mode == SCHED_SHARED)
+        return sched_submit(sched, fn, arg);
+
+    sched_task_t *task = task_new(fn, arg);
+    if (task == NULL)
+        return -1;
+    stats_add(sched->stat_queue_depth, 1);
+    if (wsdeque_push(self->deque, task) < 0) {
+        stats_sub(sched->stat_queue_depth, 1);
+        free(task);
+        return -1;
+    }
+    if (sched->mode == SCHED_STEAL)
+        wake_idle(sched);
+    return 0;
+}
+
+int sched_submit_lane(sched_t *sched, int lane, sched_fn_t fn, void *arg) {
+    if (lane < 0 || lane >= sched->nlanes)
+        return -1;
+    if (sched->mode == SCHED_SHARED)
+        return sched_submit(sched, fn, arg);
+
+    sched_lane_queue_t *q = &sched->lanes[lane];
+    sched_task_t *task = task_new(fn, arg);
+    if (task == NULL)
+        return -1;
+    task->lane = lane;
+    task->deadline_us = task->enqueued_us + q->budget_us;
+
+    plock_lock(&q->mutex);
+    int res = heap_push(q, task);
+    plock_unlock(&q->mutex);
+    if (res < 0) {
+        free(task);
+        return -1;
+    }
+    stats_add(sched->stat_queue_depth, 1);
+    stats_add(q->stat_depth, 1);
+    wake_lane(sched, q);
+    return 0;
+}
+
+int sched_worker_id(void) {
+    return t_worker ? t_worker->id : -1;
+}
+
+void sched_free(sched_t *sched) {
+    plock_lock(&sched->idle_mutex);
+    atomic_store(&sched->stopping, true);
+    pthread_cond_broadcast(&sched->idle_cond);
+    pthread_cond_broadcast(&sched->retire_cond);
+    for (int i = 0; i < sched->nlanes; ++i)
+        pthread_cond_broadcast(&sched->lanes[i].cond);
+    plock_unlock(&sched->idle_mutex);
+
+    if (sched->tuning)
+        pthread_join(sched->tune_tid, NULL);
+    const int n = atomic_load(&sched->nworkers);
+    for (int i = 0; i < n; ++i)
+        pthread_join(sched->workers[i]->tid, NULL);
+    for (int i = 0; i < n; ++i) {
+        wsdeque_free(sched->workers[i]->deque);
+        plock_destroy(&sched->workers[i]->inbox_mutex);
+        free(sched->workers[i]);
+    }
+    for (int i = 0; i < sched->nlanes; ++i) {
+        plock_destroy(&sched->lanes[i].mutex);
+        pthread_cond_destroy(&sched->lanes[i].cond);
+        free(sched->lanes[i].heap);
+    }
+
+    free(sched);
+}
@@ -0,0 +1,144 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A fixed pool of worker threads that run relay tasks.
+ *
+ * In the default work-stealing mode every worker owns a Chase-Lev deque.
+ * New connections are dealt to workers round-robin, continuations of a
+ * connection are pushed onto the deque of the worker that produced them (so
+ * they tend to run on the same core, right away), and a worker that runs dry
+ * steals the oldest task of a randomly chosen victim. A worker stuck behind a
+ * slow origin therefore never holds up the tasks queued behind it.
+ *
+ * Two simpler modes exist for comparison: a single mutex-protected queue
+ * shared by all workers, and static assignment (per-worker queues without
+ * stealing).
+ *
+ * On top of that, tasks can be classified into priority lanes (cf.
+ * sched_lane_t). Each lane is an earliest-deadline-first queue and may hold
+ * some workers in reserve, so that a flood of slow tasks in one lane cannot
+ * take every worker away from another.
+ *
+ * The pool can also size itself (cf. sched_autosize): a controller grows it
+ * while tasks queue up behind workers that are blocked, and shrinks it while
+ * workers sit idle.
+ */
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCHED_MAX_WORKERS 256
+#define SCHED_MAX_LANES 8
+#define SCHED_LANE_NAMELEN 32
+
+typedef void (*sched_fn_t)(void *arg);
+
+typedef enum {
+    SCHED_STEAL,  /* Per-worker deques with randomized stealing. */
+    SCHED_SHARED, /* One queue shared by every worker. */
+    SCHED_STATIC  /* Per-worker queues, no stealing. */
+} sched_mode_t;
+
+/**
+ * A priority lane. Its tasks run earliest-deadline-first, the deadline of a
+ * task being its submission time plus the lane's latency budget.
+ *
+ * @param  name       Used to name the lane's stats, e.g. "sched.hit.tasks".
+ * @param  reserved   Workers that serve this lane only. When the lane is empty
+ *                    they fall back to unclassified tasks, never to other
+ *                    lanes. Workers not reserved by any lane serve every lane,
+ *                    most urgent deadline first.
+ * @param  budget_us  Latency budget of the lane's tasks.
+ */
+typedef struct {
+    const char *name;
+    int reserved;
+    uint64_t budget_us;
+} sched_lane_t;
+
+/**
+ * Bounds and gains of the pool size controller.
+ *
+ * @param  min_workers     Never retire below this. Workers reserved by lanes
+ *                         are never retired either.
+ * @param  max_workers     Never grow beyond this.
+ * @param  interval_us     Controller period.
+ * @param  target_wait_us  Mean queueing delay above which the pool grows.
+ * @param  grow_step       Workers added per period while growing. The pool
+ *                         shrinks by a quarter per period while idle.
+ */
+typedef struct {
+    int min_workers;
+    int max_workers;
+    uint64_t interval_us;
+    uint64_t target_wait_us;
+    int grow_step;
+} sched_tune_t;
+
+typedef struct Sched sched_t;
+
+/**
+ * Start a pool of `nworkers` threads. Must be freed later by sched_free.
+ */
+sched_t *sched_init(int nworkers, sched_mode_t mode);
+
+/**
+ * Start a pool of `nworkers` threads serving `nlanes` priority lanes in
+ * addition to unclassified tasks. Lane ids are indices into `lanes`.
+ *
+ * @return NULL if the lanes reserve more workers than there are, or reserve
+ *         every worker while leaving some lane without any.
+ */
+sched_t *sched_init_lanes(int nworkers, sched_mode_t mode,
+                          const sched_lane_t *lanes, int nlanes);
+
+/**
+ * Let a controller thread resize the pool between the given bounds for as long
+ * as it runs. Only supported in SCHED_STEAL mode. Its decisions are exported
+ * as `sched.workers` and `sched.tune.*` stats.
+ *
+ * @return 0 on success, -1 on invalid bounds or an unsupported mode.
+ */
+int sched_autosize(sched_t *sched, const sched_tune_t *tune);
+
+/**
+ * Number of workers currently taking part.
+ */
+int sched_workers(sched_t *sched);
+
+/**
+ * Queue a new task (e.g. a freshly accepted connection). Thread-safe.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int sched_submit(sched_t *sched, sched_fn_t fn, void *arg);
+
+/**
+ * Queue the continuation of the task currently running on this worker. It
+ * goes onto this worker's own deque, where it stays hot unless another worker
+ * runs out of work and steals it. From outside the pool this is sched_submit.
+ */
+int sched_continue(sched_t *sched, sched_fn_t fn, void *arg);
+
+/**
+ * Queue a task on a priority lane. Thread-safe. Lanes need per-worker queues
+ * to reserve workers, so in SCHED_SHARED mode this is sched_submit.
+ *
+ * @return 0 on success, -1 on allocation failure or an unknown lane.
+ */
+int sched_submit_lane(sched_t *sched, int lane, sched_fn_t fn, void *arg);
+
+/**
+ * Index of the worker running the caller, or -1 outside of the pool.
+ */
+int sched_worker_id(void);
+
+/**
+ * Run every queued task to completion, then stop and join the workers, and
+ * free the pool.
+ */
+void sched_free(sched_t *sched);
+
+#endif
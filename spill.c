@@ -0,0 +1,96 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Bounded byte queue made of pooled chunks.
+ */
+#include "spill.h"
+
+/**************** STRUCTS ****************/
+/**
+ * Header at the start of each pooled buffer; the payload follows it.
+ *
+ * @param  rpos  Offset of the first unread payload byte.
+ * @param  wpos  Offset one past the last written payload byte.
+ */
+struct SpillChunk {
+    struct SpillChunk *next;
+    size_t rpos;
+    size_t wpos;
+    char data[];
+};
+
+/**************** PUBLIC INTERFACE ****************/
+void spill_init(spill_t *spill, bufpool_t *pool, size_t cap) {
+    spill->pool = pool;
+    spill->head = spill->tail = NULL;
+    spill->len = 0;
+    spill->cap = cap;
+}
+
+void spill_clear(spill_t *spill) {
+    while (spill->head) {
+        spill_chunk_t *next = spill->head->next;
+        bufpool_put(spill->pool, spill->head);
+        spill->head = next;
+    }
+    spill->tail = NULL;
+    spill->len = 0;
+}
+
+size_t spill_chunk_size(const bufpool_t *pool) {
+    return bufpool_bufsize(pool) - sizeof(spill_chunk_t);
+}
+
+char *spill_reserve(spill_t *spill, size_t *avail) {
+    const size_t chunk_size = spill_chunk_size(spill->pool);
+    *avail = 0;
+    if (spill_full(spill))
+        return NULL;
+
+    spill_chunk_t *tail = spill->tail;
+    if (tail == NULL || tail->wpos == chunk_size) {
+        if ((tail = bufpool_get(spill->pool)) == NULL)
+            return NULL;
+        tail->next = NULL;
+        tail->rpos = tail->wpos = 0;
+        if (spill->tail)
+            spill->tail->next = tail;
+        else
+            spill->head = tail;
+        spill->tail = tail;
+    }
+
+    *avail = chunk_size - tail->wpos;
+    if (*avail > spill->cap - spill->len)
+        *avail = spill->cap - spill->len;
+    return tail->data + tail->wpos;
+}
+
+void spill_commit(spill_t *spill, size_t n) {
+    spill->tail->wpos += n;
+    spill->len += n;
+}
+
+const char *spill_peek(const spill_t *spill, size_t *n) {
+    spill_chunk_t *head = spill->head;
+    if (head == NULL) {
+        *n = 0;
+        return NULL;
+    }
+    *n = head->wpos - head->rpos;
+    return head->data + head->rpos;
+}
+
+void spill_consume(spill_t *spill, size_t n) {
+    spill_chunk_t *head = spill->head;
+    head->rpos += n;
+    spill->len -= n;
+
+    // Hand drained chunks back right away.
+    if (head->rpos == head->wpos) {
+        spill->head = head->next;
+        if (spill->head == NULL)
+            spill->tail = NULL;
+        bufpool_put(spill->pool, head);
+    }
+}
@@ -0,0 +1,89 @@
+/**
+ * @author Jonathan Helland
+ *
+ * A bounded byte queue for the part of a response that the origin has sent
+ * but the client has not yet taken. It lets the proxy keep reading from a fast
+ * origin while a slow client catches up.
+ *
+ * The queue is a list of chunks borrowed from a bufpool_t, so it holds only as
+ * much memory as is actually queued, and hands chunks back as soon as the
+ * client has drained them. Once `cap` bytes are queued it refuses more, which
+ * is the caller's cue to stop reading from the origin and let TCP flow control
+ * push back on it.
+ */
+#ifndef SPILL_H
+#define SPILL_H
+
+#include "bufpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct SpillChunk spill_chunk_t;
+
+/**
+ * @param  pool  Source of the chunks. Its buffers must be larger than a chunk
+ *               header (cf. spill_chunk_size).
+ * @param  len   Bytes queued.
+ * @param  cap   Bound on len.
+ */
+typedef struct {
+    bufpool_t *pool;
+    spill_chunk_t *head;
+    spill_chunk_t *tail;
+    size_t len;
+    size_t cap;
+} spill_t;
+
+/**
+ * Set up an empty queue holding at most `cap` bytes.
+ */
+void spill_init(spill_t *spill, bufpool_t *pool, size_t cap);
+
+/**
+ * Drop everything queued and give the chunks back to the pool.
+ */
+void spill_clear(spill_t *spill);
+
+/**
+ * Bytes of payload per chunk borrowed from `pool`.
+ */
+size_t spill_chunk_size(const bufpool_t *pool);
+
+static inline size_t spill_len(const spill_t *spill) {
+    return spill->len;
+}
+
+static inline bool spill_full(const spill_t *spill) {
+    return spill->len >= spill->cap;
+}
+
+/**
+ * Contiguous free space at the tail of the queue, to be filled (e.g. by
+ * recv(2)) and then published with spill_commit.
+ *
+ * @param[out]  avail  Bytes that may be written, never beyond the cap.
+ *
+ * @return NULL if the queue is full or no chunk could be borrowed.
+ */
+char *spill_reserve(spill_t *spill, size_t *avail);
+
+/**
+ * Append the first `n` bytes of the space returned by spill_reserve.
+ */
+void spill_commit(spill_t *spill, size_t n);
+
+/**
+ * Contiguous bytes at the head of the queue, to be sent (e.g. by send(2)) and
+ * then dropped with spill_consume.
+ *
+ * @param[out]  n  Number of bytes available, 0 if the queue is empty.
+ */
+const char *spill_peek(const spill_t *spill, size_t *n);
+
+/**
+ * Drop the first `n` bytes returned by spill_peek.
+ */
+void spill_consume(spill_t *spill, size_t n);
+
+#endif
@@ -0,0 +1,158 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Process-wide counters and histograms.
+ */
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * The metrics region. Entries are appended under `mutex` and published by
+ * bumping the matching count, so readers never see a half-initialized entry.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    _Atomic size_t ncounters;
+    _Atomic size_t nhists;
+    stat_counter_t counters[STATS_MAX_COUNTERS];
+    stat_hist_t hists[STATS_MAX_HISTS];
+} g_stats = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+stat_counter_t *stats_counter(const char *name) {
+    stat_counter_t *c = NULL;
+    pthread_mutex_lock(&g_stats.mutex);
+
+    size_t n = atomic_load(&g_stats.ncounters);
+    for (size_t i = 0; i < n; ++i) {
+        if (strncmp(g_stats.counters[i].name, name, STATS_NAME_LEN) == 0) {
+            c = &g_stats.counters[i];
+            break;
+        }
+    }
+    if (c == NULL && n < STATS_MAX_COUNTERS) {
+        c = &g_stats.counters[n];
+        strncpy(c->name, name, STATS_NAME_LEN - 1);
+        atomic_init(&c->value, 0);
+        atomic_store_explicit(&g_stats.ncounters, n + 1,
+                              memory_order_release);
+    }
+
+    pthread_mutex_unlock(&g_stats.mutex);
+    return c;
+}
+
+stat_hist_t *stats_hist(const char *name) {
+    stat_hist_t *h = NULL;
+    pthread_mutex_lock(&g_stats.mutex);
+
+    size_t n = atomic_load(&g_stats.nhists);
+    for (size_t i = 0; i < n; ++i) {
+        if (strncmp(g_stats.hists[i].name, name, STATS_NAME_LEN) == 0) {
+            h = &g_stats.hists[i];
+            break;
+        }
+    }
+    if (h == NULL && n < STATS_MAX_HISTS) {
+        h = &g_stats.hists[n];
+        strncpy(h->name, name, STATS_NAME_LEN - 1);
+        atomic_store_explicit(&g_stats.nhists, n + 1, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&g_stats.mutex);
+    return h;
+}
+
+/**
+ * @brief Map a sample to its power-of-two bucket.
+ */
+static inline size_t hist_bucket(uint64_t v) {
+    if (v == 0)
+        return 0;
+    size_t b = 64 - __builtin_clzll(v);
+    return (b < STATS_HIST_BUCKETS) ? b : STATS_HIST_BUCKETS - 1;
+}
+
+void stats_hist_record(stat_hist_t *h, uint64_t v) {
+    if (h == NULL)
+        return;
+    atomic_fetch_add_explicit(&h->buckets[hist_bucket(v)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+uint64_t stats_hist_quantile(const stat_hist_t *h, double q) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < STATS_HIST_BUCKETS; ++i)
+        total += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HIST_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= rank)
+            return (i == 0) ? 0 : (1ULL << i) - 1;
+    }
+    return UINT64_MAX;
+}
+
+uint64_t stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const stat_counter_t *stats_counters(size_t *n) {
+    *n = atomic_load_explicit(&g_stats.ncounters, memory_order_acquire);
+    return g_stats.counters;
+}
+
+const stat_hist_t *stats_hists(size_t *n) {
+    *n = atomic_load_explicit(&g_stats.nhists, memory_order_acquire);
+    return g_stats.hists;
+}
+
+size_t stats_dump(char *buf, size_t len) {
+    size_t off = 0;
+
+// Append to buf, but keep counting past the end so that the caller learns how
+// much room it needs.
+#define STATS_APPEND(...)                                                      \
+    do {                                                                       \
+        int res = snprintf(buf + (off < len ? off : len),                     \
+                           off < len ? len - off : 0, __VA_ARGS__);            \
+        if (res > 0)                                                           \
+            off += res;                                                        \
+    } while (0)
+
+    size_t n = atomic_load_explicit(&g_stats.ncounters, memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        const stat_counter_t *c = &g_stats.counters[i];
+        STATS_APPEND("%s %" PRIu64 "\n", c->name, stats_get(c));
+    }
+
+    n = atomic_load_explicit(&g_stats.nhists, memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        const stat_hist_t *h = &g_stats.hists[i];
+        STATS_APPEND("%s.count %" PRIu64 "\n", h->name,
+                     atomic_load_explicit(&h->count, memory_order_relaxed));
+        STATS_APPEND("%s.sum %" PRIu64 "\n", h->name,
+                     atomic_load_explicit(&h->sum, memory_order_relaxed));
+        STATS_APPEND("%s.p50 %" PRIu64 "\n", h->name,
+                     stats_hist_quantile(h, 0.50));
+        STATS_APPEND("%s.p99 %" PRIu64 "\n", h->name,
+                     stats_hist_quantile(h, 0.99));
+    }
+
+#undef STATS_APPEND
+    return off;
+}
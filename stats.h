@@ -0,0 +1,102 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Process-wide counters and histograms. Subsystems look their metrics up once
+ * by name and then update them with relaxed atomics, so recording a sample is
+ * a single uncontended instruction on the hot path.
+ *
+ * All metrics live in one fixed-size region that is never reallocated, which
+ * keeps pointers handed out by stats_counter/stats_hist valid forever.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_NAME_LEN 64
+#define STATS_MAX_COUNTERS 1024
+#define STATS_MAX_HISTS 128
+#define STATS_HIST_BUCKETS 64
+
+/**
+ * A named 64-bit counter. Also used for gauges, which move in both directions.
+ */
+typedef struct StatCounter {
+    char name[STATS_NAME_LEN];
+    _Atomic uint64_t value;
+} stat_counter_t;
+
+/**
+ * A named histogram with power-of-two buckets: bucket i counts samples in
+ * [2^(i-1), 2^i), and bucket 0 counts zeros.
+ */
+typedef struct StatHist {
+    char name[STATS_NAME_LEN];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t buckets[STATS_HIST_BUCKETS];
+} stat_hist_t;
+
+/**
+ * Look up a counter by name, creating it on first use. Returns NULL only when
+ * the region is full; the update functions below accept NULL and do nothing.
+ */
+stat_counter_t *stats_counter(const char *name);
+
+/**
+ * Look up a histogram by name, creating it on first use.
+ */
+stat_hist_t *stats_hist(const char *name);
+
+static inline void stats_add(stat_counter_t *c, uint64_t n) {
+    if (c)
+        atomic_fetch_add_explicit(&c->value, n, memory_order_relaxed);
+}
+
+static inline void stats_sub(stat_counter_t *c, uint64_t n) {
+    if (c)
+        atomic_fetch_sub_explicit(&c->value, n, memory_order_relaxed);
+}
+
+static inline void stats_set(stat_counter_t *c, uint64_t v) {
+    if (c)
+        atomic_store_explicit(&c->value, v, memory_order_relaxed);
+}
+
+static inline uint64_t stats_get(const stat_counter_t *c) {
+    return c ? atomic_load_explicit(&c->value, memory_order_relaxed) : 0;
+}
+
+/**
+ * Record one sample in a histogram.
+ */
+void stats_hist_record(stat_hist_t *h, uint64_t v);
+
+/**
+ * Estimate the q-quantile (0 < q <= 1) of a histogram. The result is the upper
+ * bound of the bucket holding the quantile.
+ */
+uint64_t stats_hist_quantile(const stat_hist_t *h, double q);
+
+/**
+ * Current time in microseconds on the monotonic clock, for latency samples.
+ */
+uint64_t stats_now_us(void);
+
+/**
+ * The registry itself, for exporters: the `*n` counters or histograms
+ * registered so far. Entries are never moved or removed, and new ones are
+ * only appended.
+ */
+const stat_counter_t *stats_counters(size_t *n);
+const stat_hist_t *stats_hists(size_t *n);
+
+/**
+ * Write every metric as "name value" lines into buf. Returns the number of
+ * bytes that would have been written, like snprintf.
+ */
+size_t stats_dump(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,202 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Metrics segment publisher and reader.
+ */
+#include "statshm.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATSHM_READ_TRIES 1000
+
+/**************** GLOBALS ****************/
+/*
+ * The segment being published, and how many of its names are filled in.
+ */
+static struct {
+    statshm_header_t *shm;
+    unsigned interval_ms;
+    size_t named_counters;
+    size_t named_hists;
+} g_statshm;
+
+/**************** HELPERS ****************/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline size_t segment_size(void) {
+    return sizeof(statshm_header_t) +
+           STATS_MAX_COUNTERS * sizeof(statshm_counter_t) +
+           STATS_MAX_HISTS * sizeof(statshm_hist_t);
+}
+
+/**
+ * @brief Copy the registry into the segment under the sequence lock. Names
+ * never change, so only those of new entries are copied.
+ */
+static void publish(void) {
+    statshm_header_t *shm = g_statshm.shm;
+    statshm_counter_t *out_counters =
+        (statshm_counter_t *)((char *)shm + shm->counters_off);
+    statshm_hist_t *out_hists = (statshm_hist_t *)((char *)shm + shm->hists_off);
+    size_t ncounters, nhists;
+    const stat_counter_t *counters = stats_counters(&ncounters);
+    const stat_hist_t *hists = stats_hists(&nhists);
+
+    const uint64_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+    atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (size_t i = g_statshm.named_counters; i < ncounters; ++i)
+        memcpy(out_counters[i].name, counters[i].name, STATS_NAME_LEN);
+    for (size_t i = 0; i < ncounters; ++i)
+        out_counters[i].value = stats_get(&counters[i]);
+
+    for (size_t i = g_statshm.named_hists; i < nhists; ++i)
+        memcpy(out_hists[i].name, hists[i].name, STATS_NAME_LEN);
+    for (size_t i = 0; i < nhists; ++i) {
+        out_hists[i].count =
+            atomic_load_explicit(&hists[i].count, memory_order_relaxed);
+        out_hists[i].sum =
+            atomic_load_explicit(&hists[i].sum, memory_order_relaxed);
+        for (size_t b = 0; b < STATS_HIST_BUCKETS; ++b)
+            out_hists[i].buckets[b] = atomic_load_explicit(
+                &hists[i].buckets[b], memory_order_relaxed);
+    }
+    g_statshm.named_counters = ncounters;
+    g_statshm.named_hists = nhists;
+    shm->ncounters = ncounters;
+    shm->nhists = nhists;
+    shm->publish_ns = now_ns();
+
+    atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+static void *thread_statshm(void *vargp) {
+    const struct timespec interval = {
+        .tv_sec = g_statshm.interval_ms / 1000,
+        .tv_nsec = (long)(g_statshm.interval_ms % 1000) * 1000000,
+    };
+    while (1) {
+        publish();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int statshm_start(const char *path, unsigned interval_ms) {
+    const size_t len = segment_size();
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    statshm_header_t *shm =
+        mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return -1;
+
+    shm->version = STATSHM_VERSION;
+    shm->header_size = sizeof(statshm_header_t);
+    atomic_init(&shm->seq, 0);
+    shm->pid = getpid();
+    if (interval_ms == 0)
+        interval_ms = STATSHM_DEFAULT_INTERVAL_MS;
+    shm->interval_ms = interval_ms;
+    shm->max_counters = STATS_MAX_COUNTERS;
+    shm->max_hists = STATS_MAX_HISTS;
+    shm->name_len = STATS_NAME_LEN;
+    shm->hist_buckets = STATS_HIST_BUCKETS;
+    shm->counters_off = sizeof(statshm_header_t);
+    shm->hists_off = shm->counters_off +
+                     STATS_MAX_COUNTERS * sizeof(statshm_counter_t);
+
+    g_statshm.shm = shm;
+    g_statshm.interval_ms = interval_ms;
+    publish();
+
+    // Readers trust the layout once they see the magic.
+    atomic_thread_fence(memory_order_release);
+    memcpy(shm->magic, STATSHM_MAGIC, sizeof(STATSHM_MAGIC));
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, thread_statshm, NULL) != 0) {
+        munmap(shm, len);
+        g_statshm.shm = NULL;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+const statshm_header_t *statshm_map(const char *path, size_t *len) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(statshm_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    const statshm_header_t *shm =
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+
+    const size_t size = st.st_size;
+    if (memcmp(shm->magic, STATSHM_MAGIC, sizeof(STATSHM_MAGIC)) != 0 ||
+        shm->version != STATSHM_VERSION ||
+        shm->header_size != sizeof(statshm_header_t) ||
+        shm->name_len != STATS_NAME_LEN ||
+        shm->hist_buckets != STATS_HIST_BUCKETS ||
+        shm->counters_off + shm->max_counters * sizeof(statshm_counter_t) >
+            size ||
+        shm->hists_off + shm->max_hists * sizeof(statshm_hist_t) > size) {
+        munmap((void *)shm, size);
+        return NULL;
+    }
+    *len = size;
+    return shm;
+}
+
+int statshm_read(const statshm_header_t *shm, void *buf, size_t len) {
+    statshm_header_t *copy = buf;
+    for (int attempt = 0; attempt < STATSHM_READ_TRIES; ++attempt) {
+        const uint64_t seq =
+            atomic_load_explicit(&shm->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+
+        // Copy the header, then only the entries in use.
+        memcpy(copy, shm, sizeof(statshm_header_t));
+        size_t ncounters = copy->ncounters, nhists = copy->nhists;
+        if (ncounters > copy->max_counters || nhists > copy->max_hists ||
+            copy->hists_off + copy->max_hists * sizeof(statshm_hist_t) > len)
+            continue;
+        memcpy((char *)copy + copy->counters_off,
+               (const char *)shm + copy->counters_off,
+               ncounters * sizeof(statshm_counter_t));
+        memcpy((char *)copy + copy->hists_off,
+               (const char *)shm + copy->hists_off,
+               nhists * sizeof(statshm_hist_t));
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shm->seq, memory_order_relaxed) == seq)
+            return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,112 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Metrics segment: a copy of the stats registry that the proxy republishes
+ * into a file in /dev/shm every few milliseconds. External tools map the file
+ * read-only and read it with plain loads, so monitoring costs the proxy
+ * nothing beyond the periodic copy, however often it is sampled.
+ *
+ * Layout, version 1, in native byte order:
+ *
+ *     offset 0            statshm_header_t
+ *     counters_off        max_counters x statshm_counter_t
+ *     hists_off           max_hists x statshm_hist_t
+ *
+ * Only the first `ncounters` and `nhists` entries are in use. An entry keeps
+ * its index for the lifetime of the proxy, so readers can compute rates by
+ * index.
+ *
+ * The segment is guarded by a sequence lock. The publisher makes `seq` odd
+ * before it writes and even again once it is done; a reader copies the
+ * segment and keeps the copy only if `seq` was even and unchanged across the
+ * copy. statshm_read implements that protocol.
+ */
+#ifndef STATSHM_H
+#define STATSHM_H
+
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATSHM_MAGIC "PXSTATS"
+#define STATSHM_VERSION 1
+#define STATSHM_DEFAULT_INTERVAL_MS 50
+
+/**
+ * @param  seq           Sequence lock, odd while the publisher is writing.
+ * @param  publish_ns    CLOCK_MONOTONIC time of the latest publication.
+ * @param  interval_ms   How often the proxy publishes.
+ * @param  name_len      Bytes of every name, NUL-terminated.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    _Atomic uint64_t seq;
+    uint64_t publish_ns;
+    uint32_t pid;
+    uint32_t interval_ms;
+    uint32_t ncounters;
+    uint32_t nhists;
+    uint32_t max_counters;
+    uint32_t max_hists;
+    uint32_t name_len;
+    uint32_t hist_buckets;
+    uint64_t counters_off;
+    uint64_t hists_off;
+} statshm_header_t;
+
+typedef struct {
+    char name[STATS_NAME_LEN];
+    uint64_t value;
+} statshm_counter_t;
+
+/**
+ * Histogram buckets as in stats.h: bucket i counts samples in [2^(i-1), 2^i),
+ * bucket 0 counts zeros.
+ */
+typedef struct {
+    char name[STATS_NAME_LEN];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+} statshm_hist_t;
+
+/**
+ * Create the segment at `path` and start publishing into it from a background
+ * thread every `interval_ms`.
+ *
+ * @return 0 on success, -1 if the file could not be created.
+ */
+int statshm_start(const char *path, unsigned interval_ms);
+
+/**
+ * Map a segment read-only.
+ *
+ * @param[out]  len  Size of the mapping.
+ *
+ * @return The mapping, or NULL if `path` is not a metrics segment this code
+ *         understands.
+ */
+const statshm_header_t *statshm_map(const char *path, size_t *len);
+
+/**
+ * Take a consistent copy of a mapped segment into `buf`, which must hold
+ * `len` bytes, retrying while the publisher is writing.
+ *
+ * @return 0 on success, -1 if no consistent copy could be taken.
+ */
+int statshm_read(const statshm_header_t *shm, void *buf, size_t len);
+
+static inline const statshm_counter_t *
+statshm_counters(const statshm_header_t *shm) {
+    return (const statshm_counter_t *)((const char *)shm + shm->counters_off);
+}
+
+static inline const statshm_hist_t *statshm_hists(const statshm_header_t *shm) {
+    return (const statshm_hist_t *)((const char *)shm + shm->hists_off);
+}
+
+#endif
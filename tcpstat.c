@@ -0,0 +1,212 @@
+/**
+ * @author Jonathan Helland
+ *
+ * TCP_INFO sampling and per-group histograms.
+ */
+#include "tcpstat.h"
+
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/*
+ * Samples the rate limit lets through at once after a quiet spell.
+ */
+#define TCPSTAT_BURST 64
+
+#define TCPSTAT_KEY_LEN 48
+
+/**************** STRUCTS ****************/
+struct TcpstatGroup {
+    char key[TCPSTAT_KEY_LEN];
+    stat_hist_t *rtt_us;
+    stat_hist_t *retrans;
+    stat_hist_t *cwnd;
+    stat_hist_t *delivery;
+};
+
+/**
+ * The groups of one kind. Groups are appended under the mutex and published
+ * by `ngroups`, so lookups only read.
+ */
+typedef struct {
+    const char *prefix;
+    pthread_mutex_t mutex;
+    _Atomic size_t ngroups;
+    tcpstat_group_t groups[TCPSTAT_MAX_GROUPS];
+} tcpstat_kind_groups_t;
+
+/**************** GLOBALS ****************/
+static struct {
+    bool enabled;
+    uint64_t interval_us;
+    _Atomic uint64_t next_us;
+    stat_counter_t *samples;
+    stat_counter_t *skipped;
+    tcpstat_kind_groups_t kinds[2];
+} g_tcpstat = {
+    .kinds =
+        {
+            [TCPSTAT_ORIGIN] = {.prefix = "tcp.origin",
+                                .mutex = PTHREAD_MUTEX_INITIALIZER},
+            [TCPSTAT_CLIENT] = {.prefix = "tcp.client",
+                                .mutex = PTHREAD_MUTEX_INITIALIZER},
+        },
+};
+
+/**************** HELPERS ****************/
+/**
+ * @brief Take one sample from the process-wide budget: one every
+ * `interval_us`, with up to TCPSTAT_BURST saved up.
+ */
+static bool take_token(void) {
+    const uint64_t now = stats_now_us();
+    uint64_t next = atomic_load_explicit(&g_tcpstat.next_us,
+                                         memory_order_relaxed);
+    if (now < next)
+        return false;
+    const uint64_t burst = TCPSTAT_BURST * g_tcpstat.interval_us;
+    const uint64_t base = next + burst < now ? now - burst : next;
+    return atomic_compare_exchange_strong_explicit(
+        &g_tcpstat.next_us, &next, base + g_tcpstat.interval_us,
+        memory_order_relaxed, memory_order_relaxed);
+}
+
+/**
+ * @brief Find the group of `key`, creating it while there is room, and
+ * falling back to "other" once there is not.
+ */
+static tcpstat_group_t *find_group(tcpstat_kind_t kind, const char *key) {
+    tcpstat_kind_groups_t *kg = &g_tcpstat.kinds[kind];
+    size_t n = atomic_load_explicit(&kg->ngroups, memory_order_acquire);
+    for (size_t i = 0; i < n; ++i)
+        if (strcmp(kg->groups[i].key, key) == 0)
+            return &kg->groups[i];
+    if (n == TCPSTAT_MAX_GROUPS)
+        return &kg->groups[n - 1];
+
+    tcpstat_group_t *group = NULL;
+    pthread_mutex_lock(&kg->mutex);
+    n = atomic_load_explicit(&kg->ngroups, memory_order_relaxed);
+    // The last slot is kept for "other".
+    if (n >= TCPSTAT_MAX_GROUPS - 1)
+        key = "other";
+    for (size_t i = 0; i < n; ++i)
+        if (strcmp(kg->groups[i].key, key) == 0)
+            group = &kg->groups[i];
+    if (group == NULL && n < TCPSTAT_MAX_GROUPS) {
+        char metric[STATS_NAME_LEN];
+        group = &kg->groups[n];
+        snprintf(group->key, sizeof(group->key), "%s", key);
+        snprintf(metric, sizeof(metric), "%s.%s.rtt_us", kg->prefix,
+                 group->key);
+        group->rtt_us = stats_hist(metric);
+        snprintf(metric, sizeof(metric), "%s.%s.retrans", kg->prefix,
+                 group->key);
+        group->retrans = stats_hist(metric);
+        snprintf(metric, sizeof(metric), "%s.%s.cwnd", kg->prefix,
+                 group->key);
+        group->cwnd = stats_hist(metric);
+        snprintf(metric, sizeof(metric), "%s.%s.delivery_bytes_s",
+                 kg->prefix, group->key);
+        group->delivery = stats_hist(metric);
+        atomic_store_explicit(&kg->ngroups, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&kg->mutex);
+    return group;
+}
+
+/**
+ * @brief Name the subnet of a connected client: its /24 for IPv4, its /48
+ * for IPv6.
+ *
+ * @return 0 on success, -1 if the peer is unknown.
+ */
+static int client_subnet(int fd, char *key, size_t len) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char ip[INET6_ADDRSTRLEN];
+    if (getpeername(fd, (struct sockaddr *)&addr, &addrlen) < 0)
+        return -1;
+
+    if (addr.ss_family == AF_INET) {
+        struct in_addr a = ((struct sockaddr_in *)&addr)->sin_addr;
+        a.s_addr &= htonl(0xffffff00);
+        inet_ntop(AF_INET, &a, ip, sizeof(ip));
+        snprintf(key, len, "%.40s/24", ip);
+    } else if (addr.ss_family == AF_INET6) {
+        struct in6_addr a = ((struct sockaddr_in6 *)&addr)->sin6_addr;
+        memset(a.s6_addr + 6, 0, 10);
+        inet_ntop(AF_INET6, &a, ip, sizeof(ip));
+        snprintf(key, len, "%.40s/48", ip);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+void tcpstat_init(unsigned rate) {
+    if (rate == 0)
+        return;
+    g_tcpstat.interval_us = rate >= 1000000 ? 1 : 1000000 / rate;
+    g_tcpstat.samples = stats_counter("tcp.samples");
+    g_tcpstat.skipped = stats_counter("tcp.skipped");
+    g_tcpstat.enabled = true;
+}
+
+void tcpstat_conn_init(tcpstat_conn_t *conn, tcpstat_kind_t kind,
+                       const char *host) {
+    conn->kind = kind;
+    conn->host = host;
+    conn->group = NULL;
+    conn->retrans = 0;
+    conn->next_us = UINT64_MAX;
+}
+
+void tcpstat_sample(tcpstat_conn_t *conn, int fd) {
+    if (!g_tcpstat.enabled)
+        return;
+    conn->next_us = stats_now_us() + TCPSTAT_PERIOD_US;
+    if (!take_token()) {
+        stats_add(g_tcpstat.skipped, 1);
+        return;
+    }
+
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return;
+
+    if (conn->group == NULL) {
+        char key[TCPSTAT_KEY_LEN];
+        if (conn->kind == TCPSTAT_ORIGIN) {
+            snprintf(key, sizeof(key), "%.*s", TCPSTAT_HOST_LEN,
+                     conn->host ? conn->host : "?");
+        } else if (client_subnet(fd, key, sizeof(key)) < 0) {
+            return;
+        }
+        conn->group = find_group(conn->kind, key);
+        if (conn->group == NULL)
+            return;
+    }
+
+    tcpstat_group_t *group = conn->group;
+    stats_add(g_tcpstat.samples, 1);
+    stats_hist_record(group->rtt_us, info.tcpi_rtt);
+    stats_hist_record(group->retrans, info.tcpi_total_retrans - conn->retrans);
+    stats_hist_record(group->cwnd, info.tcpi_snd_cwnd);
+    // Kernels older than 4.9 do not fill it in.
+    if (len >= offsetof(struct tcp_info, tcpi_delivery_rate) +
+                   sizeof(info.tcpi_delivery_rate) &&
+        info.tcpi_delivery_rate)
+        stats_hist_record(group->delivery, info.tcpi_delivery_rate);
+    conn->retrans = info.tcpi_total_retrans;
+}
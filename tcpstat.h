@@ -0,0 +1,87 @@
+/**
+ * @author Jonathan Helland
+ *
+ * TCP telemetry: the kernel's view of client and origin connections, read
+ * with getsockopt(TCP_INFO) at a few points of every relay and aggregated into
+ * histograms, to tell a slow origin from a lossy path or a slow client.
+ *
+ * Connections are grouped by origin host and by client subnet (/24 for IPv4,
+ * /48 for IPv6). Each group gets four histograms in the stats registry:
+ *
+ *     tcp.<origin|client>.<group>.rtt_us            smoothed round-trip time
+ *     tcp.<origin|client>.<group>.retrans           retransmissions since the
+ *                                                   previous sample
+ *     tcp.<origin|client>.<group>.cwnd              congestion window, segments
+ *     tcp.<origin|client>.<group>.delivery_bytes_s  delivery rate, when the
+ *                                                   kernel reports one
+ *
+ * The first TCPSTAT_MAX_GROUPS - 1 groups of each kind seen are tracked by
+ * name; later ones share the group "other". The kernel measures the sending
+ * direction, so for origins, which mostly send to the proxy, the RTT is the
+ * meaningful figure.
+ *
+ * Samples are rate-limited process-wide, so the cost stays bounded however
+ * busy the proxy is: a connection whose sample is refused simply goes
+ * unmeasured at that point.
+ */
+#ifndef TCPSTAT_H
+#define TCPSTAT_H
+
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TCPSTAT_DEFAULT_RATE 1000 /* Samples per second. */
+#define TCPSTAT_PERIOD_US (1000 * 1000)
+#define TCPSTAT_MAX_GROUPS 8
+#define TCPSTAT_HOST_LEN 32
+
+typedef enum { TCPSTAT_ORIGIN, TCPSTAT_CLIENT } tcpstat_kind_t;
+
+typedef struct TcpstatGroup tcpstat_group_t;
+
+/**
+ * Sampling state of one connection. Its group is looked up on the first
+ * sample taken, so connections that are never sampled cost nothing.
+ *
+ * @param  host     Origin host name, for TCPSTAT_ORIGIN. Not copied.
+ * @param  retrans  Retransmissions counted at the previous sample.
+ * @param  next_us  When the connection is due for a periodic sample.
+ */
+typedef struct TcpstatConn {
+    tcpstat_kind_t kind;
+    const char *host;
+    tcpstat_group_t *group;
+    uint32_t retrans;
+    uint64_t next_us;
+} tcpstat_conn_t;
+
+/**
+ * Enable sampling at up to `rate` samples per second; 0 leaves it off.
+ */
+void tcpstat_init(unsigned rate);
+
+/**
+ * Start tracking a connection.
+ *
+ * @param  host  Origin host name for TCPSTAT_ORIGIN, NULL for TCPSTAT_CLIENT.
+ */
+void tcpstat_conn_init(tcpstat_conn_t *conn, tcpstat_kind_t kind,
+                       const char *host);
+
+/**
+ * Sample a connection at a key point (first byte, completion), if the rate
+ * limit allows. Also schedules the next periodic sample.
+ */
+void tcpstat_sample(tcpstat_conn_t *conn, int fd);
+
+/**
+ * Sample a long transfer once per TCPSTAT_PERIOD_US after its first sample.
+ */
+static inline void tcpstat_periodic(tcpstat_conn_t *conn, int fd) {
+    if (conn->next_us != UINT64_MAX && stats_now_us() >= conn->next_us)
+        tcpstat_sample(conn, fd);
+}
+
+#endif
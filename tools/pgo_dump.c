@@ -0,0 +1,23 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Linked into the instrumented proxy of `make pgo` only. The proxy never
+ * exits on its own, so the profile it gathers under the training load would
+ * never reach the disk; this writes it out when the proxy is told to stop
+ * with SIGTERM.
+ */
+#include <signal.h>
+#include <unistd.h>
+
+void __gcov_dump(void);
+
+static void dump_profile(int sig) {
+    __gcov_dump();
+    _exit(0);
+}
+
+__attribute__((constructor)) static void install_dump_handler(void) {
+    struct sigaction action = {.sa_handler = dump_profile};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+}
@@ -0,0 +1,213 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Live view of a running proxy, read from its metrics segment (see statshm.h)
+ * without talking to the proxy at all. Every interval it prints the counters
+ * that moved the most, with their rates, and the histograms that received
+ * samples, with percentiles over that interval alone.
+ *
+ *     proxytop [-i ms] [-n iterations] [-r rows] [-f prefix] [-b] segment
+ *
+ * `-f` keeps only metrics whose name starts with `prefix`, and `-b` prints
+ * one report after another instead of redrawing the screen, for logging.
+ */
+#include "statshm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_INTERVAL_MS 1000
+#define DEFAULT_ROWS 20
+
+typedef struct {
+    size_t index;
+    double rate;
+} row_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_rows(const void *a, const void *b) {
+    const row_t *x = a, *y = b;
+    return (x->rate < y->rate) - (x->rate > y->rate);
+}
+
+/**
+ * @brief Upper bound of the bucket holding the q-quantile of a bucket array,
+ * as stats_hist_quantile computes it.
+ */
+static uint64_t quantile(const uint64_t *buckets, double q) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < STATS_HIST_BUCKETS; ++i)
+        total += buckets[i];
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HIST_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return (i == 0) ? 0 : (1ULL << i) - 1;
+    }
+    return UINT64_MAX;
+}
+
+/**
+ * @brief Print one report: rates between two snapshots of the same proxy.
+ */
+static void report(const statshm_header_t *prev, const statshm_header_t *cur,
+                   const char *prefix, size_t rows, bool batch) {
+    const double dt = (cur->publish_ns - prev->publish_ns) / 1e9;
+    const uint64_t age_ms = (now_ns() - cur->publish_ns) / 1000000;
+    const statshm_counter_t *c0 = statshm_counters(prev);
+    const statshm_counter_t *c1 = statshm_counters(cur);
+    const statshm_hist_t *h0 = statshm_hists(prev);
+    const statshm_hist_t *h1 = statshm_hists(cur);
+    const size_t plen = prefix ? strlen(prefix) : 0;
+
+    if (!batch)
+        printf("\033[H\033[2J");
+    printf("proxy %u: published every %u ms, %lu ms ago%s\n", cur->pid,
+           cur->interval_ms, (unsigned long)age_ms,
+           age_ms > 3 * cur->interval_ms + 1000 ? " (stale)" : "");
+
+    row_t *table = malloc((cur->ncounters + cur->nhists + 1) * sizeof(row_t));
+    size_t n = 0;
+    for (size_t i = 0; i < cur->ncounters; ++i) {
+        if (plen && strncmp(c1[i].name, prefix, plen) != 0)
+            continue;
+        const uint64_t before = i < prev->ncounters ? c0[i].value : 0;
+        if (c1[i].value == 0 && before == 0)
+            continue;
+        table[n].index = i;
+        table[n].rate = dt > 0 ? ((double)c1[i].value - before) / dt : 0;
+        table[n].rate = table[n].rate < 0 ? -table[n].rate : table[n].rate;
+        n++;
+    }
+    qsort(table, n, sizeof(row_t), cmp_rows);
+    printf("\n%-48s %16s %14s\n", "COUNTER", "VALUE", "RATE/s");
+    for (size_t r = 0; r < n && r < rows; ++r) {
+        const size_t i = table[r].index;
+        const uint64_t before = i < prev->ncounters ? c0[i].value : 0;
+        printf("%-48.48s %16lu %14.1f\n", c1[i].name,
+               (unsigned long)c1[i].value,
+               dt > 0 ? ((double)c1[i].value - before) / dt : 0.0);
+    }
+
+    n = 0;
+    for (size_t i = 0; i < cur->nhists; ++i) {
+        if (plen && strncmp(h1[i].name, prefix, plen) != 0)
+            continue;
+        const uint64_t before = i < prev->nhists ? h0[i].count : 0;
+        if (h1[i].count == before)
+            continue;
+        table[n].index = i;
+        table[n].rate = dt > 0 ? (h1[i].count - before) / dt : 0;
+        n++;
+    }
+    qsort(table, n, sizeof(row_t), cmp_rows);
+    printf("\n%-48s %12s %12s %12s %12s\n", "HISTOGRAM", "SAMPLES/s",
+           "MEAN", "P50", "P99");
+    for (size_t r = 0; r < n && r < rows; ++r) {
+        const size_t i = table[r].index;
+        uint64_t buckets[STATS_HIST_BUCKETS];
+        uint64_t count = h1[i].count, sum = h1[i].sum;
+        for (size_t b = 0; b < STATS_HIST_BUCKETS; ++b)
+            buckets[b] = h1[i].buckets[b];
+        if (i < prev->nhists) {
+            count -= h0[i].count;
+            sum -= h0[i].sum;
+            for (size_t b = 0; b < STATS_HIST_BUCKETS; ++b)
+                buckets[b] -= h0[i].buckets[b];
+        }
+        printf("%-48.48s %12.1f %12.1f %12lu %12lu\n", h1[i].name,
+               table[r].rate, count ? (double)sum / count : 0.0,
+               (unsigned long)quantile(buckets, 0.50),
+               (unsigned long)quantile(buckets, 0.99));
+    }
+    printf("\n");
+    fflush(stdout);
+    free(table);
+}
+
+int main(int argc, char **argv) {
+    unsigned interval_ms = DEFAULT_INTERVAL_MS;
+    long iterations = -1;
+    size_t rows = DEFAULT_ROWS;
+    const char *prefix = NULL;
+    bool batch = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:r:f:b")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'r':
+            rows = atoi(optarg);
+            break;
+        case 'f':
+            prefix = optarg;
+            break;
+        case 'b':
+            batch = true;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1 || interval_ms == 0) {
+        fprintf(stderr,
+                "Usage: %s [-i ms] [-n iterations] [-r rows] [-f prefix] "
+                "[-b] segment\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t len;
+    const statshm_header_t *shm = statshm_map(argv[optind], &len);
+    if (shm == NULL) {
+        fprintf(stderr, "%s: not a metrics segment\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    statshm_header_t *prev = malloc(len), *cur = malloc(len);
+    if (prev == NULL || cur == NULL || statshm_read(shm, prev, len) < 0) {
+        fprintf(stderr, "%s: could not read the segment\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    const struct timespec interval = {
+        .tv_sec = interval_ms / 1000,
+        .tv_nsec = (long)(interval_ms % 1000) * 1000000,
+    };
+    for (long i = 0; iterations < 0 || i < iterations; ++i) {
+        nanosleep(&interval, NULL);
+        if (statshm_read(shm, cur, len) < 0)
+            continue;
+        // A restarted proxy starts its counters over.
+        if (cur->pid != prev->pid) {
+            statshm_header_t *tmp = prev;
+            prev = cur;
+            cur = tmp;
+            continue;
+        }
+        report(prev, cur, prefix, rows, batch);
+        if (cur->publish_ns != prev->publish_ns) {
+            statshm_header_t *tmp = prev;
+            prev = cur;
+            cur = tmp;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * @author Jonathan Helland
+ *
+ * UNIX stream sockets.
+ */
+#define _GNU_SOURCE
+#include "unixsock.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/**************** STRUCTS ****************/
+/**
+ * An origin reached over a UNIX socket.
+ */
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *path;
+} route_t;
+
+/**************** GLOBALS ****************/
+static struct {
+    route_t routes[UNIXSOCK_MAX_ROUTES];
+    int nroutes;
+} g_unixsock;
+
+/**************** PUBLIC INTERFACE ****************/
+bool unixsock_is_path(const char *addr) {
+    return addr[0] == '@' || strchr(addr, '/') != NULL;
+}
+
+int unixsock_addr(const char *path, struct sockaddr_un *sun, socklen_t *len) {
+    const size_t n = strlen(path);
+    if (n == 0 || n >= sizeof(sun->sun_path))
+        return -1;
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, n);
+    // Abstract names are not NUL-terminated: the address length bounds them.
+    if (path[0] == '@') {
+        sun->sun_path[0] = '\0';
+        *len = offsetof(struct sockaddr_un, sun_path) + n;
+    } else {
+        *len = sizeof(*sun);
+    }
+    return 0;
+}
+
+int unixsock_listen(const char *path, int backlog) {
+    struct sockaddr_un sun;
+    socklen_t len;
+    if (unixsock_addr(path, &sun, &len) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (path[0] != '@')
+        unlink(path);
+    if (bind(fd, (struct sockaddr *)&sun, len) < 0 || listen(fd, backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int unixsock_connect(const char *path) {
+    struct sockaddr_un sun;
+    socklen_t len;
+    if (unixsock_addr(path, &sun, &len) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, len) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+pid_t unixsock_peer_pid(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return -1;
+    return cred.pid;
+}
+
+int unixsock_add_route(char *spec) {
+    char *path = strchr(spec, '=');
+    if (path == NULL || g_unixsock.nroutes == UNIXSOCK_MAX_ROUTES)
+        return -1;
+    *path++ = '\0';
+    char *port = strrchr(spec, ':');
+    if (port == NULL || port == spec || port[1] == '\0' ||
+        !unixsock_is_path(path))
+        return -1;
+    *port++ = '\0';
+
+    g_unixsock.routes[g_unixsock.nroutes++] =
+        (route_t){.host = spec, .port = port, .path = path};
+    return 0;
+}
+
+const char *unixsock_route(const char *host, const char *port) {
+    for (int i = 0; i < g_unixsock.nroutes; ++i) {
+        const route_t *route = &g_unixsock.routes[i];
+        if (strcasecmp(route->host, host) == 0 &&
+            strcmp(route->port, port) == 0)
+            return route->path;
+    }
+    return NULL;
+}
@@ -0,0 +1,73 @@
+/**
+ * @author Jonathan Helland
+ *
+ * UNIX stream sockets, for clients, origins and peers running on the same
+ * host as the proxy: they skip the TCP/IP stack that loopback connections go
+ * through. An address names a UNIX socket when it has a `/` (a path in the
+ * file system) or starts with `@` (a name in the abstract namespace, which
+ * leaves no file behind).
+ *
+ * Origins can be reached over UNIX sockets through routes, each mapping an
+ * origin authority `host:port`, as requests name it, to a socket (cf.
+ * unixsock_route). Routes are added at startup, before any thread reads them.
+ */
+#ifndef UNIXSOCK_H
+#define UNIXSOCK_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#define UNIXSOCK_BACKLOG 1024
+#define UNIXSOCK_MAX_ROUTES 16
+
+/**
+ * Whether `addr` names a UNIX socket rather than a TCP port or host:port.
+ */
+bool unixsock_is_path(const char *addr);
+
+/**
+ * Fill in the socket address of the UNIX socket `path`.
+ *
+ * @return 0 on success, -1 if `path` is too long.
+ */
+int unixsock_addr(const char *path, struct sockaddr_un *sun, socklen_t *len);
+
+/**
+ * Listen on the UNIX socket `path`, replacing a socket file left over by a
+ * previous run.
+ *
+ * @return The listening socket, or -1.
+ */
+int unixsock_listen(const char *path, int backlog);
+
+/**
+ * Connect to the UNIX socket `path`.
+ *
+ * @return The connected, blocking socket, or -1.
+ */
+int unixsock_connect(const char *path);
+
+/**
+ * @return The pid of the process on the other end of the UNIX socket `fd`, as
+ *         of when it connected, or -1.
+ */
+pid_t unixsock_peer_pid(int fd);
+
+/**
+ * Route connections to the origin `host:port` to a UNIX socket, as given by
+ * `spec`, which is of the form `host:port=path` and is kept, not copied.
+ *
+ * @return 0 on success, -1 if `spec` is malformed or there are already
+ *         UNIXSOCK_MAX_ROUTES routes.
+ */
+int unixsock_add_route(char *spec);
+
+/**
+ * @return The UNIX socket that connections to `host:port` are routed to, or
+ *         NULL to connect over TCP.
+ */
+const char *unixsock_route(const char *host, const char *port);
+
+#endif
@@ -0,0 +1,331 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache warm-up from URL lists and access logs.
+ */
+#include "warmup.h"
+#include "alog.h"
+#include "fetch.h"
+#include "hashmap.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define WARMUP_LINE 1024
+
+/*
+ * How far past the first unclaimed URL a thread looks for one whose origin
+ * has a free slot.
+ */
+#define WARMUP_WINDOW 256
+
+/**************** STRUCTS ****************/
+/**
+ * @param  count  Times the URL was requested, in an access log.
+ * @param  order  Position of its first appearance, to break ties.
+ */
+typedef struct {
+    char *uri;
+    const char *path;
+    size_t origin;
+    size_t count;
+    size_t order;
+    bool claimed;
+} warm_url_t;
+
+/**
+ * An origin host and port, and the fetches in flight to it.
+ */
+typedef struct {
+    char host[FETCH_HOST_LEN];
+    char port[FETCH_PORT_LEN];
+    char *key;
+    int inflight;
+} warm_origin_t;
+
+/**************** GLOBALS ****************/
+static struct {
+    warmup_cfg_t cfg;
+    warmup_store_fn store;
+    void *arg;
+
+    warm_url_t *urls;
+    size_t nurls;
+    warm_origin_t *origins;
+    size_t norigins;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t cursor;
+    uint64_t next_ns;
+    bool full;
+    int running;
+
+    stat_counter_t *stat_urls;
+    stat_counter_t *stat_stored;
+    stat_counter_t *stat_skipped;
+    stat_counter_t *stat_failed;
+    stat_counter_t *stat_running;
+} g_warmup = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+              .cond = PTHREAD_COND_INITIALIZER};
+
+/**************** HELPERS ****************/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Count a request for `uri`, adding the URL the first time.
+ */
+static void add_url(hashmap_t *urls, hashmap_t *origins, size_t *cap,
+                    const char *uri) {
+    // Values are indices plus one, since NULL means absent.
+    uintptr_t idx = (uintptr_t)hashmap_find(urls, uri, strlen(uri));
+    if (idx) {
+        g_warmup.urls[idx - 1].count++;
+        return;
+    }
+
+    warm_origin_t origin;
+    size_t path;
+    if (fetch_parse_url(uri, origin.host, origin.port, &path) < 0)
+        return;
+    if (g_warmup.nurls == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        g_warmup.urls = realloc(g_warmup.urls, *cap * sizeof(warm_url_t));
+    }
+    warm_url_t *url = &g_warmup.urls[g_warmup.nurls];
+    url->uri = strdup(uri);
+    url->path = path ? url->uri + path : "/";
+    url->count = 1;
+    url->order = g_warmup.nurls;
+    url->claimed = false;
+
+    char key[FETCH_HOST_LEN + FETCH_PORT_LEN + 1];
+    snprintf(key, sizeof(key), "%s:%s", origin.host, origin.port);
+    uintptr_t o = (uintptr_t)hashmap_find(origins, key, strlen(key));
+    if (o == 0) {
+        g_warmup.origins = realloc(g_warmup.origins, (g_warmup.norigins + 1) *
+                                                         sizeof(warm_origin_t));
+        origin.key = strdup(key);
+        origin.inflight = 0;
+        g_warmup.origins[g_warmup.norigins++] = origin;
+        o = g_warmup.norigins;
+        hashmap_insert(origins, origin.key, strlen(key), (void *)o);
+    }
+    url->origin = o - 1;
+
+    g_warmup.nurls++;
+    hashmap_insert(urls, url->uri, strlen(url->uri),
+                   (void *)(uintptr_t)g_warmup.nurls);
+}
+
+/**
+ * @brief Read every URL of a URL list or access log into g_warmup.urls.
+ *
+ * @return 0 on success, -1 if the file could not be read.
+ */
+static int load_urls(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    hashmap_t *urls = hashmap_init(1024), *origins = hashmap_init(64);
+    size_t cap = 0;
+
+    // Access logs truncate URIs, and a truncated URI names another object.
+    alog_file_header_t header;
+    if (fread(&header, sizeof(header), 1, f) == 1 &&
+        memcmp(header.magic, ALOG_MAGIC, sizeof(header.magic)) == 0) {
+        // Binary access log.
+        alog_record_t rec;
+        if (header.record_size == sizeof(rec))
+            while (fread(&rec, sizeof(rec), 1, f) == 1)
+                if (rec.status == 200 && rec.outcome != ALOG_ERROR &&
+                    strnlen(rec.uri, ALOG_URI_LEN) < ALOG_URI_LEN - 1)
+                    add_url(urls, origins, &cap, rec.uri);
+    } else {
+        // URL list, or text access log: time, client, URI, status, ...
+        char line[WARMUP_LINE], uri[WARMUP_LINE];
+        unsigned status;
+        rewind(f);
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (strncasecmp(line, "http://", 7) == 0)
+                add_url(urls, origins, &cap, line);
+            else if (sscanf(line, "%*s %*s %1023s %u", uri, &status) == 2 &&
+                     status == 200 && strlen(uri) < ALOG_URI_LEN - 1)
+                add_url(urls, origins, &cap, uri);
+        }
+    }
+
+    fclose(f);
+    hashmap_free(urls);
+    hashmap_free(origins);
+    return 0;
+}
+
+static int cmp_popularity(const void *a, const void *b) {
+    const warm_url_t *x = a, *y = b;
+    if (x->count != y->count)
+        return (x->count < y->count) - (x->count > y->count);
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+/**
+ * @brief Claim the next URL to fetch, waiting for a slot at its origin or
+ * for the rate limit as needed.
+ *
+ * @return NULL once there is nothing left to fetch.
+ */
+static warm_url_t *claim_url(void) {
+    warm_url_t *url = NULL;
+    uint64_t slot = 0;
+
+    pthread_mutex_lock(&g_warmup.mutex);
+    while (url == NULL) {
+        while (g_warmup.cursor < g_warmup.nurls &&
+               g_warmup.urls[g_warmup.cursor].claimed)
+            g_warmup.cursor++;
+        if (g_warmup.full || g_warmup.cursor == g_warmup.nurls)
+            break;
+
+        const size_t end = g_warmup.cursor + WARMUP_WINDOW < g_warmup.nurls
+                               ? g_warmup.cursor + WARMUP_WINDOW
+                               : g_warmup.nurls;
+        for (size_t i = g_warmup.cursor; i < end && url == NULL; ++i) {
+            warm_url_t *u = &g_warmup.urls[i];
+            if (!u->claimed &&
+                g_warmup.origins[u->origin].inflight < g_warmup.cfg.per_origin)
+                url = u;
+        }
+        if (url == NULL)
+            pthread_cond_wait(&g_warmup.cond, &g_warmup.mutex);
+    }
+    if (url) {
+        url->claimed = true;
+        g_warmup.origins[url->origin].inflight++;
+        if (g_warmup.cfg.rate) {
+            const uint64_t now = now_ns();
+            slot = g_warmup.next_ns > now ? g_warmup.next_ns : now;
+            g_warmup.next_ns = slot + 1000000000ULL / g_warmup.cfg.rate;
+        }
+    }
+    pthread_mutex_unlock(&g_warmup.mutex);
+
+    // Wait for this fetch's turn under the rate limit.
+    const uint64_t now = now_ns();
+    if (url && slot > now) {
+        const struct timespec wait = {
+            .tv_sec = (slot - now) / 1000000000,
+            .tv_nsec = (slot - now) % 1000000000,
+        };
+        nanosleep(&wait, NULL);
+    }
+    return url;
+}
+
+/**
+ * @brief Fetch a URL from its origin into `buf`.
+ *
+ * @return Bytes of the response, or -1 if the fetch failed or the response
+ *         was larger than `max_object`.
+ */
+static ssize_t fetch_url(const warm_url_t *url, char *buf) {
+    const warm_origin_t *origin = &g_warmup.origins[url->origin];
+    return fetch_get(origin->host, origin->port, url->path, buf,
+                     g_warmup.cfg.max_object);
+}
+
+static void *thread_warmup(void *vargp) {
+    char *buf = malloc(g_warmup.cfg.max_object);
+    warm_url_t *url;
+    while (buf && (url = claim_url()) != NULL) {
+        warmup_result_t res = WARMUP_SKIPPED;
+        ssize_t len = fetch_url(url, buf);
+        if (len < 0)
+            stats_add(g_warmup.stat_failed, 1);
+        else
+            res = g_warmup.store(url->uri, buf, len, g_warmup.arg);
+        if (res == WARMUP_STORED)
+            stats_add(g_warmup.stat_stored, 1);
+        else if (res == WARMUP_SKIPPED && len >= 0)
+            stats_add(g_warmup.stat_skipped, 1);
+
+        pthread_mutex_lock(&g_warmup.mutex);
+        g_warmup.origins[url->origin].inflight--;
+        if (res == WARMUP_FULL)
+            g_warmup.full = true;
+        pthread_cond_broadcast(&g_warmup.cond);
+        pthread_mutex_unlock(&g_warmup.mutex);
+    }
+    free(buf);
+
+    // The last thread out frees the URLs.
+    pthread_mutex_lock(&g_warmup.mutex);
+    const bool last = --g_warmup.running == 0;
+    pthread_cond_broadcast(&g_warmup.cond);
+    pthread_mutex_unlock(&g_warmup.mutex);
+    stats_sub(g_warmup.stat_running, 1);
+    if (last) {
+        for (size_t i = 0; i < g_warmup.nurls; ++i)
+            free(g_warmup.urls[i].uri);
+        for (size_t i = 0; i < g_warmup.norigins; ++i)
+            free(g_warmup.origins[i].key);
+        free(g_warmup.urls);
+        free(g_warmup.origins);
+        g_warmup.urls = NULL;
+        g_warmup.origins = NULL;
+        g_warmup.nurls = g_warmup.norigins = 0;
+    }
+    return NULL;
+}
+
+/**************** PUBLIC INTERFACE ****************/
+int warmup_start(const warmup_cfg_t *cfg, warmup_store_fn store, void *arg) {
+    if (cfg->per_origin <= 0 || cfg->max_object == 0 ||
+        load_urls(cfg->path) < 0)
+        return -1;
+    g_warmup.cfg = *cfg;
+    g_warmup.store = store;
+    g_warmup.arg = arg;
+
+    qsort(g_warmup.urls, g_warmup.nurls, sizeof(warm_url_t), cmp_popularity);
+    if (cfg->max_urls && g_warmup.nurls > cfg->max_urls) {
+        for (size_t i = cfg->max_urls; i < g_warmup.nurls; ++i)
+            free(g_warmup.urls[i].uri);
+        g_warmup.nurls = cfg->max_urls;
+    }
+
+    g_warmup.stat_urls = stats_counter("warmup.urls");
+    g_warmup.stat_stored = stats_counter("warmup.stored");
+    g_warmup.stat_skipped = stats_counter("warmup.skipped");
+    g_warmup.stat_failed = stats_counter("warmup.failed");
+    g_warmup.stat_running = stats_counter("warmup.threads");
+    stats_set(g_warmup.stat_urls, g_warmup.nurls);
+
+    const int nthreads = g_warmup.nurls < WARMUP_THREADS ? (int)g_warmup.nurls
+                                                         : WARMUP_THREADS;
+    g_warmup.running = nthreads;
+    stats_set(g_warmup.stat_running, nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, thread_warmup, NULL) != 0) {
+            pthread_mutex_lock(&g_warmup.mutex);
+            g_warmup.running -= nthreads - i;
+            pthread_mutex_unlock(&g_warmup.mutex);
+            stats_sub(g_warmup.stat_running, nthreads - i);
+            return i > 0 ? 0 : -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
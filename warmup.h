@@ -0,0 +1,65 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Cache warm-up. A freshly started proxy has an empty cache and takes a long
+ * time to reach its steady-state hit ratio; warm-up fetches the objects it is
+ * likely to be asked for first, in the background, while it already serves.
+ *
+ * The input is either a URL list, one absolute URL per line, or an access log
+ * written by alog.h, text or binary, of which only successful requests count.
+ * URLs are fetched most requested first; in a plain list, where every URL
+ * appears once, that is the order of the list.
+ *
+ * Fetching is paced by a rate limit and by a cap on concurrent fetches per
+ * origin, so that warming up does not hammer any one origin. It stops early
+ * once the store callback reports that the cache is full, since anything
+ * fetched later is less popular than what it would evict.
+ */
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stddef.h>
+
+#define WARMUP_DEFAULT_RATE 100
+#define WARMUP_DEFAULT_PER_ORIGIN 2
+#define WARMUP_THREADS 8
+
+/**
+ * @param  path        URL list or access log.
+ * @param  max_urls    Fetch at most the `max_urls` most popular URLs (0 = no
+ *                     limit).
+ * @param  rate        Fetches started per second (0 = no limit).
+ * @param  per_origin  Concurrent fetches per origin host and port.
+ * @param  max_object  Responses larger than this are not fetched in full.
+ */
+typedef struct {
+    const char *path;
+    size_t max_urls;
+    unsigned rate;
+    int per_origin;
+    size_t max_object;
+} warmup_cfg_t;
+
+typedef enum {
+    WARMUP_STORED,  /* The response is in the cache. */
+    WARMUP_SKIPPED, /* Not cached, but warm-up goes on. */
+    WARMUP_FULL     /* The cache is full: stop warming up. */
+} warmup_result_t;
+
+/**
+ * Called from the warm-up threads with every complete response, headers
+ * included, as the origin sent it.
+ */
+typedef warmup_result_t (*warmup_store_fn)(const char *uri,
+                                           const char *response, size_t len,
+                                           void *arg);
+
+/**
+ * Read the URLs to warm up and start fetching them in the background.
+ * Progress is exported as `warmup.*` stats.
+ *
+ * @return 0 on success, -1 if the file could not be read.
+ */
+int warmup_start(const warmup_cfg_t *cfg, warmup_store_fn store, void *arg);
+
+#endif
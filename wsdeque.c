@@ -0,0 +1,140 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Chase-Lev work-stealing deque.
+ */
+#include "wsdeque.h"
+
+#include <stdlib.h>
+
+/**
+ * @brief Allocate a ring with room for `capacity` items (a power of two).
+ */
+static ws_ring_t *ring_init(size_t capacity) {
+    ws_ring_t *ring =
+        malloc(sizeof(ws_ring_t) + capacity * sizeof(_Atomic(void *)));
+    if (ring == NULL)
+        return NULL;
+    ring->mask = capacity - 1;
+    ring->prev = NULL;
+    return ring;
+}
+
+static inline void *ring_get(ws_ring_t *ring, int64_t i) {
+    return atomic_load_explicit(&ring->slots[i & ring->mask],
+                                memory_order_relaxed);
+}
+
+static inline void ring_put(ws_ring_t *ring, int64_t i, void *item) {
+    atomic_store_explicit(&ring->slots[i & ring->mask], item,
+                          memory_order_relaxed);
+}
+
+/**
+ * @brief Replace the ring by one twice its size, copying the live range
+ * [top, bottom).
+ */
+static ws_ring_t *ring_grow(ws_ring_t *ring, int64_t top, int64_t bottom) {
+    ws_ring_t *bigger = ring_init((ring->mask + 1) << 1);
+    if (bigger == NULL)
+        return NULL;
+    for (int64_t i = top; i < bottom; ++i)
+        ring_put(bigger, i, ring_get(ring, i));
+    bigger->prev = ring;
+    return bigger;
+}
+
+wsdeque_t *wsdeque_init(size_t capacity) {
+    wsdeque_t *deque = malloc(sizeof(wsdeque_t));
+    if (deque == NULL)
+        return NULL;
+
+    size_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    ws_ring_t *ring = ring_init(cap);
+    if (ring == NULL) {
+        free(deque);
+        return NULL;
+    }
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->ring, ring);
+    return deque;
+}
+
+void wsdeque_free(wsdeque_t *deque) {
+    ws_ring_t *ring = atomic_load(&deque->ring);
+    while (ring) {
+        ws_ring_t *prev = ring->prev;
+        free(ring);
+        ring = prev;
+    }
+    free(deque);
+}
+
+int wsdeque_push(wsdeque_t *deque, void *item) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    ws_ring_t *ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+
+    if (b - t > (int64_t)ring->mask) {
+        ring = ring_grow(ring, t, b);
+        if (ring == NULL)
+            return -1;
+        atomic_store_explicit(&deque->ring, ring, memory_order_release);
+    }
+
+    ring_put(ring, b, item);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+void *wsdeque_pop(wsdeque_t *deque) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    ws_ring_t *ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    // Empty: restore bottom.
+    if (t > b) {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    void *item = ring_get(ring, b);
+    if (t == b) {
+        // Last item: race the thieves for it.
+        if (!atomic_compare_exchange_strong_explicit(
+                &deque->top, &t, t + 1, memory_order_seq_cst,
+                memory_order_relaxed))
+            item = NULL;
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+void *wsdeque_steal(wsdeque_t *deque) {
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+
+    ws_ring_t *ring = atomic_load_explicit(&deque->ring, memory_order_consume);
+    void *item = ring_get(ring, t);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return WSDEQUE_ABORT;
+    return item;
+}
+
+size_t wsdeque_size(wsdeque_t *deque) {
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    return (b > t) ? (size_t)(b - t) : 0;
+}
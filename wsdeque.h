@@ -0,0 +1,81 @@
+/**
+ * @author Jonathan Helland
+ *
+ * Chase-Lev work-stealing deque. The owning thread pushes and pops at the
+ * bottom without locks; any other thread may steal from the top. The ring of
+ * slots doubles when it fills up.
+ *
+ * Memory orderings follow Le, Pop, Cohen & Zappa Nardelli, "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ */
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Returned by wsdeque_steal when it lost a race with another thief or the
+ * owner. The deque may still hold items, so the caller should retry.
+ */
+#define WSDEQUE_ABORT ((void *)-1)
+
+/**
+ * @param  mask   Capacity - 1; the capacity is a power of two.
+ * @param  prev   Ring this one replaced. Rings are only freed together with
+ *                the deque, since a thief may still be reading an old one.
+ * @param  slots  The ring itself.
+ */
+typedef struct WsRing {
+    size_t mask;
+    struct WsRing *prev;
+    _Atomic(void *) slots[];
+} ws_ring_t;
+
+/**
+ * @param  top     Next index to steal from.
+ * @param  bottom  Next index the owner pushes to.
+ * @param  ring    Current ring of slots.
+ */
+typedef struct WsDeque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(ws_ring_t *) ring;
+} wsdeque_t;
+
+/**
+ * Initialize memory for the deque. Capacity is rounded up to a power of two.
+ * Must be freed later by wsdeque_free.
+ */
+wsdeque_t *wsdeque_init(size_t capacity);
+
+/**
+ * Free the deque and every ring it has used. Items are not freed.
+ */
+void wsdeque_free(wsdeque_t *deque);
+
+/**
+ * Push an item at the bottom. Owner only.
+ *
+ * @return 0 on success, -1 if the ring could not grow.
+ */
+int wsdeque_push(wsdeque_t *deque, void *item);
+
+/**
+ * Pop the most recently pushed item. Owner only. Returns NULL when empty.
+ */
+void *wsdeque_pop(wsdeque_t *deque);
+
+/**
+ * Take the oldest item. Safe from any thread. Returns NULL when empty and
+ * WSDEQUE_ABORT when it lost a race.
+ */
+void *wsdeque_steal(wsdeque_t *deque);
+
+/**
+ * Approximate number of items, for statistics.
+ */
+size_t wsdeque_size(wsdeque_t *deque);
+
+#endif